@@ -25,23 +25,40 @@
 
 namespace pdlfs {
 
+// Abstract interface for allocating memory that is freed all at once when
+// the allocator is deleted.
+class Allocator {
+ public:
+  Allocator() {}
+  virtual ~Allocator();
+
+  virtual char* Allocate(size_t bytes) = 0;
+  virtual char* AllocateAligned(size_t bytes) = 0;
+  virtual size_t MemoryUsage() const = 0;
+
+ private:
+  // No copying allowed
+  void operator=(const Allocator&);
+  Allocator(const Allocator&);
+};
+
 // An arena is a collection of allocated memory managed atop
 // the native system allocator.
-class Arena {
+class Arena : public Allocator {
  public:
   Arena();
-  ~Arena();
+  virtual ~Arena();
 
   // Return a pointer to a newly allocated memory block of "bytes" bytes.
-  char* Allocate(size_t bytes);
+  virtual char* Allocate(size_t bytes);
 
   // Allocate memory with the normal alignment guarantees provided by malloc
-  char* AllocateAligned(size_t bytes);
+  virtual char* AllocateAligned(size_t bytes);
 
   // Returns an estimate of the total memory usage of data allocated
   // by the arena (including space allocated but not yet used for user
   // allocations).
-  size_t MemoryUsage() const {
+  virtual size_t MemoryUsage() const {
     return blocks_memory_ + blocks_.capacity() * sizeof(char*);
   }
 
@@ -78,4 +95,36 @@ inline char* Arena::Allocate(size_t bytes) {
   return AllocateFallback(bytes);
 }
 
+// A thread-safe arena. Small allocations are served from a set of shards,
+// each refilled with blocks carved out of a shared arena. Threads pick their
+// shard by the cpu they run on so concurrent allocations rarely contend for
+// the same lock.
+class ConcurrentArena : public Allocator {
+ public:
+  ConcurrentArena();
+  virtual ~ConcurrentArena();
+
+  virtual char* Allocate(size_t bytes);
+  virtual char* AllocateAligned(size_t bytes);
+
+  // Safe to call concurrently with allocations.
+  virtual size_t MemoryUsage() const {
+    return reinterpret_cast<uintptr_t>(memory_usage_.NoBarrier_Load());
+  }
+
+ private:
+  struct Shard;
+  Shard* CurrentShard();
+  char* AllocateImpl(size_t bytes, bool aligned);
+  // REQUIRES: mu_ has been locked.
+  char* AllocateFromArena(size_t bytes);
+
+  enum { kNumShards = 16 };
+  Shard* shards_;
+
+  port::Mutex mu_;
+  Arena arena_;  // Protected by mu_
+  port::AtomicPointer memory_usage_;
+};
+
 }  // namespace pdlfs
@@ -14,6 +14,9 @@
 #include <stdint.h>
 
 #include "pdlfs-common/slice.h"
+#include "pdlfs-common/status.h"
+
+#include <string>
 
 namespace pdlfs {
 
@@ -21,10 +24,27 @@ class ECT {
  public:
   static ECT* Default(size_t key_len, size_t n, const Slice* keys);
 
+  // Same as Default(), but keys are split into consecutive partitions of
+  // partition_size keys that are encoded separately. Uses a little more
+  // memory for each partition, but lookups only decode a single partition
+  // and therefore stay fast when n is large.
+  static ECT* Partitioned(size_t key_len, size_t n, const Slice* keys,
+                          size_t partition_size);
+
+  // Rebuild an index from an encoding previously produced by EncodeTo().
+  // On success, advances *input past the encoding and sets *result to
+  // the new index. The caller should delete *result when it is no longer
+  // needed.
+  static Status DecodeFrom(Slice* input, ECT** result);
+
+  // Append a serialized form of the index to *dst.
+  virtual void EncodeTo(std::string* dst) const = 0;
+
   // Return the internal memory usage in bits.
   virtual size_t MemUsage() const = 0;
 
-  // Return the rank of a given key.
+  // Return the rank of a given key. For a key not in the set, the result is
+  // either the number of keys smaller than it or that number minus one.
   virtual size_t Find(const Slice& key) const = 0;
 
   virtual ~ECT();
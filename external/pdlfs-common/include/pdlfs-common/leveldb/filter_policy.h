@@ -39,6 +39,23 @@ class FilterPolicy;
 // trailing spaces in keys.
 extern const FilterPolicy* NewBloomFilterPolicy(int bits_per_key);
 
+// Build a bloom filter one key at a time for a known number of keys. The
+// filter is appended to *dst and is identical to the one created by
+// NewBloomFilterPolicy(bits_per_key) for the same keys, but keys need not be
+// held in memory all at once. *dst must not be modified while keys are
+// being added.
+class BloomFilterBuilder {
+ public:
+  BloomFilterBuilder(int bits_per_key, size_t n, std::string* dst);
+  void AddKey(const Slice& key);
+
+ private:
+  size_t bits_;
+  size_t k_;
+  std::string* const dst_;
+  size_t off_;  // Offset of the filter in *dst_
+};
+
 // A database can be configured with a custom FilterPolicy object.
 // This object is responsible for creating a small filter from a set
 // of keys.  These filters are stored in leveldb and are consulted
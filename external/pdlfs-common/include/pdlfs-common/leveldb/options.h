@@ -31,6 +31,19 @@ class Logger;
 class Snapshot;
 class ThreadPool;
 
+// Formats of the index block written at the end of each table.  The
+// format is recorded in the index block itself, so tables of different
+// formats can be read regardless of the options used to open them.
+enum IndexType {
+  // Separator keys and block handles in a regular restart-point block.
+  kBlockIndex = 0x0,
+  // An entropy-coded trie (see pdlfs-common/ect.h) mapping separator keys
+  // to block ranks plus a packed array of block offsets.  Takes a few
+  // bytes per data block, but is only available when pdlfs-common is
+  // built with PDLFS_SILT_ECT and tables are ordered byte-wise.
+  kEctIndex = 0x1
+};
+
 // Options to control the behavior of a database (passed to DB::Open)
 struct DBOptions {
   // -------------------
@@ -80,6 +93,15 @@ struct DBOptions {
   // Default: NULL
   ThreadPool* compaction_pool;
 
+  // Max number of pieces a compaction is split into by key range. Pieces are
+  // compacted in parallel by compaction_pool (or env if compaction_pool is
+  // NULL) together with the thread running the compaction. Outputs of all
+  // pieces are installed in a single version edit. The default env runs
+  // all background work on a single thread, so pieces are only compacted in
+  // parallel with a compaction_pool of multiple threads.
+  // Default: 1 (no splitting)
+  int max_subcompactions;
+
   // -------------------
   // Parameters that affect performance
 
@@ -136,6 +158,15 @@ struct DBOptions {
   // Default: 1
   int index_block_restart_interval;
 
+  // Format of the index block of each new table.  An ECT index is much
+  // smaller than a block index, which matters when many tables have their
+  // indexes pinned in memory, and locates blocks without a binary search.
+  // Tables whose keys an ECT cannot order (a custom comparator or user
+  // keys longer than 254 bytes) are written with a block index instead.
+  //
+  // Default: kBlockIndex
+  IndexType index_type;
+
   // Compress blocks using the specified compression algorithm.  This
   // parameter can be changed dynamically.
   //
@@ -194,6 +225,29 @@ struct DBOptions {
   // Default: false
   bool disable_write_ahead_log;
 
+  // If true, writes are applied in two pipelined stages: a group of writes is
+  // appended to the write-ahead log and then inserted into the memtable in
+  // the order of logging. Logging of the next group starts as soon as the
+  // previous group is logged instead of after it is fully applied.
+  // Ignored when no_memtable is true.
+  // Default: false
+  bool pipelined_write;
+
+  // If true, memtables are built atop a lock-free skiplist and a sharded
+  // arena that allow multiple threads to insert at the same time. With
+  // pipelined_write, groups of writes are then inserted into the memtable in
+  // parallel instead of one after another.
+  // Default: false
+  bool concurrent_memtable;
+
+  // Number of hash buckets for indexing memtable entries by user key. With
+  // the index, point lookups into a memtable take constant time instead of a
+  // skiplist search. Iterators and memtable flushes still use the skiplist.
+  // May only be used when keys compare equal iff they are identical, as is
+  // the case for the default comparator.
+  // Default: 0 (no hash index)
+  size_t memtable_hash_buckets;
+
   // If true, no background compaction will be performed except for
   // those triggered by MemTable dumps.
   // All Tables will stay in Level-0 forever.
@@ -11,6 +11,7 @@
 #pragma once
 
 #include "pdlfs-common/env.h"
+#include "pdlfs-common/port.h"
 #include "pdlfs-common/status.h"
 
 #include <string>
@@ -77,6 +78,18 @@ struct RPCOptions {
   // Not needed for clients.
   rpc::If* fs;
 
+  // Max number of asynchronous calls a stub may have in flight. Once reached,
+  // further asynchronous calls block until earlier ones complete. Only used
+  // by the socket rpc engine. Mercury and Margo stubs run asynchronous calls
+  // synchronously.
+  // Default: 64
+  int max_outstanding_calls;
+
+  // Max size in bytes of an incoming rpc message. Socket engines reject larger
+  // messages without buffering them.
+  // Default: 64MB
+  size_t max_msgsz;
+
   // Options specific to the Mercury rpc engine
 
   // Max number of server addrs that may be cached locally
@@ -84,11 +97,13 @@ struct RPCOptions {
 
   // Options specific to the socket rpc engine
 
-  // Max unexpected message size in bytes for UDP communication.
+  // Max unexpected message size in bytes for UDP communication. Messages
+  // that do not fit in a single datagram of this size are fragmented.
   // Default: 1432
   size_t udp_max_unexpected_msgsz;
 
-  // Max expected message size for UDP.
+  // Max expected message size for UDP. Replies larger than this are sent to
+  // clients as multiple datagrams.
   // Default: 1432
   size_t udp_max_expected_msgsz;
 
@@ -100,6 +115,57 @@ struct RPCOptions {
   // Per-socket UDP server-side sender buffer size.
   // Default: -1
   int udp_srv_sndbuf;
+
+  // Max number of datagrams a UDP server thread receives using a single
+  // recvmmsg call. Replies to calls handled by the thread itself are then sent
+  // together using a single sendmmsg call. Set to 1 to receive and send one
+  // datagram per system call. Batching is only supported on Linux.
+  // Default: 1
+  int udp_srv_batch_size;
+
+  // Give each UDP server thread its own socket bound to the same port using
+  // SO_REUSEPORT. The kernel then spreads incoming datagrams across threads
+  // instead of having all threads contend for a single socket.
+  // Default: false
+  bool udp_srv_reuseport;
+
+  // Max number of incoming UDP calls that may be queued for extra workers.
+  // Once reached, new calls are instantly rejected with a busy reply, which
+  // clients understand and use to back off before trying again. Set to 0 to
+  // queue calls without limits.
+  // Default: 0
+  int udp_max_pending_calls;
+
+  // Time in microseconds a UDP client waits for a reply before resending its
+  // request. Doubles after each retransmission. Servers detect duplicate
+  // requests and either ignore them or resend a remembered reply so that a
+  // call is executed at most once within the reply-cache window. Set to 0 to
+  // disable.
+  // Default: 500000 (0.5 second)
+  uint64_t udp_retransmit_timeout;
+
+  // Max total bytes of partially received requests buffered by a UDP server.
+  // Fragments of new requests are dropped once reached.
+  // Default: 64MB
+  size_t udp_max_reassembly_bytes;
+
+  // Max number of replies remembered by a UDP server for resending to
+  // clients that have not received them. Set to 0 to disable. Single-datagram
+  // requests are then executed without any duplicate detection.
+  // Default: 4096
+  size_t udp_reply_cache_size;
+
+  // Use long-lived, length-framed TCP connections instead of opening a new
+  // connection for each call. Concurrent calls are multiplexed over the
+  // connections of a stub using request ids. Must be set consistently at both
+  // the client and the server side.
+  // Default: false
+  bool tcp_persistent_conns;
+
+  // Number of pooled connections kept by each TCP stub when persistent
+  // connections are in use.
+  // Default: 1
+  int tcp_conns_per_stub;
 };
 
 // Each RPC* is a reference to an RPC instance. This instance either acts as a
@@ -199,7 +265,23 @@ class If {
     int op;          // Operation type. XXX: To be removed. No longer used.
     int err;         // Error code. XXX: To be removed. No longer used.
     Slice contents;  // Message body, reference to the
-    Message() : op(0), err(0) {}
+    Message() : op(0), err(0), nchunks(0) {}
+
+    // An outgoing message may carry extra chunks of data that are sent
+    // after contents as if they were part of it. Chunks reference caller
+    // memory, which must remain valid until the call returns. RPC
+    // implementations transmit them using gather writes so that large
+    // payloads reach the network without being copied into the message
+    // first. Incoming messages never carry chunks.
+    enum { kMaxChunks = 4 };
+    Slice chunks[kMaxChunks];
+    int nchunks;
+    void AddChunk(const Slice& chunk);
+    // Return the total size of contents and all chunks.
+    size_t size() const;
+    // Merge all chunks into contents. Needed by code that handles messages
+    // without sending them over the network.
+    void Flatten();
 
     // To reduce memory copying, a caller may reference external memory
     // instead of copying data into the spaces defined below
@@ -210,6 +292,22 @@ class If {
   // Return OK on success, or a non-OK status on errors.
   // Must not throw any exceptions.
   virtual Status Call(Message& in, Message& out) RPCNOEXCEPT = 0;
+
+  // Invoked once an asynchronous call completes. status is the final status
+  // of the call. On OK, the reply is in the call's output message.
+  typedef void (*Callback)(const Status& status, void* arg);
+
+  // Start a call without waiting for its reply. cb is invoked exactly once,
+  // possibly from another thread, including a thread that is itself in the
+  // middle of a synchronous call through the same stub, or, for calls that
+  // fail early, before AsyncCall() returns. Both in and out must remain
+  // valid until then. Blocks when the stub already has the max number of
+  // outstanding calls. Callbacks should be short and must not make calls
+  // through the same stub. The default implementation makes a synchronous
+  // call and invokes cb before returning.
+  virtual void AsyncCall(Message& in, Message& out, Callback cb,
+                         void* arg) RPCNOEXCEPT;
+
   virtual ~If();
   If() {}
 
@@ -219,5 +317,29 @@ class If {
   If(const If&);
 };
 
+// Bounds the number of outstanding asynchronous calls of a stub. Used by RPC
+// implementations.
+class AsyncCallWindow {
+ public:
+  // A size of 0 or less means unbounded.
+  explicit AsyncCallWindow(int size) : cv_(&mu_), size_(size), n_(0) {}
+
+  // Wait until a new call may be started and account for it.
+  void Enter();
+  // Account for the completion of a call.
+  void Leave();
+  // Wait until all outstanding calls have completed.
+  void Drain();
+
+ private:
+  // No copying allowed
+  void operator=(const AsyncCallWindow&);
+  AsyncCallWindow(const AsyncCallWindow&);
+  port::Mutex mu_;
+  port::CondVar cv_;
+  const int size_;
+  int n_;  // Number of outstanding calls
+};
+
 }  // namespace rpc
 }  // namespace pdlfs
@@ -16,11 +16,18 @@
  */
 
 #include "pdlfs-common/arena.h"
+#include "pdlfs-common/mutexlock.h"
+
+#if defined(PDLFS_OS_LINUX)
+#include <sched.h>
+#endif
 
 namespace pdlfs {
 
 static const int kBlockSize = 4096;
 
+Allocator::~Allocator() {}
+
 Arena::Arena() {
   blocks_memory_ = 0;
   alloc_ptr_ = NULL;  // First allocation will allocate a block
@@ -77,4 +84,88 @@ char* Arena::AllocateNewBlock(size_t block_bytes) {
   return result;
 }
 
+struct ConcurrentArena::Shard {
+  Shard() : alloc_ptr(NULL), alloc_bytes_remaining(0) {}
+  port::Mutex mu;
+  char* alloc_ptr;
+  size_t alloc_bytes_remaining;
+  // Keep shards on separate cache lines
+  char padding[64];
+};
+
+ConcurrentArena::ConcurrentArena()
+    : shards_(new Shard[kNumShards]), memory_usage_(NULL) {}
+
+ConcurrentArena::~ConcurrentArena() { delete[] shards_; }
+
+ConcurrentArena::Shard* ConcurrentArena::CurrentShard() {
+#if defined(PDLFS_OS_LINUX)
+  const int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return &shards_[cpu % kNumShards];
+  }
+#endif
+  // Otherwise pick a shard by the caller's stack, which differs from one
+  // thread to another
+  char dummy;
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(&dummy);
+  return &shards_[(addr >> 20) % kNumShards];
+}
+
+// REQUIRES: mu_ has been locked.
+char* ConcurrentArena::AllocateFromArena(size_t bytes) {
+  mu_.AssertHeld();
+  char* const result = arena_.AllocateAligned(bytes);
+  memory_usage_.NoBarrier_Store(
+      reinterpret_cast<void*>(static_cast<uintptr_t>(arena_.MemoryUsage())));
+  return result;
+}
+
+char* ConcurrentArena::AllocateImpl(size_t bytes, bool aligned) {
+  if (bytes > kBlockSize / 4) {
+    // Allocate it directly from the shared arena to avoid wasting too much
+    // space in leftover bytes of a shard
+    MutexLock ml(&mu_);
+    return AllocateFromArena(bytes);
+  }
+
+  Shard* const shard = CurrentShard();
+  MutexLock l(&shard->mu);
+  size_t slop = 0;
+  if (aligned) {
+    const int align = (sizeof(void*) > 8) ? sizeof(void*) : 8;
+    assert((align & (align - 1)) == 0);  // Pointer size should be a power of 2
+    size_t current_mod =
+        reinterpret_cast<uintptr_t>(shard->alloc_ptr) & (align - 1);
+    slop = (current_mod == 0 ? 0 : align - current_mod);
+  }
+  size_t needed = bytes + slop;
+  if (needed > shard->alloc_bytes_remaining) {
+    // We waste the remaining space in the shard's current block
+    {
+      MutexLock ml(&mu_);
+      shard->alloc_ptr = AllocateFromArena(kBlockSize);
+    }
+    shard->alloc_bytes_remaining = kBlockSize;
+    slop = 0;  // Blocks are always aligned
+    needed = bytes;
+  }
+  char* const result = shard->alloc_ptr + slop;
+  shard->alloc_ptr += needed;
+  shard->alloc_bytes_remaining -= needed;
+  return result;
+}
+
+char* ConcurrentArena::Allocate(size_t bytes) {
+  // The semantics of what to return are a bit messy if we allow
+  // 0-byte allocations, so we disallow them here (we don't need
+  // them for our internal use).
+  assert(bytes > 0);
+  return AllocateImpl(bytes, false);
+}
+
+char* ConcurrentArena::AllocateAligned(size_t bytes) {
+  return AllocateImpl(bytes, true);
+}
+
 }  // namespace pdlfs
@@ -15,9 +15,13 @@
  * found at https://github.com/google/leveldb.
  */
 #include "pdlfs-common/arena.h"
+#include "pdlfs-common/env.h"
+#include "pdlfs-common/mutexlock.h"
 #include "pdlfs-common/random.h"
 #include "pdlfs-common/testharness.h"
 
+#include <string.h>
+
 namespace pdlfs {
 
 class ArenaTest {};
@@ -73,6 +77,72 @@ TEST(ArenaTest, Simple) {
   }
 }
 
+namespace {
+struct ConcurrentAllocState {
+  explicit ConcurrentAllocState(ConcurrentArena* a)
+      : arena(a), done(0), cv(&mu) {}
+  ConcurrentArena* const arena;
+  port::Mutex mu;
+  int done;
+  port::CondVar cv;
+};
+
+struct ConcurrentAllocator {
+  ConcurrentAllocState* state;
+  int id;
+  bool ok;
+};
+
+void ConcurrentAlloc(void* arg) {
+  ConcurrentAllocator* const a = reinterpret_cast<ConcurrentAllocator*>(arg);
+  std::vector<std::pair<size_t, char*> > allocated;
+  Random rnd(301 + a->id);
+  for (int i = 0; i < 20000; i++) {
+    const size_t s = rnd.OneIn(1000) ? rnd.Uniform(6000) + 1
+                                     : rnd.Uniform(100) + 1;
+    char* const r = rnd.OneIn(10) ? a->state->arena->AllocateAligned(s)
+                                  : a->state->arena->Allocate(s);
+    memset(r, a->id, s);
+    allocated.push_back(std::make_pair(s, r));
+  }
+  // No other thread may have written into our allocations
+  a->ok = true;
+  for (size_t i = 0; i < allocated.size(); i++) {
+    for (size_t b = 0; b < allocated[i].first; b++) {
+      if (allocated[i].second[b] != a->id) {
+        a->ok = false;
+      }
+    }
+  }
+  MutexLock ml(&a->state->mu);
+  a->state->done++;
+  a->state->cv.SignalAll();
+}
+}  // namespace
+
+TEST(ArenaTest, Concurrent) {
+  const int kThreads = 4;
+  ConcurrentArena arena;
+  ConcurrentAllocState state(&arena);
+  ConcurrentAllocator allocators[kThreads];
+  for (int i = 0; i < kThreads; i++) {
+    allocators[i].state = &state;
+    allocators[i].id = i;
+    allocators[i].ok = false;
+    Env::Default()->StartThread(ConcurrentAlloc, &allocators[i]);
+  }
+  {
+    MutexLock ml(&state.mu);
+    while (state.done < kThreads) {
+      state.cv.Wait();
+    }
+  }
+  for (int i = 0; i < kThreads; i++) {
+    ASSERT_TRUE(allocators[i].ok);
+  }
+  ASSERT_GT(arena.MemoryUsage(), 0);
+}
+
 }  // namespace pdlfs
 
 int main(int argc, char** argv) {
@@ -11,8 +11,11 @@
 #include "ectrie/bit_vector.h"
 #include "ectrie/trie.h"
 
+#include "pdlfs-common/coding.h"
 #include "pdlfs-common/ect.h"
 
+#include <string.h>
+#include <algorithm>
 #include <vector>
 
 namespace pdlfs {
@@ -28,18 +31,21 @@ class ECTCoder {
     return &singleton;
   }
 
+  // Decode a trie starting at bit offset "start" of encoding.
   template <typename T>
-  size_t Decode(const T& encoding, const uint8_t* key, size_t k_len,
-                size_t num_k) const {
-    size_t iter = 0;
-    size_t rank = trie_.locate(encoding, iter, key, k_len, 0, num_k);
+  size_t Decode(const T& encoding, size_t start, const uint8_t* key,
+                size_t k_len, size_t num_k, size_t skip_bits = 0) const {
+    size_t iter = start;
+    size_t rank =
+        trie_.locate(encoding, iter, key, k_len, 0, num_k, 0, 1, skip_bits);
     return rank;
   }
 
+  // Encode keys whose first skip_bits bits are known to be equal.
   template <typename T>
-  void Encode(T& encoding, size_t k_len, size_t num_k,
-              const uint8_t** keys) const {
-    trie_.encode(encoding, keys, k_len, 0, num_k);
+  void Encode(T& encoding, size_t k_len, size_t num_k, const uint8_t** keys,
+              size_t skip_bits = 0) const {
+    trie_.encode(encoding, keys, k_len, 0, num_k, 0, 1, skip_bits);
   }
 
  private:
@@ -51,15 +57,68 @@ class ECTCoder {
   trie_t trie_;
 };
 
+// Locating a key in a trie decodes every subtree to the left of its path, so
+// the cost of a lookup grows linearly with the number of keys. A partitioned
+// index splits keys into consecutive runs of at most partition_size keys and
+// encodes one trie per run. A lookup binary searches the first key of each
+// run (the pivots) and only decodes the trie of the run it lands in. Each
+// trie starts below the bits shared by all keys of its run, so lookups do
+// not pay for long common prefixes either.
 class ECTIndex : public ECT {
  public:
-  ECTIndex(size_t k_len) : key_len_(k_len), n_(0) {}
+  ECTIndex(size_t k_len, size_t partition_size = 0)
+      : key_len_(k_len), partition_size_(partition_size), n_(0) {}
   virtual ~ECTIndex() {}
 
-  virtual size_t MemUsage() const { return bitvec_.size(); }
+  virtual size_t MemUsage() const {
+    return bitvec_.size() +
+           8 * (pivots_.size() + offsets_.size() * sizeof(offsets_[0]) +
+                depths_.size() * sizeof(depths_[0]));
+  }
+
+  // Return the number of leading bits a and b have in common, up to limit.
+  size_t CommonPrefixBits(const uint8_t* a, const uint8_t* b,
+                          size_t limit) const {
+    size_t i = 0;
+    while (i < limit / 8 && a[i] == b[i]) i++;
+    size_t bits = 8 * i;
+    if (bits < limit) {
+      const uint8_t diff = a[i] ^ b[i];
+      for (uint8_t mask = 0x80; mask != 0 && !(diff & mask); mask >>= 1) {
+        bits++;
+      }
+    }
+    return std::min(bits, limit);
+  }
 
   size_t Locate(const uint8_t* key) const {
-    return ECTCoder::Get()->Decode(bitvec_, key, key_len_, n_);
+    if (offsets_.empty()) {
+      return ECTCoder::Get()->Decode(bitvec_, 0, key, key_len_, n_);
+    }
+    // Find the last partition whose pivot is <= key
+    size_t left = 0;
+    size_t right = offsets_.size() - 1;
+    while (left < right) {
+      const size_t mid = (left + right + 1) / 2;
+      if (memcmp(&pivots_[mid * key_len_], key, key_len_) <= 0) {
+        left = mid;
+      } else {
+        right = mid - 1;
+      }
+    }
+    const size_t base = left * partition_size_;
+    const size_t num_k = std::min(partition_size_, n_ - base);
+    // All keys of the partition share their first depths_[left] bits and
+    // the trie is encoded below them. A key that does not share them is
+    // either smaller or larger than every key of the partition.
+    const uint8_t* const pivot =
+        reinterpret_cast<const uint8_t*>(&pivots_[left * key_len_]);
+    const size_t depth = depths_[left];
+    if (CommonPrefixBits(pivot, key, depth) < depth) {
+      return memcmp(pivot, key, key_len_) < 0 ? base + num_k : base;
+    }
+    return base + ECTCoder::Get()->Decode(bitvec_, offsets_[left], key,
+                                          key_len_, num_k, depth);
   }
 
   virtual size_t Find(const Slice& key) const {
@@ -68,16 +127,89 @@ class ECTIndex : public ECT {
 
   virtual void InsertKeys(size_t n, const uint8_t** keys) {
     assert(n_ == 0);
-    ECTCoder::Get()->Encode(bitvec_, key_len_, n, keys);
+    if (partition_size_ == 0) {
+      ECTCoder::Get()->Encode(bitvec_, key_len_, n, keys);
+    } else {
+      for (size_t base = 0; base < n; base += partition_size_) {
+        const size_t num_k = std::min(partition_size_, n - base);
+        // Keys are sorted so the first and the last key of a partition
+        // share the fewest bits
+        const size_t depth = CommonPrefixBits(
+            keys[base], keys[base + num_k - 1], 8 * key_len_);
+        pivots_.append(reinterpret_cast<const char*>(keys[base]), key_len_);
+        offsets_.push_back(static_cast<uint32_t>(bitvec_.size()));
+        depths_.push_back(static_cast<uint32_t>(depth));
+        ECTCoder::Get()->Encode(bitvec_, key_len_, num_k, keys + base, depth);
+      }
+    }
+    bitvec_.compact();
+    n_ = n;
+  }
+
+  // Bits are stored most significant bit first so the encoding does not
+  // depend on the block type of the in-memory bit vector.
+  virtual void EncodeTo(std::string* dst) const {
+    const size_t nbits = bitvec_.size();
+    PutVarint64(dst, key_len_);
+    PutVarint64(dst, partition_size_);
+    PutVarint64(dst, n_);
+    PutVarint64(dst, nbits);
+    for (size_t i = 0; i < nbits; i += 8) {
+      const size_t len = std::min<size_t>(8, nbits - i);
+      uint8_t b = bitvec_.get<uint8_t>(i, len);
+      dst->push_back(static_cast<char>(b << (8 - len)));
+    }
+    dst->append(pivots_);
+    for (size_t i = 0; i < offsets_.size(); i++) {
+      PutVarint32(dst, offsets_[i]);
+      PutVarint32(dst, depths_[i]);
+    }
+  }
+
+  bool DecodeFrom(Slice* input) {
+    uint64_t n, nbits;
+    if (!GetVarint64(input, &n) || !GetVarint64(input, &nbits)) {
+      return false;
+    }
+    const size_t nbytes = (nbits + 7) / 8;
+    if (input->size() < nbytes) {
+      return false;
+    }
+    assert(n_ == 0 && bitvec_.size() == 0);
+    bitvec_.append(reinterpret_cast<const uint8_t*>(input->data()), 0, nbits);
     bitvec_.compact();
+    input->remove_prefix(nbytes);
     n_ = n;
+    if (partition_size_ != 0 && n_ != 0) {
+      const size_t num_partitions =
+          (n_ + partition_size_ - 1) / partition_size_;
+      const size_t pivot_bytes = num_partitions * key_len_;
+      if (input->size() < pivot_bytes) {
+        return false;
+      }
+      pivots_.assign(input->data(), pivot_bytes);
+      input->remove_prefix(pivot_bytes);
+      offsets_.resize(num_partitions);
+      depths_.resize(num_partitions);
+      for (size_t i = 0; i < num_partitions; i++) {
+        if (!GetVarint32(input, &offsets_[i]) || offsets_[i] > nbits ||
+            !GetVarint32(input, &depths_[i]) || depths_[i] > 8 * key_len_) {
+          return false;
+        }
+      }
+    }
+    return true;
   }
 
  private:
   typedef ectrie::bit_vector<> bitvec_t;
   bitvec_t bitvec_;
   size_t key_len_;
+  size_t partition_size_;  // 0 if not partitioned
   size_t n_;
+  std::string pivots_;             // First key of each partition
+  std::vector<uint32_t> offsets_;  // Starting bit of each partition
+  std::vector<uint32_t> depths_;   // Bits shared by keys of each partition
 };
 
 }  // anonymous namespace
@@ -97,4 +229,27 @@ ECT* ECT::Default(size_t key_len, size_t n, const Slice* keys) {
   return ect;
 }
 
+ECT* ECT::Partitioned(size_t key_len, size_t n, const Slice* keys,
+                      size_t partition_size) {
+  assert(partition_size != 0);
+  ECT* ect = new ECTIndex(key_len, partition_size);
+  ECT::InitTrie(ect, n, keys);
+  return ect;
+}
+
+Status ECT::DecodeFrom(Slice* input, ECT** result) {
+  *result = NULL;
+  uint64_t key_len, partition_size;
+  if (!GetVarint64(input, &key_len) || !GetVarint64(input, &partition_size)) {
+    return Status::Corruption("bad ect header");
+  }
+  ECTIndex* ect = new ECTIndex(key_len, partition_size);
+  if (!ect->DecodeFrom(input)) {
+    delete ect;
+    return Status::Corruption("bad ect encoding");
+  }
+  *result = ect;
+  return Status::OK();
+}
+
 }  // namespace pdlfs
@@ -9,6 +9,7 @@
  * found in the LICENSE file. See the AUTHORS file for names of contributors.
  */
 
+#include <iterator>
 #include <set>
 #include <string>
 #include <vector>
@@ -18,7 +19,7 @@
 #include "pdlfs-common/slice.h"
 #include "pdlfs-common/testharness.h"
 
-#include "spooky_impl.h"
+#include "spooky/SpookyV2.h"
 
 namespace pdlfs {
 
@@ -27,13 +28,18 @@ class ECTTest {};
 class TrieWrapper {
  private:
   const size_t k_len_;
+  const size_t partition_size_;  // 0 for no partitioning
   std::vector<size_t> k_offs_;
   std::string k_buffer_;
   size_t num_k_;
   ECT* ect_;
 
  public:
-  TrieWrapper(size_t key_len) : k_len_(key_len), num_k_(0), ect_(NULL) {}
+  TrieWrapper(size_t key_len, size_t partition_size = 0)
+      : k_len_(key_len),
+        partition_size_(partition_size),
+        num_k_(0),
+        ect_(NULL) {}
 
   ~TrieWrapper() { delete ect_; }
 
@@ -41,6 +47,16 @@ class TrieWrapper {
 
   size_t MemUsage() const { return ect_->MemUsage(); }
 
+  // Replace the index with one decoded from its own encoding.
+  void Reload() {
+    std::string encoding;
+    ect_->EncodeTo(&encoding);
+    delete ect_;
+    Slice input = encoding;
+    ASSERT_OK(ECT::DecodeFrom(&input, &ect_));
+    ASSERT_TRUE(input.empty());
+  }
+
   void Insert(const Slice& key) {
     k_offs_.push_back(k_buffer_.size());
     k_buffer_.append(key.data(), key.size());
@@ -55,7 +71,12 @@ class TrieWrapper {
     for (size_t i = 0; i < num_k_; i++) {
       tmp_keys[i] = Slice(&k_buffer_[k_offs_[i]], k_offs_[i + 1] - k_offs_[i]);
     }
-    ect_ = ECT::Default(k_len_, tmp_keys.size(), &tmp_keys[0]);
+    if (partition_size_ != 0) {
+      ect_ = ECT::Partitioned(k_len_, tmp_keys.size(), &tmp_keys[0],
+                              partition_size_);
+    } else {
+      ect_ = ECT::Default(k_len_, tmp_keys.size(), &tmp_keys[0]);
+    }
     k_offs_.clear();
     k_buffer_.clear();
     num_k_ = 0;
@@ -149,6 +170,50 @@ static std::string RandomKey(Random* rnd, int k_len) {
 }
 #endif
 
+static void TestEncodeDecode(size_t partition_size) {
+  Random rnd(301);
+  std::set<std::string> keys;
+  while (keys.size() < 1000) keys.insert(RandomKey(&rnd, 8));
+  TrieWrapper trie(8, partition_size);
+  std::set<std::string>::const_iterator iter;
+  for (iter = keys.begin(); iter != keys.end(); ++iter) {
+    trie.Insert(*iter);
+  }
+  trie.Flush();
+  std::vector<size_t> ranks;
+  std::vector<std::string> probes;
+  for (iter = keys.begin(); iter != keys.end(); ++iter) {
+    probes.push_back(*iter);
+    probes.push_back(RandomKey(&rnd, 8));
+  }
+  for (size_t i = 0; i < probes.size(); i++) {
+    const size_t rank = trie.Locate(probes[i]);
+    const size_t lower_bound =
+        std::distance(keys.begin(), keys.lower_bound(probes[i]));
+    if (keys.count(probes[i]) != 0) {
+      ASSERT_EQ(rank, lower_bound);
+    } else {
+      BETWEEN(rank, lower_bound == 0 ? 0 : lower_bound - 1, lower_bound);
+    }
+    ranks.push_back(rank);
+  }
+  const size_t bits = trie.MemUsage();
+  trie.Reload();
+  ASSERT_EQ(trie.MemUsage(), bits);
+  for (size_t i = 0; i < probes.size(); i++) {
+    ASSERT_EQ(trie.Locate(probes[i]), ranks[i]);
+  }
+}
+
+TEST(ECTTest, EncodeDecode) { TestEncodeDecode(0); }
+
+TEST(ECTTest, Partitioned) {
+  TestEncodeDecode(1);
+  TestEncodeDecode(7);
+  TestEncodeDecode(64);
+  TestEncodeDecode(1000);
+}
+
 TEST(ECTTest, ECTBench) {
   for (int k_len = 4; k_len <= 16; k_len += 4) {
     for (int num_k = 16; num_k <= 8192; num_k *= 2) {
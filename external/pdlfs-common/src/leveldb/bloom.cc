@@ -26,46 +26,62 @@ static uint32_t BloomHash(const Slice& key) {
   return Hash(key.data(), key.size(), 0xbc9f1d34);
 }
 
+static size_t BloomProbes(int bits_per_key) {
+  // We intentionally round down to reduce probing cost a little bit
+  size_t k = static_cast<size_t>(bits_per_key * 0.69);  // 0.69 =~ ln(2)
+  if (k < 1) k = 1;
+  if (k > 30) k = 30;
+  return k;
+}
+
+// Append an empty filter for n keys to *dst. Return the number of bits of the
+// filter.
+static size_t BloomInit(size_t n, size_t bits_per_key, size_t k,
+                        std::string* dst) {
+  // Compute bloom filter size (in both bits and bytes)
+  size_t bits = n * bits_per_key;
+
+  // For small n, we can see a very high false positive rate.  Fix it
+  // by enforcing a minimum bloom filter length.
+  if (bits < 64) bits = 64;
+
+  size_t bytes = (bits + 7) / 8;
+  bits = bytes * 8;
+
+  dst->resize(dst->size() + bytes, 0);
+  dst->push_back(static_cast<char>(k));  // Remember # of probes in filter
+  return bits;
+}
+
+static void BloomAdd(const Slice& key, size_t bits, size_t k, char* array) {
+  // Use double-hashing to generate a sequence of hash values.
+  // See analysis in [Kirsch,Mitzenmacher 2006].
+  uint32_t h = BloomHash(key);
+  const uint32_t delta = (h >> 17) | (h << 15);  // Rotate right 17 bits
+  for (size_t j = 0; j < k; j++) {
+    const uint32_t bitpos = h % bits;
+    array[bitpos / 8] |= (1 << (bitpos % 8));
+    h += delta;
+  }
+}
+
 class BloomFilterPolicy : public FilterPolicy {
  private:
   size_t bits_per_key_;
   size_t k_;
 
  public:
-  explicit BloomFilterPolicy(int bits_per_key) : bits_per_key_(bits_per_key) {
-    // We intentionally round down to reduce probing cost a little bit
-    k_ = static_cast<size_t>(bits_per_key * 0.69);  // 0.69 =~ ln(2)
-    if (k_ < 1) k_ = 1;
-    if (k_ > 30) k_ = 30;
-  }
+  explicit BloomFilterPolicy(int bits_per_key)
+      : bits_per_key_(bits_per_key), k_(BloomProbes(bits_per_key)) {}
 
   virtual const char* Name() const { return "leveldb.BuiltinBloomFilter2"; }
 
   virtual void CreateFilter(const Slice* keys, int n, std::string* dst) const {
-    // Compute bloom filter size (in both bits and bytes)
-    size_t bits = n * bits_per_key_;
-
-    // For small n, we can see a very high false positive rate.  Fix it
-    // by enforcing a minimum bloom filter length.
-    if (bits < 64) bits = 64;
-
-    size_t bytes = (bits + 7) / 8;
-    bits = bytes * 8;
-
     const size_t init_size = dst->size();
-    dst->resize(init_size + bytes, 0);
-    dst->push_back(static_cast<char>(k_));  // Remember # of probes in filter
+    const size_t bits = BloomInit(n, bits_per_key_, k_, dst);
     char* array = &(*dst)[init_size];
     for (size_t i = 0; i < n; i++) {
-      // Use double-hashing to generate a sequence of hash values.
-      // See analysis in [Kirsch,Mitzenmacher 2006].
-      uint32_t h = BloomHash(keys[i]);
-      const uint32_t delta = (h >> 17) | (h << 15);  // Rotate right 17 bits
-      for (size_t j = 0; j < k_; j++) {
-        const uint32_t bitpos = h % bits;
-        array[bitpos / 8] |= (1 << (bitpos % 8));
-        h += delta;
-      }
+      BloomAdd(keys[i], bits, k_, array);
     }
   }
 
@@ -101,4 +117,14 @@ const FilterPolicy* NewBloomFilterPolicy(int bits_per_key) {
   return new BloomFilterPolicy(bits_per_key);
 }
 
+BloomFilterBuilder::BloomFilterBuilder(int bits_per_key, size_t n,
+                                       std::string* dst)
+    : k_(BloomProbes(bits_per_key)), dst_(dst), off_(dst->size()) {
+  bits_ = BloomInit(n, bits_per_key, k_, dst_);
+}
+
+void BloomFilterBuilder::AddKey(const Slice& key) {
+  BloomAdd(key, bits_, k_, &(*dst_)[off_]);
+}
+
 }  // namespace pdlfs
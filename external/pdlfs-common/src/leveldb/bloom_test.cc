@@ -119,6 +119,26 @@ static int NextLength(int length) {
   return length;
 }
 
+// Filters built one key at a time match those created from all keys at once.
+TEST(BloomTest, Builder) {
+  char buffer[sizeof(int)];
+  const int lengths[] = {0, 1, 10, 1000};
+  for (int i = 0; i < 4; i++) {
+    const int n = lengths[i];
+    std::vector<std::string> keys;
+    for (int j = 0; j < n; j++) keys.push_back(Key(j, buffer).ToString());
+    std::vector<Slice> key_slices(keys.begin(), keys.end());
+    const FilterPolicy* const policy = NewBloomFilterPolicy(10);
+    std::string expected = "xyz";
+    policy->CreateFilter(n != 0 ? &key_slices[0] : NULL, n, &expected);
+    delete policy;
+    std::string filter = "xyz";
+    BloomFilterBuilder builder(10, n, &filter);
+    for (int j = 0; j < n; j++) builder.AddKey(key_slices[j]);
+    ASSERT_EQ(filter, expected);
+  }
+}
+
 TEST(BloomTest, VaryingLengths) {
   char buffer[sizeof(int)];
 
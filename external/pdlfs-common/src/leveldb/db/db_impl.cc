@@ -56,6 +56,11 @@ struct DBImpl::Writer {
   WriteBatch* batch;
   bool sync;
   bool done;
+  // Last sequence of the group of writes led by this writer and whether
+  // the group has been inserted into the memtable. Set only for pipelined
+  // writes.
+  SequenceNumber last_sequence;
+  bool inserted;
   port::CondVar cv;
 
   explicit Writer(port::Mutex* mu) : cv(mu) {}
@@ -84,10 +89,40 @@ struct DBImpl::CompactionState {
 
   uint64_t total_bytes;
 
+  // Range of user keys compacted: [begin, limit). An empty begin means the
+  // beginning of the compaction and an empty limit means its end. Set when
+  // compacting a piece of a compaction.
+  std::string begin;
+  std::string limit;
+  Compaction::Cursor cursor;
+  Status status;
+
+  // Time spent on memtable compactions and being paused
+  int64_t imm_micros;
+  int64_t paused_micros;
+
   Output* current_output() { return &outputs[outputs.size() - 1]; }
 
   explicit CompactionState(Compaction* c)
-      : compaction(c), outfile(NULL), builder(NULL), total_bytes(0) {}
+      : compaction(c),
+        outfile(NULL),
+        builder(NULL),
+        total_bytes(0),
+        imm_micros(0),
+        paused_micros(0) {}
+};
+
+// Pieces of a compaction shared by the thread running the compaction and the
+// threads helping it. Each thread repeatedly claims the next piece until none
+// remain so that the compaction completes even when no helper gets to run.
+struct DBImpl::SubcompactionJob {
+  DBImpl* db;
+  CompactionState* compact;  // The compaction being split
+  // State below is protected by db->mutex_
+  std::vector<CompactionState*> pieces;
+  size_t next;  // Next piece to claim
+  int running;  // Number of pieces being compacted
+  int refs;     // The thread running the compaction plus pending helpers
 };
 
 struct DBImpl::InsertionState {
@@ -137,11 +172,13 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
       bg_compaction_disabled_(0),
       bg_compaction_paused_(0),
       bg_compaction_scheduled_(false),
-      bg_compaction_in_progress_(false),
+      bg_compaction_in_progress_(0),
+      bg_subcompaction_helpers_(0),
       bulk_insert_in_progress_(false),
       manual_compaction_(NULL) {
   if (!options_.no_memtable) {
-    mem_ = new MemTable(internal_comparator_);
+    mem_ = new MemTable(internal_comparator_, options_.concurrent_memtable,
+                        options_.memtable_hash_buckets);
     mem_->Ref();
   }
   has_imm_.Release_Store(NULL);
@@ -162,7 +199,8 @@ DBImpl::~DBImpl() {
   Log(options_.info_log, 1, "Shutting down ...");
 #endif
   shutting_down_.Release_Store(this);  // Any non-NULL value is ok
-  while (bg_compaction_scheduled_ || bg_compaction_paused_) {
+  while (bg_compaction_scheduled_ || bg_compaction_paused_ ||
+         bg_subcompaction_helpers_ != 0) {
     bg_cv_.Wait();
   }
   mutex_.Unlock();
@@ -778,7 +816,11 @@ bool DBImpl::HasCompaction() {
 void DBImpl::MaybeScheduleCompaction() {
   mutex_.AssertHeld();
   if (bg_compaction_scheduled_ || bg_compaction_paused_) {
-    // Already scheduled or paused
+    // Already scheduled or paused. Wake up a compaction that may be waiting
+    // for its subcompactions so it can compact the new memtable
+    if (imm_ != NULL) {
+      bg_cv_.SignalAll();
+    }
   } else if (shutting_down_.Acquire_Load()) {
     // DB is being deleted; no more background compactions
   } else if (!bg_error_.ok()) {
@@ -821,9 +863,9 @@ void DBImpl::BackgroundCall() {
 
 void DBImpl::BackgroundCompactionWrapper() {
   assert(!bg_compaction_in_progress_);
-  bg_compaction_in_progress_ = true;
+  bg_compaction_in_progress_++;
   BackgroundCompaction();
-  bg_compaction_in_progress_ = false;
+  bg_compaction_in_progress_--;
 }
 
 void DBImpl::BackgroundCompaction() {
@@ -1041,9 +1083,8 @@ Status DBImpl::InstallCompactionResults(CompactionState* compact) {
 }
 
 Status DBImpl::DoCompactionWork(CompactionState* compact) {
+  mutex_.AssertHeld();
   const uint64_t start_micros = CurrentMicros();
-  int64_t paused_micros = 0;
-  int64_t imm_micros = 0;  // Micros spent doing imm_ compactions
 #if VERBOSE >= 4
   Log(options_.info_log, 4, "Compacting %d@%d + %d@%d files ...",
       compact->compaction->num_input_files(0), compact->compaction->level(),
@@ -1059,11 +1100,162 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
     compact->smallest_snapshot = snapshots_.oldest()->number_;
   }
 
-  // Release mutex while we're actually doing the compaction work
-  mutex_.Unlock();
+  std::vector<std::string> split_keys;
+  compact->compaction->GetSplitKeys(options_.max_subcompactions, &split_keys);
+  Status status;
+  if (split_keys.empty()) {
+    // Release mutex while we're actually doing the compaction work
+    mutex_.Unlock();
+    status = DoSubcompactionWork(compact, true);
+    mutex_.Lock();
+  } else {
+    status = DoSubcompactions(compact, split_keys);
+  }
+
+  CompactionStats stats;
+  stats.micros = CurrentMicros() - start_micros - compact->paused_micros -
+                 compact->imm_micros;
+  stats.in0 = compact->compaction->num_input_files(0);
+  stats.in1 = compact->compaction->num_input_files(1);
+  for (int which = 0; which < 2; which++) {
+    for (int i = 0; i < compact->compaction->num_input_files(which); i++) {
+      stats.bytes_read += compact->compaction->input(which, i)->file_size;
+    }
+  }
+  stats.files = compact->outputs.size();
+  for (size_t i = 0; i < compact->outputs.size(); i++) {
+    stats.bytes_written += compact->outputs[i].file_size;
+  }
+  stats.n = 1;
+
+  stats_[compact->compaction->level() + 1].Add(stats);
+
+  if (status.ok()) {
+    status = InstallCompactionResults(compact);
+  }
+  if (!status.ok()) {
+    RecordBackgroundError(status);
+  }
+#if VERBOSE >= 1
+  VersionSet::LevelSummaryStorage tmp;
+  Log(options_.info_log, 1, "Compaction done: L%d->L%d, db => %s",
+      compact->compaction->level(), compact->compaction->level() + 1,
+      versions_->LevelSummary(&tmp));
+#endif
+  return status;
+}
+
+// Pieces are ordered by key, so are their outputs. While waiting for helpers
+// to finish, the thread running the compaction keeps compacting memtables.
+Status DBImpl::DoSubcompactions(  ///
+    CompactionState* const compact,
+    const std::vector<std::string>& split_keys) {
+  mutex_.AssertHeld();
+  SubcompactionJob* const job = new SubcompactionJob;
+  job->db = this;
+  job->compact = compact;
+  for (size_t i = 0; i <= split_keys.size(); i++) {
+    CompactionState* const piece = new CompactionState(compact->compaction);
+    piece->smallest_snapshot = compact->smallest_snapshot;
+    if (i != 0) piece->begin = split_keys[i - 1];
+    if (i != split_keys.size()) piece->limit = split_keys[i];
+    job->pieces.push_back(piece);
+  }
+  job->next = 0;
+  job->running = 0;
+  const int helpers = static_cast<int>(split_keys.size());
+  job->refs = 1 + helpers;
+  bg_subcompaction_helpers_ += helpers;
+  for (int i = 0; i < helpers; i++) {
+    if (options_.compaction_pool != NULL) {
+      options_.compaction_pool->Schedule(&DBImpl::SubcompactionWork, job);
+    } else {
+      env_->Schedule(&DBImpl::SubcompactionWork, job);
+    }
+  }
+  RunSubcompactions(job, true);
+  while (job->running != 0) {
+    if (imm_ != NULL) {
+      const uint64_t imm_start = CurrentMicros();
+      CompactMemTable();
+      bg_cv_.SignalAll();  // Wakeup MakeRoomForWrite() if necessary
+      compact->imm_micros += (CurrentMicros() - imm_start);
+    } else if (bg_compaction_paused_) {
+      const uint64_t pause_start = CurrentMicros();
+      bg_compaction_in_progress_--;
+      bg_cv_.SignalAll();
+      while (bg_compaction_paused_) {
+        bg_cv_.Wait();
+      }
+      bg_compaction_in_progress_++;
+      compact->paused_micros += (CurrentMicros() - pause_start);
+    } else {
+      bg_cv_.Wait();
+    }
+  }
+  Status status;
+  for (size_t i = 0; i < job->pieces.size(); i++) {
+    CompactionState* const piece = job->pieces[i];
+    if (status.ok()) {
+      status = piece->status;
+    }
+    compact->outputs.insert(compact->outputs.end(), piece->outputs.begin(),
+                            piece->outputs.end());
+    compact->total_bytes += piece->total_bytes;
+    // Outputs are now owned by *compact
+    piece->outputs.clear();
+    CleanupCompaction(piece);
+  }
+  job->pieces.clear();
+  if (--job->refs == 0) {
+    delete job;
+  }
+  return status;
+}
+
+void DBImpl::SubcompactionWork(void* arg) {
+  SubcompactionJob* const job = reinterpret_cast<SubcompactionJob*>(arg);
+  DBImpl* const db = job->db;
+  MutexLock l(&db->mutex_);
+  while (db->bg_compaction_paused_) {
+    db->bg_cv_.Wait();
+  }
+  db->bg_compaction_in_progress_++;
+  db->RunSubcompactions(job, false);
+  db->bg_compaction_in_progress_--;
+  if (--job->refs == 0) {
+    delete job;
+  }
+  db->bg_subcompaction_helpers_--;
+  db->bg_cv_.SignalAll();
+}
+
+// REQUIRES: mutex_ has been locked.
+void DBImpl::RunSubcompactions(SubcompactionJob* const job, bool is_main) {
+  mutex_.AssertHeld();
+  while (job->next < job->pieces.size()) {
+    CompactionState* const piece = job->pieces[job->next++];
+    job->running++;
+    mutex_.Unlock();
+    piece->status = DoSubcompactionWork(piece, is_main);
+    mutex_.Lock();
+    if (is_main) {
+      job->compact->imm_micros += piece->imm_micros;
+      job->compact->paused_micros += piece->paused_micros;
+    }
+    job->running--;
+  }
+  bg_cv_.SignalAll();
+}
 
+Status DBImpl::DoSubcompactionWork(CompactionState* compact, bool is_main) {
   Iterator* input = versions_->MakeInputIterator(compact->compaction);
-  input->SeekToFirst();
+  if (compact->begin.empty()) {
+    input->SeekToFirst();
+  } else {
+    InternalKey begin(compact->begin, kMaxSequenceNumber, kValueTypeForSeek);
+    input->Seek(begin.Encode());
+  }
   Status status;
   ParsedInternalKey ikey;
   std::string current_user_key;
@@ -1071,7 +1263,7 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
   SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
   for (; input->Valid() && !shutting_down_.Acquire_Load();) {
     // Prioritize memtable compactions and bulk insertion work
-    if (has_imm_.NoBarrier_Load() != NULL) {
+    if (is_main && has_imm_.NoBarrier_Load() != NULL) {
       const uint64_t imm_start = CurrentMicros();
       mutex_.Lock();
       if (imm_ != NULL) {
@@ -1079,24 +1271,28 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
         bg_cv_.SignalAll();  // Wakeup MakeRoomForWrite() if necessary
       }
       mutex_.Unlock();
-      imm_micros += (CurrentMicros() - imm_start);
+      compact->imm_micros += (CurrentMicros() - imm_start);
     }
     if (bg_compaction_paused_) {
       const uint64_t pause_start = CurrentMicros();
       mutex_.Lock();
-      assert(bg_compaction_in_progress_);
-      bg_compaction_in_progress_ = false;
+      assert(bg_compaction_in_progress_ > 0);
+      bg_compaction_in_progress_--;
       bg_cv_.SignalAll();
       while (bg_compaction_paused_) {
         bg_cv_.Wait();
       }
-      bg_compaction_in_progress_ = true;
+      bg_compaction_in_progress_++;
       mutex_.Unlock();
-      paused_micros += (CurrentMicros() - pause_start);
+      compact->paused_micros += (CurrentMicros() - pause_start);
     }
 
     Slice key = input->key();
-    if (compact->compaction->ShouldStopBefore(key) &&
+    const bool parsed = ParseInternalKey(key, &ikey);
+    if (parsed && !BeforeUserLimit(key, compact->limit)) {
+      break;  // The rest belongs to the next piece
+    }
+    if (compact->compaction->ShouldStopBefore(key, &compact->cursor) &&
         compact->builder != NULL) {
       status = FinishCompactionOutputFile(compact, input);
       if (!status.ok()) {
@@ -1106,7 +1302,7 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
 
     // Handle key/value, add to state, etc.
     bool drop = false;
-    if (!ParseInternalKey(key, &ikey)) {
+    if (!parsed) {
       // Do not hide error keys
       current_user_key.clear();
       has_current_user_key = false;
@@ -1126,7 +1322,8 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
         drop = true;  // (A)
       } else if (ikey.type == kTypeDeletion &&
                  ikey.sequence <= compact->smallest_snapshot &&
-                 compact->compaction->IsBaseLevelForKey(ikey.user_key)) {
+                 compact->compaction->IsBaseLevelForKey(ikey.user_key,
+                                                        &compact->cursor)) {
         // For this user key:
         // (1) there is no data in higher levels
         // (2) data in lower levels will have larger sequence numbers
@@ -1139,15 +1336,6 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
 
       last_sequence_for_key = ikey.sequence;
     }
-#if 0
-    Log(options_.info_log,
-        "  Compact: %s, seq %d, type: %d %d, drop: %d, is_base: %d, "
-        "%d smallest_snapshot: %d",
-        ikey.user_key.ToString().c_str(),
-        (int)ikey.sequence, ikey.type, kTypeValue, drop,
-        compact->compaction->IsBaseLevelForKey(ikey.user_key),
-        (int)last_sequence_for_key, (int)compact->smallest_snapshot);
-#endif
 
     if (!drop) {
       // Open output file if necessary
@@ -1183,38 +1371,6 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
     status = input->status();
   }
   delete input;
-  input = NULL;
-
-  CompactionStats stats;
-  stats.micros = CurrentMicros() - start_micros - paused_micros - imm_micros;
-  stats.in0 = compact->compaction->num_input_files(0);
-  stats.in1 = compact->compaction->num_input_files(1);
-  for (int which = 0; which < 2; which++) {
-    for (int i = 0; i < compact->compaction->num_input_files(which); i++) {
-      stats.bytes_read += compact->compaction->input(which, i)->file_size;
-    }
-  }
-  stats.files = compact->outputs.size();
-  for (size_t i = 0; i < compact->outputs.size(); i++) {
-    stats.bytes_written += compact->outputs[i].file_size;
-  }
-  stats.n = 1;
-
-  mutex_.Lock();
-  stats_[compact->compaction->level() + 1].Add(stats);
-
-  if (status.ok()) {
-    status = InstallCompactionResults(compact);
-  }
-  if (!status.ok()) {
-    RecordBackgroundError(status);
-  }
-#if VERBOSE >= 1
-  VersionSet::LevelSummaryStorage tmp;
-  Log(options_.info_log, 1, "Compaction done: L%d->L%d, db => %s",
-      compact->compaction->level(), compact->compaction->level() + 1,
-      versions_->LevelSummary(&tmp));
-#endif
   return status;
 }
 
@@ -1435,6 +1591,11 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
     my_batch = &flush_memtable_;
   }
 
+  if (options_.pipelined_write && !options_.no_memtable &&
+      my_batch != &flush_memtable_ && my_batch != &sync_wal_) {
+    return PipelinedWrite(options, my_batch);
+  }
+
   Writer w(&mutex_);
   w.sync = options.sync;
   w.done = false;
@@ -1464,7 +1625,8 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
       // We skip flush_memtable_ batches because they don't have any real data
       // for insertion. For regular batches, we try adding more writes into the
       // current batch. If we do so we will update last_writer accordingly.
-      WriteBatch* const final_batch = BuildBatchGroup(&last_writer);
+      WriteBatch* const final_batch =
+          BuildBatchGroup(&last_writer, &tmp_batch_);
       uint64_t last_sequence = versions_->LastSequence();
       WriteBatchInternal::SetSequence(final_batch, last_sequence + 1);
       last_sequence += WriteBatchInternal::Count(final_batch);
@@ -1572,9 +1734,132 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
   return status;
 }
 
+// Group commit in two stages. The writer at the front of writers_ appends a
+// group of writes to the log and then passes the log to the next writer
+// before joining mem_writers_ to insert the group into the memtable. Groups
+// are inserted in the order they are logged, or in parallel with a
+// concurrent memtable. Either way, the db's last sequence only advances in
+// log order over writes that are fully applied.
+Status DBImpl::PipelinedWrite(const WriteOptions& options,
+                              WriteBatch* my_batch) {
+  Writer w(&mutex_);
+  w.sync = options.sync;
+  w.done = false;
+  w.batch = my_batch;
+  w.inserted = false;
+
+  MutexLock l(&mutex_);
+  writers_.push_back(&w);
+  while (!w.done && &w != writers_.front()) {
+    w.cv.Wait();
+  }
+  if (w.done) {
+    return w.status;
+  }
+
+  std::vector<Writer*> group;
+  WriteBatch tmp_batch;
+  WriteBatch* final_batch = NULL;
+  Writer* last_writer = &w;
+  Status status = MakeRoomForWrite(false);
+  if (status.ok()) {
+    final_batch = BuildBatchGroup(&last_writer, &tmp_batch);
+    // Sequences are allocated after those of the groups not yet inserted
+    SequenceNumber last_sequence = mem_writers_.empty()
+                                       ? versions_->LastSequence()
+                                       : mem_writers_.back()->last_sequence;
+    WriteBatchInternal::SetSequence(final_batch, last_sequence + 1);
+    last_sequence += WriteBatchInternal::Count(final_batch);
+    w.last_sequence = last_sequence;
+
+    // Add to log. We can release the lock during this phase since &w is
+    // currently responsible for logging and protects against concurrent
+    // loggers.
+    if (!options_.disable_write_ahead_log) {
+      bool sync_error = false;
+      mutex_.Unlock();
+      status = log_->AddRecord(WriteBatchInternal::Contents(final_batch));
+      if (status.ok() && options.sync) {
+        status = logfile_->Sync();
+        if (!status.ok()) {
+          sync_error = true;
+        }
+      }
+      mutex_.Lock();
+      if (sync_error) {
+        // The state of the log file is unclear: the log record we just
+        // added may or may not show up when the DB is re-opened. So we
+        // force the db into a mode where all future writes fail.
+        RecordBackgroundError(status);
+      }
+    }
+
+    mem_writers_.push_back(&w);
+  }
+
+  // Pass the log to the next writer
+  while (true) {
+    Writer* ready = writers_.front();
+    writers_.pop_front();
+    if (ready != &w) {
+      group.push_back(ready);
+    }
+    if (ready == last_writer) {
+      break;
+    }
+  }
+  if (!writers_.empty()) {
+    writers_.front()->cv.Signal();
+  }
+
+  if (final_batch != NULL) {
+    if (!options_.concurrent_memtable) {
+      while (&w != mem_writers_.front()) {
+        w.cv.Wait();
+      }
+    }
+    // mem_ is not switched while mem_writers_ is non-empty
+    MemTable* const mem = mem_;
+    if (status.ok()) {
+      mutex_.Unlock();
+      status = WriteBatchInternal::InsertInto(final_batch, mem);
+      mutex_.Lock();
+    }
+    // Retire all inserted groups at the front of the queue. A group
+    // inserted ahead of earlier groups waits to be retired by them.
+    w.inserted = true;
+    while (!mem_writers_.empty() && mem_writers_.front()->inserted) {
+      Writer* const ready = mem_writers_.front();
+      mem_writers_.pop_front();
+      versions_->SetLastSequence(ready->last_sequence);
+      ready->done = true;
+      if (ready != &w) {
+        ready->cv.Signal();
+      }
+    }
+    if (!mem_writers_.empty()) {
+      mem_writers_.front()->cv.Signal();
+    } else {
+      bg_cv_.SignalAll();  // Wakeup MakeRoomForWrite() if necessary
+    }
+    while (!w.done) {
+      w.cv.Wait();
+    }
+  }
+
+  for (size_t i = 0; i < group.size(); i++) {
+    group[i]->status = status;
+    group[i]->done = true;
+    group[i]->cv.Signal();
+  }
+
+  return status;
+}
+
 // REQUIRES: Writer list must be non-empty
 // REQUIRES: First writer must have a non-NULL batch
-WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer) {
+WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer,
+                                    WriteBatch* const tmp_batch) {
   assert(!writers_.empty());
   Writer* first = writers_.front();
   WriteBatch* result = first->batch;
@@ -1615,7 +1900,7 @@ WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer) {
       // Append to *result
       if (result == first->batch) {
         // Switch to temporary batch instead of disturbing caller's batch
-        result = &tmp_batch_;
+        result = tmp_batch;
         assert(WriteBatchInternal::Count(result) == 0);
         WriteBatchInternal::Append(result, first->batch);
       }
@@ -1673,6 +1958,9 @@ Status DBImpl::MakeRoomForWrite(bool force) {
 #endif
       bg_cv_.Wait();
       l0_hard_limits_++;
+    } else if (!mem_writers_.empty()) {
+      // Pipelined writes are still being inserted into the current memtable
+      bg_cv_.Wait();
     } else if (!options_.no_memtable) {
       // Close the current log file and open a new one
       if (!options_.disable_write_ahead_log) {
@@ -1700,7 +1988,8 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       // trigger compaction of old
       imm_ = mem_;
       has_imm_.Release_Store(imm_);
-      mem_ = new MemTable(internal_comparator_);
+      mem_ = new MemTable(internal_comparator_, options_.concurrent_memtable,
+                        options_.memtable_hash_buckets);
       mem_->Ref();
       force = false;  // Do not force another compaction if have room
       MaybeScheduleCompaction();
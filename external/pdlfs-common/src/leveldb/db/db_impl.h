@@ -100,6 +100,7 @@ class DBImpl : public DB {
  protected:
   friend class DB;
   struct CompactionState;
+  struct SubcompactionJob;
   struct InsertionState;
   struct Writer;
 
@@ -137,7 +138,8 @@ class DBImpl : public DB {
                           SequenceNumber* min_seq, SequenceNumber* max_seq);
 
   Status MakeRoomForWrite(bool force /* compact even if there is room? */);
-  WriteBatch* BuildBatchGroup(Writer** last_writer);
+  WriteBatch* BuildBatchGroup(Writer** last_writer, WriteBatch* tmp_batch);
+  Status PipelinedWrite(const WriteOptions& options, WriteBatch* my_batch);
 
   void RecordBackgroundError(const Status& s);
 
@@ -149,6 +151,15 @@ class DBImpl : public DB {
   void BackgroundCompaction();
   void CleanupCompaction(CompactionState* compact);
   Status DoCompactionWork(CompactionState* compact);
+  // Compact the pieces of a compaction in parallel and gather their outputs
+  // into *compact. REQUIRES: mutex_ has been locked.
+  Status DoSubcompactions(CompactionState* compact,
+                          const std::vector<std::string>& split_keys);
+  static void SubcompactionWork(void* job);
+  void RunSubcompactions(SubcompactionJob* job, bool is_main);
+  // Compact the key range of a single compaction or a piece of it. Only the
+  // thread running the compaction (is_main) may compact memtables meanwhile.
+  Status DoSubcompactionWork(CompactionState* compact, bool is_main);
 
   Status OpenCompactionOutputFile(CompactionState* compact);
   Status FinishCompactionOutputFile(CompactionState* compact, Iterator* input);
@@ -188,6 +199,9 @@ class DBImpl : public DB {
 
   // Queue of writers.
   std::deque<Writer*> writers_;
+  // Queue of logged write groups waiting to be inserted into mem_, each
+  // represented by its leader. Only used by pipelined writes.
+  std::deque<Writer*> mem_writers_;
   WriteBatch flush_memtable_;  // Dummy batch representing a compaction request
   WriteBatch sync_wal_;        // Dummy batch representing a WAL sync request
   // Temporary storage for grouping write batches
@@ -212,9 +226,12 @@ class DBImpl : public DB {
   unsigned int bg_compaction_paused_;
   // Has a background compaction been scheduled and not yet completed?
   bool bg_compaction_scheduled_;
-  // Is there an active background compaction job? Background compaction work
-  // may be paused (inactive) in the middle
-  bool bg_compaction_in_progress_;
+  // Number of threads actively doing background compaction work, including
+  // those helping with subcompactions. Background compaction work may be
+  // paused (inactive) in the middle
+  int bg_compaction_in_progress_;
+  // Number of subcompaction helpers scheduled and not yet completed
+  int bg_subcompaction_helpers_;
   // Is there an active foreground bulk insertion job?
   bool bulk_insert_in_progress_;
 
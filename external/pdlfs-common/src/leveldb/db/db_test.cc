@@ -208,7 +208,16 @@ class DBTest {
   const FilterPolicy* filter_policy_;
 
   // Sequence of option configurations to try
-  enum OptionConfig { kDefault, kFilter, kUncompressed, kEnd };
+  enum OptionConfig {
+    kDefault,
+    kFilter,
+    kUncompressed,
+    kPipelinedWrite,
+    kConcurrentMemTable,
+    kHashIndexedMemTable,
+    kEctIndexedTable,
+    kEnd
+  };
   int option_config_;
 
  public:
@@ -255,6 +264,20 @@ class DBTest {
       case kUncompressed:
         options.compression = kNoCompression;
         break;
+      case kPipelinedWrite:
+        options.pipelined_write = true;
+        break;
+      case kConcurrentMemTable:
+        options.pipelined_write = true;
+        options.concurrent_memtable = true;
+        break;
+      case kHashIndexedMemTable:
+        options.memtable_hash_buckets = 64;  // Force long bucket chains
+        break;
+      case kEctIndexedTable:
+        options.index_type = kEctIndex;
+        options.filter_policy = filter_policy_;
+        break;
       default:
         break;
     }
@@ -1157,6 +1180,62 @@ TEST(DBTest, CompactionsGenerateMultipleFiles) {
   }
 }
 
+TEST(DBTest, Subcompactions) {
+  ThreadPool* const pool = ThreadPool::NewFixed(3);
+  Options options = CurrentOptions();
+  options.write_buffer_size = 100000000;  // Large write buffer
+  options.compaction_pool = pool;
+  options.max_subcompactions = 4;
+  Reopen(&options);
+
+  Random rnd(301);
+
+  // Write 8MB (80 values, each 100K) and compact them into multiple
+  // level-1 files
+  std::vector<std::string> values;
+  for (int i = 0; i < 80; i++) {
+    values.push_back(RandomString(&rnd, 100000));
+    ASSERT_OK(Put(Key(i), values[i]));
+  }
+  Reopen(&options);
+  dbfull()->TEST_CompactRange(0, NULL, NULL);
+  ASSERT_GT(NumTableFilesAtLevel(1), 1);
+
+  // Overwrite and delete keys across the entire key range so every
+  // subcompaction has work to do
+  for (int i = 0; i < 80; i += 3) {
+    values[i] = RandomString(&rnd, 100000);
+    ASSERT_OK(Put(Key(i), values[i]));
+  }
+  for (int i = 1; i < 80; i += 7) {
+    values[i] = "NOT_FOUND";
+    ASSERT_OK(Delete(Key(i)));
+  }
+  Reopen(&options);
+  dbfull()->TEST_CompactRange(0, NULL, NULL);
+
+  ASSERT_EQ(NumTableFilesAtLevel(0), 0);
+  ASSERT_GT(NumTableFilesAtLevel(1), 1);
+  for (int i = 0; i < 80; i++) {
+    ASSERT_EQ(Get(Key(i)), values[i]);
+  }
+  Iterator* iter = db_->NewIterator(ReadOptions());
+  int i = 0;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    while (values[i] == "NOT_FOUND") i++;
+    ASSERT_EQ(iter->key().ToString(), Key(i));
+    ASSERT_EQ(iter->value().ToString(), values[i]);
+    i++;
+  }
+  ASSERT_OK(iter->status());
+  delete iter;
+  while (i < 80 && values[i] == "NOT_FOUND") i++;
+  ASSERT_EQ(i, 80);
+
+  Close();
+  delete pool;
+}
+
 TEST(DBTest, RepeatedWritesToSameKey) {
   Options options = CurrentOptions();
   options.env = env_;
@@ -18,6 +18,7 @@
 
 #include "pdlfs-common/coding.h"
 #include "pdlfs-common/env.h"
+#include "pdlfs-common/hash.h"
 
 #include <algorithm>
 
@@ -30,12 +31,34 @@ static Slice GetLengthPrefixedSlice(const char* data) {
   return Slice(p, len);
 }
 
-MemTable::MemTable(const InternalKeyComparator& cmp)
-    : comparator_(cmp), refs_(0), table_(comparator_, &arena_) {}
+MemTable::MemTable(const InternalKeyComparator& cmp, bool concurrent_insert,
+                   size_t hash_buckets)
+    : comparator_(cmp),
+      concurrent_insert_(concurrent_insert),
+      refs_(0),
+      concurrent_arena_(concurrent_insert ? new ConcurrentArena : NULL),
+      alloc_(concurrent_insert ? static_cast<Allocator*>(concurrent_arena_)
+                               : &arena_),
+      table_(comparator_, alloc_),
+      buckets_(NULL),
+      num_buckets_(hash_buckets) {
+  if (num_buckets_ != 0) {
+    buckets_ = new port::AtomicPointer[num_buckets_];
+    for (size_t i = 0; i < num_buckets_; i++) {
+      buckets_[i].NoBarrier_Store(NULL);
+    }
+  }
+}
 
-MemTable::~MemTable() { assert(refs_ == 0); }
+MemTable::~MemTable() {
+  assert(refs_ == 0);
+  delete[] buckets_;
+  delete concurrent_arena_;
+}
 
-size_t MemTable::ApproximateMemoryUsage() { return arena_.MemoryUsage(); }
+size_t MemTable::ApproximateMemoryUsage() {
+  return alloc_->MemoryUsage() + num_buckets_ * sizeof(port::AtomicPointer);
+}
 
 int MemTable::KeyComparator::operator()(const char* aptr,
                                         const char* bptr) const {
@@ -97,7 +120,7 @@ void MemTable::Add(SequenceNumber s, ValueType type, const Slice& key,
   const size_t encoded_len = VarintLength(internal_key_size) +
                              internal_key_size + VarintLength(val_size) +
                              val_size;
-  char* buf = arena_.Allocate(encoded_len);
+  char* buf = alloc_->Allocate(encoded_len);
   char* p = EncodeVarint32(buf, internal_key_size);
   memcpy(p, key.data(), key_size);
   p += key_size;
@@ -106,10 +129,93 @@ void MemTable::Add(SequenceNumber s, ValueType type, const Slice& key,
   p = EncodeVarint32(p, val_size);
   memcpy(p, value.data(), val_size);
   assert((p + val_size) - buf == encoded_len);
-  table_.Insert(buf);
+  if (concurrent_insert_) {
+    table_.InsertConcurrently(buf);
+  } else {
+    table_.Insert(buf);
+  }
+  if (buckets_ != NULL) {
+    AddToHashIndex(key, buf);
+  }
+}
+
+// New entries are pushed to the front of their buckets. Readers see either
+// the old or the new bucket head, both of which lead to complete chains.
+void MemTable::AddToHashIndex(const Slice& user_key, const char* entry) {
+  HashEntry* const e = reinterpret_cast<HashEntry*>(
+      alloc_->AllocateAligned(sizeof(HashEntry)));
+  e->entry = entry;
+  port::AtomicPointer* const bucket =
+      &buckets_[Hash(user_key.data(), user_key.size(), 0) % num_buckets_];
+  if (concurrent_insert_) {
+    void* head;
+    do {
+      head = bucket->Acquire_Load();
+      e->next.NoBarrier_Store(head);
+    } while (!bucket->CompareAndSwap(head, e));
+  } else {
+    e->next.NoBarrier_Store(bucket->NoBarrier_Load());
+    bucket->Release_Store(e);
+  }
+}
+
+namespace {
+// Read the value of a memtable entry whose internal key is stored at
+// key_ptr. Return false if the entry is neither a value nor a deletion.
+bool ReadEntry(const char* key_ptr, uint32_t key_length, Buffer* buf,
+               size_t limit, Status* s) {
+  const uint64_t tag = DecodeFixed64(key_ptr + key_length - 8);
+  switch (static_cast<ValueType>(tag & 0xff)) {
+    case kTypeValue: {
+      Slice v = GetLengthPrefixedSlice(key_ptr + key_length);
+      buf->Fill(v.data(), std::min(v.size(), limit));
+      return true;
+    }
+    case kTypeDeletion:
+      *s = Status::NotFound(Slice());
+      return true;
+  }
+  return false;
+}
+}  // namespace
+
+// A bucket chain holds all versions of a user key, though not necessarily
+// in sequence order when entries are inserted concurrently. Pick the latest
+// version that is not newer than the lookup key.
+bool MemTable::GetFromHashIndex(const LookupKey& key, Buffer* buf,
+                                size_t limit, Status* s) {
+  const Slice user_key = key.user_key();
+  const Slice ikey = key.internal_key();
+  const SequenceNumber seq = DecodeFixed64(ikey.data() + ikey.size() - 8) >> 8;
+  const char* found = NULL;
+  uint32_t found_length = 0;
+  SequenceNumber found_seq = 0;
+  HashEntry* e = reinterpret_cast<HashEntry*>(
+      buckets_[Hash(user_key.data(), user_key.size(), 0) % num_buckets_]
+          .Acquire_Load());
+  for (; e != NULL; e = reinterpret_cast<HashEntry*>(e->next.Acquire_Load())) {
+    uint32_t key_length;
+    const char* key_ptr = GetVarint32Ptr(e->entry, e->entry + 5, &key_length);
+    if (Slice(key_ptr, key_length - 8) == user_key) {
+      const SequenceNumber n = DecodeFixed64(key_ptr + key_length - 8) >> 8;
+      if (n <= seq && (found == NULL || n > found_seq)) {
+        found = key_ptr;
+        found_length = key_length;
+        found_seq = n;
+      }
+    }
+  }
+  if (found != NULL) {
+    return ReadEntry(found, found_length, buf, limit, s);
+  } else {
+    return false;
+  }
 }
 
 bool MemTable::Get(const LookupKey& key, Buffer* buf, size_t limit, Status* s) {
+  if (buckets_ != NULL) {
+    return GetFromHashIndex(key, buf, limit, s);
+  }
   Slice memkey = key.memtable_key();
   Table::Iterator iter(&table_);
   iter.Seek(memkey.data());
@@ -130,17 +236,7 @@ bool MemTable::Get(const LookupKey& key, Buffer* buf, size_t limit, Status* s) {
     const Comparator* ucmp = comparator_.comparator.user_comparator();
     if (ucmp->Compare(Slice(key_ptr, key_length - 8), key.user_key()) == 0) {
       // Correct user key
-      const uint64_t tag = DecodeFixed64(key_ptr + key_length - 8);
-      switch (static_cast<ValueType>(tag & 0xff)) {
-        case kTypeValue: {
-          Slice v = GetLengthPrefixedSlice(key_ptr + key_length);
-          buf->Fill(v.data(), std::min(v.size(), limit));
-          return true;
-        }
-        case kTypeDeletion:
-          *s = Status::NotFound(Slice());
-          return true;
-      }
+      return ReadEntry(key_ptr, key_length, buf, limit, s);
     }
   }
   return false;
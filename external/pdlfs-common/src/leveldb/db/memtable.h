@@ -33,7 +33,14 @@ class MemTable {
  public:
   // MemTables are reference counted.  The initial reference count
   // is zero and the caller must call Ref() at least once.
-  explicit MemTable(const InternalKeyComparator& comparator);
+  // If concurrent_insert is true, Add() may be called by multiple threads at
+  // once. Otherwise it requires external synchronization.
+  // If hash_buckets is not 0, entries are additionally indexed by user key
+  // in a hash table with the given number of buckets so that Get() does not
+  // need to search the skiplist. REQUIRES: user keys compare equal iff they
+  // are identical byte strings.
+  explicit MemTable(const InternalKeyComparator& comparator,
+                    bool concurrent_insert = false, size_t hash_buckets = 0);
 
   // Increase reference count.
   void Ref() { ++refs_; }
@@ -51,7 +58,8 @@ class MemTable {
   // data structure.
   //
   // REQUIRES: external synchronization to prevent simultaneous
-  // operations on the same MemTable.
+  // operations on the same MemTable unless it is created for concurrent
+  // insertion.
   size_t ApproximateMemoryUsage();
 
   // Return an iterator that yields the contents of the memtable.
@@ -86,10 +94,25 @@ class MemTable {
 
   typedef SkipList<const char*, KeyComparator> Table;
 
+  // An entry of a hash bucket. Points to an entry in table_.
+  struct HashEntry {
+    const char* entry;
+    port::AtomicPointer next;
+  };
+  void AddToHashIndex(const Slice& user_key, const char* entry);
+  bool GetFromHashIndex(const LookupKey& key, Buffer* value, size_t limit,
+                        Status* s);
+
   KeyComparator comparator_;
+  const bool concurrent_insert_;
   int refs_;
   Arena arena_;
+  ConcurrentArena* const concurrent_arena_;  // NULL if !concurrent_insert_
+  Allocator* const alloc_;
   Table table_;
+  // Heads of hash buckets; NULL if the hash index is disabled
+  port::AtomicPointer* buckets_;
+  const size_t num_buckets_;
 
   // No copying allowed
   MemTable(const MemTable&);
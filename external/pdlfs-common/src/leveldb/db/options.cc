@@ -34,12 +34,14 @@ DBOptions::DBOptions()
       env(Env::Default()),
       info_log(NULL),
       compaction_pool(NULL),
+      max_subcompactions(1),
       write_buffer_size(4 * 1048576),
       table_cache(NULL),
       block_cache(NULL),
       block_size(4 * 1024),
       block_restart_interval(16),
       index_block_restart_interval(1),
+      index_type(kBlockIndex),
       compression(kSnappyCompression),
       filter_policy(NULL),
       no_memtable(false),
@@ -48,6 +50,9 @@ DBOptions::DBOptions()
       rotating_manifest(false),
       sync_log_on_close(false),
       disable_write_ahead_log(false),
+      pipelined_write(false),
+      concurrent_memtable(false),
+      memtable_hash_buckets(0),
       disable_compaction(false),
       disable_seek_compaction(false),
       table_builder_skip_verification(false),
@@ -1586,12 +1586,12 @@ Compaction::Compaction(const Options* options, int level)
     : level_(level),
       max_output_file_size_(MaxFileSizeForLevel(options, level)),
       max_grand_parent_overlap_bytes_(MaxGrandParentOverlapBytes(options)),
-      input_version_(NULL),
-      grandparent_index_(0),
-      seen_key_(false),
-      overlapped_bytes_(0) {
+      input_version_(NULL) {}
+
+Compaction::Cursor::Cursor()
+    : grandparent_index(0), seen_key(false), overlapped_bytes(0) {
   for (int i = 0; i < config::kNumLevels; i++) {
-    level_ptrs_[i] = 0;
+    level_ptrs[i] = 0;
   }
 }
 
@@ -1617,13 +1617,14 @@ void Compaction::AddInputDeletions(VersionEdit* edit) {
   }
 }
 
-bool Compaction::IsBaseLevelForKey(const Slice& user_key) {
+bool Compaction::IsBaseLevelForKey(const Slice& user_key, Cursor* cursor) {
   // Maybe use binary search to find right entry instead of linear search?
   const Comparator* user_cmp = input_version_->vset_->icmp_.user_comparator();
+  size_t* const level_ptrs = cursor->level_ptrs;
   for (int lvl = level_ + 2; lvl < config::kNumLevels; lvl++) {
     const std::vector<FileMetaData*>& files = input_version_->files_[lvl];
-    for (; level_ptrs_[lvl] < files.size();) {
-      FileMetaData* f = files[level_ptrs_[lvl]];
+    for (; level_ptrs[lvl] < files.size();) {
+      FileMetaData* f = files[level_ptrs[lvl]];
       if (user_cmp->Compare(user_key, f->largest.user_key()) <= 0) {
         // We've advanced far enough
         if (user_cmp->Compare(user_key, f->smallest.user_key()) >= 0) {
@@ -1632,35 +1633,84 @@ bool Compaction::IsBaseLevelForKey(const Slice& user_key) {
         }
         break;
       }
-      level_ptrs_[lvl]++;
+      level_ptrs[lvl]++;
     }
   }
   return true;
 }
 
-bool Compaction::ShouldStopBefore(const Slice& internal_key) {
+bool Compaction::ShouldStopBefore(const Slice& internal_key, Cursor* cursor) {
   // Scan to find earliest grandparent file that contains key.
   const InternalKeyComparator* icmp = &input_version_->vset_->icmp_;
-  while (grandparent_index_ < grandparents_.size() &&
-         icmp->Compare(internal_key,
-                       grandparents_[grandparent_index_]->largest.Encode()) >
-             0) {
-    if (seen_key_) {
-      overlapped_bytes_ += grandparents_[grandparent_index_]->file_size;
+  while (cursor->grandparent_index < grandparents_.size() &&
+         icmp->Compare(
+             internal_key,
+             grandparents_[cursor->grandparent_index]->largest.Encode()) > 0) {
+    if (cursor->seen_key) {
+      cursor->overlapped_bytes +=
+          grandparents_[cursor->grandparent_index]->file_size;
     }
-    grandparent_index_++;
+    cursor->grandparent_index++;
   }
-  seen_key_ = true;
+  cursor->seen_key = true;
 
-  if (overlapped_bytes_ > max_grand_parent_overlap_bytes_) {
+  if (cursor->overlapped_bytes > max_grand_parent_overlap_bytes_) {
     // Too much overlap for current output; start new output
-    overlapped_bytes_ = 0;
+    cursor->overlapped_bytes = 0;
     return true;
   } else {
     return false;
   }
 }
 
+namespace {
+struct UserKeyLess {
+  explicit UserKeyLess(const Comparator* ucmp) : ucmp(ucmp) {}
+  bool operator()(const Slice& a, const Slice& b) const {
+    return ucmp->Compare(a, b) < 0;
+  }
+  const Comparator* ucmp;
+};
+}  // namespace
+
+// Input files at "level+1" are disjoint and sorted, so their smallest keys
+// make natural split points. When there are not enough of them, such as when
+// level-0 files are compacted into an empty level-1, the smallest keys of the
+// input files at "level" are used as well.
+void Compaction::GetSplitKeys(int n,
+                              std::vector<std::string>* user_keys) const {
+  user_keys->clear();
+  if (n <= 1) {
+    return;
+  }
+  const Comparator* const ucmp = input_version_->vset_->icmp_.user_comparator();
+  std::vector<Slice> candidates;
+  for (int which = 1; which >= 0; which--) {
+    for (size_t i = 0; i < inputs_[which].size(); i++) {
+      candidates.push_back(inputs_[which][i]->smallest.user_key());
+    }
+    if (candidates.size() > static_cast<size_t>(n)) {
+      break;
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(), UserKeyLess(ucmp));
+  std::vector<Slice> splits;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    if (i == 0 || ucmp->Compare(candidates[i], candidates[i - 1]) != 0) {
+      splits.push_back(candidates[i]);
+    }
+  }
+  // The smallest key already starts the first piece
+  if (splits.size() <= 1) {
+    return;
+  }
+  splits.erase(splits.begin());
+  const size_t m = std::min(static_cast<size_t>(n - 1), splits.size());
+  for (size_t i = 1; i <= m; i++) {
+    user_keys->push_back(splits[i * splits.size() / (m + 1)].ToString());
+  }
+}
+
 void Compaction::ReleaseInputs() {
   if (input_version_ != NULL) {
     input_version_->Unref();
@@ -10,8 +10,74 @@
  */
 #include "index_block.h"
 
+#include "pdlfs-common/leveldb/internal_types.h"
+#include "pdlfs-common/leveldb/iterator.h"
+
+#include "pdlfs-common/coding.h"
+#include "pdlfs-common/ect.h"
+#include "pdlfs-common/pdlfs_config.h"
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+
 namespace pdlfs {
 
+static const uint32_t kEctIndexMagic = 0xEC7EC7ECu;
+static const size_t kEctTrailerSize = 3 + 4;
+static const size_t kMaxEctUserKeyLength = 254;
+static const uint8_t kEctInternalKeys = 0x1;
+// Bounds the part of the trie decoded by each lookup
+static const size_t kEctPartitionSize = 16;
+
+// Map a key to a fixed-length string whose byte-wise order matches the
+// table's key order: the user key zero-padded (or cut) to max_len bytes,
+// one byte holding the user key length (capped at max_len + 1), and, for
+// internal keys, the inverted tag in big-endian so newer entries sort first.
+// The mapping is exact for all keys compared against separators of at most
+// max_len bytes, which is what an ECT needs to return correct ranks.
+static void EncodeEctKey(const Slice& key, bool internal_keys, size_t max_len,
+                         std::string* dst) {
+  Slice user_key = key;
+  uint64_t tag = 0;
+  if (internal_keys && key.size() >= 8) {
+    user_key = ExtractUserKey(key);
+    tag = DecodeFixed64(key.data() + user_key.size());
+  }
+  const size_t n = std::min(user_key.size(), max_len);
+  dst->append(user_key.data(), n);
+  dst->append(max_len - n, '\0');
+  dst->push_back(static_cast<char>(std::min(user_key.size(), max_len + 1)));
+  if (internal_keys) {
+    tag = ~tag;
+    for (int i = 7; i >= 0; i--) {
+      dst->push_back(static_cast<char>((tag >> (8 * i)) & 0xff));
+    }
+  }
+}
+
+IndexBlockBuilder::IndexBlockBuilder(IndexType type, int restart_interval,
+                                     const Comparator* cmp)
+    : builder_(restart_interval, cmp),
+      ect_(false),
+      internal_keys_(false),
+      max_user_key_length_(0) {
+#if defined(PDLFS_SILT_ECT)
+  if (type == kEctIndex) {
+    if (cmp == BytewiseComparator()) {
+      ect_ = true;
+    } else if (strcmp(cmp->Name(), "leveldb.InternalKeyComparator") == 0) {
+      const InternalKeyComparator* const icmp =
+          static_cast<const InternalKeyComparator*>(cmp);
+      if (icmp->user_comparator() == BytewiseComparator()) {
+        internal_keys_ = true;
+        ect_ = true;
+      }
+    }
+  }
+#endif
+}
+
 void IndexBlockBuilder::AddIndexEntry(std::string* last_key,
                                       const Slice* next_key,
                                       const BlockHandle& block_handle) {
@@ -22,9 +88,255 @@ void IndexBlockBuilder::AddIndexEntry(std::string* last_key,
     cmp->FindShortSuccessor(last_key);
   }
 
+  if (ect_) {
+    const Slice user_key =
+        internal_keys_ ? ExtractUserKey(*last_key) : Slice(*last_key);
+    if (user_key.size() > kMaxEctUserKeyLength ||
+        (!block_offsets_.empty() &&
+         block_offsets_.back() != block_handle.offset())) {
+      SwitchToBlockIndex();
+    } else {
+      if (block_offsets_.empty()) {
+        block_offsets_.push_back(block_handle.offset());
+      }
+      block_offsets_.push_back(block_handle.offset() + block_handle.size() +
+                               kBlockTrailerSize);
+      key_offsets_.push_back(keys_.size());
+      keys_.append(*last_key);
+      max_user_key_length_ = std::max(max_user_key_length_, user_key.size());
+      return;
+    }
+  }
+
   std::string encoding;
   block_handle.EncodeTo(&encoding);
   builder_.Add(*last_key, encoding);
 }
 
+void IndexBlockBuilder::SwitchToBlockIndex() {
+  assert(ect_);
+  ect_ = false;
+  std::string encoding;
+  for (size_t i = 0; i < key_offsets_.size(); i++) {
+    const size_t limit =
+        (i + 1 < key_offsets_.size()) ? key_offsets_[i + 1] : keys_.size();
+    Slice key(keys_.data() + key_offsets_[i], limit - key_offsets_[i]);
+    BlockHandle handle;
+    handle.set_offset(block_offsets_[i]);
+    handle.set_size(block_offsets_[i + 1] - block_offsets_[i] -
+                    kBlockTrailerSize);
+    encoding.clear();
+    handle.EncodeTo(&encoding);
+    builder_.Add(key, encoding);
+  }
+  keys_.clear();
+  key_offsets_.clear();
+  block_offsets_.clear();
+}
+
+size_t IndexBlockBuilder::CurrentSizeEstimate() const {
+  if (ect_) {
+    return keys_.size() + block_offsets_.size() * 8;
+  } else {
+    return builder_.CurrentSizeEstimate();
+  }
+}
+
+Slice IndexBlockBuilder::Finish() {
+  if (ect_ && !key_offsets_.empty()) {
+    FinishEct();
+    return buffer_;
+  } else {
+    return builder_.Finish();
+  }
+}
+
+void IndexBlockBuilder::FinishEct() {
+#if defined(PDLFS_SILT_ECT)
+  const size_t n = key_offsets_.size();
+  const size_t key_len = max_user_key_length_ + 1 + (internal_keys_ ? 8 : 0);
+  std::string ect_keys;
+  ect_keys.reserve(n * key_len);
+  for (size_t i = 0; i < n; i++) {
+    const size_t limit = (i + 1 < n) ? key_offsets_[i + 1] : keys_.size();
+    Slice key(keys_.data() + key_offsets_[i], limit - key_offsets_[i]);
+    EncodeEctKey(key, internal_keys_, max_user_key_length_, &ect_keys);
+  }
+  std::vector<Slice> sorted_keys;
+  sorted_keys.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    sorted_keys.push_back(Slice(ect_keys.data() + i * key_len, key_len));
+  }
+  ECT* const ect =
+      ECT::Partitioned(key_len, n, &sorted_keys[0], kEctPartitionSize);
+  buffer_.clear();
+  ect->EncodeTo(&buffer_);
+  delete ect;
+
+  const size_t width = (block_offsets_.back() > 0xffffffffu) ? 8 : 4;
+  for (size_t i = 0; i < block_offsets_.size(); i++) {
+    if (width == 8) {
+      PutFixed64(&buffer_, block_offsets_[i]);
+    } else {
+      PutFixed32(&buffer_, static_cast<uint32_t>(block_offsets_[i]));
+    }
+  }
+  buffer_.push_back(static_cast<char>(max_user_key_length_));
+  buffer_.push_back(static_cast<char>(internal_keys_ ? kEctInternalKeys : 0));
+  buffer_.push_back(static_cast<char>(width));
+  PutFixed32(&buffer_, kEctIndexMagic);
+#endif
+}
+
+// Iterates over the data blocks of a table in order. Seek() lands on the
+// block whose rank the ECT returns for the target, which is either the
+// first block that may hold the target or the one before it.
+class IndexBlockReader::EctIter : public Iterator {
+ public:
+  explicit EctIter(const IndexBlockReader* reader)
+      : reader_(reader),
+        num_blocks_(reader->offsets_.size() / reader->offset_width_ - 1),
+        current_(num_blocks_) {}
+
+  virtual ~EctIter() {}
+
+  virtual bool Valid() const { return current_ < num_blocks_; }
+
+  virtual void Seek(const Slice& target) {
+    tmp_.clear();
+    EncodeEctKey(target, reader_->internal_keys_,
+                 reader_->max_user_key_length_, &tmp_);
+    current_ = std::min(reader_->ect_->Find(tmp_), num_blocks_);
+    ParseCurrentHandle();
+  }
+
+  virtual void SeekToFirst() {
+    current_ = 0;
+    ParseCurrentHandle();
+  }
+
+  virtual void SeekToLast() {
+    current_ = num_blocks_ - 1;
+    ParseCurrentHandle();
+  }
+
+  virtual void Next() {
+    assert(Valid());
+    current_++;
+    ParseCurrentHandle();
+  }
+
+  virtual void Prev() {
+    assert(Valid());
+    current_ = (current_ == 0) ? num_blocks_ : current_ - 1;
+    ParseCurrentHandle();
+  }
+
+  // Separator keys are not kept in memory
+  virtual Slice key() const {
+    assert(Valid());
+    return Slice();
+  }
+
+  virtual Slice value() const {
+    assert(Valid());
+    return handle_;
+  }
+
+  virtual Status status() const { return Status::OK(); }
+
+ private:
+  uint64_t BlockOffset(size_t i) const {
+    const char* p = reader_->offsets_.data() + i * reader_->offset_width_;
+    if (reader_->offset_width_ == 8) {
+      return DecodeFixed64(p);
+    } else {
+      return DecodeFixed32(p);
+    }
+  }
+
+  void ParseCurrentHandle() {
+    handle_.clear();
+    if (Valid()) {
+      const uint64_t offset = BlockOffset(current_);
+      BlockHandle handle;
+      handle.set_offset(offset);
+      handle.set_size(BlockOffset(current_ + 1) - offset - kBlockTrailerSize);
+      handle.EncodeTo(&handle_);
+    }
+  }
+
+  const IndexBlockReader* const reader_;
+  const size_t num_blocks_;
+  size_t current_;
+  std::string handle_;  // Encoding of the current block handle
+  std::string tmp_;     // Scratch space for seek targets
+};
+
+IndexBlockReader::IndexBlockReader(const BlockContents& contents)
+    : block_(NULL),
+      ect_(NULL),
+      offset_width_(0),
+      max_user_key_length_(0),
+      internal_keys_(false) {
+  const Slice data = contents.data;
+  if (data.size() < kEctTrailerSize ||
+      DecodeFixed32(data.data() + data.size() - 4) != kEctIndexMagic) {
+    block_ = new Block(contents);
+    return;
+  }
+#if defined(PDLFS_SILT_ECT)
+  const char* const trailer = data.data() + data.size() - kEctTrailerSize;
+  max_user_key_length_ = static_cast<uint8_t>(trailer[0]);
+  internal_keys_ = (static_cast<uint8_t>(trailer[1]) & kEctInternalKeys) != 0;
+  offset_width_ = static_cast<uint8_t>(trailer[2]);
+  Slice input(data.data(), data.size() - kEctTrailerSize);
+  if (offset_width_ != 4 && offset_width_ != 8) {
+    status_ = Status::Corruption("bad ect index offset width");
+  } else {
+    status_ = ECT::DecodeFrom(&input, &ect_);
+  }
+  if (status_.ok()) {
+    if (input.size() % offset_width_ != 0 ||
+        input.size() < 2 * offset_width_) {
+      status_ = Status::Corruption("bad ect index offsets");
+    } else {
+      offsets_.assign(input.data(), input.size());
+    }
+  }
+#else
+  status_ = Status::NotSupported("ect index requires PDLFS_SILT_ECT");
+#endif
+  // The trie and the offsets have been copied out
+  if (contents.heap_allocated) {
+    delete[] contents.data.data();
+  }
+}
+
+IndexBlockReader::~IndexBlockReader() {
+  delete block_;
+  delete ect_;
+}
+
+size_t IndexBlockReader::ApproximateMemoryUsage() const {
+  if (block_ != NULL) {
+    return block_->size();
+  }
+  size_t result = offsets_.size();
+  if (ect_ != NULL) {
+    result += (ect_->MemUsage() + 7) / 8;
+  }
+  return result;
+}
+
+Iterator* IndexBlockReader::NewIterator(const Comparator* cmp) {
+  if (!status_.ok()) {
+    return NewErrorIterator(status_);
+  } else if (block_ != NULL) {
+    return block_->NewIterator(cmp);
+  } else {
+    return new EctIter(this);
+  }
+}
+
 }  // namespace pdlfs
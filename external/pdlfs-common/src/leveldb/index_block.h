@@ -14,21 +14,38 @@
 #include "pdlfs-common/leveldb/block_builder.h"
 #include "pdlfs-common/leveldb/comparator.h"
 #include "pdlfs-common/leveldb/format.h"
+#include "pdlfs-common/leveldb/options.h"
 #include "pdlfs-common/status.h"
 
+#include <string>
+#include <vector>
+
 namespace pdlfs {
 
+class ECT;
+
+// An ECT index block is laid out as:
+//    trie: an ECT over the separator keys (see ECT::EncodeTo)
+//    offsets: fixed32 or fixed64 [num_blocks + 1]
+//    max_user_key_length: uint8
+//    flags: uint8 (kEctInternalKeys)
+//    offset_width: uint8 (4 or 8)
+//    magic: fixed32 (kEctIndexMagic)
+// Data blocks are written back to back, so the handle of block i spans
+// offsets[i] to offsets[i + 1] minus the block trailer. The magic number
+// is larger than any restart count a block index could have, which is how
+// readers tell the two formats apart.
 class IndexBlockBuilder {
  public:
-  IndexBlockBuilder(int restart_interval, const Comparator* cmp)
-      : builder_(restart_interval, cmp) {}
+  IndexBlockBuilder(IndexType type, int restart_interval,
+                    const Comparator* cmp);
 
   void AddIndexEntry(std::string* last_key, const Slice* next_key,
                      const BlockHandle& block_handle);
 
-  Slice Finish() { return builder_.Finish(); }
+  Slice Finish();
 
-  size_t CurrentSizeEstimate() const { return builder_.CurrentSizeEstimate(); }
+  size_t CurrentSizeEstimate() const;
 
   void ChangeRestartInterval(int interval) {
     builder_.ChangeRestartInterval(interval);
@@ -39,21 +56,57 @@ class IndexBlockBuilder {
   }
 
  private:
+  // Move the index entries kept for an ECT into the block builder.
+  void SwitchToBlockIndex();
+  void FinishEct();
+
   BlockBuilder builder_;
+  // The remaining fields are only used to build an ECT index
+  bool ect_;
+  bool internal_keys_;  // Separators are internal keys
+  std::string keys_;    // Flattened separator keys
+  std::vector<size_t> key_offsets_;
+  std::vector<uint64_t> block_offsets_;  // Plus the end of the last block
+  size_t max_user_key_length_;
+  std::string buffer_;  // Finished ECT index
 };
 
 class IndexBlockReader {
  public:
-  explicit IndexBlockReader(const BlockContents& contents) : block_(contents) {}
+  explicit IndexBlockReader(const BlockContents& contents);
+  ~IndexBlockReader();
 
-  size_t ApproximateMemoryUsage() const { return block_.size(); }
+  // Return non-OK if the index is corrupted or cannot be read in this build.
+  Status status() const { return status_; }
 
-  Iterator* NewIterator(const Comparator* cmp) {
-    return block_.NewIterator(cmp);
-  }
+  size_t ApproximateMemoryUsage() const;
+
+  // Seek() on an iterator over an ECT index may stop one block short of
+  // the first block whose separator is >= the target, in which case callers
+  // must seek the target again in the next block. Such iterators also
+  // return empty keys since separators are not retained. Seek() on a
+  // block index is exact.
+  Iterator* NewIterator(const Comparator* cmp);
+
+  // Return the number of consecutive blocks, starting from the one an
+  // index iterator lands on after Seek(), that may hold the first key >=
+  // the target.
+  int SeekCandidates() const { return block_ == NULL ? 2 : 1; }
 
  private:
-  Block block_;
+  class EctIter;
+  Status status_;
+  Block* block_;
+  // ECT index
+  ECT* ect_;
+  std::string offsets_;
+  size_t offset_width_;
+  size_t max_user_key_length_;
+  bool internal_keys_;
+
+  // No copying allowed
+  void operator=(const IndexBlockReader&);
+  IndexBlockReader(const IndexBlockReader&);
 };
 
 }  // namespace pdlfs
@@ -26,10 +26,12 @@
 // Thread safety
 // -------------
 //
-// Writes require external synchronization, most likely a mutex.
-// Reads require a guarantee that the SkipList will not be destroyed
-// while the read is in progress.  Apart from that, reads progress
-// without any internal locking or synchronization.
+// Writes require external synchronization, most likely a mutex, unless they
+// are all done through InsertConcurrently(), which links nodes with atomic
+// compare-and-swap operations and may be called by multiple threads at once
+// given a thread-safe allocator. Reads require a guarantee that the SkipList
+// will not be destroyed while the read is in progress.  Apart from that, reads
+// progress without any internal locking or synchronization.
 //
 // Invariants:
 //
@@ -46,8 +48,6 @@
 // ... prev vs. next pointer ordering ...
 namespace pdlfs {
 
-class Arena;
-
 template <typename Key, class Comparator>
 class SkipList {
  private:
@@ -57,12 +57,17 @@ class SkipList {
   // Create a new SkipList object that will use "cmp" for comparing keys,
   // and will allocate memory using "*arena".  Objects allocated in the arena
   // must remain allocated for the lifetime of the skiplist object.
-  explicit SkipList(Comparator cmp, Arena* arena);
+  explicit SkipList(Comparator cmp, Allocator* arena);
 
   // Insert key into the list.
   // REQUIRES: nothing that compares equal to key is currently in the list.
   void Insert(const Key& key);
 
+  // Like Insert(), but safe to be called concurrently with other calls to
+  // InsertConcurrently(). Must not be mixed with Insert().
+  // REQUIRES: the arena used by the list is thread-safe.
+  void InsertConcurrently(const Key& key);
+
   // Returns true iff an entry that compares equal to key is in the list.
   bool Contains(const Key& key) const;
 
@@ -110,7 +115,7 @@ class SkipList {
 
   // Immutable after construction
   Comparator const compare_;
-  Arena* const arena_;  // Arena used for allocations of nodes
+  Allocator* const arena_;  // Arena used for allocations of nodes
 
   Node* const head_;
 
@@ -126,8 +131,13 @@ class SkipList {
   // Read/written only by Insert().
   Random rnd_;
 
+  // Number of nodes inserted concurrently so far. Used in place of rnd_ for
+  // generating node heights by InsertConcurrently().
+  port::AtomicPointer num_concurrent_inserts_;
+
   Node* NewNode(const Key& key, int height);
   int RandomHeight();
+  int ConcurrentRandomHeight();
   bool Equal(const Key& a, const Key& b) const { return (compare_(a, b) == 0); }
 
   // Return true if key is greater than the data stored in "n"
@@ -140,6 +150,12 @@ class SkipList {
   // node at "level" for every level in [0..max_height_-1].
   Node* FindGreaterOrEqual(const Key& key, Node** prev) const;
 
+  // Starting from node "before", find the two adjacent nodes at "level" that
+  // key falls between and store them in *prev and *next.
+  // REQUIRES: before is head_ or a node with a key < key.
+  void FindSpliceForLevel(const Key& key, Node* before, int level,
+                          Node** prev, Node** next) const;
+
   // Return the latest node with a key < key.
   // Return head_ if there is no such node.
   Node* FindLessThan(const Key& key) const;
@@ -185,6 +201,13 @@ struct SkipList<Key, Comparator>::Node {
     next_[n].NoBarrier_Store(x);
   }
 
+  // Set link n to x iff it currently points to expected. The swap acts as a
+  // full barrier so readers observe a fully initialized version of x.
+  bool CASNext(int n, Node* expected, Node* x) {
+    assert(n >= 0);
+    return next_[n].CompareAndSwap(expected, x);
+  }
+
  private:
   // Array of length equal to the node height.  next_[0] is lowest level link.
   port::AtomicPointer next_[1];
@@ -263,6 +286,31 @@ int SkipList<Key, Comparator>::RandomHeight() {
   return height;
 }
 
+template <typename Key, class Comparator>
+int SkipList<Key, Comparator>::ConcurrentRandomHeight() {
+  uintptr_t n;
+  do {
+    n = reinterpret_cast<uintptr_t>(num_concurrent_inserts_.NoBarrier_Load());
+  } while (!num_concurrent_inserts_.CompareAndSwap(
+      reinterpret_cast<void*>(n), reinterpret_cast<void*>(n + 1)));
+  // Scramble the insertion counter (the finalizer of MurmurHash3) and take
+  // two bits at a time so that each level is reached with probability 1 in 4
+  uint64_t h = n;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  int height = 1;
+  while (height < kMaxHeight && (h & 3) == 0) {
+    height++;
+    h >>= 2;
+  }
+  assert(height > 0);
+  assert(height <= kMaxHeight);
+  return height;
+}
+
 template <typename Key, class Comparator>
 bool SkipList<Key, Comparator>::KeyIsAfterNode(const Key& key, Node* n) const {
   // NULL n is considered infinite
@@ -292,6 +340,22 @@ SkipList<Key, Comparator>::FindGreaterOrEqual(const Key& key,
   }
 }
 
+template <typename Key, class Comparator>
+void SkipList<Key, Comparator>::FindSpliceForLevel(const Key& key, Node* before,
+                                                   int level, Node** prev,
+                                                   Node** next) const {
+  while (true) {
+    Node* after = before->Next(level);
+    if (KeyIsAfterNode(key, after)) {
+      before = after;
+    } else {
+      *prev = before;
+      *next = after;
+      return;
+    }
+  }
+}
+
 template <typename Key, class Comparator>
 typename SkipList<Key, Comparator>::Node*
 SkipList<Key, Comparator>::FindLessThan(const Key& key) const {
@@ -334,12 +398,13 @@ typename SkipList<Key, Comparator>::Node* SkipList<Key, Comparator>::FindLast()
 }
 
 template <typename Key, class Comparator>
-SkipList<Key, Comparator>::SkipList(Comparator cmp, Arena* arena)
+SkipList<Key, Comparator>::SkipList(Comparator cmp, Allocator* arena)
     : compare_(cmp),
       arena_(arena),
       head_(NewNode(0 /* any key will do */, kMaxHeight)),
       max_height_(reinterpret_cast<void*>(1)),
-      rnd_(0xdeadbeef) {
+      rnd_(0xdeadbeef),
+      num_concurrent_inserts_(NULL) {
   for (int i = 0; i < kMaxHeight; i++) {
     head_->SetNext(i, NULL);
   }
@@ -381,6 +446,50 @@ void SkipList<Key, Comparator>::Insert(const Key& key) {
   }
 }
 
+template <typename Key, class Comparator>
+void SkipList<Key, Comparator>::InsertConcurrently(const Key& key) {
+  const int height = ConcurrentRandomHeight();
+  Node* const x = NewNode(key, height);
+
+  // Concurrent readers and writers that observe a stale max_height_ will
+  // simply miss the new levels of x, which is ok as in Insert().
+  int max_height = GetMaxHeight();
+  while (height > max_height) {
+    if (max_height_.CompareAndSwap(reinterpret_cast<void*>(max_height),
+                                   reinterpret_cast<void*>(height))) {
+      break;
+    }
+    max_height = GetMaxHeight();
+  }
+
+  // Find the position of x at every level, starting from the top
+  Node* prev[kMaxHeight];
+  Node* next[kMaxHeight];
+  Node* before = head_;
+  for (int i = kMaxHeight - 1; i >= 0; i--) {
+    FindSpliceForLevel(key, before, i, &prev[i], &next[i]);
+    before = prev[i];
+  }
+
+  // Our data structure does not allow duplicate insertion
+  assert(next[0] == NULL || !Equal(key, next[0]->key));
+
+  // Link x from the bottom up. A level of x is linked only after all levels
+  // below it so that x is always reachable by searches reaching that level.
+  // Should another node be linked between prev[i] and next[i] in the
+  // meantime, we search again starting from prev[i], which remains before x
+  // since nodes are never deleted.
+  for (int i = 0; i < height; i++) {
+    while (true) {
+      x->NoBarrier_SetNext(i, next[i]);
+      if (prev[i]->CASNext(i, next[i], x)) {
+        break;
+      }
+      FindSpliceForLevel(key, prev[i], i, &prev[i], &next[i]);
+    }
+  }
+}
+
 template <typename Key, class Comparator>
 bool SkipList<Key, Comparator>::Contains(const Key& key) const {
   Node* x = FindGreaterOrEqual(key, NULL);
@@ -19,6 +19,7 @@
 #include "pdlfs-common/arena.h"
 #include "pdlfs-common/env.h"
 #include "pdlfs-common/hash.h"
+#include "pdlfs-common/mutexlock.h"
 #include "pdlfs-common/random.h"
 #include "pdlfs-common/testharness.h"
 
@@ -374,6 +375,106 @@ TEST(SkipTest, Concurrent3) { RunConcurrent(3); }
 TEST(SkipTest, Concurrent4) { RunConcurrent(4); }
 TEST(SkipTest, Concurrent5) { RunConcurrent(5); }
 
+// Multiple writers inserting through InsertConcurrently() while a reader
+// keeps scanning the list.
+class ConcurrentInsertState {
+ public:
+  ConcurrentInsertState(SkipList<Key, Comparator>* list, int num)
+      : list_(list), num_(num), done_(0), cv_(&mu_) {}
+
+  // Keys of different writers differ in their lowest 8 bits. Multiplying by
+  // an odd constant shuffles the keys of a writer without repeating them.
+  static Key MakeKey(int id, int i) {
+    const uint32_t x = static_cast<uint32_t>(i) * 2654435761u;
+    return (static_cast<Key>(x) << 8) | static_cast<Key>(id);
+  }
+
+  void InsertAll(int id) {
+    for (int i = 0; i < num_; i++) {
+      list_->InsertConcurrently(MakeKey(id, i));
+    }
+    MutexLock ml(&mu_);
+    done_++;
+    cv_.SignalAll();
+  }
+
+  int NumDone() {
+    MutexLock ml(&mu_);
+    return done_;
+  }
+
+  void WaitForDone(int n) {
+    MutexLock ml(&mu_);
+    while (done_ < n) {
+      cv_.Wait();
+    }
+  }
+
+ private:
+  SkipList<Key, Comparator>* const list_;
+  const int num_;
+  port::Mutex mu_;
+  int done_;
+  port::CondVar cv_;
+};
+
+struct ConcurrentInserter {
+  ConcurrentInsertState* state;
+  int id;
+};
+
+static void ConcurrentInsert(void* arg) {
+  ConcurrentInserter* const inserter =
+      reinterpret_cast<ConcurrentInserter*>(arg);
+  inserter->state->InsertAll(inserter->id);
+}
+
+TEST(SkipTest, ConcurrentInsert) {
+  const int kThreads = 4;
+  const int kNum = 20000;
+  ConcurrentArena arena;
+  Comparator cmp;
+  SkipList<Key, Comparator> list(cmp, &arena);
+  ConcurrentInsertState state(&list, kNum);
+  ConcurrentInserter inserters[kThreads];
+  for (int i = 0; i < kThreads; i++) {
+    inserters[i].state = &state;
+    inserters[i].id = i;
+    Env::Default()->StartThread(ConcurrentInsert, &inserters[i]);
+  }
+
+  // Entries must always appear in order
+  while (state.NumDone() < kThreads) {
+    SkipList<Key, Comparator>::Iterator iter(&list);
+    iter.SeekToFirst();
+    if (iter.Valid()) {
+      Key prev = iter.key();
+      for (iter.Next(); iter.Valid(); iter.Next()) {
+        ASSERT_LT(prev, iter.key());
+        prev = iter.key();
+      }
+    }
+  }
+  state.WaitForDone(kThreads);
+
+  std::set<Key> model;
+  for (int id = 0; id < kThreads; id++) {
+    for (int i = 0; i < kNum; i++) {
+      const Key key = ConcurrentInsertState::MakeKey(id, i);
+      ASSERT_TRUE(list.Contains(key));
+      model.insert(key);
+    }
+  }
+  SkipList<Key, Comparator>::Iterator iter(&list);
+  iter.SeekToFirst();
+  for (std::set<Key>::iterator it = model.begin(); it != model.end(); ++it) {
+    ASSERT_TRUE(iter.Valid());
+    ASSERT_EQ(*it, iter.key());
+    iter.Next();
+  }
+  ASSERT_TRUE(!iter.Valid());
+}
+
 }  // namespace pdlfs
 
 int main(int argc, char** argv) {
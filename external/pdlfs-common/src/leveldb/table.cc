@@ -83,6 +83,14 @@ Status Table::Open(const Options& options, RandomAccessFile* file,
     opt.verify_checksums = true;
   }
   s = ReadBlock(file, opt, footer.index_handle(), &contents);
+  IndexBlockReader* index_block = NULL;
+  if (s.ok()) {
+    index_block = new IndexBlockReader(contents);
+    s = index_block->status();
+    if (!s.ok()) {
+      delete index_block;
+    }
+  }
   if (s.ok()) {
     // We've successfully read the footer and the index block: we're
     // ready to serve requests.
@@ -91,7 +99,7 @@ Status Table::Open(const Options& options, RandomAccessFile* file,
     rep->file = file;
     rep->metaindex_handle = footer.metaindex_handle();
     rep->cache_id = (options.block_cache ? options.block_cache->NewId() : 0);
-    rep->index_block = new IndexBlockReader(contents);
+    rep->index_block = index_block;
     rep->filter_data = NULL;
     rep->filter = NULL;
     rep->props_valid = false;
@@ -269,7 +277,9 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
   Status s;
   Iterator* iiter = rep_->index_block->NewIterator(rep_->options.comparator);
   iiter->Seek(k);
-  if (iiter->Valid()) {
+  // Some indexes may land one block before the block holding k
+  int candidates = rep_->index_block->SeekCandidates();
+  for (; candidates > 0 && iiter->Valid(); candidates--) {
     Slice handle_value = iiter->value();
     FilterBlockReader* filter = rep_->filter;
     BlockHandle handle;
@@ -279,13 +289,18 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
     } else {
       Iterator* block_iter = BlockReader(this, options, iiter->value());
       block_iter->Seek(k);
-      if (block_iter->Valid()) {
+      const bool found = block_iter->Valid();
+      if (found) {
         Slice v = (options.limit != 0) ? block_iter->value() : Slice();
         (*saver)(arg, block_iter->key(), v);
       }
       s = block_iter->status();
       delete block_iter;
+      if (found || !s.ok()) {
+        break;
+      }
     }
+    iiter->Next();
   }
   if (s.ok()) {
     s = iiter->status();
@@ -298,6 +313,18 @@ uint64_t Table::ApproximateOffsetOf(const Slice& key) const {
   Iterator* index_iter =
       rep_->index_block->NewIterator(rep_->options.comparator);
   index_iter->Seek(key);
+  if (index_iter->Valid() && rep_->index_block->SeekCandidates() > 1) {
+    // The index may have landed one block early. Check the block.
+    ReadOptions options;
+    options.fill_cache = false;
+    Iterator* block_iter = BlockReader(const_cast<Table*>(this), options,
+                                       index_iter->value());
+    block_iter->Seek(key);
+    if (!block_iter->Valid() && block_iter->status().ok()) {
+      index_iter->Next();
+    }
+    delete block_iter;
+  }
   uint64_t result;
   if (index_iter->Valid()) {
     BlockHandle handle;
@@ -67,7 +67,8 @@ struct TableBuilder::Rep {
         file(f),
         offset(0),
         data_block(options.block_restart_interval, options.comparator),
-        index_block(options.index_block_restart_interval, options.comparator),
+        index_block(options.index_type, options.index_block_restart_interval,
+                    options.comparator),
         num_entries(0),
         num_blocks(0),
         closed(false),
@@ -111,6 +112,9 @@ Status TableBuilder::ChangeOptions(const Options& options) {
   if (options.comparator != rep_->options.comparator) {
     return Status::InvalidArgument("changing comparator while building table");
   }
+  if (options.index_type != rep_->options.index_type) {
+    return Status::InvalidArgument("changing index type while building table");
+  }
 
   rep_->options = options;
   rep_->data_block.ChangeRestartInterval(rep_->options.block_restart_interval);
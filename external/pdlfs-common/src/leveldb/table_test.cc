@@ -11,9 +11,11 @@
 #include "pdlfs-common/leveldb/table.h"
 #include "pdlfs-common/leveldb/comparator.h"
 #include "pdlfs-common/leveldb/internal_types.h"
+#include "pdlfs-common/leveldb/iterator.h"
 #include "pdlfs-common/leveldb/options.h"
 #include "pdlfs-common/leveldb/table_builder.h"
 #include "pdlfs-common/leveldb/table_properties.h"
+#include "pdlfs-common/pdlfs_config.h"
 #include "pdlfs-common/testharness.h"
 #include "pdlfs-common/testutil.h"
 
@@ -91,7 +93,8 @@ class TableWriter {
   KVMap data_;
 
  public:
-  TableWriter(const Options& options) : builder_(options, &file_) {}
+  TableWriter(const Options& options)
+      : builder_(options, &file_), data_(STLLessThan(options.comparator)) {}
 
   std::string contents() const { return file_.contents(); }
 
@@ -141,6 +144,8 @@ class TableReader {
 
   ~TableReader() { delete table_; }
 
+  Iterator* NewIterator() const { return table_->NewIterator(ReadOptions()); }
+
   Slice SmallestKey() {
     const TableProperties* const props = table_->GetProperties();
     ASSERT_TRUE(props != NULL);
@@ -213,6 +218,84 @@ TEST(TableTest, ReadWrite) {
   ASSERT_EQ(reader.MaxSeq(), kMinSequenceNumber + kNumEntries - 1);
 }
 
+#if defined(PDLFS_SILT_ECT)
+static void AssertSameResult(Iterator* iter, Iterator* expected) {
+  ASSERT_EQ(iter->Valid(), expected->Valid());
+  if (expected->Valid()) {
+    ASSERT_EQ(iter->key().ToString(), expected->key().ToString());
+  }
+}
+
+// Compare a table with an ECT index against one with a block index.
+static void TestEctIndex(const DBOptions& base_options) {
+  DBOptions options = base_options;
+  options.block_size = 256;
+  options.index_type = kBlockIndex;
+  TableWriter writer(options);
+  std::string contents = CreateTable(&writer);
+  options.index_type = kEctIndex;
+  TableWriter ect_writer(options);
+  std::string ect_contents = CreateTable(&ect_writer);
+  ASSERT_LT(ect_contents.size(), contents.size());
+
+  TableReader reader(options, contents);
+  TableReader ect_reader(options, ect_contents);
+  Iterator* expected = reader.NewIterator();
+  Iterator* iter = ect_reader.NewIterator();
+  Random rnd(test::RandomSeed());
+  int n = 0;
+  for (expected->SeekToFirst(); expected->Valid(); expected->Next()) {
+    ParsedInternalKey ikey;
+    ASSERT_TRUE(ParseInternalKey(expected->key(), &ikey));
+    std::string targets[3];
+    targets[0] = expected->key().ToString();
+    AppendInternalKey(&targets[1],
+                      ParsedInternalKey(ikey.user_key, 0, kTypeValue));
+    AppendInternalKey(&targets[2], ParsedInternalKey(ikey.user_key,
+                                                     kMaxSequenceNumber,
+                                                     kTypeValue));
+    for (int i = 0; i < 3; i++) {
+      Iterator* probe = reader.NewIterator();
+      probe->Seek(targets[i]);
+      iter->Seek(targets[i]);
+      AssertSameResult(iter, probe);
+      delete probe;
+    }
+    n++;
+  }
+  ASSERT_EQ(n, kNumEntries);
+  for (int i = 0; i < kNumEntries; i++) {
+    std::string ukey = RandomKey(&rnd);
+    ukey.resize(rnd.Uniform(kTableKeyLength + 1));
+    std::string target;
+    AppendInternalKey(&target, ParsedInternalKey(ukey, rnd.Next(), kTypeValue));
+    expected->Seek(target);
+    iter->Seek(target);
+    AssertSameResult(iter, expected);
+  }
+  iter->SeekToLast();
+  for (expected->SeekToLast(); expected->Valid(); expected->Prev()) {
+    AssertSameResult(iter, expected);
+    iter->Prev();
+  }
+  ASSERT_FALSE(iter->Valid());
+  delete iter;
+  delete expected;
+}
+
+TEST(TableTest, EctIndex) {
+  Options options;
+  TestEctIndex(options);
+}
+
+TEST(TableTest, EctIndexWithInternalKeys) {
+  InternalKeyComparator icmp(BytewiseComparator());
+  Options options;
+  options.comparator = &icmp;
+  TestEctIndex(options);
+}
+#endif
+
 }  // namespace pdlfs
 
 int main(int argc, char** argv) {
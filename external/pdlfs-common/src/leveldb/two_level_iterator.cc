@@ -94,6 +94,15 @@ void TwoLevelIterator::Seek(const Slice& target) {
   index_iter_.Seek(target);
   InitDataBlock();
   if (data_iter_.iter() != NULL) data_iter_.Seek(target);
+  // Some indexes (see IndexBlockReader) may land one block before the first
+  // block holding keys >= target, so seek again instead of starting the
+  // next block from its first key.
+  if (data_iter_.iter() != NULL && !data_iter_.Valid() &&
+      index_iter_.Valid()) {
+    index_iter_.Next();
+    InitDataBlock();
+    if (data_iter_.iter() != NULL) data_iter_.Seek(target);
+  }
   SkipEmptyDataBlocksForward();
 }
 
@@ -28,12 +28,19 @@ hg_return_t MercuryRPC::RPCMessageCoder(hg_proc_t proc, void* data) {
         hg_int8_t err_code = static_cast<int8_t>(msg->err);
         ret = hg_proc_hg_int8_t(proc, &err_code);
         if (ret == HG_SUCCESS) {
-          hg_uint16_t len = static_cast<uint16_t>(msg->contents.size());
+          hg_uint16_t len = static_cast<uint16_t>(msg->size());
           ret = hg_proc_hg_uint16_t(proc, &len);
           if (ret == HG_SUCCESS) {
-            if (len > 0) {
+            if (!msg->contents.empty()) {
               char* p = const_cast<char*>(&msg->contents[0]);
-              ret = hg_proc_memcpy(proc, p, len);
+              ret = hg_proc_memcpy(proc, p, msg->contents.size());
+            }
+            // Chunks are encoded as if they were part of contents
+            for (int i = 0; i < msg->nchunks && ret == HG_SUCCESS; i++) {
+              if (!msg->chunks[i].empty()) {
+                char* p = const_cast<char*>(&msg->chunks[i][0]);
+                ret = hg_proc_memcpy(proc, p, msg->chunks[i].size());
+              }
             }
           }
         }
@@ -104,17 +104,24 @@ std::string PosixSocketServer::GetBaseUri() {
   return addr_->GetUri();
 }
 
+void PosixSocketServer::AddPkts(int myid, uint64_t n) {
+  MutexLock ml(&mutex_);
+  bg_usage_[myid].pkts += n;
+}
+
 std::string PosixSocketServer::GetUsageInfo() {
   MutexLock ml(&mutex_);
   std::string result;
   char tmp[200];
-  snprintf(tmp, sizeof(tmp), "%6s %12s %12s %12s\n", "Thread", "User(sec)",
-           "System(sec)", "Wall(sec)");
+  snprintf(tmp, sizeof(tmp), "%6s %12s %12s %12s %12s\n", "Thread",
+           "User(sec)", "System(sec)", "Wall(sec)", "Pkts/s");
   result += tmp;
-  result += "---------------------------------------------\n";
+  result += "----------------------------------------------------------\n";
   for (size_t i = 0; i < bg_usage_.size(); i++) {
-    snprintf(tmp, sizeof(tmp), "%-6d %12.3f %12.3f %12.3f\n", int(i),
-             bg_usage_[i].user, bg_usage_[i].system, bg_usage_[i].wall);
+    const BGUsageInfo& info = bg_usage_[i];
+    snprintf(tmp, sizeof(tmp), "%-6d %12.3f %12.3f %12.3f %12.0f\n", int(i),
+             info.user, info.system, info.wall,
+             info.wall > 0 ? info.pkts / info.wall : 0);
     result += tmp;
   }
   return result;
@@ -212,12 +219,22 @@ Status PosixRPC::status() {
 
 rpc::If* PosixRPC::OpenStubFor(const std::string& uri) {
   if (!tcp_) {
-    PosixUDPCli* const cli =
-        new PosixUDPCli(options_.rpc_timeout, options_.udp_max_expected_msgsz);
+    PosixUDPCli* const cli = new PosixUDPCli(
+        options_.env, options_.rpc_timeout, options_.udp_retransmit_timeout,
+        options_.udp_max_expected_msgsz, options_.udp_max_unexpected_msgsz,
+        options_.max_outstanding_calls);
     cli->Open(uri);
     return cli;
+  } else if (options_.tcp_persistent_conns) {
+    PosixTCPMuxCli* const cli =
+        new PosixTCPMuxCli(options_.env, options_.rpc_timeout,
+                           options_.tcp_conns_per_stub,
+                           options_.max_outstanding_calls, options_.max_msgsz);
+    cli->SetTarget(uri);
+    return cli;
   } else {
-    PosixTCPCli* const cli = new PosixTCPCli(options_.rpc_timeout);
+    PosixTCPCli* const cli =
+        new PosixTCPCli(options_.rpc_timeout, options_.max_msgsz);
     cli->SetTarget(uri);
     return cli;
   }
@@ -53,7 +53,11 @@ class PosixSocketServer {
     double user;    // user CPU time in seconds
     double system;  // system CPU time
     double wall;    // wall time
+    uint64_t pkts;  // Number of datagrams received
   };
+  // Add to the number of datagrams received by a bg thread. To be called
+  // by subclasses whenever convenient, such as before waiting for more data.
+  void AddPkts(int myid, uint64_t n);
 
   // For options_.info_log, options_.fs, and other socket-specific options
   const RPCOptions& options_;
@@ -10,17 +10,39 @@
  */
 #include "posix_rpc_tcp.h"
 
+#include "pdlfs-common/coding.h"
 #include "pdlfs-common/mutexlock.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <map>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <set>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#if defined(PDLFS_OS_LINUX)
+#include <sys/epoll.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
 
 namespace pdlfs {
 PosixTCPServer::PosixTCPServer(const RPCOptions& opts, uint64_t t, size_t s)
-    : PosixSocketServer(opts), rpc_timeout_(t), buf_sz_(s) {}
+    : PosixSocketServer(opts), rpc_timeout_(t), buf_sz_(s), bg_count_(0) {}
+
+PosixTCPServer::~PosixTCPServer() {
+  BGStop();  // Stop receiving new messages
+  MutexLock ml(&mutex_);
+  while (bg_count_ != 0) {  // Wait until all bg work items have been processed
+    bg_cv_.Wait();
+  }
+  // More resources will be released by parent
+}
 
 Status PosixTCPServer::OpenAndBind(const std::string& uri) {
   MutexLock ml(&mutex_);
@@ -38,6 +60,10 @@ Status PosixTCPServer::OpenAndBind(const std::string& uri) {
   if (fd_ == -1) {
     status = Status::IOError(strerror(errno));
   } else {
+    // Long-lived connections closed by us at shutdown are left in TIME_WAIT,
+    // which would otherwise prevent the port from being reused right away.
+    int one = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
     int rv = bind(fd_, reinterpret_cast<struct sockaddr*>(addr_->rep()),
                   sizeof(struct sockaddr_in));
     if (rv != -1) {
@@ -68,9 +94,164 @@ inline void SET_O_NONBLOCK(int fd, bool non_blocking) {
   flags = non_blocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
   fcntl(fd, F_SETFL, flags);
 }
+
+// When persistent connections are used, each message is sent as a frame
+// starting with a fixed 8-byte header: a 32-bit payload size followed by a
+// 32-bit request id. A reply carries the same request id as its request.
+const size_t kFrameHeaderSize = 8;
+
+// Fill iov with the contents and the chunks of a message, skipping empty
+// ones. Return the number of entries filled. iov must have room for at least
+// kMaxChunks + 1 entries.
+int FillIov(const rpc::If::Message& msg, struct iovec* iov) {
+  int n = 0;
+  if (!msg.contents.empty()) {
+    iov[n].iov_base = const_cast<char*>(msg.contents.data());
+    iov[n].iov_len = msg.contents.size();
+    n++;
+  }
+  for (int i = 0; i < msg.nchunks; i++) {
+    if (!msg.chunks[i].empty()) {
+      iov[n].iov_base = const_cast<char*>(msg.chunks[i].data());
+      iov[n].iov_len = msg.chunks[i].size();
+      n++;
+    }
+  }
+  return n;
+}
+
+// Send data using gather writes. The socket may be non-blocking, in which case
+// we poll for it to become writable again. Timeouts are only checked roughly
+// every 0.2 second.
+Status SendIov(int fd, struct iovec* iov, int iovcnt, uint64_t timeout) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  const uint64_t start = CurrentMicros();
+  struct pollfd po;
+  memset(&po, 0, sizeof(struct pollfd));
+  po.events = POLLOUT;
+  po.fd = fd;
+  while (msg.msg_iovlen != 0) {
+    ssize_t rv = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (rv >= 0) {
+      size_t n = rv;
+      while (msg.msg_iovlen != 0 && n >= msg.msg_iov->iov_len) {
+        n -= msg.msg_iov->iov_len;
+        msg.msg_iov++;
+        msg.msg_iovlen--;
+      }
+      if (n != 0) {
+        msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + n;
+        msg.msg_iov->iov_len -= n;
+      }
+      continue;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EWOULDBLOCK) {
+      rv = poll(&po, 1, 200);
+    }
+
+    // Either sendmsg or poll may have returned errors
+    if (rv == -1) {
+      return Status::IOError("TCP send/poll", strerror(errno));
+    } else if (rv == 0 && CurrentMicros() - start >= timeout) {
+      return Status::Disconnected("timeout");
+    }
+  }
+
+  return Status::OK();
+}
+
+// Send a message as a frame using a single gather write whenever possible.
+Status SendFrame(int fd, uint32_t reqid, const rpc::If::Message& msg,
+                 uint64_t timeout) {
+  char header[kFrameHeaderSize];
+  EncodeFixed32(header, static_cast<uint32_t>(msg.size()));
+  EncodeFixed32(header + 4, reqid);
+  struct iovec iov[rpc::If::Message::kMaxChunks + 2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  const int n = 1 + FillIov(msg, iov + 1);
+  return SendIov(fd, iov, n, timeout);
+}
+
+// Send an entire message over a non-persistent connection.
+Status SendMessage(int fd, const rpc::If::Message& msg, uint64_t timeout) {
+  struct iovec iov[rpc::If::Message::kMaxChunks + 1];
+  const int n = FillIov(msg, iov);
+  return SendIov(fd, iov, n, timeout);
+}
+
+// Receive data until the peer shuts down its end of the connection. Data is
+// read directly into *buf without going through a temporary buffer. We do
+// non-blocking receives and use a timed poll to check data availability so
+// that timeouts can be checked roughly every 0.2 second. Messages longer than
+// max_len are rejected.
+Status RecvMessage(int fd, std::string* buf, size_t buf_sz, size_t max_len,
+                   uint64_t timeout) {
+  buf->clear();
+  const uint64_t start = CurrentMicros();
+  struct pollfd po;
+  memset(&po, 0, sizeof(struct pollfd));
+  po.events = POLLIN;
+  po.fd = fd;
+  while (true) {
+    const size_t off = buf->size();
+    buf->resize(off + buf_sz);
+    ssize_t rv = recv(fd, &(*buf)[off], buf_sz, MSG_DONTWAIT);
+    buf->resize(off + (rv > 0 ? rv : 0));
+    if (buf->size() > max_len) {
+      return Status::BufferFull("Message too long");
+    } else if (rv > 0) {
+      continue;
+    } else if (rv == 0) {  // End of message
+      return Status::OK();
+    } else if (errno == EWOULDBLOCK || errno == EINTR) {
+      rv = poll(&po, 1, 200);
+    }
+
+    // Either recv or poll may have returned errors
+    if (rv == -1) {
+      return Status::IOError(strerror(errno));
+    } else if (rv == 1) {
+      continue;
+    } else if (CurrentMicros() - start >= timeout) {
+      return Status::Disconnected("timeout");
+    }
+  }
+}
+
+// Return true if a complete frame is found at the beginning of *input, in which
+// case the frame is consumed.
+bool GetFrame(Slice* input, uint32_t* reqid, Slice* payload) {
+  if (input->size() < kFrameHeaderSize) {
+    return false;
+  }
+  const uint32_t len = DecodeFixed32(input->data());
+  if (input->size() - kFrameHeaderSize < len) {
+    return false;
+  }
+  *reqid = DecodeFixed32(input->data() + 4);
+  *payload = Slice(input->data() + kFrameHeaderSize, len);
+  input->remove_prefix(kFrameHeaderSize + len);
+  return true;
+}
+
+// Return true if the frame at the beginning of input claims a payload longer
+// than max_len.
+bool FrameTooLong(const Slice& input, size_t max_len) {
+  return input.size() >= kFrameHeaderSize &&
+         DecodeFixed32(input.data()) > max_len;
+}
+
 }  // namespace
 
 Status PosixTCPServer::BGLoop(int myid) {
+  if (options_.tcp_persistent_conns) {
+    return BGLoopMux(myid);
+  }
   SET_O_NONBLOCK(fd_, true);
   struct pollfd po;
   po.events = POLLIN;
@@ -105,69 +286,206 @@ Status PosixTCPServer::BGLoop(int myid) {
 }
 
 void PosixTCPServer::HandleIncomingCall(CallState* const call) {
-  int err = 0;
   rpc::If::Message in, out;
-  const uint64_t start = CurrentMicros();
-  struct pollfd po;
-  memset(&po, 0, sizeof(struct pollfd));
-  po.events = POLLIN;
-  po.fd = call->fd;
-  char* const buf = new char[buf_sz_];
-  while (true) {
-    ssize_t rv = recv(call->fd, buf, buf_sz_, MSG_DONTWAIT);
-    if (rv > 0) {
-      in.extra_buf.append(buf, rv);
-      continue;
-    } else if (rv == 0) {  // End of message
-      in.contents = in.extra_buf;
-      break;
-    } else if (errno == EWOULDBLOCK) {
-      // We wait for 0.2 second and therefore timeouts are only checked
-      // roughly every that amount of time.
-      rv = poll(&po, 1, 200);
-    }
+  Status s = RecvMessage(call->fd, &in.extra_buf, buf_sz_, options_.max_msgsz,
+                         rpc_timeout_);
+  if (!s.ok()) {
+    //
+    return;
+  }
 
-    // Either recv or poll may have returned errors
-    if (rv == -1) {
-      err = errno;
-      break;
-    } else if (rv == 1) {
+  in.contents = in.extra_buf;
+  options_.fs->Call(in, out);
+  SET_O_NONBLOCK(call->fd, false);  // Force blocking semantics
+  s = SendMessage(call->fd, out, rpc_timeout_);
+  if (!s.ok()) {
+    //
+    return;
+  }
+
+  shutdown(call->fd, SHUT_WR);
+}
+
+PosixTCPServer::Conn::Conn(PosixTCPServer* srv, int fd)
+    : parent_srv(srv), fd(fd), refs(1) {}
+
+void PosixTCPServer::Unref(Conn* const conn) {
+  conn->mu.Lock();
+  assert(conn->refs > 0);
+  const bool dead = --conn->refs == 0;
+  conn->mu.Unlock();
+  if (dead) {
+    close(conn->fd);
+    delete conn;
+  }
+}
+
+#if defined(PDLFS_OS_LINUX)
+// Each bg thread runs its own epoll instance. All of them watch the listening
+// socket for new connections. A connection, once accepted, stays with the bg
+// thread that has accepted it until it is closed by the peer. Level-triggered
+// events are used so that we read at most one buffer per connection each time
+// to be fair to the other connections of the same thread.
+Status PosixTCPServer::BGLoopMux(int myid) {
+  SET_O_NONBLOCK(fd_, true);
+  const int efd = epoll_create(256);
+  if (efd == -1) {
+    return Status::IOError("epoll_create", strerror(errno));
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;  // NULL indicates the listening socket
+
+  int err = 0;
+  if (epoll_ctl(efd, EPOLL_CTL_ADD, fd_, &ev) == -1) {
+    err = errno;
+  }
+  std::set<Conn*> conns;  // Connections owned by this bg thread
+  struct epoll_event events[64];
+  while (!err && !shutting_down_.Acquire_Load()) {
+    int n = epoll_wait(efd, events, 64, 200);
+    if (n == -1) {
+      if (errno != EINTR) err = errno;
       continue;
-    } else if (CurrentMicros() - start >= rpc_timeout_) {
-      err = -1;
-      break;
+    }
+    for (int i = 0; i < n && !err; i++) {
+      Conn* const conn = static_cast<Conn*>(events[i].data.ptr);
+      if (!conn) {
+        int rv = accept(fd_, NULL, NULL);
+        if (rv == -1) {  // Connections may have been taken by other threads
+          if (errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+            err = errno;
+          continue;
+        }
+        SET_O_NONBLOCK(rv, true);
+        int one = 1;
+        setsockopt(rv, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Conn* const c = new Conn(this, rv);
+        ev.data.ptr = c;
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, rv, &ev) == -1) {
+          err = errno;
+          Unref(c);
+        } else {
+          conns.insert(c);
+        }
+      } else if (!HandleReadableConn(conn)) {
+        epoll_ctl(efd, EPOLL_CTL_DEL, conn->fd, &ev);
+        conns.erase(conn);
+        Unref(conn);
+      }
     }
   }
 
-  delete[] buf;
+  for (std::set<Conn*>::iterator it = conns.begin(); it != conns.end(); ++it) {
+    Unref(*it);  // Connections still in use by bg workers are closed later
+  }
+  close(efd);
+  Status status;
   if (err) {
-    //
-    return;
+    status = Status::IOError("TCP epoll/accept", strerror(err));
+  }
+  return status;
+}
+#else
+Status PosixTCPServer::BGLoopMux(int myid) {
+  return Status::NotSupported("Persistent tcp connections require epoll");
+}
+#endif
+
+bool PosixTCPServer::HandleReadableConn(Conn* const conn) {
+  bool alive = true;
+  std::string& buf = conn->inbuf;
+  const size_t off = buf.size();
+  buf.resize(off + buf_sz_);
+  ssize_t rv = recv(conn->fd, &buf[off], buf_sz_, 0);
+  buf.resize(off + (rv > 0 ? rv : 0));
+  if (rv == 0) {  // Peer has closed the connection
+    alive = false;
+  } else if (rv == -1 && errno != EWOULDBLOCK && errno != EINTR) {
+    alive = false;
   }
 
-  options_.fs->Call(in, out);
-  Slice remaining_out = out.contents;
-  SET_O_NONBLOCK(call->fd, false);  // Force blocking semantics
-  while (!remaining_out.empty()) {
-    ssize_t nbytes =
-        send(call->fd, remaining_out.data(), remaining_out.size(), 0);
-    if (nbytes > 0) {
-      remaining_out.remove_prefix(nbytes);
+  Slice input = buf;
+  Slice payload;
+  uint32_t reqid;
+  while (GetFrame(&input, &reqid, &payload)) {
+    FrameState* const frame = new FrameState;
+    frame->conn = conn;
+    frame->reqid = reqid;
+    if (input.empty()) {
+      // The frame ends the buffer. Hand over the entire buffer instead
+      // of copying the payload out of it.
+      const size_t pos = payload.data() - buf.data();
+      frame->msg.swap(buf);
+      frame->payload = Slice(frame->msg.data() + pos, payload.size());
     } else {
-      //
-      return;
+      frame->msg = payload.ToString();
+      frame->payload = frame->msg;
     }
+    HandleIncomingFrame(frame);
   }
+  if (FrameTooLong(input, options_.max_msgsz)) {
+    alive = false;  // Drop the connection instead of buffering the frame
+  }
+  buf.erase(0, buf.size() - input.size());
+  return alive;
+}
 
-  shutdown(call->fd, SHUT_WR);
+void PosixTCPServer::HandleIncomingFrame(FrameState* const frame) {
+  if (options_.extra_workers) {
+    Conn* const conn = frame->conn;
+    conn->mu.Lock();
+    ++conn->refs;
+    conn->mu.Unlock();
+    MutexLock ml(&mutex_);
+    ++bg_count_;
+    options_.extra_workers->Schedule(ProcessFrameWrapper, frame);
+  } else {
+    ProcessFrame(frame);
+    delete frame;
+  }
+}
+
+void PosixTCPServer::ProcessFrameWrapper(void* arg) {
+  FrameState* const frame = reinterpret_cast<FrameState*>(arg);
+  Conn* const conn = frame->conn;
+  PosixTCPServer* const srv = conn->parent_srv;
+  srv->ProcessFrame(frame);
+  delete frame;
+  Unref(conn);
+  MutexLock ml(&srv->mutex_);
+  assert(srv->bg_count_ > 0);
+  --srv->bg_count_;
+  if (!srv->bg_count_) {
+    srv->bg_cv_.SignalAll();
+  }
+}
+
+void PosixTCPServer::ProcessFrame(FrameState* const frame) {
+  rpc::If::Message in, out;
+  in.contents = frame->payload;
+  Status s = options_.fs->Call(in, out);
+  if (!s.ok()) {
+    Log(options_.info_log, 0, "Fail to handle incoming call: %s",
+        s.ToString().c_str());
+    return;
+  }
+  Conn* const conn = frame->conn;
+  MutexLock ml(&conn->mu);  // Replies may be sent by multiple bg workers
+  s = SendFrame(conn->fd, frame->reqid, out, rpc_timeout_);
+  if (!s.ok()) {
+    Log(options_.info_log, 0, "Error sending data to client: %s",
+        s.ToString().c_str());
+  }
 }
 
 std::string PosixTCPServer::GetUri() {
   return std::string("tcp://") + GetBaseUri();
 }
 
-PosixTCPCli::PosixTCPCli(uint64_t timeout, size_t buf_sz)
-    : rpc_timeout_(timeout), buf_sz_(buf_sz) {}
+PosixTCPCli::PosixTCPCli(uint64_t timeout, size_t max_msgsz, size_t buf_sz)
+    : rpc_timeout_(timeout), max_msgsz_(max_msgsz), buf_sz_(buf_sz) {}
 
 void PosixTCPCli::SetTarget(const std::string& uri) {
   status_ = addr_.ResolvUri(uri);
@@ -197,54 +515,498 @@ Status PosixTCPCli::Call(Message& in, Message& out) RPCNOEXCEPT {
   if (!status.ok()) {
     return status;
   }
-  Slice remaining_in = in.contents;
   SET_O_NONBLOCK(fd, false);  // Force blocking semantics
-  while (!remaining_in.empty()) {
-    ssize_t nbytes = send(fd, remaining_in.data(), remaining_in.size(), 0);
-    if (nbytes > 0) {
-      remaining_in.remove_prefix(nbytes);
-    } else {
-      status = Status::IOError(strerror(errno));
-      close(fd);
-      return status;
-    }
+  status = SendMessage(fd, in, rpc_timeout_);
+  if (!status.ok()) {
+    close(fd);
+    return status;
   }
   shutdown(fd, SHUT_WR);
-  const uint64_t start = CurrentMicros();
-  struct pollfd po;
-  memset(&po, 0, sizeof(struct pollfd));
-  po.events = POLLIN;
-  po.fd = fd;
-  char* const buf = new char[buf_sz_];
-  while (true) {
-    ssize_t rv = recv(fd, buf, buf_sz_, MSG_DONTWAIT);
-    if (rv > 0) {
-      out.extra_buf.append(buf, rv);
-      continue;
-    } else if (rv == 0) {  // End of message
-      out.contents = out.extra_buf;
-      break;
-    } else if (errno == EWOULDBLOCK) {
-      // We wait for 0.2 second and therefore timeouts are only checked
-      // roughly every that amount of time.
-      rv = poll(&po, 1, 200);
+  status = RecvMessage(fd, &out.extra_buf, buf_sz_, max_msgsz_, rpc_timeout_);
+  if (status.ok()) {
+    out.contents = out.extra_buf;
+  }
+
+  close(fd);
+  return status;
+}
+
+// State for each in-flight call.
+struct PosixTCPMuxCli::Waiter {
+  Message* out;
+  Status status;
+  bool done;
+  // Only set for asynchronous calls
+  Callback cb;
+  void* arg;
+  uint64_t start;
+};
+
+struct PosixTCPMuxCli::Conn {
+  explicit Conn(port::Mutex* mu)
+      : cv(mu),
+        fd(-1),
+        connecting(false),
+        reading(false),
+        polled(false),
+        async_calls(0) {}
+  // Signaled whenever the reader delivers replies or gives up its role, or
+  // when a connection attempt ends.
+  port::CondVar cv;
+  // Serializes senders. When both are needed, wmu must be acquired before the
+  // mutex_ of the parent stub.
+  port::Mutex wmu;
+  // State below protected by the mutex_ of the parent stub
+  std::map<uint32_t, Waiter*> waiters;
+  int fd;
+  bool connecting;  // True iff a caller is establishing the connection
+  bool reading;  // True iff a caller or the bg thread is reading replies off fd
+  bool polled;   // True iff fd is being polled by the bg thread
+  int async_calls;  // Number of asynchronous calls among waiters
+  // Partially received replies. Only accessed by the current reader.
+  std::string inbuf;
+};
+
+PosixTCPMuxCli::PosixTCPMuxCli(Env* env, uint64_t timeout, int num_conns,
+                               int max_outstanding_calls, size_t max_msgsz,
+                               size_t buf_sz)
+    : env_(env),
+      rpc_timeout_(timeout),
+      max_msgsz_(max_msgsz),
+      buf_sz_(buf_sz),
+      window_(max_outstanding_calls),
+      bg_cv_(&mutex_),
+      next_reqid_(0),
+      next_conn_(0),
+      wakeup_pending_(false),
+      bg_started_(false),
+      bg_running_(false),
+      shutting_down_(false) {
+  for (int i = 0; i < num_conns || i == 0; i++) {
+    conns_.push_back(new Conn(&mutex_));
+  }
+  wakeup_[0] = wakeup_[1] = -1;
+}
+
+PosixTCPMuxCli::~PosixTCPMuxCli() {
+  window_.Drain();  // Wait for outstanding asynchronous calls
+  mutex_.Lock();
+  shutting_down_ = true;
+  if (bg_running_) {
+    WakeBG();
+  }
+  while (bg_running_) {
+    bg_cv_.Wait();
+  }
+  mutex_.Unlock();
+  for (int i = 0; i < 2; i++) {
+    if (wakeup_[i] != -1) {
+      close(wakeup_[i]);
+    }
+  }
+  for (size_t i = 0; i < conns_.size(); i++) {
+    if (conns_[i]->fd != -1) {
+      close(conns_[i]->fd);
     }
+    delete conns_[i];
+  }
+}
 
-    // Either recv or poll may have returned errors
-    if (rv == -1) {
-      status = Status::IOError(strerror(errno));
-      break;
-    } else if (rv == 1) {
-      continue;
-    } else if (CurrentMicros() - start >= rpc_timeout_) {
-      status = Status::Disconnected("timeout");
-      break;
+void PosixTCPMuxCli::SetTarget(const std::string& uri) {
+  status_ = addr_.ResolvUri(uri);
+}
+
+// Establish a connection if conn does not have one. Connecting is done without
+// holding mutex_ so that calls over other connections are not blocked. Callers
+// picking the same connection wait for the ongoing attempt.
+// REQUIRES: mutex_ has been locked.
+Status PosixTCPMuxCli::MaybeConnect(Conn* const conn) {
+  mutex_.AssertHeld();
+  while (conn->connecting) {
+    conn->cv.Wait();
+  }
+  Status status;
+  if (conn->fd == -1) {
+    conn->connecting = true;
+    mutex_.Unlock();
+    int fd = -1;
+    status = OpenAndConnect(&fd);
+    mutex_.Lock();
+    conn->connecting = false;
+    if (status.ok()) {
+      conn->fd = fd;
     }
+    conn->cv.SignalAll();
   }
+  return status;
+}
 
-  delete[] buf;
-  close(fd);
+Status PosixTCPMuxCli::OpenAndConnect(int* const result) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return Status::IOError(strerror(errno));
+  }
+  int rv = connect(fd, reinterpret_cast<struct sockaddr*>(addr_.rep()),
+                   sizeof(struct sockaddr_in));
+  if (rv == -1) {
+    Status status = Status::IOError(strerror(errno));
+    close(fd);
+    return status;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  SET_O_NONBLOCK(fd, true);
+  *result = fd;
+  return Status::OK();
+}
+
+// Remove a waiter from its connection.
+// REQUIRES: mutex_ has been locked.
+void PosixTCPMuxCli::Remove(Conn* const conn,
+                            std::map<uint32_t, Waiter*>::iterator it) {
+  mutex_.AssertHeld();
+  if (it->second->cb != NULL) {
+    assert(conn->async_calls > 0);
+    conn->async_calls--;
+  }
+  conn->waiters.erase(it);
+}
+
+// Fail all in-flight calls of a connection and close it. A new connection will
+// be established by the next call that picks it. Asynchronous calls are added
+// to *completed for their callbacks to be invoked.
+// REQUIRES: both conn->wmu and mutex_ have been locked.
+void PosixTCPMuxCli::BreakConn(Conn* const conn, const Status& reason,
+                               std::vector<Waiter*>* const completed) {
+  mutex_.AssertHeld();
+  close(conn->fd);
+  conn->fd = -1;
+  conn->inbuf.clear();
+  std::map<uint32_t, Waiter*>::iterator it = conn->waiters.begin();
+  for (; it != conn->waiters.end(); ++it) {
+    it->second->status = reason;
+    it->second->done = true;
+    if (it->second->cb != NULL) {
+      completed->push_back(it->second);
+    }
+  }
+  conn->waiters.clear();
+  conn->async_calls = 0;
+}
+
+// A call may have already failed due to a broken connection, in which case it
+// is no longer registered with the connection and conn->fd may no longer be the
+// connection it has been registered with.
+Status PosixTCPMuxCli::Send(Conn* const conn, uint32_t reqid,
+                            const Message& msg) {
+  Status status;
+  MutexLock wl(&conn->wmu);
+  mutex_.Lock();
+  const bool done = conn->waiters.count(reqid) == 0;
+  const int fd = conn->fd;
+  mutex_.Unlock();
+  if (!done) {
+    status = SendFrame(fd, reqid, msg, rpc_timeout_);
+    if (!status.ok()) {
+      // Have the reader break the connection and fail all pending calls
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
   return status;
 }
 
+// Receive more reply data into conn->inbuf. Wait for at most 0.2 second when no
+// data is immediately available.
+// REQUIRES: caller is the current reader of the connection.
+Status PosixTCPMuxCli::ReadFrames(Conn* const conn) {
+  std::string& buf = conn->inbuf;
+  const size_t off = buf.size();
+  buf.resize(off + buf_sz_);
+  ssize_t rv = recv(conn->fd, &buf[off], buf_sz_, MSG_DONTWAIT);
+  buf.resize(off + (rv > 0 ? rv : 0));
+  if (FrameTooLong(buf, max_msgsz_)) {
+    return Status::BufferFull("Reply frame too long");
+  } else if (rv > 0) {
+    return Status::OK();
+  } else if (rv == 0) {
+    return Status::Disconnected("Connection closed by peer");
+  } else if (errno == EWOULDBLOCK || errno == EINTR) {
+    struct pollfd po;
+    memset(&po, 0, sizeof(struct pollfd));
+    po.events = POLLIN;
+    po.fd = conn->fd;
+    if (poll(&po, 1, 200) == -1 && errno != EINTR) {
+      return Status::IOError("TCP poll", strerror(errno));
+    }
+    return Status::OK();
+  } else {
+    return Status::IOError("TCP recv", strerror(errno));
+  }
+}
+
+// Hand all complete frames in conn->inbuf to their calls. Asynchronous calls
+// are added to *completed for their callbacks to be invoked.
+// REQUIRES: mutex_ has been locked and caller is the current reader.
+void PosixTCPMuxCli::DeliverFrames(Conn* const conn,
+                                   std::vector<Waiter*>* const completed) {
+  mutex_.AssertHeld();
+  Slice input = conn->inbuf;
+  Slice payload;
+  uint32_t id;
+  while (GetFrame(&input, &id, &payload)) {
+    std::map<uint32_t, Waiter*>::iterator it = conn->waiters.find(id);
+    if (it != conn->waiters.end()) {  // Late replies are discarded
+      Waiter* const waiter = it->second;
+      if (input.empty()) {  // Take over the buffer to avoid a copy
+        const size_t pos = payload.data() - conn->inbuf.data();
+        std::string& buf = waiter->out->extra_buf;
+        buf.swap(conn->inbuf);
+        waiter->out->contents = Slice(buf.data() + pos, payload.size());
+      } else {
+        waiter->out->extra_buf.assign(payload.data(), payload.size());
+        waiter->out->contents = waiter->out->extra_buf;
+      }
+      waiter->done = true;
+      if (waiter->cb != NULL) {
+        completed->push_back(waiter);
+      }
+      Remove(conn, it);
+    }
+  }
+  conn->inbuf.erase(0, conn->inbuf.size() - input.size());
+}
+
+// Invoke the callbacks of completed asynchronous calls.
+// REQUIRES: mutex_ has NOT been locked.
+void PosixTCPMuxCli::Complete(const std::vector<Waiter*>& completed) {
+  for (size_t i = 0; i < completed.size(); i++) {
+    Waiter* const w = completed[i];
+    w->cb(w->status, w->arg);
+    delete w;
+    window_.Leave();
+  }
+}
+
+// Interrupt the bg thread so that it starts polling connections that have just
+// got asynchronous calls.
+// REQUIRES: mutex_ has been locked.
+void PosixTCPMuxCli::WakeBG() {
+  mutex_.AssertHeld();
+  if (!wakeup_pending_) {
+    wakeup_pending_ = true;
+    char c = 0;
+    if (write(wakeup_[1], &c, 1) != 1) {
+      // Still okay: the bg thread wakes up at least every 0.2 second
+    }
+  }
+}
+
+Status PosixTCPMuxCli::Call(Message& in, Message& out) RPCNOEXCEPT {
+  if (!status_.ok()) {
+    return status_;
+  }
+  Waiter w;
+  w.out = &out;
+  w.done = false;
+  w.cb = NULL;
+  w.arg = NULL;
+  const uint64_t start = w.start = CurrentMicros();
+  MutexLock ml(&mutex_);
+  Conn* const conn = conns_[next_conn_++ % conns_.size()];
+  Status status = MaybeConnect(conn);
+  if (!status.ok()) {
+    return status;
+  }
+  const uint32_t reqid = next_reqid_++;
+  conn->waiters.insert(std::make_pair(reqid, &w));
+  mutex_.Unlock();
+  status = Send(conn, reqid, in);
+  mutex_.Lock();
+  if (!status.ok() && !w.done) {
+    conn->waiters.erase(reqid);
+    return status;
+  }
+  std::vector<Waiter*> completed;
+  while (!w.done) {
+    if (!conn->reading) {
+      // Become the reader of the connection and deliver replies to all
+      // in-flight calls, including our own.
+      conn->reading = true;
+      mutex_.Unlock();
+      status = ReadFrames(conn);
+      if (!status.ok()) {
+        conn->wmu.Lock();
+        mutex_.Lock();
+        BreakConn(conn, status, &completed);
+        conn->wmu.Unlock();
+      } else {
+        mutex_.Lock();
+        DeliverFrames(conn, &completed);
+      }
+      conn->reading = false;
+      conn->cv.SignalAll();
+      if (conn->async_calls != 0) {
+        WakeBG();  // Have the bg thread take over
+      }
+      if (!completed.empty()) {
+        mutex_.Unlock();
+        Complete(completed);
+        completed.clear();
+        mutex_.Lock();
+      }
+    } else if (CurrentMicros() - start < rpc_timeout_) {
+      // The current reader signals us at least every 0.2 second
+      conn->cv.Wait();
+    }
+
+    if (!w.done && CurrentMicros() - start >= rpc_timeout_) {
+      conn->waiters.erase(reqid);
+      return Status::Disconnected("timeout");
+    }
+  }
+
+  return w.status;
+}
+
+void PosixTCPMuxCli::AsyncCall(Message& in, Message& out, Callback cb,
+                               void* arg) RPCNOEXCEPT {
+  if (!status_.ok()) {
+    cb(status_, arg);
+    return;
+  }
+  window_.Enter();
+  Waiter* const w = new Waiter;
+  w->out = &out;
+  w->done = false;
+  w->cb = cb;
+  w->arg = arg;
+  w->start = CurrentMicros();
+  Status status;
+  mutex_.Lock();
+  if (!bg_started_) {
+    if (pipe(wakeup_) == -1) {
+      status = Status::IOError("Cannot create pipe", strerror(errno));
+    } else {
+      SET_O_NONBLOCK(wakeup_[0], true);
+      bg_started_ = bg_running_ = true;
+      env_->StartThread(BGLoopWrapper, this);
+    }
+  }
+  Conn* const conn = conns_[next_conn_++ % conns_.size()];
+  if (status.ok()) {
+    status = MaybeConnect(conn);
+  }
+  if (status.ok()) {
+    const uint32_t reqid = next_reqid_++;
+    conn->waiters.insert(std::make_pair(reqid, w));
+    conn->async_calls++;
+    if (!conn->polled) {
+      WakeBG();
+    }
+    mutex_.Unlock();
+    status = Send(conn, reqid, in);
+    mutex_.Lock();
+    if (!status.ok()) {
+      // Fail the call ourselves unless it has already been failed by the
+      // reader, in which case it may have already been deleted.
+      std::map<uint32_t, Waiter*>::iterator it = conn->waiters.find(reqid);
+      if (it != conn->waiters.end()) {
+        Remove(conn, it);
+      } else {
+        status = Status::OK();
+      }
+    }
+  }
+  mutex_.Unlock();
+  if (!status.ok()) {
+    delete w;
+    cb(status, arg);
+    window_.Leave();
+  }
+}
+
+void PosixTCPMuxCli::BGLoopWrapper(void* arg) {
+  PosixTCPMuxCli* const cli = reinterpret_cast<PosixTCPMuxCli*>(arg);
+  cli->BGLoop();
+}
+
+// Poll all connections with outstanding asynchronous calls that are not being
+// read by others, deliver their replies, and fail calls that have timed out.
+void PosixTCPMuxCli::BGLoop() {
+  std::vector<Waiter*> completed;
+  std::vector<struct pollfd> pos;
+  std::vector<Conn*> polled;
+  MutexLock ml(&mutex_);
+  while (!shutting_down_) {
+    pos.resize(1);
+    memset(&pos[0], 0, sizeof(struct pollfd));
+    pos[0].fd = wakeup_[0];
+    pos[0].events = POLLIN;
+    polled.clear();
+    for (size_t i = 0; i < conns_.size(); i++) {
+      Conn* const conn = conns_[i];
+      if (conn->fd != -1 && conn->async_calls != 0 && !conn->reading) {
+        conn->reading = conn->polled = true;
+        struct pollfd po;
+        memset(&po, 0, sizeof(struct pollfd));
+        po.fd = conn->fd;
+        po.events = POLLIN;
+        pos.push_back(po);
+        polled.push_back(conn);
+      }
+    }
+    mutex_.Unlock();
+    poll(&pos[0], pos.size(), 200);
+    if (pos[0].revents != 0) {
+      char tmp[64];
+      while (read(wakeup_[0], tmp, sizeof(tmp)) > 0) {
+      }
+    }
+    mutex_.Lock();
+    wakeup_pending_ = false;
+    for (size_t i = 0; i < polled.size(); i++) {
+      Conn* const conn = polled[i];
+      if (pos[i + 1].revents != 0) {
+        mutex_.Unlock();
+        Status status = ReadFrames(conn);
+        if (!status.ok()) {
+          conn->wmu.Lock();
+          mutex_.Lock();
+          BreakConn(conn, status, &completed);
+          conn->wmu.Unlock();
+        } else {
+          mutex_.Lock();
+          DeliverFrames(conn, &completed);
+        }
+      }
+      conn->reading = conn->polled = false;
+      conn->cv.SignalAll();
+    }
+    const uint64_t now = CurrentMicros();
+    for (size_t i = 0; i < conns_.size(); i++) {
+      Conn* const conn = conns_[i];
+      std::map<uint32_t, Waiter*>::iterator it = conn->waiters.begin();
+      while (conn->async_calls != 0 && it != conn->waiters.end()) {
+        Waiter* const w = it->second;
+        if (w->cb != NULL && now - w->start >= rpc_timeout_) {
+          w->status = Status::Disconnected("timeout");
+          w->done = true;
+          completed.push_back(w);
+          Remove(conn, it++);
+        } else {
+          ++it;
+        }
+      }
+    }
+    if (!completed.empty()) {
+      mutex_.Unlock();
+      Complete(completed);
+      completed.clear();
+      mutex_.Lock();
+    }
+  }
+  bg_running_ = false;
+  bg_cv_.SignalAll();
+}
+
 }  // namespace pdlfs
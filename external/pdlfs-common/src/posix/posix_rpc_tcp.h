@@ -12,8 +12,12 @@
 
 #include "posix_rpc.h"
 
+#include <map>
 #include <stddef.h>
+#include <stdint.h>
+#include <string>
 #include <sys/socket.h>
+#include <vector>
 
 namespace pdlfs {
 // RPC srv impl using TCP.
@@ -21,9 +25,7 @@ class PosixTCPServer : public PosixSocketServer {
  public:
   PosixTCPServer(const RPCOptions& options, uint64_t timeout,
                  size_t buf_sz = 4000);
-  virtual ~PosixTCPServer() {
-    BGStop();
-  }  // More resources to be released by parent
+  virtual ~PosixTCPServer();
 
   // On OK, BGStart() from parent should then be called to commence background
   // server progressing.
@@ -38,15 +40,40 @@ class PosixTCPServer : public PosixSocketServer {
     int fd;
   };
   void HandleIncomingCall(CallState* call);
+  // A long-lived client connection. Used when options_.tcp_persistent_conns is
+  // set. Each connection carries a stream of length-framed requests.
+  struct Conn {
+    Conn(PosixTCPServer* srv, int fd);
+    PosixTCPServer* const parent_srv;
+    const int fd;
+    std::string inbuf;  // Partially received frames. Only used by bg loop.
+    port::Mutex mu;     // Serializes replies and protects refs
+    int refs;
+  };
+  // A decoded request frame.
+  struct FrameState {
+    Conn* conn;
+    uint32_t reqid;
+    std::string msg;
+    Slice payload;  // References msg
+  };
+  static void Unref(Conn* conn);
+  bool HandleReadableConn(Conn* conn);  // Return false if conn is lost
+  void HandleIncomingFrame(FrameState* frame);  // May send frame to bg pool
+  void ProcessFrame(FrameState* frame);
+  static void ProcessFrameWrapper(void* arg);
+  Status BGLoopMux(int myid);  // Epoll-driven reactor over persistent conns
   virtual Status BGLoop(int myid);
   const uint64_t rpc_timeout_;  // In microseconds
   const size_t buf_sz_;         // Buffer size for reading peer data
+  // State below protected by mutex_
+  int bg_count_;  // Total number of bg work items pending
 };
 
 // TCP client.
 class PosixTCPCli : public rpc::If {
  public:
-  explicit PosixTCPCli(uint64_t timeout, size_t buf_sz = 4000);
+  PosixTCPCli(uint64_t timeout, size_t max_msgsz, size_t buf_sz = 4000);
   virtual ~PosixTCPCli() {}
 
   // Each call creates a new socket, followed by a connection operation, a send,
@@ -63,9 +90,71 @@ class PosixTCPCli : public rpc::If {
   PosixTCPCli(const PosixTCPCli& other);
   Status OpenAndConnect(int* fd);
   const uint64_t rpc_timeout_;  // In microseconds
+  const size_t max_msgsz_;      // Max size of replies
+  const size_t buf_sz_;
+  PosixSocketAddr addr_;
+  Status status_;
+};
+
+// TCP client using long-lived connections. Each stub keeps a small pool of
+// connections to the target server. Every request is sent as a frame prefixed
+// with its length and a request id so that multiple in-flight calls can share
+// a single connection. Replies are demultiplexed by request id. There is no
+// background thread for synchronous calls: one of the waiting callers
+// temporarily acts as the reader of a connection and hands replies to the
+// rest. Connections with outstanding asynchronous calls are read by a
+// background thread started at the first such call.
+class PosixTCPMuxCli : public rpc::If {
+ public:
+  PosixTCPMuxCli(Env* env, uint64_t timeout, int num_conns,
+                 int max_outstanding_calls, size_t max_msgsz,
+                 size_t buf_sz = 4000);
+  virtual ~PosixTCPMuxCli();
+
+  virtual Status Call(Message& in, Message& out) RPCNOEXCEPT;
+  virtual void AsyncCall(Message& in, Message& out, Callback cb,
+                         void* arg) RPCNOEXCEPT;
+
+  // If we fail to resolve the uri, we will record the error and return it at
+  // the next Call() invocation.
+  void SetTarget(const std::string& uri);
+
+ private:
+  struct Waiter;
+  struct Conn;
+  // No copying allowed
+  void operator=(const PosixTCPMuxCli&);
+  PosixTCPMuxCli(const PosixTCPMuxCli& other);
+  Status MaybeConnect(Conn* conn);
+  Status OpenAndConnect(int* fd);
+  Status Send(Conn* conn, uint32_t reqid, const Message& msg);
+  Status ReadFrames(Conn* conn);
+  void DeliverFrames(Conn* conn, std::vector<Waiter*>* completed);
+  void BreakConn(Conn* conn, const Status& reason,
+                 std::vector<Waiter*>* completed);
+  void Remove(Conn* conn, std::map<uint32_t, Waiter*>::iterator it);
+  void Complete(const std::vector<Waiter*>& completed);
+  void WakeBG();
+  static void BGLoopWrapper(void* arg);
+  void BGLoop();
+  Env* const env_;
+  const uint64_t rpc_timeout_;  // In microseconds
+  const size_t max_msgsz_;      // Max size of reply frames
   const size_t buf_sz_;
+  rpc::AsyncCallWindow window_;
   PosixSocketAddr addr_;
   Status status_;
+  port::Mutex mutex_;
+  port::CondVar bg_cv_;
+  // State below protected by mutex_
+  std::vector<Conn*> conns_;
+  uint32_t next_reqid_;
+  size_t next_conn_;
+  int wakeup_[2];  // Pipe for interrupting the bg thread when it polls
+  bool wakeup_pending_;
+  bool bg_started_;
+  bool bg_running_;
+  bool shutting_down_;
 };
 
 }  // namespace pdlfs
@@ -10,20 +10,140 @@
  */
 #include "posix_rpc_udp.h"
 
+#include "pdlfs-common/coding.h"
 #include "pdlfs-common/env.h"
+#include "pdlfs-common/hash.h"
 #include "pdlfs-common/mutexlock.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <netdb.h>
 #include <poll.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 namespace pdlfs {
+namespace {
+// Each datagram starts with a fixed 16-byte header: a 32-bit request id chosen
+// by the caller, a 16-bit fragment index, a 16-bit fragment count, a 32-bit
+// datagram type, and the max size of datagrams the sender is willing to
+// receive. Replies carry the same request id as their requests. Messages too
+// large for a single datagram are sent as multiple fragments.
+const size_t kHeaderSize = 16;
+
+// Datagram types. A busy reply tells a client to back off and try again.
+enum { kRequest = 1, kReply = 2, kBusy = 3 };
+
+// Backoff time of a client after receiving a busy reply. Starts at 1ms and
+// doubles after each busy reply of the same call, up to 128ms.
+const uint64_t kMinBackoff = 1000;
+const uint64_t kMaxBackoff = 128000;
+
+struct Header {
+  uint32_t reqid;
+  uint32_t idx;     // Fragment index
+  uint32_t nfrags;  // Total number of fragments
+  uint32_t type;
+  uint32_t maxsz;  // Max size of datagrams the sender is willing to receive
+};
+
+void EncodeHeader(char* dst, const Header& h) {
+  EncodeFixed32(dst, h.reqid);
+  EncodeFixed16(dst + 4, static_cast<uint16_t>(h.idx));
+  EncodeFixed16(dst + 6, static_cast<uint16_t>(h.nfrags));
+  EncodeFixed32(dst + 8, h.type);
+  EncodeFixed32(dst + 12, h.maxsz);
+}
+
+// Return false if a datagram is too short or carries bad fragment info.
+bool DecodeHeader(const char* src, size_t n, Header* h) {
+  if (n < kHeaderSize) {
+    return false;
+  }
+  h->reqid = DecodeFixed32(src);
+  h->idx = DecodeFixed16(src + 4);
+  h->nfrags = DecodeFixed16(src + 6);
+  h->type = DecodeFixed32(src + 8);
+  h->maxsz = DecodeFixed32(src + 12);
+  return h->idx < h->nfrags;
+}
+
+// Send a message as one or more datagrams, each carrying at most fragsz bytes
+// of the message after the header. Datagrams are sent using gather writes so
+// that message chunks are not copied into a contiguous buffer first. Fragments
+// are sent starting from fragment first % nfrags. Retransmissions start at
+// different fragments so that fragments at the end of a message are not the
+// ones that always get dropped when the receiver's socket buffer overflows.
+// addr may be NULL for connected sockets.
+Status SendFragments(int fd, Header* h, const rpc::If::Message& m,
+                     size_t fragsz, size_t first, struct sockaddr* addr,
+                     socklen_t addrlen) {
+  Slice segs[rpc::If::Message::kMaxChunks + 1];
+  int nsegs = 0;
+  segs[nsegs++] = m.contents;
+  for (int i = 0; i < m.nchunks; i++) {
+    segs[nsegs++] = m.chunks[i];
+  }
+  const size_t total = m.size();
+  const size_t nfrags = total != 0 ? (total + fragsz - 1) / fragsz : 1;
+  if (nfrags > 65535) {
+    return Status::InvalidArgument("Message too large");
+  }
+  char header[kHeaderSize];
+  struct iovec iov[rpc::If::Message::kMaxChunks + 2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = addr;
+  msg.msg_namelen = addr ? addrlen : 0;
+  msg.msg_iov = iov;
+  h->nfrags = nfrags;
+  for (size_t k = 0; k < nfrags; k++) {
+    const size_t i = (first + k) % nfrags;
+    h->idx = i;
+    EncodeHeader(header, *h);
+    size_t off = i * fragsz;  // Offset of the fragment in the message
+    const size_t len = std::min(fragsz, total - off);
+    size_t remaining = len;
+    int niov = 1;
+    for (int j = 0; j < nsegs && remaining != 0; j++) {
+      if (off >= segs[j].size()) {
+        off -= segs[j].size();
+        continue;
+      }
+      const size_t n = std::min(remaining, segs[j].size() - off);
+      iov[niov].iov_base = const_cast<char*>(segs[j].data() + off);
+      iov[niov].iov_len = n;
+      niov++;
+      remaining -= n;
+      off = 0;
+    }
+    msg.msg_iovlen = niov;
+    ssize_t rv = sendmsg(fd, &msg, 0);
+    if (rv != static_cast<ssize_t>(len + kHeaderSize)) {
+      return Status::IOError("UDP send", strerror(errno));
+    }
+  }
+  return Status::OK();
+}
+
+}  // namespace
+
+namespace {
+// Max number of fragments of a message that is at most max_msgsz bytes when
+// each fragment is carried by a datagram of at most max_datagramsz bytes.
+size_t MaxFrags(size_t max_msgsz, size_t max_datagramsz) {
+  const size_t fragsz = max_datagramsz - kHeaderSize;
+  return std::min<size_t>((max_msgsz + fragsz - 1) / fragsz, 65535);
+}
+}  // namespace
 
 PosixUDPServer::PosixUDPServer(const RPCOptions& options)
     : PosixSocketServer(options),
       max_msgsz_(options.udp_max_unexpected_msgsz),
+      max_frags_(MaxFrags(options.max_msgsz, max_msgsz_)),
       bg_count_(0) {}
 
 PosixUDPServer::~PosixUDPServer() {
@@ -32,37 +152,47 @@ PosixUDPServer::~PosixUDPServer() {
   while (bg_count_ != 0) {  // Wait until all bg work items have been processed
     bg_cv_.Wait();
   }
+  for (int i = 0; i < kCallShards; i++) {
+    std::map<std::string, CallEntry*>::iterator it = shards_[i].calls.begin();
+    for (; it != shards_[i].calls.end(); ++it) {
+      delete it->second;
+    }
+  }
+  for (size_t i = 0; i < extra_fds_.size(); i++) {
+    close(extra_fds_[i]);
+  }
   // More resources will be released by parent
 }
 
-Status PosixUDPServer::OpenAndBind(const std::string& uri) {
-  MutexLock ml(&mutex_);
-  if (fd_ != -1) {
-    return Status::AssertionFailed("Socket already opened");
-  }
-  Status status = addr_->ResolvUri(uri);
-  if (!status.ok()) {
-    return status;
+Status PosixUDPServer::OpenSocket(struct sockaddr_in* addr, int* result) {
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1) {
+    return Status::IOError("Cannot create UDP socket", strerror(errno));
   }
 
-  // Try opening the server. If we fail we will clean up so that we can try
-  // again later.
-  fd_ = socket(AF_INET, SOCK_DGRAM, 0);
-  if (fd_ == -1) {
-    status = Status::IOError("Cannot create UDP socket", strerror(errno));
-  } else {
-    int rv = bind(fd_, reinterpret_cast<struct sockaddr*>(addr_->rep()),
-                  sizeof(struct sockaddr_in));
-    if (rv == -1) {
-      status = Status::IOError("UDP bind", strerror(errno));
-      close(fd_);
-      fd_ = -1;
+  if (options_.udp_srv_reuseport) {
+#if defined(SO_REUSEPORT)
+    int one = 1;
+    int rv = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (rv != 0) {
+      Log(options_.info_log, 0, "Cannot set SO_REUSEPORT: %s", strerror(errno));
     }
+#else
+    Log(options_.info_log, 0, "SO_REUSEPORT not supported");
+#endif
+  }
+
+  int rv = bind(fd, reinterpret_cast<struct sockaddr*>(addr),
+                sizeof(struct sockaddr_in));
+  if (rv == -1) {
+    Status status = Status::IOError("UDP bind", strerror(errno));
+    close(fd);
+    return status;
   }
 
   if (options_.udp_srv_rcvbuf != -1) {
-    int rv = setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &options_.udp_srv_rcvbuf,
-                        sizeof(options_.udp_srv_rcvbuf));
+    rv = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options_.udp_srv_rcvbuf,
+                    sizeof(options_.udp_srv_rcvbuf));
     if (rv != 0) {
       Log(options_.info_log, 0, "Cannot set SO_RCVBUF=%d: %s",
           options_.udp_srv_rcvbuf, strerror(errno));
@@ -70,14 +200,31 @@ Status PosixUDPServer::OpenAndBind(const std::string& uri) {
   }
 
   if (options_.udp_srv_sndbuf != -1) {
-    int rv = setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &options_.udp_srv_sndbuf,
-                        sizeof(options_.udp_srv_sndbuf));
+    rv = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options_.udp_srv_sndbuf,
+                    sizeof(options_.udp_srv_sndbuf));
     if (rv != 0) {
       Log(options_.info_log, 0, "Cannot set SO_SNDBUF=%d: %s",
           options_.udp_srv_sndbuf, strerror(errno));
     }
   }
 
+  *result = fd;
+  return Status::OK();
+}
+
+Status PosixUDPServer::OpenAndBind(const std::string& uri) {
+  MutexLock ml(&mutex_);
+  if (fd_ != -1) {
+    return Status::AssertionFailed("Socket already opened");
+  }
+  Status status = addr_->ResolvUri(uri);
+  if (!status.ok()) {
+    return status;
+  }
+
+  // Try opening the server. If we fail we will clean up so that we can try
+  // again later.
+  status = OpenSocket(addr_->rep(), &fd_);
   if (status.ok()) {
     // Fetch the port that we have just bound to in case we have decided to have
     // the OS choose the port
@@ -93,29 +240,49 @@ inline PosixUDPServer::CallState* PosixUDPServer::CreateCallState() {
   CallState* const call = static_cast<CallState*>(
       malloc(sizeof(struct CallState) - 1 + max_msgsz_));
   call->parent_srv = this;
+  call->entry = NULL;
   return call;
 }
 
 Status PosixUDPServer::BGLoop(int myid) {
+  int fd = fd_;
+  if (options_.udp_srv_reuseport && myid != 0) {
+    MutexLock ml(&mutex_);
+    Status status = OpenSocket(actual_addr_->rep(), &fd);
+    if (!status.ok()) {
+      return status;
+    }
+    extra_fds_.push_back(fd);
+  }
+#if defined(PDLFS_OS_LINUX)
+  if (options_.udp_srv_batch_size > 1) {
+    return BGLoopBatched(myid, fd);
+  }
+#endif
   CallState* call = CreateCallState();
   struct pollfd po;
   po.events = POLLIN;
-  po.fd = fd_;
+  po.fd = fd;
 
+  uint64_t npkts = 0;
   int err = 0;
   while (!err && !shutting_down_.Acquire_Load()) {
     call->addrlen = sizeof(call->addrstor);
     // Try performing a quick non-blocking receive from peers before sinking
     // into poll.
-    ssize_t rv = recvfrom(fd_, call->msg, max_msgsz_, MSG_DONTWAIT,
+    ssize_t rv = recvfrom(fd, call->msg, max_msgsz_, MSG_DONTWAIT,
                           call->addrbuf(), &call->addrlen);
     if (rv > 0) {
+      call->fd = fd;
       call->msgsz = rv;
-      HandleIncomingCall(&call);
+      npkts++;
+      HandleIncomingCall(&call, NULL);
       continue;
     } else if (rv == 0) {  // Empty message
       continue;
     } else if (errno == EWOULDBLOCK) {
+      AddPkts(myid, npkts);
+      npkts = 0;
       rv = poll(&po, 1, 200);
     }
 
@@ -125,6 +292,7 @@ Status PosixUDPServer::BGLoop(int myid) {
     }
   }
 
+  AddPkts(myid, npkts);
   free(call);
 
   Status status;
@@ -134,27 +302,282 @@ Status PosixUDPServer::BGLoop(int myid) {
   return status;
 }
 
-void PosixUDPServer::HandleIncomingCall(CallState** call) {
+#if defined(PDLFS_OS_LINUX)
+// Replies to calls handled by a bg thread in between two recvmmsg calls.
+// Only replies that fit in a single datagram and that do not reference
+// reassembled requests are batched. Others are sent immediately.
+struct PosixUDPServer::ReplyBatch {
+  explicit ReplyBatch(int n)
+      : outs(n), msgs(n), iovs(n * kIovs), headers(n * kHeaderSize), n(0) {}
+
+  enum { kIovs = rpc::If::Message::kMaxChunks + 2 };
+
+  // Return the message to be used for holding the next reply.
+  rpc::If::Message* Next() {
+    rpc::If::Message* const out = &outs[n];
+    out->contents = Slice();
+    out->nchunks = 0;
+    return out;
+  }
+
+  // Add the reply previously obtained through Next(). Return false if the
+  // reply must be sent separately.
+  bool Add(CallState* call, size_t max_replysz) {
+    const rpc::If::Message& out = outs[n];
+    if (out.size() + kHeaderSize > max_replysz) {
+      return false;
+    }
+    Header h;
+    h.reqid = call->reqid;
+    h.idx = 0;
+    h.nfrags = 1;
+    h.type = kReply;
+    h.maxsz = 0;
+    char* const header = &headers[n * kHeaderSize];
+    EncodeHeader(header, h);
+    struct iovec* const iov = &iovs[n * kIovs];
+    iov[0].iov_base = header;
+    iov[0].iov_len = kHeaderSize;
+    int niov = 1;
+    iov[niov].iov_base = const_cast<char*>(out.contents.data());
+    iov[niov].iov_len = out.contents.size();
+    niov++;
+    for (int i = 0; i < out.nchunks; i++) {
+      iov[niov].iov_base = const_cast<char*>(out.chunks[i].data());
+      iov[niov].iov_len = out.chunks[i].size();
+      niov++;
+    }
+    struct msghdr* const msg = &msgs[n].msg_hdr;
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_name = call->addrbuf();
+    msg->msg_namelen = call->addrlen;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = niov;
+    n++;
+    return true;
+  }
+
+  std::vector<rpc::If::Message> outs;
+  std::vector<struct mmsghdr> msgs;
+  std::vector<struct iovec> iovs;
+  std::vector<char> headers;
+  int n;  // Number of replies batched so far
+};
+
+// Receive up to options_.udp_srv_batch_size datagrams at a time into a ring of
+// preallocated call states. Calls handled by us rather than extra workers have
+// their replies sent together before we receive more.
+Status PosixUDPServer::BGLoopBatched(int myid, int fd) {
+  const int n = options_.udp_srv_batch_size;
+  std::vector<CallState*> calls(n);
+  std::vector<struct mmsghdr> msgs(n);
+  std::vector<struct iovec> iovs(n);
+  for (int i = 0; i < n; i++) {
+    calls[i] = CreateCallState();
+  }
+  ReplyBatch batch(n);
+  struct pollfd po;
+  po.events = POLLIN;
+  po.fd = fd;
+
+  uint64_t npkts = 0;
+  int err = 0;
+  while (!err && !shutting_down_.Acquire_Load()) {
+    for (int i = 0; i < n; i++) {
+      iovs[i].iov_base = calls[i]->msg;
+      iovs[i].iov_len = max_msgsz_;
+      struct msghdr* const msg = &msgs[i].msg_hdr;
+      memset(msg, 0, sizeof(struct msghdr));
+      msg->msg_name = calls[i]->addrbuf();
+      msg->msg_namelen = sizeof(calls[i]->addrstor);
+      msg->msg_iov = &iovs[i];
+      msg->msg_iovlen = 1;
+    }
+    int rv = recvmmsg(fd, &msgs[0], n, MSG_DONTWAIT, NULL);
+    if (rv > 0) {
+      npkts += rv;
+      for (int i = 0; i < rv; i++) {
+        calls[i]->fd = fd;
+        calls[i]->addrlen = msgs[i].msg_hdr.msg_namelen;
+        calls[i]->msgsz = msgs[i].msg_len;
+        // Calls sent to extra workers are replaced with new ones
+        HandleIncomingCall(&calls[i], &batch);
+      }
+      int sent = 0;
+      while (sent < batch.n) {
+        int r = sendmmsg(fd, &batch.msgs[sent], batch.n - sent, 0);
+        if (r == -1) {
+          if (errno == EINTR) continue;
+          Log(options_.info_log, 0, "Error sending data to clients: %s",
+              strerror(errno));
+          break;
+        }
+        sent += r;
+      }
+      batch.n = 0;
+      continue;
+    } else if (rv == 0) {
+      continue;
+    } else if (errno == EWOULDBLOCK || errno == EINTR) {
+      AddPkts(myid, npkts);
+      npkts = 0;
+      rv = poll(&po, 1, 200);
+    }
+
+    // Either poll() or recvmmsg() may have returned error
+    if (rv == -1) {
+      err = errno;
+    }
+  }
+
+  AddPkts(myid, npkts);
+  for (int i = 0; i < n; i++) {
+    free(calls[i]);
+  }
+
+  Status status;
+  if (err) {
+    status = Status::IOError("UDP recvmmsg/poll", strerror(err));
+  }
+  return status;
+}
+#endif
+
+// Single-datagram requests bypass the call table when replies are not
+// remembered. There is nothing to resend for their retransmissions.
+void PosixUDPServer::HandleIncomingCall(CallState** call,
+                                        ReplyBatch* const batch) {
+  CallState* const c = *call;
+  Header h;
+  if (!DecodeHeader(c->msg, c->msgsz, &h) || h.type != kRequest) {
+    return;  // Silently drop bad datagrams
+  } else if (h.nfrags > 1 && c->msgsz == kHeaderSize) {
+    return;  // Fragments of a multi-fragment message are never empty
+  } else if (h.nfrags > max_frags_) {
+    return;  // Message too large
+  }
+  c->reqid = h.reqid;
+  c->max_replysz = h.maxsz;
+  c->entry = NULL;
+  if (h.nfrags <= 1 && options_.udp_reply_cache_size == 0) {
+    if (IsBusy()) {
+      rpc::If::Message busy;
+      SendReply(c, kBusy, busy, 0);
+      return;
+    }
+    Dispatch(call, batch);
+    return;
+  }
+  std::string key(reinterpret_cast<char*>(&c->addrstor), c->addrlen);
+  CallShard* const shard =
+      &shards_[Hash(key.data(), key.size(), 0) % kCallShards];
+  PutFixed32(&key, h.reqid);
+  const size_t fragsz = c->msgsz - kHeaderSize;
+  const size_t max_assembling_bytes =
+      options_.udp_max_reassembly_bytes / kCallShards;
+  shard->mu.Lock();
+  CallEntry* e;
+  std::map<std::string, CallEntry*>::iterator it = shard->calls.find(key);
+  if (it != shard->calls.end()) {
+    e = it->second;
+    if (e->state == CallEntry::kDone) {  // The reply may have been lost
+      rpc::If::Message out;
+      out.extra_buf = e->reply;
+      out.contents = out.extra_buf;
+      shard->mu.Unlock();
+      SendReply(c, kReply, out, CurrentMicros());
+      return;
+    } else if (e->state == CallEntry::kRunning ||
+               e->frags.size() != h.nfrags || !e->frags[h.idx].empty()) {
+      shard->mu.Unlock();
+      return;  // Duplicate
+    } else if (shard->assembling_bytes + fragsz > max_assembling_bytes) {
+      shard->mu.Unlock();
+      return;  // Too many bytes being reassembled
+    }
+    e->frags[h.idx].assign(c->msg + kHeaderSize, fragsz);
+    e->nfrags++;
+    e->bytes += fragsz;
+    shard->assembling_bytes += fragsz;
+    if (e->nfrags < e->frags.size()) {
+      shard->mu.Unlock();
+      return;
+    }
+    shard->assembling.erase(e->pos);
+    shard->assembling_bytes -= e->bytes;
+    for (size_t i = 0; i < e->frags.size(); i++) {
+      e->msg.append(e->frags[i]);
+    }
+    std::vector<std::string>().swap(e->frags);
+  } else if (IsBusy()) {
+    shard->mu.Unlock();
+    // Instantly reject new calls when too many calls are already pending
+    // so that callers will back off instead of timing out and retrying
+    rpc::If::Message busy;
+    SendReply(c, kBusy, busy, 0);
+    return;
+  } else {
+    const uint64_t now = CurrentMicros();
+    Sweep(shard, now);
+    if (h.nfrags > 1 &&
+        shard->assembling_bytes + fragsz > max_assembling_bytes) {
+      shard->mu.Unlock();
+      return;  // Too many bytes being reassembled
+    }
+    e = new CallEntry;
+    e->arrival = now;
+    e->shard = shard;
+    e->key = key;
+    e->nfrags = 0;
+    e->bytes = 0;
+    shard->calls.insert(std::make_pair(key, e));
+    if (h.nfrags > 1) {
+      e->state = CallEntry::kAssembling;
+      e->frags.resize(h.nfrags);
+      e->frags[h.idx].assign(c->msg + kHeaderSize, fragsz);
+      e->nfrags++;
+      e->bytes += fragsz;
+      shard->assembling_bytes += fragsz;
+      e->pos = shard->assembling.insert(shard->assembling.end(), e);
+      shard->mu.Unlock();
+      return;
+    }
+  }
+
+  e->state = CallEntry::kRunning;
+  shard->mu.Unlock();
+  c->entry = e;
+  Dispatch(call, batch);
+}
+
+// Return true if too many calls are already pending for extra workers.
+bool PosixUDPServer::IsBusy() {
+  if (options_.extra_workers && options_.udp_max_pending_calls > 0) {
+    MutexLock ml(&mutex_);
+    return bg_count_ >= options_.udp_max_pending_calls;
+  }
+  return false;
+}
+
+// Run a call either directly or through extra workers. Calls sent to extra
+// workers are replaced with new ones.
+void PosixUDPServer::Dispatch(CallState** call, ReplyBatch* const batch) {
+  CallState* const c = *call;
   if (options_.extra_workers) {
     mutex_.Lock();
     ++bg_count_;
-    // XXX: senders/callers are implicitly rate-limited by not sending them
-    // replies. Should we more explicitly rate-limit them? For example, when
-    // bg_work_ is larger than a certain threshold, incoming calls are instantly
-    // rejected with a special reply. This special reply is understood by
-    // PosixUDPCli, which in turn returns a special Status to the caller.
-    options_.extra_workers->Schedule(ProcessCallWrapper, *call);
     mutex_.Unlock();
+    options_.extra_workers->Schedule(ProcessCallWrapper, c);
     *call = CreateCallState();
   } else {
-    ProcessCall(*call);
+    ProcessCall(c, batch);
   }
 }
 
 void PosixUDPServer::ProcessCallWrapper(void* arg) {
   CallState* const call = reinterpret_cast<CallState*>(arg);
   PosixUDPServer* const srv = call->parent_srv;
-  srv->ProcessCall(call);
+  srv->ProcessCall(call, NULL);
   free(call);
   MutexLock ml(&srv->mutex_);
   assert(srv->bg_count_ > 0);
@@ -164,39 +587,154 @@ void PosixUDPServer::ProcessCallWrapper(void* arg) {
   }
 }
 
-void PosixUDPServer::ProcessCall(CallState* const call) {
-  rpc::If::Message in, out;
-  in.contents = Slice(call->msg, call->msgsz);
-  Status s = options_.fs->Call(in, out);
+void PosixUDPServer::ProcessCall(CallState* const call,
+                                 ReplyBatch* const batch) {
+  CallEntry* const e = call->entry;
+  rpc::If::Message in, tmp;
+  rpc::If::Message* out = &tmp;
+  if (e != NULL && !e->msg.empty()) {  // Reassembled from multiple fragments
+    in.contents = e->msg;
+  } else {
+    in.contents = Slice(call->msg + kHeaderSize, call->msgsz - kHeaderSize);
+#if defined(PDLFS_OS_LINUX)
+    // Replies may reference requests, which will stay in the receive ring
+    // until the batch is sent
+    if (batch != NULL) {
+      out = batch->Next();
+    }
+#endif
+  }
+  Status s = options_.fs->Call(in, *out);
   if (!s.ok()) {
     Log(options_.info_log, 0, "Fail to handle incoming call: %s",
         s.ToString().c_str());
+    Finish(e, NULL);
     return;
   }
-  ssize_t nbytes = sendto(fd_, out.contents.data(), out.contents.size(), 0,
-                          call->addrbuf(), call->addrlen);
-  if (nbytes != out.contents.size()) {
+#if defined(PDLFS_OS_LINUX)
+  if (out != &tmp &&
+      batch->Add(call, call->max_replysz > kHeaderSize ? call->max_replysz
+                                                        : max_msgsz_)) {
+    Finish(e, out);
+    return;
+  }
+#endif
+  SendReply(call, kReply, *out, 0);
+  Finish(e, out);
+}
+
+void PosixUDPServer::SendReply(CallState* const call, uint32_t type,
+                               const rpc::If::Message& out, size_t first) {
+  Header h;
+  h.reqid = call->reqid;
+  h.type = type;
+  h.maxsz = 0;
+  size_t max_replysz = call->max_replysz;
+  if (max_replysz <= kHeaderSize) {
+    max_replysz = max_msgsz_;
+  }
+  Status s = SendFragments(call->fd, &h, out, max_replysz - kHeaderSize,
+                           first, call->addrbuf(), call->addrlen);
+  if (!s.ok()) {
 #if VERBOSE >= 1
-    const int errno_copy = errno;  // Store a copy before calling getnameinfo()
     char host[NI_MAXHOST];
     char port[NI_MAXSERV];
     getnameinfo(call->addrbuf(), call->addrlen, host, sizeof(host), port,
                 sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
     Log(options_.info_log, 1, "Fail to send rpc reply to client[%s:%s]: %s",
-        host, port, strerror(errno_copy));
+        host, port, s.ToString().c_str());
 #else
     Log(options_.info_log, 0, "Error sending data to client: %s",
-        strerror(errno));
+        s.ToString().c_str());
 #endif
   }
 }
 
+// Remember the reply of a call so that it can be resent when the caller
+// retransmits its request. A NULL reply causes the call to be forgotten so
+// that a retransmission will execute it again.
+void PosixUDPServer::Finish(CallEntry* const e, const rpc::If::Message* out) {
+  if (e == NULL) {
+    return;  // Never remembered
+  }
+  std::string reply;
+  if (out != NULL && options_.udp_reply_cache_size != 0) {
+    reply.reserve(out->size());
+    reply.append(out->contents.data(), out->contents.size());
+    for (int i = 0; i < out->nchunks; i++) {
+      reply.append(out->chunks[i].data(), out->chunks[i].size());
+    }
+  }
+  CallShard* const shard = e->shard;
+  MutexLock ml(&shard->mu);
+  if (out == NULL || options_.udp_reply_cache_size == 0) {
+    Remove(e);
+  } else {
+    e->state = CallEntry::kDone;
+    std::string().swap(e->msg);
+    e->reply.swap(reply);
+    shard->done.push_back(e);
+    Sweep(shard, CurrentMicros());
+  }
+}
+
+// REQUIRES: e->shard->mu has been locked.
+void PosixUDPServer::Remove(CallEntry* const e) {
+  e->shard->mu.AssertHeld();
+  e->shard->calls.erase(e->key);
+  delete e;
+}
+
+// Forget partially received requests and remembered replies that no caller
+// may still be waiting for.
+// Each shard remembers its share of options_.udp_reply_cache_size replies.
+// REQUIRES: shard->mu has been locked.
+void PosixUDPServer::Sweep(CallShard* const shard, uint64_t now) {
+  shard->mu.AssertHeld();
+  const size_t max_done =
+      (options_.udp_reply_cache_size + kCallShards - 1) / kCallShards;
+  while (!shard->assembling.empty() &&
+         now - shard->assembling.front()->arrival >= options_.rpc_timeout) {
+    CallEntry* const e = shard->assembling.front();
+    shard->assembling.pop_front();
+    shard->assembling_bytes -= e->bytes;
+    Remove(e);
+  }
+  while (!shard->done.empty() &&
+         (shard->done.size() > max_done ||
+          now - shard->done.front()->arrival >= options_.rpc_timeout)) {
+    CallEntry* const e = shard->done.front();
+    shard->done.pop_front();
+    Remove(e);
+  }
+}
+
 std::string PosixUDPServer::GetUri() {
   return std::string("udp://") + GetBaseUri();
 }
 
-PosixUDPCli::PosixUDPCli(uint64_t timeout, size_t max_msgsz)
-    : rpc_timeout_(timeout), max_msgsz_(max_msgsz), fd_(-1) {}
+PosixUDPCli::PosixUDPCli(Env* env, uint64_t timeout,
+                         uint64_t retransmit_timeout, size_t max_msgsz,
+                         size_t max_reqsz, int max_outstanding_calls)
+    : env_(env),
+      rpc_timeout_(timeout),
+      retransmit_timeout_(retransmit_timeout),
+      max_msgsz_(max_msgsz),
+      max_reqsz_(max_reqsz),
+      window_(max_outstanding_calls),
+      bg_cv_(&mutex_),
+      bg_started_(false),
+      bg_running_(false),
+      shutting_down_(false),
+      next_reqid_(0),
+      rnd_(static_cast<uint32_t>(CurrentMicros())),
+      fd_(-1) {
+  assert(max_msgsz_ > kHeaderSize);
+  assert(max_reqsz_ > kHeaderSize);
+  // Avoid reusing request ids of a previous client that was bound to the
+  // same port
+  next_reqid_ = rnd_.Next();
+}
 
 void PosixUDPCli::Open(const std::string& uri) {
   PosixSocketAddr addr;
@@ -218,39 +756,102 @@ void PosixUDPCli::Open(const std::string& uri) {
   }
 }
 
+Status PosixUDPCli::Send(uint32_t reqid, const Message& in, size_t first) {
+  Header h;
+  h.reqid = reqid;
+  h.type = kRequest;
+  h.maxsz = max_msgsz_;
+  return SendFragments(fd_, &h, in, max_reqsz_ - kHeaderSize, first, NULL, 0);
+}
+
 // We do a synchronous send, followed by one or more non-blocking receives
 // so that we can easily check timeouts without waiting for the data
-// indefinitely. We use a timed poll to check data availability.
+// indefinitely. We use a timed poll to check data availability. Requests are
+// resent using the same request id when no reply arrives in time, or after a
+// randomized backoff when the server replies that it is busy.
 Status PosixUDPCli::Call(Message& in, Message& out) RPCNOEXCEPT {
   if (!status_.ok()) {
     return status_;
   }
-  Status status;
-  ssize_t rv = send(fd_, in.contents.data(), in.contents.size(), 0);
-  if (rv != in.contents.size()) {
-    status = Status::IOError("UDP send", strerror(errno));
+  mutex_.Lock();
+  if (bg_started_) {
+    mutex_.Unlock();
+    return WaitForAsyncCall(in, out);
+  }
+  const uint32_t reqid = next_reqid_++;
+  mutex_.Unlock();
+  Status status = Send(reqid, in, 0);
+  if (!status.ok()) {
     return status;
   }
   const uint64_t start = CurrentMicros();
+  uint64_t retransmit_timeout = retransmit_timeout_;
+  uint64_t next_retransmit = start + retransmit_timeout;
+  uint64_t backoff = kMinBackoff;
+  bool busy = false;
+  std::vector<std::string> frags;  // Reply fragments received so far
+  size_t nfrags = 0;
   std::string& buf = out.extra_buf;
-  buf.reserve(max_msgsz_);
-  buf.resize(1);
+  buf.resize(max_msgsz_);
   struct pollfd po;
   memset(&po, 0, sizeof(struct pollfd));
   po.events = POLLIN;
   po.fd = fd_;
   while (true) {
-    rv = recv(fd_, &buf[0], max_msgsz_, MSG_DONTWAIT);
-    if (rv > 0) {
-      out.contents = Slice(&buf[0], rv);
-      break;
-    } else if (rv == 0) {  // Empty reply
-      out.contents = Slice();
-      break;
-    } else if (errno == EWOULDBLOCK) {
-      // We wait for 0.2 second and therefore timeouts are only checked
+    ssize_t rv = recv(fd_, &buf[0], max_msgsz_, MSG_DONTWAIT);
+    if (rv >= 0) {
+      Header h;
+      if (!DecodeHeader(&buf[0], rv, &h) || h.reqid != reqid) {
+        continue;  // Ignore bad datagrams and late replies of earlier calls
+      } else if (h.type == kReply && h.nfrags == 1) {
+        buf.resize(rv);
+        out.contents = Slice(&buf[kHeaderSize], rv - kHeaderSize);
+        break;
+      } else if (h.type == kReply) {
+        if (frags.size() != h.nfrags) {
+          frags.clear();
+          frags.resize(h.nfrags);
+          nfrags = 0;
+        }
+        if (frags[h.idx].empty() && rv > kHeaderSize) {
+          frags[h.idx].assign(&buf[kHeaderSize], rv - kHeaderSize);
+          nfrags++;
+        }
+        if (nfrags == frags.size()) {
+          buf.clear();
+          for (size_t i = 0; i < frags.size(); i++) {
+            buf.append(frags[i]);
+          }
+          out.contents = buf;
+          break;
+        }
+      } else if (h.type == kBusy) {
+        busy = true;
+        const uint64_t delay = backoff / 2 + rnd_.Uniform(backoff / 2);
+        if (CurrentMicros() + delay - start >= rpc_timeout_) {
+          status = Status::TryAgain("Server busy");
+          break;
+        }
+        SleepForMicroseconds(delay);
+        backoff = std::min(2 * backoff, kMaxBackoff);
+        status = Send(reqid, in, rnd_.Next());
+        if (!status.ok()) {
+          break;
+        }
+        next_retransmit = CurrentMicros() + retransmit_timeout;
+      }
+      continue;
+    } else if (errno == EWOULDBLOCK || errno == EINTR) {
+      // We wait for at most 0.2 second and therefore timeouts are only checked
       // roughly every that amount of time.
-      rv = poll(&po, 1, 200);
+      int wait = 200;
+      const uint64_t now = CurrentMicros();
+      if (retransmit_timeout_ != 0) {
+        wait = now < next_retransmit
+                   ? std::min<uint64_t>(wait, (next_retransmit - now) / 1000)
+                   : 0;
+      }
+      rv = poll(&po, 1, wait);
     }
 
     // Either poll() or recv() may have returned an error
@@ -259,16 +860,283 @@ Status PosixUDPCli::Call(Message& in, Message& out) RPCNOEXCEPT {
       break;
     } else if (rv == 1) {
       continue;
-    } else if (CurrentMicros() - start >= rpc_timeout_) {
-      status = Status::Disconnected("timeout");
+    }
+    const uint64_t now = CurrentMicros();
+    if (now - start >= rpc_timeout_) {
+      status = busy ? Status::TryAgain("Server busy")
+                    : Status::Disconnected("timeout");
       break;
+    } else if (retransmit_timeout_ != 0 && now >= next_retransmit) {
+      status = Send(reqid, in, rnd_.Next());
+      if (!status.ok()) {
+        break;
+      }
+      retransmit_timeout *= 2;
+      next_retransmit = now + retransmit_timeout;
     }
   }
 
   return status;
 }
 
+// State for each outstanding asynchronous call.
+struct PosixUDPCli::AsyncState {
+  Message* in;
+  Message* out;
+  Callback cb;
+  void* arg;
+  Status status;  // Final status of the call
+  uint32_t reqid;
+  uint64_t start;
+  uint64_t retransmit_timeout;
+  uint64_t next_send;  // Time to resend the request
+  uint64_t backoff;
+  bool busy;  // True if the next send concludes a busy backoff
+  bool ever_busy;
+  std::vector<std::string> frags;  // Reply fragments received so far
+  size_t nfrags;
+};
+
+namespace {
+struct SyncCallState {
+  explicit SyncCallState(port::Mutex* m) : mu(m), cv(m), done(false) {}
+  port::Mutex* mu;
+  port::CondVar cv;
+  Status status;
+  bool done;
+};
+}  // namespace
+
+static void SyncCallDone(const Status& status, void* arg) {
+  SyncCallState* const state = reinterpret_cast<SyncCallState*>(arg);
+  MutexLock ml(state->mu);
+  state->status = status;
+  state->done = true;
+  state->cv.SignalAll();
+}
+
+Status PosixUDPCli::WaitForAsyncCall(Message& in, Message& out) {
+  port::Mutex mu;
+  SyncCallState state(&mu);
+  AsyncCall(in, out, SyncCallDone, &state);
+  MutexLock ml(&mu);
+  while (!state.done) {
+    state.cv.Wait();
+  }
+  return state.status;
+}
+
+void PosixUDPCli::AsyncCall(Message& in, Message& out, Callback cb,
+                            void* arg) RPCNOEXCEPT {
+  if (!status_.ok()) {
+    cb(status_, arg);
+    return;
+  }
+  window_.Enter();
+  AsyncState* const state = new AsyncState;
+  state->in = &in;
+  state->out = &out;
+  state->cb = cb;
+  state->arg = arg;
+  state->start = CurrentMicros();
+  state->retransmit_timeout = retransmit_timeout_;
+  state->next_send = retransmit_timeout_ != 0
+                         ? state->start + retransmit_timeout_
+                         : ~static_cast<uint64_t>(0);
+  state->backoff = kMinBackoff;
+  state->busy = state->ever_busy = false;
+  state->nfrags = 0;
+  mutex_.Lock();
+  if (!bg_started_) {
+    bg_started_ = bg_running_ = true;
+    env_->StartThread(BGLoopWrapper, this);
+  }
+  state->reqid = next_reqid_++;
+  calls_.insert(std::make_pair(state->reqid, state));
+  // The request is sent while holding mutex_ so that the bg thread does not
+  // resend it before the original is out
+  Status status = Send(state->reqid, in, 0);
+  if (!status.ok()) {
+    calls_.erase(state->reqid);
+  }
+  mutex_.Unlock();
+  if (!status.ok()) {
+    delete state;
+    cb(status, arg);
+    window_.Leave();
+  }
+}
+
+// Process a datagram received by the bg thread. Return true if buf has been
+// given to a call as its reply, in which case the caller must reallocate it.
+// Completed calls are removed and added to *done.
+// REQUIRES: mutex_ has been locked.
+bool PosixUDPCli::HandleReply(const char* data, size_t n, std::string* buf,
+                              std::vector<AsyncState*>* done) {
+  mutex_.AssertHeld();
+  Header h;
+  if (!DecodeHeader(data, n, &h)) {
+    return false;  // Ignore bad datagrams
+  }
+  std::map<uint32_t, AsyncState*>::iterator it = calls_.find(h.reqid);
+  if (it == calls_.end()) {
+    return false;  // Late replies of finished calls
+  }
+  AsyncState* const state = it->second;
+  bool taken = false;
+  if (h.type == kReply && h.nfrags == 1) {
+    std::string& dst = state->out->extra_buf;
+    dst.swap(*buf);
+    dst.resize(n);
+    state->out->contents = Slice(&dst[kHeaderSize], n - kHeaderSize);
+    taken = true;
+  } else if (h.type == kReply) {
+    if (state->frags.size() != h.nfrags) {
+      state->frags.clear();
+      state->frags.resize(h.nfrags);
+      state->nfrags = 0;
+    }
+    if (state->frags[h.idx].empty() && n > kHeaderSize) {
+      state->frags[h.idx].assign(data + kHeaderSize, n - kHeaderSize);
+      state->nfrags++;
+    }
+    if (state->nfrags != state->frags.size()) {
+      return false;
+    }
+    std::string& dst = state->out->extra_buf;
+    dst.clear();
+    for (size_t i = 0; i < state->frags.size(); i++) {
+      dst.append(state->frags[i]);
+    }
+    state->out->contents = dst;
+  } else if (h.type == kBusy) {
+    const uint64_t delay =
+        state->backoff / 2 + rnd_.Uniform(state->backoff / 2);
+    const uint64_t now = CurrentMicros();
+    state->ever_busy = true;
+    if (now + delay - state->start < rpc_timeout_) {
+      state->backoff = std::min(2 * state->backoff, kMaxBackoff);
+      state->next_send = now + delay;
+      state->busy = true;
+      return false;
+    }
+    state->status = Status::TryAgain("Server busy");
+  } else {
+    return false;
+  }
+  calls_.erase(it);
+  done->push_back(state);
+  return taken;
+}
+
+// Fail calls that have timed out and resend requests that are due. Return the
+// time in microseconds until the next request is due.
+// REQUIRES: mutex_ has been locked.
+uint64_t PosixUDPCli::CheckTimers(uint64_t now,
+                                  std::vector<AsyncState*>* done) {
+  mutex_.AssertHeld();
+  uint64_t wait = ~static_cast<uint64_t>(0);
+  std::map<uint32_t, AsyncState*>::iterator it = calls_.begin();
+  while (it != calls_.end()) {
+    AsyncState* const state = it->second;
+    if (now - state->start >= rpc_timeout_) {
+      state->status = state->ever_busy ? Status::TryAgain("Server busy")
+                                       : Status::Disconnected("timeout");
+    } else if (now >= state->next_send) {
+      state->status = Send(state->reqid, *state->in, rnd_.Next());
+      if (!state->busy) {
+        state->retransmit_timeout *= 2;
+      }
+      state->busy = false;
+      state->next_send = retransmit_timeout_ != 0
+                             ? now + state->retransmit_timeout
+                             : ~static_cast<uint64_t>(0);
+    }
+    if (!state->status.ok()) {
+      calls_.erase(it++);
+      done->push_back(state);
+    } else {
+      wait = std::min(wait, state->next_send - now);
+      ++it;
+    }
+  }
+  return wait;
+}
+
+void PosixUDPCli::Complete(const std::vector<AsyncState*>& done) {
+  for (size_t i = 0; i < done.size(); i++) {
+    AsyncState* const state = done[i];
+    state->cb(state->status, state->arg);
+    delete state;
+    window_.Leave();
+  }
+}
+
+void PosixUDPCli::BGLoopWrapper(void* arg) {
+  PosixUDPCli* const cli = reinterpret_cast<PosixUDPCli*>(arg);
+  cli->BGLoop();
+}
+
+void PosixUDPCli::BGLoop() {
+  std::vector<AsyncState*> done;
+  std::string buf;
+  struct pollfd po;
+  memset(&po, 0, sizeof(struct pollfd));
+  po.events = POLLIN;
+  po.fd = fd_;
+  MutexLock ml(&mutex_);
+  while (!shutting_down_) {
+    mutex_.Unlock();
+    buf.resize(max_msgsz_);
+    ssize_t rv = recv(fd_, &buf[0], max_msgsz_, MSG_DONTWAIT);
+    mutex_.Lock();
+    if (rv >= 0) {
+      if (HandleReply(buf.data(), rv, &buf, &done)) {
+        buf.clear();
+      }
+      // Drain all available datagrams before invoking callbacks
+      continue;
+    } else if (errno != EWOULDBLOCK && errno != EINTR) {
+      // Such as ICMP port unreachable errors reported on connected sockets
+      Status status = Status::IOError("UDP recv", strerror(errno));
+      std::map<uint32_t, AsyncState*>::iterator it = calls_.begin();
+      for (; it != calls_.end(); ++it) {
+        it->second->status = status;
+        done.push_back(it->second);
+      }
+      calls_.clear();
+    }
+    uint64_t wait = CheckTimers(CurrentMicros(), &done);
+    if (!done.empty()) {
+      mutex_.Unlock();
+      Complete(done);
+      done.clear();
+      mutex_.Lock();
+      continue;
+    }
+    // Wait for at most 0.2 second so that timeouts are checked regularly. Calls
+    // started while we wait resend their requests no earlier than
+    // retransmit_timeout_ from now.
+    wait = std::min<uint64_t>(wait, 200 * 1000);
+    if (retransmit_timeout_ != 0) {
+      wait = std::min(wait, retransmit_timeout_);
+    }
+    mutex_.Unlock();
+    poll(&po, 1, static_cast<int>((wait + 999) / 1000));
+    mutex_.Lock();
+  }
+  bg_running_ = false;
+  bg_cv_.SignalAll();
+}
+
 PosixUDPCli::~PosixUDPCli() {
+  window_.Drain();  // Wait for outstanding asynchronous calls
+  mutex_.Lock();
+  shutting_down_ = true;
+  while (bg_running_) {
+    bg_cv_.Wait();
+  }
+  mutex_.Unlock();
   if (fd_ != -1) {
     close(fd_);
   }
@@ -12,11 +12,22 @@
 
 #include "posix_rpc.h"
 
+#include "pdlfs-common/random.h"
+
+#include <deque>
+#include <list>
+#include <map>
 #include <stddef.h>
+#include <string>
 #include <sys/socket.h>
+#include <vector>
 
 namespace pdlfs {
-// RPC srv impl using UDP.
+// RPC srv impl using UDP. Incoming requests are remembered by the address of
+// their callers and their request ids. Retransmitted requests are either
+// dropped, when the original is still in progress, or answered with the
+// remembered reply. An rpc is therefore executed at most once within the
+// reply-cache window.
 class PosixUDPServer : public PosixSocketServer {
  public:
   explicit PosixUDPServer(const RPCOptions& options);
@@ -28,6 +39,21 @@ class PosixUDPServer : public PosixSocketServer {
   virtual std::string GetUri();
 
  private:
+  struct CallShard;
+  // Bookkeeping for a request identified by its caller and request id.
+  struct CallEntry {
+    enum { kAssembling, kRunning, kDone };
+    int state;
+    uint64_t arrival;  // Arrival time of the first fragment in microseconds
+    CallShard* shard;  // The shard holding the entry
+    std::string key;
+    std::vector<std::string> frags;  // Fragments received so far
+    size_t nfrags;                   // Number of fragments received so far
+    size_t bytes;                    // Bytes of fragments received so far
+    std::list<CallEntry*>::iterator pos;  // Position in assembling_
+    std::string msg;                      // Reassembled request
+    std::string reply;                    // Remembered reply
+  };
   // State for each incoming procedure call.
   struct CallState {
     PosixUDPServer* parent_srv;  // Back pointer to the server
@@ -37,38 +63,104 @@ class PosixUDPServer : public PosixSocketServer {
       return reinterpret_cast<struct sockaddr*>(&addrstor);
     }
     socklen_t addrlen;
-    size_t msgsz;  // Payload size
+    int fd;            // Socket through which the call has been received
+    CallEntry* entry;  // Set once all fragments have been received, or NULL
+    uint32_t reqid;
+    uint32_t max_replysz;  // Max size of reply datagrams
+    size_t msgsz;          // Datagram size, including the header
     char msg[1];
   };
+  // Replies to be sent together using a single system call.
+  struct ReplyBatch;
   CallState* CreateCallState();
-  void HandleIncomingCall(CallState** call);  // May send call to bg worker pool
-  void ProcessCall(CallState* call);
+  Status OpenSocket(struct sockaddr_in* addr, int* result);
+  // May send call to bg worker pool
+  void HandleIncomingCall(CallState** call, ReplyBatch* batch);
+  void ProcessCall(CallState* call, ReplyBatch* batch);
   static void ProcessCallWrapper(void* arg);
+  void SendReply(CallState* call, uint32_t type, const rpc::If::Message& out,
+                 size_t first);
+  void Dispatch(CallState** call, ReplyBatch* batch);
+  bool IsBusy();
+  void Finish(CallEntry* entry, const rpc::If::Message* out);
+  void Remove(CallEntry* entry);
+  void Sweep(CallShard* shard, uint64_t now);
+  Status BGLoopBatched(int myid, int fd);  // Batched receives using recvmmsg
   virtual Status BGLoop(int myid);
   const size_t max_msgsz_;  // Buffer size for incoming rpc messages
+  const size_t max_frags_;  // Max number of fragments of a request
+  // Requests we have seen, keyed by caller addresses and request ids. Calls are
+  // spread over shards by the hash of their caller addresses so that datagrams
+  // from different callers do not contend for a single lock.
+  enum { kCallShards = 16 };
+  struct CallShard {
+    CallShard() : assembling_bytes(0) {}
+    port::Mutex mu;
+    // State below protected by mu
+    std::map<std::string, CallEntry*> calls;
+    std::list<CallEntry*> assembling;  // Partially received requests
+    size_t assembling_bytes;           // Total bytes of assembling requests
+    std::deque<CallEntry*> done;       // Remembered replies, oldest first
+  };
+  CallShard shards_[kCallShards];
   // State below protected by mutex_
+  // Sockets opened for bg threads other than the first one. Only used when
+  // options_.udp_srv_reuseport is set.
+  std::vector<int> extra_fds_;
   int bg_count_;  // Total number of bg work items pending
 };
 
-// UDP client.
+// UDP client. Asynchronous calls are progressed by a background thread that
+// is started at the first such call. The thread receives replies, resends
+// requests whose replies are late, and invokes callbacks.
 class PosixUDPCli : public rpc::If {
  public:
-  PosixUDPCli(uint64_t timeout, size_t max_msgsz);
+  PosixUDPCli(Env* env, uint64_t timeout, uint64_t retransmit_timeout,
+              size_t max_msgsz, size_t max_reqsz, int max_outstanding_calls);
   virtual ~PosixUDPCli();
 
-  // Each call results in 1 UDP send and 1 UDP receive.
+  // Each call results in 1 UDP send and 1 UDP receive unless messages have to
+  // be fragmented, lost datagrams have to be retransmitted, or the server
+  // asks us to back off. Not thread-safe. Once the stub has been used for
+  // asynchronous calls, synchronous calls are sent asynchronously and waited
+  // for so that their replies are not taken by the background thread.
   virtual Status Call(Message& in, Message& out) RPCNOEXCEPT;
+  // May be invoked by multiple threads concurrently.
+  virtual void AsyncCall(Message& in, Message& out, Callback cb,
+                         void* arg) RPCNOEXCEPT;
   // If we fail to open, error status will be set and the next Call()
   // operation will return it.
   void Open(const std::string& uri);
 
  private:
+  struct AsyncState;
   // No copying allowed
   void operator=(const PosixUDPCli&);
   PosixUDPCli(const PosixUDPCli& other);
-  const uint64_t rpc_timeout_;  // In microseconds
-  const size_t max_msgsz_;
+  Status Send(uint32_t reqid, const Message& in, size_t first);
+  Status WaitForAsyncCall(Message& in, Message& out);
+  bool HandleReply(const char* data, size_t n, std::string* buf,
+                   std::vector<AsyncState*>* done);
+  uint64_t CheckTimers(uint64_t now, std::vector<AsyncState*>* done);
+  void Complete(const std::vector<AsyncState*>& done);
+  static void BGLoopWrapper(void* arg);
+  void BGLoop();
+  Env* const env_;
+  const uint64_t rpc_timeout_;         // In microseconds
+  const uint64_t retransmit_timeout_;  // In microseconds
+  const size_t max_msgsz_;             // Max size of reply datagrams
+  const size_t max_reqsz_;             // Max size of request datagrams
+  rpc::AsyncCallWindow window_;
   Status status_;
+  port::Mutex mutex_;
+  port::CondVar bg_cv_;
+  // State below protected by mutex_
+  std::map<uint32_t, AsyncState*> calls_;  // Outstanding asynchronous calls
+  bool bg_started_;
+  bool bg_running_;
+  bool shutting_down_;
+  uint32_t next_reqid_;
+  Random rnd_;
   int fd_;
 };
 
@@ -13,6 +13,7 @@
 #include "posix/posix_rpc.h"
 
 #include "pdlfs-common/env.h"
+#include "pdlfs-common/mutexlock.h"
 #include "pdlfs-common/pdlfs_config.h"
 
 #include <assert.h>
@@ -38,11 +39,21 @@ RPCOptions::RPCOptions()
       env(NULL),
       info_log(NULL),
       fs(NULL),
+      max_outstanding_calls(64),
+      max_msgsz(64 << 20),
       addr_cache_size(128),
       udp_max_unexpected_msgsz(1432),
       udp_max_expected_msgsz(1432),
       udp_srv_rcvbuf(-1),
-      udp_srv_sndbuf(-1) {}
+      udp_srv_sndbuf(-1),
+      udp_srv_batch_size(1),
+      udp_srv_reuseport(false),
+      udp_max_pending_calls(0),
+      udp_retransmit_timeout(500000),
+      udp_max_reassembly_bytes(64 << 20),
+      udp_reply_cache_size(4096),
+      tcp_persistent_conns(false),
+      tcp_conns_per_stub(1) {}
 
 int RPC::GetPort() { return -1; }
 
@@ -117,6 +128,61 @@ namespace rpc {
 
 If::~If() {}
 
+void If::AsyncCall(Message& in, Message& out, Callback cb,
+                   void* arg) RPCNOEXCEPT {
+  Status status = Call(in, out);
+  cb(status, arg);
+}
+
+void AsyncCallWindow::Enter() {
+  MutexLock ml(&mu_);
+  while (size_ > 0 && n_ >= size_) {
+    cv_.Wait();
+  }
+  n_++;
+}
+
+void AsyncCallWindow::Leave() {
+  MutexLock ml(&mu_);
+  assert(n_ > 0);
+  n_--;
+  cv_.SignalAll();
+}
+
+void AsyncCallWindow::Drain() {
+  MutexLock ml(&mu_);
+  while (n_ != 0) {
+    cv_.Wait();
+  }
+}
+
+void If::Message::AddChunk(const Slice& chunk) {
+  assert(nchunks < kMaxChunks);
+  chunks[nchunks++] = chunk;
+}
+
+size_t If::Message::size() const {
+  size_t result = contents.size();
+  for (int i = 0; i < nchunks; i++) {
+    result += chunks[i].size();
+  }
+  return result;
+}
+
+void If::Message::Flatten() {
+  if (nchunks != 0) {
+    std::string tmp;
+    tmp.reserve(size());
+    tmp.append(contents.data(), contents.size());
+    for (int i = 0; i < nchunks; i++) {
+      tmp.append(chunks[i].data(), chunks[i].size());
+    }
+    extra_buf.swap(tmp);
+    contents = extra_buf;
+    nchunks = 0;
+  }
+}
+
 namespace {
 #if defined(PDLFS_MARGO_RPC)
 class MargoRPCImpl : public RPC {
@@ -10,6 +10,7 @@
  */
 #include "pdlfs-common/rpc.h"
 
+#include "pdlfs-common/mutexlock.h"
 #include "pdlfs-common/port.h"
 #include "pdlfs-common/testharness.h"
 
@@ -20,7 +21,7 @@ namespace pdlfs {
 
 class RPCTest : public rpc::If {
  public:
-  RPCTest() {}
+  RPCTest() : max_msgsz_(RPCOptions().max_msgsz) {}
 
   virtual Status Call(Message& in, Message& out) RPCNOEXCEPT {
     out.extra_buf.assign(in.contents.data(), in.contents.size());
@@ -29,14 +30,20 @@ class RPCTest : public rpc::If {
   }
 
   RPC* Open(const std::string& uri, int num_rpc_threads = 1,
-            ThreadPool* extra_worker = NULL) {
+            ThreadPool* extra_worker = NULL, bool tcp_persistent = false) {
     RPCOptions options;
     options.num_rpc_threads = num_rpc_threads;
     options.extra_workers = extra_worker;
+    options.tcp_persistent_conns = tcp_persistent;
+    options.tcp_conns_per_stub = 2;
+    options.max_outstanding_calls = 16;
+    options.max_msgsz = max_msgsz_;
     options.uri = uri;
     options.fs = this;
     return RPC::Open(options);
   }
+
+  size_t max_msgsz_;
 };
 
 TEST(RPCTest, Addr) {
@@ -93,6 +100,406 @@ TEST(RPCTest, SendAndRecv) {
   delete extra_worker;
 }
 
+// Messages carrying extra chunks arrive as a single contiguous message.
+TEST(RPCTest, SendChunks) {
+  const char* uris[3] = {"udp://127.0.0.1:0", "tcp://127.0.0.1:0",
+                         "tcp://127.0.0.1:0"};
+  for (int i = 0; i < 3; i++) {
+    fprintf(stderr, "Uri: %s%s\n", uris[i], i == 2 ? " (persistent)" : "");
+    RPC* rpc = Open(uris[i], 1, NULL, i == 2);
+    ASSERT_TRUE(rpc != NULL);
+    ASSERT_OK(rpc->Start());
+    SleepForMicroseconds(1000);
+    ASSERT_OK(rpc->status());
+    rpc::If* client = rpc->OpenStubFor(rpc->GetUri());
+    ASSERT_TRUE(client != NULL);
+    // Large UDP messages are fragmented. Keep them small enough to fit in
+    // default socket buffers.
+    std::string big(i == 0 ? 64 << 10 : 300 << 10, 'b');
+    rpc::If::Message in, out;
+    in.contents = Slice("xxyyzz");
+    in.AddChunk(big);
+    in.AddChunk(Slice());
+    in.AddChunk(Slice("end"));
+    ASSERT_EQ(in.size(), 6 + big.size() + 3);
+    ASSERT_OK(client->Call(in, out));
+    ASSERT_TRUE(out.contents == "xxyyzz" + big + "end");
+    ASSERT_EQ(out.nchunks, 0);
+    in.Flatten();
+    ASSERT_EQ(in.nchunks, 0);
+    ASSERT_TRUE(in.contents == out.contents);
+    delete client;
+    ASSERT_OK(rpc->Stop());
+    delete rpc;
+  }
+}
+
+namespace {
+struct CallerState {
+  rpc::If* client;
+  int id;
+  int ncalls;
+  port::Mutex* mu;
+  port::CondVar* cv;
+  int* nrunning;
+  Status status;
+};
+
+void CallerThread(void* arg) {
+  CallerState* const state = reinterpret_cast<CallerState*>(arg);
+  rpc::If::Message in, out;
+  char msg[50];
+  for (int i = 0; i < state->ncalls && state->status.ok(); i++) {
+    snprintf(msg, sizeof(msg), "caller%d-%d", state->id, i);
+    in.contents = Slice(msg);
+    state->status = state->client->Call(in, out);
+    if (state->status.ok() && out.contents != in.contents) {
+      state->status = Status::Corruption("Reply mismatch", msg);
+    }
+  }
+  MutexLock ml(state->mu);
+  --*state->nrunning;
+  state->cv->SignalAll();
+}
+}  // namespace
+
+// Tcp messages larger than the max message size are rejected. Calls made after
+// that still succeed.
+TEST(RPCTest, TcpMaxMsgSize) {
+  max_msgsz_ = 4096;
+  for (int i = 0; i < 2; i++) {
+    fprintf(stderr, "Uri: tcp://127.0.0.1:0%s\n",
+            i == 1 ? " (persistent)" : "");
+    RPC* rpc = Open("tcp://127.0.0.1:0", 1, NULL, i == 1);
+    ASSERT_TRUE(rpc != NULL);
+    ASSERT_OK(rpc->Start());
+    SleepForMicroseconds(1000);
+    rpc::If* client = rpc->OpenStubFor(rpc->GetUri());
+    const size_t sizes[] = {1000, 10000, 1000};
+    for (int j = 0; j < 3; j++) {
+      std::string msg(sizes[j], 'x');
+      rpc::If::Message in, out;
+      in.contents = msg;
+      Status s = client->Call(in, out);
+      if (sizes[j] <= max_msgsz_) {
+        ASSERT_OK(s);
+        ASSERT_TRUE(out.contents == in.contents);
+      } else {
+        ASSERT_TRUE(!s.ok() || out.contents != in.contents);
+      }
+    }
+    delete client;
+    ASSERT_OK(rpc->Stop());
+    delete rpc;
+  }
+}
+
+// Multiple callers share a single stub. Their calls are multiplexed over the
+// pooled connections of the stub.
+TEST(RPCTest, PersistentTcpConns) {
+  ThreadPool* extra_worker = ThreadPool::NewFixed(2, true);
+  const char* uri = "tcp://127.0.0.1:0";
+  for (int j = 0; j < 2; j++) {
+    RPC* rpc;
+    if (j == 0) {
+      fprintf(stderr, "Uri: %s (no extra workers)\n", uri);
+      rpc = Open(uri, 2, NULL, true);
+    } else {
+      fprintf(stderr, "Uri: %s\n", uri);
+      rpc = Open(uri, 2, extra_worker, true);
+    }
+    ASSERT_TRUE(rpc != NULL);
+    ASSERT_OK(rpc->Start());
+    SleepForMicroseconds(1000);
+    ASSERT_OK(rpc->status());
+    rpc::If* client = rpc->OpenStubFor(rpc->GetUri());
+    ASSERT_TRUE(client != NULL);
+    port::Mutex mu;
+    port::CondVar cv(&mu);
+    const int n = 4;
+    int nrunning = n;
+    CallerState states[n];
+    for (int i = 0; i < n; i++) {
+      states[i].client = client;
+      states[i].id = i;
+      states[i].ncalls = 1000;
+      states[i].mu = &mu;
+      states[i].cv = &cv;
+      states[i].nrunning = &nrunning;
+      Env::Default()->StartThread(CallerThread, &states[i]);
+    }
+    mu.Lock();
+    while (nrunning != 0) {
+      cv.Wait();
+    }
+    mu.Unlock();
+    for (int i = 0; i < n; i++) {
+      ASSERT_OK(states[i].status);
+    }
+    delete client;
+    ASSERT_OK(rpc->Stop());
+    delete rpc;
+  }
+  delete extra_worker;
+}
+
+namespace {
+// Outstanding asynchronous calls issued by a single thread.
+struct AsyncCalls {
+  AsyncCalls() : cv(&mu), ndone(0) {}
+
+  struct Call {
+    AsyncCalls* parent;
+    rpc::If::Message in, out;
+    char msg[50];
+    Status status;
+    bool done;
+  };
+
+  static void Done(const Status& status, void* arg) {
+    Call* const call = reinterpret_cast<Call*>(arg);
+    MutexLock ml(&call->parent->mu);
+    call->status = status;
+    call->done = true;
+    call->parent->ndone++;
+    call->parent->cv.SignalAll();
+  }
+
+  port::Mutex mu;
+  port::CondVar cv;
+  int ndone;
+};
+
+// Start n calls without waiting for any of them and then wait for all.
+// Synchronous calls are mixed in through the same stub.
+Status RunAsyncCalls(rpc::If* client, int n) {
+  AsyncCalls calls;
+  AsyncCalls::Call* const c = new AsyncCalls::Call[n];
+  Status s;
+  int i = 0;
+  for (; i < n && s.ok(); i++) {
+    c[i].parent = &calls;
+    c[i].done = false;
+    snprintf(c[i].msg, sizeof(c[i].msg), "async%d", i);
+    c[i].in.contents = Slice(c[i].msg);
+    client->AsyncCall(c[i].in, c[i].out, AsyncCalls::Done, &c[i]);
+    if (i % 50 == 0) {
+      rpc::If::Message in, out;
+      in.contents = Slice("sync");
+      s = client->Call(in, out);
+      if (s.ok() && out.contents != in.contents) {
+        s = Status::Corruption("Reply mismatch", "sync");
+      }
+    }
+  }
+  MutexLock ml(&calls.mu);
+  while (calls.ndone != i) {
+    calls.cv.Wait();
+  }
+  for (int j = 0; j < i && s.ok(); j++) {
+    s = c[j].status;
+    if (s.ok() && c[j].out.contents != c[j].in.contents) {
+      s = Status::Corruption("Reply mismatch", c[j].msg);
+    }
+  }
+  delete[] c;
+  return s;
+}
+}  // namespace
+
+// Many asynchronous calls are kept in flight through a single stub.
+TEST(RPCTest, AsyncCalls) {
+  const char* uris[3] = {"udp://127.0.0.1:0", "tcp://127.0.0.1:0",
+                         "tcp://127.0.0.1:0"};
+  for (int i = 0; i < 3; i++) {
+    fprintf(stderr, "Uri: %s%s\n", uris[i], i == 2 ? " (persistent)" : "");
+    RPC* rpc = Open(uris[i], 2, NULL, i == 2);
+    ASSERT_TRUE(rpc != NULL);
+    ASSERT_OK(rpc->Start());
+    SleepForMicroseconds(1000);
+    ASSERT_OK(rpc->status());
+    rpc::If* client = rpc->OpenStubFor(rpc->GetUri());
+    ASSERT_TRUE(client != NULL);
+    ASSERT_OK(RunAsyncCalls(client, 1000));
+    delete client;
+    ASSERT_OK(rpc->Stop());
+    delete rpc;
+  }
+}
+
+// A slow UDP server that counts the calls it executes.
+class UDPTest : public rpc::If {
+ public:
+  UDPTest() : ncalls_(0), delay_(0) {}
+
+  virtual Status Call(Message& in, Message& out) RPCNOEXCEPT {
+    if (delay_ != 0) {
+      SleepForMicroseconds(delay_);
+    }
+    MutexLock ml(&mu_);
+    ncalls_++;
+    out.extra_buf.assign(in.contents.data(), in.contents.size());
+    out.contents = out.extra_buf;
+    return Status::OK();
+  }
+
+  RPC* Open(ThreadPool* extra_workers, int max_pending_calls) {
+    options_.uri = "udp://127.0.0.1:0";
+    options_.extra_workers = extra_workers;
+    options_.udp_max_pending_calls = max_pending_calls;
+    options_.udp_retransmit_timeout = 1000;
+    options_.fs = this;
+    return RPC::Open(options_);
+  }
+
+  RPCOptions options_;
+  port::Mutex mu_;
+  int ncalls_;
+  int delay_;
+};
+
+// Requests retransmitted while the original is still being processed are not
+// executed again.
+TEST(UDPTest, Retransmission) {
+  delay_ = 50000;
+  RPC* rpc = Open(NULL, 0);
+  ASSERT_OK(rpc->Start());
+  SleepForMicroseconds(1000);
+  rpc::If* client = rpc->OpenStubFor(rpc->GetUri());
+  for (int i = 0; i < 3; i++) {
+    rpc::If::Message in, out;
+    in.contents = Slice("xxyyzz");
+    ASSERT_OK(client->Call(in, out));
+    ASSERT_TRUE(out.contents == in.contents);
+  }
+  ASSERT_EQ(ncalls_, 3);
+  delete client;
+  ASSERT_OK(rpc->Stop());
+  delete rpc;
+}
+
+// Requests larger than the max message size are dropped by the server. Calls
+// still work without a reply cache, though retransmitted requests may then be
+// executed again.
+TEST(UDPTest, MaxMsgSize) {
+  options_.rpc_timeout = 200000;
+  options_.max_msgsz = 4096;
+  options_.udp_reply_cache_size = 0;
+  RPC* rpc = Open(NULL, 0);
+  ASSERT_OK(rpc->Start());
+  SleepForMicroseconds(1000);
+  rpc::If* client = rpc->OpenStubFor(rpc->GetUri());
+  const size_t sizes[] = {10, 3000, 4096, 10000};
+  for (int i = 0; i < 4; i++) {
+    std::string msg(sizes[i], 'x');
+    rpc::If::Message in, out;
+    in.contents = msg;
+    Status s = client->Call(in, out);
+    if (sizes[i] <= 4096) {
+      ASSERT_OK(s);
+      ASSERT_TRUE(out.contents == in.contents);
+    } else {
+      ASSERT_TRUE(!s.ok());
+    }
+  }
+  ASSERT_TRUE(ncalls_ >= 3);
+  delete client;
+  ASSERT_OK(rpc->Stop());
+  delete rpc;
+}
+
+// Asynchronous calls are retransmitted by the stub's background thread and
+// are still executed once.
+TEST(UDPTest, AsyncRetransmission) {
+  delay_ = 5000;
+  RPC* rpc = Open(NULL, 0);
+  ASSERT_OK(rpc->Start());
+  SleepForMicroseconds(1000);
+  rpc::If* client = rpc->OpenStubFor(rpc->GetUri());
+  ASSERT_OK(RunAsyncCalls(client, 100));
+  ASSERT_EQ(ncalls_, 100 + 2);  // Including synchronous calls
+  delete client;
+  ASSERT_OK(rpc->Stop());
+  delete rpc;
+}
+
+// Callers rejected by an overloaded server back off and eventually succeed.
+TEST(UDPTest, Busy) {
+  ThreadPool* extra_workers = ThreadPool::NewFixed(1, true);
+  delay_ = 2000;
+  RPC* rpc = Open(extra_workers, 1);
+  ASSERT_OK(rpc->Start());
+  SleepForMicroseconds(1000);
+  port::Mutex mu;
+  port::CondVar cv(&mu);
+  const int n = 8;
+  int nrunning = n;
+  CallerState states[n];
+  rpc::If* clients[n];
+  for (int i = 0; i < n; i++) {
+    clients[i] = rpc->OpenStubFor(rpc->GetUri());
+    states[i].client = clients[i];
+    states[i].id = i;
+    states[i].ncalls = 20;
+    states[i].mu = &mu;
+    states[i].cv = &cv;
+    states[i].nrunning = &nrunning;
+    Env::Default()->StartThread(CallerThread, &states[i]);
+  }
+  mu.Lock();
+  while (nrunning != 0) {
+    cv.Wait();
+  }
+  mu.Unlock();
+  for (int i = 0; i < n; i++) {
+    ASSERT_OK(states[i].status);
+    delete clients[i];
+  }
+  ASSERT_EQ(ncalls_, n * 20);
+  ASSERT_OK(rpc->Stop());
+  delete rpc;
+  delete extra_workers;
+}
+
+// Datagrams received in batches by multiple threads, each with its own socket.
+TEST(UDPTest, BatchedIO) {
+  options_.num_rpc_threads = 2;
+  options_.udp_srv_batch_size = 16;
+  options_.udp_srv_reuseport = true;
+  RPC* rpc = Open(NULL, 0);
+  ASSERT_OK(rpc->Start());
+  SleepForMicroseconds(1000);
+  port::Mutex mu;
+  port::CondVar cv(&mu);
+  const int n = 8;
+  int nrunning = n;
+  CallerState states[n];
+  rpc::If* clients[n];
+  for (int i = 0; i < n; i++) {
+    clients[i] = rpc->OpenStubFor(rpc->GetUri());
+    states[i].client = clients[i];
+    states[i].id = i;
+    states[i].ncalls = 1000;
+    states[i].mu = &mu;
+    states[i].cv = &cv;
+    states[i].nrunning = &nrunning;
+    Env::Default()->StartThread(CallerThread, &states[i]);
+  }
+  mu.Lock();
+  while (nrunning != 0) {
+    cv.Wait();
+  }
+  mu.Unlock();
+  for (int i = 0; i < n; i++) {
+    ASSERT_OK(states[i].status);
+    delete clients[i];
+  }
+  ASSERT_EQ(ncalls_, n * 1000);
+  ASSERT_OK(rpc->Stop());
+  fprintf(stderr, "%s", rpc->GetUsageInfo().c_str());
+  delete rpc;
+}
+
 namespace {
 int GetOptionFromEnv(const char* key, int def) {
   const char* env = getenv(key);
@@ -113,6 +520,7 @@ int GetOption(const char* key, int def) {
 class RPCBench {
  public:
   RPCBench(rpc::Mode mode, const char* uri) : rpc_(NULL) {
+    options_.tcp_persistent_conns = GetOption("RPC_TCP_PERSISTENT", 0);
     options_.mode = mode;
     options_.uri = uri;
   }
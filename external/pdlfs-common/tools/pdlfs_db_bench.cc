@@ -10,8 +10,9 @@
 #include "pdlfs-common/crc32c.h"
 #include "pdlfs-common/env.h"
 #include "pdlfs-common/histogram.h"
-#include "pdlfs-common/leveldb/db/db.h"
-#include "pdlfs-common/leveldb/db/write_batch.h"
+#include "pdlfs-common/leveldb/db.h"
+#include "pdlfs-common/leveldb/filter_policy.h"
+#include "pdlfs-common/leveldb/write_batch.h"
 #include "pdlfs-common/mutexlock.h"
 #include "pdlfs-common/pdlfs_config.h"
 #include "pdlfs-common/port.h"
@@ -110,6 +111,18 @@ static bool FLAGS_use_existing_db = false;
 // If true, reuse existing log/MANIFEST files when re-opening a database.
 static bool FLAGS_reuse_logs = false;
 
+// If true, overlap write-ahead logging with memtable insertion.
+static bool FLAGS_pipelined_write = false;
+
+// If true, allow multiple threads to insert into a memtable at once.
+static bool FLAGS_concurrent_memtable = false;
+
+// Number of hash buckets for indexing memtable entries (0 for no index).
+static int FLAGS_memtable_hash_buckets = 0;
+
+// If true, write table indexes as entropy-coded tries.
+static bool FLAGS_ect_index = false;
+
 // Use the db with the following name.
 static const char* FLAGS_db = NULL;
 
@@ -194,7 +207,7 @@ class Stats {
     done_ = 0;
     bytes_ = 0;
     seconds_ = 0;
-    start_ = g_env->NowMicros();
+    start_ = CurrentMicros();
     finish_ = start_;
     message_.clear();
   }
@@ -212,7 +225,7 @@ class Stats {
   }
 
   void Stop() {
-    finish_ = g_env->NowMicros();
+    finish_ = CurrentMicros();
     seconds_ = (finish_ - start_) * 1e-6;
   }
 
@@ -220,7 +233,7 @@ class Stats {
 
   void FinishedSingleOp() {
     if (FLAGS_histogram) {
-      double now = g_env->NowMicros();
+      double now = CurrentMicros();
       double micros = now - last_op_finish_;
       hist_.Add(micros);
       if (micros > 20000) {
@@ -412,7 +425,7 @@ class Benchmark {
     g_env->GetChildren(FLAGS_db, &files);
     for (size_t i = 0; i < files.size(); i++) {
       if (Slice(files[i]).starts_with("heap-")) {
-        g_env->DeleteFile(std::string(FLAGS_db) + "/" + files[i]);
+        g_env->DeleteFile((std::string(FLAGS_db) + "/" + files[i]).c_str());
       }
     }
     if (!FLAGS_use_existing_db) {
@@ -720,6 +733,10 @@ class Benchmark {
 #if 0 /* XXXCDC: not imported into our options yet */
     options.reuse_logs = FLAGS_reuse_logs;
 #endif
+    options.pipelined_write = FLAGS_pipelined_write;
+    options.concurrent_memtable = FLAGS_concurrent_memtable;
+    options.memtable_hash_buckets = FLAGS_memtable_hash_buckets;
+    options.index_type = FLAGS_ect_index ? kEctIndex : kBlockIndex;
     Status s = DB::Open(options, FLAGS_db, &db_);
     if (!s.ok()) {
       fprintf(stderr, "open error: %s\n", s.ToString().c_str());
@@ -973,6 +990,18 @@ int main(int argc, char** argv) {
     } else if (sscanf(argv[i], "--reuse_logs=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       FLAGS_reuse_logs = n;
+    } else if (sscanf(argv[i], "--pipelined_write=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_pipelined_write = n;
+    } else if (sscanf(argv[i], "--concurrent_memtable=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_concurrent_memtable = n;
+    } else if (sscanf(argv[i], "--memtable_hash_buckets=%d%c", &n, &junk) ==
+               1) {
+      FLAGS_memtable_hash_buckets = n;
+    } else if (sscanf(argv[i], "--ect_index=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_ect_index = n;
     } else if (sscanf(argv[i], "--num=%d%c", &n, &junk) == 1) {
       FLAGS_num = n;
     } else if (sscanf(argv[i], "--reads=%d%c", &n, &junk) == 1) {
@@ -112,6 +112,14 @@ int FLAGS_mon_interval = 1;
 // Use udp for rpc communication.
 bool FLAGS_udp = false;
 
+// Use long-lived, length-framed tcp connections instead of opening a new
+// connection for each rpc. Servers must be started with the same setting.
+bool FLAGS_tcp_persistent = false;
+
+// Number of pooled tcp connections per server port when FLAGS_tcp_persistent
+// is set.
+int FLAGS_tcp_conns = 1;
+
 // RPC timeout in seconds.
 int FLAGS_rpc_timeout = 30;
 
@@ -142,7 +150,10 @@ bool FLAGS_bk = false;
 // Combine multiple writes into a single rpc.
 bool FLAGS_batched_writes = false;
 
-// Number of writes per batch.
+// Combine multiple reads into a single rpc.
+bool FLAGS_batched_reads = false;
+
+// Number of writes (or reads) per batch.
 int FLAGS_batch_size = 16;
 
 // Number of files (keys) to operate upon per rank.
@@ -160,6 +171,42 @@ int FLAGS_reads = -1;
 // Number of read steps to run.
 int FLAGS_read_phases = 1;
 
+// Number of directory listing steps to run.
+int FLAGS_listdir_phases = 0;
+
+// Max size of each page of directory entries fetched from a server.
+int FLAGS_readdir_page_size = 32 << 10;
+
+// Number of client threads for talking to different servers in parallel when
+// fetching directory pages and committing batched or bulk creates. Use 0 to
+// contact servers one at a time with the calling thread.
+int FLAGS_cli_threads = 0;
+
+// Look up uncached path components along with the final operation of each
+// call in a single compound rpc. Ignored when servers skip fs checks as they
+// would then execute operations on names they do not own.
+bool FLAGS_compound_lookups = false;
+
+// Have servers resolve as many uncached path components as they own in a
+// single rpc.
+bool FLAGS_server_resolution = false;
+
+// Have servers encode stats in create and lookup replies as deltas against
+// their parent dirs.
+bool FLAGS_compact_replies = true;
+
+// Number of creates or lookups each client keeps in flight when using
+// asynchronous rpc. Use 0 to issue operations one at a time. Ignored for
+// creates when data_size is not 0.
+int FLAGS_async_ops = 0;
+
+// Max number of file lstat results each client caches per directory
+// partition. Use 0 to disable the cache.
+int FLAGS_stat_cache_size = 0;
+
+// Max age of a cached lstat result in microseconds.
+int FLAGS_stat_cache_age = 1000 * 1000;
+
 // Abort on all errors.
 bool FLAGS_abort_on_errors = false;
 
@@ -382,6 +429,7 @@ class Client {
   RPC* rpc_;
   Filesystem* fs_;
   FilesystemDb* fsdb_;
+  ThreadPool* cli_pool_;
 #if defined(PDLFS_RADOS)
   rados::RadosConnMgr* rmgr_;
   Osd* rados_osd_;
@@ -486,6 +534,13 @@ class Client {
     snprintf(timeout, sizeof(timeout), "%d s", FLAGS_rpc_timeout);
     fprintf(stdout, "RPC timeout:        %s\n",
             FLAGS_fs_use_local ? "N/A" : timeout);
+    char tcp_info[100];
+    snprintf(tcp_info, sizeof(tcp_info), "Yes (conns_per_port=%d)",
+             FLAGS_tcp_conns);
+    fprintf(stdout, "RPC tcp persistent: %s\n",
+            FLAGS_fs_use_local || FLAGS_udp
+                ? "N/A"
+                : (FLAGS_tcp_persistent ? tcp_info : "No"));
     fprintf(stdout,
             "Creats:             %d x %d per rank (%d KB data per file)\n",
             FLAGS_writes, FLAGS_write_phases, int(FLAGS_data_size >> 10));
@@ -497,6 +552,23 @@ class Client {
     PrintBkSettings();
     fprintf(stdout, "Lstats:             %d x %d per rank\n", FLAGS_reads,
             FLAGS_read_phases);
+    snprintf(bat_info, sizeof(bat_info), "%d (batch_size=%d)",
+             FLAGS_batched_reads, FLAGS_batch_size);
+    fprintf(stdout, "Batched lstats:     %s\n",
+            FLAGS_batched_reads ? bat_info : "OFF");
+    char ls_info[100];
+    snprintf(ls_info, sizeof(ls_info), "%d (page_size=%d)",
+             FLAGS_listdir_phases, FLAGS_readdir_page_size);
+    fprintf(stdout, "Listdirs:           %s\n",
+            FLAGS_listdir_phases ? ls_info : "OFF");
+    fprintf(stdout, "Client threads:     %d\n", FLAGS_cli_threads);
+    fprintf(stdout, "Compound lookups:   %d\n",
+            FLAGS_compound_lookups && !FLAGS_skip_fs_checks);
+    fprintf(stdout, "Server resolution:  %d\n", FLAGS_server_resolution);
+    fprintf(stdout, "Compact replies:    %d\n", FLAGS_compact_replies);
+    fprintf(stdout, "Async ops:          %d\n", FLAGS_async_ops);
+    fprintf(stdout, "Stat cache:         %d per partition (%d us max age)\n",
+            FLAGS_stat_cache_size, FLAGS_stat_cache_age);
     char mon_info[100];
     snprintf(mon_info, sizeof(mon_info), "%s (every %ds)",
              FLAGS_mon_destination_uri, FLAGS_mon_interval);
@@ -686,6 +758,13 @@ class Client {
     return osd_;
   }
 
+  ThreadPool* OpenCliPool() {
+    if (FLAGS_cli_threads > 0 && !cli_pool_) {
+      cli_pool_ = ThreadPool::NewFixed(FLAGS_cli_threads);
+    }
+    return cli_pool_;
+  }
+
   void OpenLocal() {
     Env* env = OpenEnv();
     if (!FLAGS_env_use_rados) {
@@ -713,11 +792,20 @@ class Client {
     opts.vsrvs = opts.nsrvs = 1;
     opts.srvid = 0;
     fs_ = new Filesystem(opts);
-    fs_->SetDb(fsdb_);
+    s = fs_->SetDb(fsdb_);
+    if (!s.ok()) {
+      fprintf(stderr, "%d: Cannot recover fs: %s\n", FLAGS_rank,
+              s.ToString().c_str());
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 
     FilesystemCliOptions cliopts;
     cliopts.skip_perm_checks = FLAGS_skip_fs_checks;
     cliopts.batch_size = FLAGS_batch_size;
+    cliopts.readdir_page_size = FLAGS_readdir_page_size;
+    cliopts.pool = OpenCliPool();
+    cliopts.per_partition_stat_lru_size = FLAGS_stat_cache_size;
+    cliopts.max_stat_age = FLAGS_stat_cache_age;
     fscli_ = new FilesystemCli(cliopts);
     fscli_->SetLocalFs(fs_);
   }
@@ -727,6 +815,8 @@ class Client {
     rpcopts.rpc_timeout = uint64_t(FLAGS_rpc_timeout) * 1000000;
     rpcopts.mode = rpc::kClientOnly;
     rpcopts.uri = FLAGS_udp ? "udp://-1:-1" : "tcp://-1:-1";
+    rpcopts.tcp_persistent_conns = FLAGS_tcp_persistent;
+    rpcopts.tcp_conns_per_stub = FLAGS_tcp_conns;
     rpc_ = RPC::Open(rpcopts);
     uri_mapper_ = new CompactUriMapper(svr_map_, num_svrs, num_ports_per_svr);
     if (FLAGS_rank == 0 && FLAGS_print_ips) {
@@ -741,6 +831,15 @@ class Client {
     FilesystemCliOptions cliopts;
     cliopts.skip_perm_checks = FLAGS_skip_fs_checks;
     cliopts.batch_size = FLAGS_batch_size;
+    // Servers skipping partition checks never tell us directory indices
+    cliopts.static_partitioning = FLAGS_skip_fs_checks;
+    cliopts.readdir_page_size = FLAGS_readdir_page_size;
+    cliopts.pool = OpenCliPool();
+    cliopts.per_partition_stat_lru_size = FLAGS_stat_cache_size;
+    cliopts.max_stat_age = FLAGS_stat_cache_age;
+    cliopts.compound_lookups = FLAGS_compound_lookups && !FLAGS_skip_fs_checks;
+    cliopts.server_resolution = FLAGS_server_resolution;
+    cliopts.compact_replies = FLAGS_compact_replies;
     fscli_ = new FilesystemCli(cliopts);
     fscli_->RegisterFsSrvUris(rpc_, uri_mapper_, num_svrs, num_ports_per_svr);
   }
@@ -886,6 +985,68 @@ class Client {
     }
   }
 
+  // Results are checked once all operations have completed. All operations
+  // share state->stbuf.
+  void DoAsyncWrites(RankState* const state) {
+    FilesystemCli::ASYNC* as;
+    Status s = fscli_->AsyncInit(&state->ctx, FLAGS_async_ops, &as);
+    if (!s.ok()) {
+      fprintf(stderr, "%d: Cannot start async ops: %s\n", FLAGS_rank,
+              s.ToString().c_str());
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    std::vector<Status> rets(FLAGS_writes);
+    char tmp[30];
+    for (int i = 0; i < FLAGS_writes; i++) {
+      Slice fname = Base64Enc(tmp, Compose(FLAGS_rank, state->fids[i]));
+      state->pathbuf.resize(state->prefix_length);
+      state->pathbuf.append(fname.data(), fname.size());
+      fscli_->AsyncMkfle(as, NULL, state->pathbuf.c_str(), 0644,
+                         &state->stbuf, &rets[i]);
+      state->stats.FinishedSingleOp(FLAGS_writes);
+    }
+    fscli_->Destroy(as);
+    for (int i = 0; i < FLAGS_writes; i++) {
+      if (!rets[i].ok()) {
+        fprintf(stderr, "%d: Fail to mkfle: %s\n", FLAGS_rank,
+                rets[i].ToString().c_str());
+        if (FLAGS_abort_on_errors) {
+          MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+      }
+    }
+  }
+
+  void DoAsyncReads(RankState* const state) {
+    FilesystemCli::ASYNC* as;
+    Status s = fscli_->AsyncInit(&state->ctx, FLAGS_async_ops, &as);
+    if (!s.ok()) {
+      fprintf(stderr, "%d: Cannot start async ops: %s\n", FLAGS_rank,
+              s.ToString().c_str());
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    std::vector<Status> rets(FLAGS_reads);
+    char tmp[30];
+    for (int i = 0; i < FLAGS_reads; i++) {
+      Slice fname = Base64Enc(tmp, Compose(FLAGS_rank, state->fids[i]));
+      state->pathbuf.resize(state->prefix_length);
+      state->pathbuf.append(fname.data(), fname.size());
+      fscli_->AsyncLstat(as, NULL, state->pathbuf.c_str(), &state->stbuf,
+                         &rets[i]);
+      state->stats.FinishedSingleOp(FLAGS_reads);
+    }
+    fscli_->Destroy(as);
+    for (int i = 0; i < FLAGS_reads; i++) {
+      if (!rets[i].ok()) {
+        fprintf(stderr, "%d: Fail to lstat: %s\n", FLAGS_rank,
+                rets[i].ToString().c_str());
+        if (FLAGS_abort_on_errors) {
+          MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+      }
+    }
+  }
+
   void DoReads(RankState* const state) {
     char tmp[30];
     for (int i = 0; i < FLAGS_reads; i++) {
@@ -905,6 +1066,65 @@ class Client {
     }
   }
 
+  void DoBatchedReads(RankState* const state) {
+    const int batch_size = std::max(FLAGS_batch_size, 1);
+    std::vector<std::string> fnames(batch_size);
+    std::vector<const char*> names(batch_size);
+    std::vector<Stat> stats(batch_size);
+    std::vector<Status> rets(batch_size);
+    state->pathbuf.resize(state->prefix_length);
+    char tmp[30];
+    for (int i = 0; i < FLAGS_reads; i += batch_size) {
+      const int n = std::min(batch_size, FLAGS_reads - i);
+      for (int j = 0; j < n; j++) {
+        fnames[j] = Base64Enc(tmp, Compose(FLAGS_rank, state->fids[i + j]))
+                        .ToString();
+        names[j] = fnames[j].c_str();
+      }
+      Status s = fscli_->Lstats(&state->ctx, NULL, state->pathbuf.c_str(),
+                                &names[0], n, &stats[0], &rets[0]);
+      for (int j = 0; j < n; j++) {
+        const Status& r = s.ok() ? rets[j] : s;
+        if (!r.ok()) {
+          fprintf(stderr, "%d: Fail to lstat: %s\n", FLAGS_rank,
+                  r.ToString().c_str());
+          if (FLAGS_abort_on_errors) {
+            MPI_Abort(MPI_COMM_WORLD, 1);
+          }
+        }
+        state->stats.FinishedSingleOp(FLAGS_reads);
+      }
+    }
+  }
+
+  void DoListdir(RankState* const state) {
+    const int total = FLAGS_share_dir ? FLAGS_n * FLAGS_comm_size : FLAGS_n;
+    state->pathbuf.resize(state->prefix_length);
+    FilesystemCli::RDIR* dir = NULL;
+    Status s = fscli_->Opendir(&state->ctx, NULL, state->pathbuf.c_str(), &dir);
+    if (s.ok()) {
+      std::string name;
+      for (;;) {
+        s = fscli_->Readdir(dir, &name, &state->stbuf);
+        if (!s.ok()) {
+          break;
+        }
+        state->stats.FinishedSingleOp(total);
+      }
+      fscli_->Destroy(dir);
+      if (s.IsNotFound()) {
+        s = Status::OK();
+      }
+    }
+    if (!s.ok()) {
+      fprintf(stderr, "%d: Fail to list dir: %s\n", FLAGS_rank,
+              s.ToString().c_str());
+      if (FLAGS_abort_on_errors) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+    }
+  }
+
   static void SleepingBarrier(MPI_Comm comm) {
     MPI_Request req;
     MPI_Ibarrier(comm, &req);
@@ -994,6 +1214,8 @@ class Client {
       RunStep("insert", state, &Client::DoBk);
     } else if (FLAGS_batched_writes) {
       RunStep("insert", state, &Client::DoBatchedWrites);
+    } else if (FLAGS_async_ops && !FLAGS_data_size) {
+      RunStep("insert", state, &Client::DoAsyncWrites);
     } else {
       RunStep("insert", state, &Client::DoWrites);
     }
@@ -1007,10 +1229,35 @@ class Client {
     if (FLAGS_reads == 0) {
       return 0;
     }
-    RunStep("fstats", state, &Client::DoReads);
+    if (FLAGS_batched_reads) {
+      RunStep("fstats", state, &Client::DoBatchedReads);
+    } else if (FLAGS_async_ops) {
+      RunStep("fstats", state, &Client::DoAsyncReads);
+    } else {
+      RunStep("fstats", state, &Client::DoReads);
+    }
     return 1;
   }
 
+  int RunListdir(RankState* state) {
+    RunStep("listdir", state, &Client::DoListdir);
+    return 1;
+  }
+
+  void PrintStatCacheStats() {
+    uint64_t my[2];
+    fscli_->GetStatCacheStats(&my[0], &my[1]);
+    uint64_t sum[2];
+    MPI_Reduce(my, sum, 2, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (FLAGS_rank == 0) {
+      const uint64_t total = sum[0] + sum[1];
+      fprintf(stdout, "Stat cache hits:    %llu / %llu (%.2f%%)\n",
+              static_cast<unsigned long long>(sum[0]),
+              static_cast<unsigned long long>(total),
+              total ? 100.0 * sum[0] / total : 0.0);
+    }
+  }
+
   void Sleep() {
     if (FLAGS_rank == 0)
       fprintf(stdout, "sleeping for %d seconds...\n", FLAGS_step_interval);
@@ -1060,6 +1307,13 @@ class Client {
       int n = RunReads(&state);
       nsteps += n;
     }
+    for (int i = 0; i < FLAGS_listdir_phases; i++) {
+      if (nsteps != 0) {
+        Sleep();
+      }
+      int n = RunListdir(&state);
+      nsteps += n;
+    }
     if (FLAGS_mon_destination_uri) {
       MutexLock ml(&mon_arg.mutex);
       mon_arg.done = true;
@@ -1076,6 +1330,7 @@ class Client {
         rpc_(NULL),
         fs_(NULL),
         fsdb_(NULL),
+        cli_pool_(NULL),
         osd_(NULL) {
 #if defined(PDLFS_RADOS)
     rmgr_ = NULL;
@@ -1087,6 +1342,7 @@ class Client {
   ~Client() {
     delete osd_;
     delete fscli_;
+    delete cli_pool_;
     delete uri_mapper_;
     delete rpc_;
     delete fs_;
@@ -1128,6 +1384,9 @@ class Client {
       OpenLocal();
     }
     RunSteps();
+    if (FLAGS_stat_cache_size) {
+      PrintStatCacheStats();
+    }
     if (fsdb_ && FLAGS_rank == 0) {
       if (FLAGS_dbopts.enable_io_monitoring) {
         fprintf(stdout, "Total random reads: %llu ",
@@ -1226,6 +1485,9 @@ void BM_Main(int* const argc, char*** const argv) {
     } else if (sscanf((*argv)[i], "--batched_writes=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       pdlfs::FLAGS_batched_writes = n;
+    } else if (sscanf((*argv)[i], "--batched_reads=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_batched_reads = n;
     } else if (sscanf((*argv)[i], "--batch_size=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_batch_size = n;
     } else if (sscanf((*argv)[i], "--step_interval=%d%c", &n, &junk) == 1) {
@@ -1243,11 +1505,41 @@ void BM_Main(int* const argc, char*** const argv) {
       pdlfs::FLAGS_reads = n;
     } else if (sscanf((*argv)[i], "--read_phases=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_read_phases = n;
+    } else if (sscanf((*argv)[i], "--listdir_phases=%d%c", &n, &junk) == 1) {
+      pdlfs::FLAGS_listdir_phases = n;
+    } else if (sscanf((*argv)[i], "--readdir_page_size=%d%c", &n, &junk) ==
+               1) {
+      pdlfs::FLAGS_readdir_page_size = n;
+    } else if (sscanf((*argv)[i], "--cli_threads=%d%c", &n, &junk) == 1) {
+      pdlfs::FLAGS_cli_threads = n;
+    } else if (sscanf((*argv)[i], "--async_ops=%d%c", &n, &junk) == 1) {
+      pdlfs::FLAGS_async_ops = n;
+    } else if (sscanf((*argv)[i], "--stat_cache_size=%d%c", &n, &junk) == 1) {
+      pdlfs::FLAGS_stat_cache_size = n;
+    } else if (sscanf((*argv)[i], "--stat_cache_age=%d%c", &n, &junk) == 1) {
+      pdlfs::FLAGS_stat_cache_age = n;
+    } else if (sscanf((*argv)[i], "--compound_lookups=%d%c", &n, &junk) ==
+                   1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_compound_lookups = n;
+    } else if (sscanf((*argv)[i], "--server_resolution=%d%c", &n, &junk) ==
+                   1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_server_resolution = n;
+    } else if (sscanf((*argv)[i], "--compact_replies=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_compact_replies = n;
     } else if (sscanf((*argv)[i], "--rpc_timeout=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_rpc_timeout = n;
     } else if (sscanf((*argv)[i], "--udp=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       pdlfs::FLAGS_udp = n;
+    } else if (sscanf((*argv)[i], "--tcp_persistent=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_tcp_persistent = n;
+    } else if (sscanf((*argv)[i], "--tcp_conns=%d%c", &n, &junk) == 1 &&
+               n > 0) {
+      pdlfs::FLAGS_tcp_conns = n;
     } else if (sscanf((*argv)[i], "--mon_interval=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_mon_interval = n;
     } else if (strncmp((*argv)[i], "--mon_uri=", 10) == 0) {
@@ -33,6 +33,7 @@
  */
 #include "env_wrapper.h"
 #include "fs.h"
+#include "fscom.h"
 #include "fsdb.h"
 #include "fsis.h"
 #include "fsro.h"
@@ -42,6 +43,7 @@
 #include "pdlfs-common/coding.h"
 #include "pdlfs-common/mutexlock.h"
 #include "pdlfs-common/port.h"
+#include "pdlfs-common/rpc.h"
 #include "pdlfs-common/strutil.h"
 
 #include <arpa/inet.h>
@@ -116,6 +118,20 @@ int FLAGS_udp_sndbuf = 512 * 1024;
 // UDP receiver buffer size in bytes.
 int FLAGS_udp_rcvbuf = 512 * 1024;
 
+// Number of UDP datagrams each rpc thread receives per system call.
+int FLAGS_udp_batch = 1;
+
+// Give each rpc thread its own UDP socket using SO_REUSEPORT.
+bool FLAGS_udp_reuseport = false;
+
+// Max number of UDP requests queued for rpc worker threads before new requests
+// are rejected with busy replies. 0 for unlimited.
+int FLAGS_udp_max_pending = 0;
+
+// Use long-lived, length-framed tcp connections. Clients must be started with
+// the same setting.
+bool FLAGS_tcp_persistent = false;
+
 // If a host is configured with 2 or more ip addresses, use the one with the
 // following prefix.
 const char* FLAGS_ip_prefix = "127.0.0.1";
@@ -123,9 +139,13 @@ const char* FLAGS_ip_prefix = "127.0.0.1";
 // Listening port for the information server.
 int FLAGS_info_port = 10086;
 
-// Number of listening ports per rank.
+// Number of listening ports per rank. Each port is a channel of the rank's
+// filesystem server with its own rpc threads and rpc worker threads.
 int FLAGS_ports_per_rank = 1;
 
+// Pin the threads of each channel to an even share of the rank's CPUs.
+bool FLAGS_pin_threads = false;
+
 // Print the ip addresses of all ranks for debugging.
 bool FLAGS_print_ips = false;
 
@@ -150,18 +170,33 @@ int FLAGS_rpc_worker_threads = 0;
 // Number of rpc threads to run.
 int FLAGS_rpc_threads = 1;
 
+// Number of entries a directory partition may hold before it is split and
+// half of it is moved to another rank. Setting to 0 disables splitting, in
+// which case directories are statically partitioned across all ranks.
+size_t FLAGS_split_threshold = 0;
+
+// Max number of entries sent to another rank in a single split call.
+size_t FLAGS_split_batch_size = 1024;
+
 class Server : public FilesystemWrapper {
  private:
   port::Mutex mu_;
   port::AtomicPointer shutting_down_;
   port::CondVar cv_;
   FilesystemInfoServer* infosvr_;
-  std::vector<FilesystemServer*> svrs_;
+  FilesystemServer* svr_;
+  // Port serving directory splits from other ranks
+  FilesystemServer* peer_svr_;
+  std::string split_secret_;
   std::vector<FilesystemReadonlyDb*> readonly_dbs_;
   Cache* table_cache_;
   Cache* block_cache_;
   FilesystemDb* fsdb_;
   Filesystem* fs_;
+  // Peers receiving directory partitions split off by us
+  std::vector<FilesystemIf*> peers_;
+  std::vector<rpc::If*> peer_stubs_;
+  RPC* peer_rpc_;
 #if defined(PDLFS_RADOS)
   rados::RadosConnMgr* mgr_;
   Env* myenv_;
@@ -246,6 +281,8 @@ class Server : public FilesystemWrapper {
             int(FLAGS_table_cache_size));
     fprintf(stdout, "Io monitoring:      %d\n",
             FLAGS_readonly_dbopts.enable_io_monitoring);
+    fprintf(stdout, "Mem filter:         %d (bits per key)\n",
+            int(FLAGS_readonly_dbopts.mem_filter_bits_per_key));
     fprintf(stdout, "Db chain: %s\n", FLAGS_readonly_db_chain);
   }
 
@@ -264,20 +301,27 @@ class Server : public FilesystemWrapper {
     PrintEnvironment();
     PrintWarnings();
     fprintf(stdout, "rpc ip:             %s*\n", FLAGS_ip_prefix);
-    char udp_info[100];
+    char udp_info[150];
     snprintf(udp_info, sizeof(udp_info),
-             "Yes (MAX_MSGSZ=%d, SO_RCVBUF=%dK, SO_SNDBUF=%dK)",
+             "Yes (MAX_MSGSZ=%d, SO_RCVBUF=%dK, SO_SNDBUF=%dK, "
+             "MAX_PENDING=%d, BATCH=%d, REUSEPORT=%d)",
              int(FLAGS_udp_max_msgsz), FLAGS_udp_rcvbuf >> 10,
-             FLAGS_udp_sndbuf >> 10);
+             FLAGS_udp_sndbuf >> 10, FLAGS_udp_max_pending, FLAGS_udp_batch,
+             int(FLAGS_udp_reuseport));
     fprintf(stdout, "rpc use udp:        %s\n", FLAGS_udp ? udp_info : "No");
+    fprintf(stdout, "rpc tcp persistent: %s\n",
+            FLAGS_udp ? "N/A" : (FLAGS_tcp_persistent ? "Yes" : "No"));
     fprintf(stdout, "Num rpc threads:    %d + %d\n", FLAGS_rpc_threads,
             FLAGS_rpc_worker_threads);
     fprintf(stdout, "Num ports per rank: %d\n", FLAGS_ports_per_rank);
+    fprintf(stdout, "Pin threads:        %d\n", FLAGS_pin_threads);
     fprintf(stdout, "Num ranks:          %d\n", FLAGS_comm_size);
     fprintf(stdout, "Fs use existing:    %d (readonly=%d)\n",
             FLAGS_use_existing_fs, FLAGS_use_existing_fs);
     fprintf(stdout, "Fs info port:       %d\n", FLAGS_info_port);
     fprintf(stdout, "Fs skip checks:     %d\n", FLAGS_skip_fs_checks);
+    fprintf(stdout, "Fs split threshold: %d (batch=%d)\n",
+            int(FLAGS_split_threshold), int(FLAGS_split_batch_size));
     fprintf(stdout, "Fs dummy:           %d\n", FLAGS_dummy_svr);
     if (!FLAGS_dummy_svr) PrintSvrSettings();
     fprintf(stdout, "------------------------------------------------\n");
@@ -529,12 +573,74 @@ class Server : public FilesystemWrapper {
             FLAGS_skip_fs_checks;
     opts.vsrvs = opts.nsrvs = FLAGS_comm_size;
     opts.mydno = opts.srvid = FLAGS_rank;
+    opts.split_threshold = FLAGS_split_threshold;
+    opts.split_batch_size = FLAGS_split_batch_size;
+    opts.split_secret = split_secret_;
     fs_ = new Filesystem(opts);
     fs_->SetReadonlyDbs(readonly_dbs_.data(), readonly_dbs_.size());
-    fs_->SetDb(fsdb_);
+    Status s = fs_->SetDb(fsdb_);
+    if (!s.ok()) {
+      fprintf(stderr, "%d: Cannot recover fs: %s\n", FLAGS_rank,
+              s.ToString().c_str());
+      MPI_Finalize();
+      exit(1);
+    }
     return fs_;
   }
 
+  // Rank 0 draws a random secret and shares it with all other ranks so that
+  // only our own ranks may split directories to us.
+  void ShareSplitSecret() {
+    char secret[16];
+    if (FLAGS_rank == 0) {
+      FILE* const f = fopen("/dev/urandom", "r");
+      const bool ok = f != NULL && fread(secret, 1, sizeof(secret), f) ==
+                                       sizeof(secret);
+      if (f != NULL) fclose(f);
+      if (!ok) {
+        fprintf(stderr, "%d: Cannot generate split secret\n", FLAGS_rank);
+        MPI_Finalize();
+        exit(1);
+      }
+    }
+    MPI_Bcast(secret, sizeof(secret), MPI_CHAR, 0, MPI_COMM_WORLD);
+    split_secret_.assign(secret, sizeof(secret));
+  }
+
+  // Connect to the peer port of every other rank so that directory partitions
+  // can be split off to them. ports[i] and ips[i] are the peer port and the ip
+  // of rank i.
+  void OpenPeers(const std::vector<unsigned short>& ports,
+                 const std::vector<unsigned>& ips) {
+    RPCOptions rpcopts;
+    rpcopts.mode = rpc::kClientOnly;
+    rpcopts.uri = FLAGS_udp ? "udp://-1:-1" : "tcp://-1:-1";
+    rpcopts.tcp_persistent_conns = FLAGS_tcp_persistent;
+    peer_rpc_ = RPC::Open(rpcopts);
+    Status s = peer_rpc_->status();
+    if (!s.ok()) {
+      fprintf(stderr, "%d: Cannot open peer rpc: %s\n", FLAGS_rank,
+              s.ToString().c_str());
+      MPI_Finalize();
+      exit(1);
+    }
+    peers_.resize(FLAGS_comm_size, NULL);
+    for (int i = 0; i < FLAGS_comm_size; i++) {
+      if (i == FLAGS_rank) {
+        continue;
+      }
+      char uri[50];
+      struct in_addr tmp_addr;
+      tmp_addr.s_addr = ips[i];
+      snprintf(uri, sizeof(uri), "%s://%s:%hu", FLAGS_udp ? "udp" : "tcp",
+               inet_ntoa(tmp_addr), ports[i]);
+      rpc::If* const stub = peer_rpc_->OpenStubFor(uri);
+      peer_stubs_.push_back(stub);
+      peers_[i] = new FilesystemPeer(stub);
+    }
+    fs_->SetPeers(&peers_[0], peers_.size());
+  }
+
   static FilesystemInfoServer* OpenInfoPort(const char* ip) {
     FilesystemInfoServerOptions infosvropts;
     infosvropts.num_rpc_threads = 1;
@@ -552,6 +658,28 @@ class Server : public FilesystemWrapper {
     return infosvr;
   }
 
+  // Split calls from other ranks are served at a separate port with its own rpc
+  // thread so that they are never stuck behind client calls.
+  static FilesystemServer* OpenPeerPort(const char* ip,
+                                        FilesystemIf* const fs) {
+    FilesystemServerOptions svropts;
+    svropts.uri = FLAGS_udp ? "udp://" : "tcp://";
+    svropts.uri += ip;
+    svropts.udp_max_incoming_msgsz = FLAGS_udp_max_msgsz;
+    svropts.tcp_persistent_conns = FLAGS_tcp_persistent;
+    svropts.peer_port = true;
+    FilesystemServer* const rpcsvr = new FilesystemServer(svropts);
+    rpcsvr->SetFs(fs);
+    Status s = rpcsvr->OpenServer();
+    if (!s.ok()) {
+      fprintf(stderr, "%d: Cannot open peer port: %s\n", FLAGS_rank,
+              s.ToString().c_str());
+      MPI_Finalize();
+      exit(1);
+    }
+    return rpcsvr;
+  }
+
   static FilesystemServer* OpenPort(const char* ip, FilesystemIf* const fs) {
     FilesystemServerOptions svropts;
     svropts.num_rpc_worker_threads = FLAGS_rpc_worker_threads;
@@ -561,6 +689,12 @@ class Server : public FilesystemWrapper {
     svropts.udp_max_incoming_msgsz = FLAGS_udp_max_msgsz;
     svropts.udp_rcvbuf = FLAGS_udp_rcvbuf;
     svropts.udp_sndbuf = FLAGS_udp_sndbuf;
+    svropts.udp_max_pending_calls = FLAGS_udp_max_pending;
+    svropts.udp_batch_size = FLAGS_udp_batch;
+    svropts.udp_reuseport = FLAGS_udp_reuseport;
+    svropts.tcp_persistent_conns = FLAGS_tcp_persistent;
+    svropts.num_channels = FLAGS_ports_per_rank;
+    svropts.pin_threads = FLAGS_pin_threads;
     FilesystemServer* const rpcsvr = new FilesystemServer(svropts);
     rpcsvr->SetFs(fs);
     Status s = rpcsvr->OpenServer();
@@ -578,10 +712,13 @@ class Server : public FilesystemWrapper {
       : shutting_down_(NULL),
         cv_(&mu_),
         infosvr_(NULL),
+        svr_(NULL),
+        peer_svr_(NULL),
         table_cache_(NULL),
         block_cache_(NULL),
         fsdb_(NULL),
-        fs_(NULL) {
+        fs_(NULL),
+        peer_rpc_(NULL) {
 #if defined(PDLFS_RADOS)
     mgr_ = NULL;
     myenv_ = NULL;
@@ -590,10 +727,16 @@ class Server : public FilesystemWrapper {
 
   ~Server() {
     delete infosvr_;
-    for (size_t i = 0; i < svrs_.size(); i++) {
-      delete svrs_[i];
-    }
+    delete svr_;
+    delete peer_svr_;
     delete fs_;
+    for (size_t i = 0; i < peers_.size(); i++) {
+      delete peers_[i];
+    }
+    for (size_t i = 0; i < peer_stubs_.size(); i++) {
+      delete peer_stubs_[i];
+    }
+    delete peer_rpc_;
     delete fsdb_;
     for (size_t i = 0; i < readonly_dbs_.size(); i++) {
       delete readonly_dbs_[i];
@@ -644,16 +787,22 @@ class Server : public FilesystemWrapper {
     if (FLAGS_rank == 0) {
       PrintHeader();
     }
+    const bool split = !FLAGS_dummy_svr && FLAGS_split_threshold != 0;
+    if (split) {
+      ShareSplitSecret();
+    }
     FilesystemIf* const fs = FLAGS_dummy_svr ? this : OpenFilesystem();
     char ip_str[INET_ADDRSTRLEN];
     memset(ip_str, 0, sizeof(ip_str));
     unsigned myip = inet_addr(PickAddr(ip_str));
     int np = FLAGS_ports_per_rank;
     std::vector<unsigned short> myports;
+    svr_ = OpenPort(ip_str, fs);
     for (int i = 0; i < np; i++) {
-      FilesystemServer* const svr = OpenPort(ip_str, fs);
-      myports.push_back(svr->GetPort());
-      svrs_.push_back(svr);
+      myports.push_back(svr_->GetPort(i));
+    }
+    if (split) {
+      peer_svr_ = OpenPeerPort(ip_str, fs);
     }
     MPI_Barrier(MPI_COMM_WORLD);
     // A svr map consists of a port map, an ip map, and a footer specifying the
@@ -691,6 +840,19 @@ class Server : public FilesystemWrapper {
           fflush(stdout);
         }
       }
+    }
+    // Every rank needs the peer ports of the ranks it splits directories to
+    if (split) {
+      unsigned short peer_port = peer_svr_->GetPort();
+      std::vector<unsigned short> peer_ports(FLAGS_comm_size);
+      std::vector<unsigned> peer_ips(FLAGS_comm_size);
+      MPI_Allgather(&peer_port, 1, MPI_UNSIGNED_SHORT, &peer_ports[0], 1,
+                    MPI_UNSIGNED_SHORT, MPI_COMM_WORLD);
+      MPI_Allgather(&myip, 1, MPI_UNSIGNED, &peer_ips[0], 1, MPI_UNSIGNED,
+                    MPI_COMM_WORLD);
+      OpenPeers(peer_ports, peer_ips);
+    }
+    if (FLAGS_rank == 0) {
       puts("Running...");
     }
     MutexLock ml(&mu_);
@@ -700,8 +862,9 @@ class Server : public FilesystemWrapper {
     if (FLAGS_rank == 0) {
       infosvr_->Close();
     }
-    for (int i = 0; i < FLAGS_ports_per_rank; i++) {
-      svrs_[i]->Close();
+    svr_->Close();
+    if (peer_svr_) {
+      peer_svr_->Close();
     }
     MPI_Barrier(MPI_COMM_WORLD);
     if (fsdb_) {
@@ -786,8 +949,17 @@ void BM_Main(int* const argc, char*** const argv) {
       pdlfs::FLAGS_rpc_threads = n;
     } else if (sscanf((*argv)[i], "--ports_per_rank=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_ports_per_rank = n;
+    } else if (sscanf((*argv)[i], "--pin_threads=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_pin_threads = n;
     } else if (sscanf((*argv)[i], "--print_ips=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_print_ips = n;
+    } else if (sscanf((*argv)[i], "--split_threshold=%d%c", &n, &junk) == 1 &&
+               n >= 0) {
+      pdlfs::FLAGS_split_threshold = n;
+    } else if (sscanf((*argv)[i], "--split_batch_size=%d%c", &n, &junk) == 1 &&
+               n > 0) {
+      pdlfs::FLAGS_split_batch_size = n;
     } else if (sscanf((*argv)[i], "--dummy_svr=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       pdlfs::FLAGS_dummy_svr = n;
@@ -823,9 +995,20 @@ void BM_Main(int* const argc, char*** const argv) {
       pdlfs::FLAGS_udp_rcvbuf = n << 10;
     } else if (sscanf((*argv)[i], "--udp_max_msgsz=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_udp_max_msgsz = n;
+    } else if (sscanf((*argv)[i], "--udp_max_pending=%d%c", &n, &junk) == 1) {
+      pdlfs::FLAGS_udp_max_pending = n;
+    } else if (sscanf((*argv)[i], "--udp_batch=%d%c", &n, &junk) == 1 &&
+               n > 0) {
+      pdlfs::FLAGS_udp_batch = n;
+    } else if (sscanf((*argv)[i], "--udp_reuseport=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_udp_reuseport = n;
     } else if (sscanf((*argv)[i], "--udp=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       pdlfs::FLAGS_udp = n;
+    } else if (sscanf((*argv)[i], "--tcp_persistent=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_tcp_persistent = n;
     } else if (sscanf((*argv)[i], "--readonly_db_chain_table_cache_size=%d%c",
                       &n, &junk) == 1) {
       pdlfs::FLAGS_table_cache_size = n;
@@ -833,6 +1016,9 @@ void BM_Main(int* const argc, char*** const argv) {
                       &n, &u, &junk) == 2 &&
                (u == 'M' || u == 'm')) {
       pdlfs::FLAGS_block_cache_size = n << 20;
+    } else if (sscanf((*argv)[i], "--readonly_db_chain_mem_filter_bits=%d%c",
+                      &n, &junk) == 1) {
+      pdlfs::FLAGS_readonly_dbopts.mem_filter_bits_per_key = n;
     } else if (strncmp((*argv)[i], "--readonly_db_chain=", 20) == 0) {
       pdlfs::FLAGS_readonly_db_chain = (*argv)[i] + 20;
     } else if (strncmp((*argv)[i], "--db=", 5) == 0) {
@@ -848,6 +1034,16 @@ void BM_Main(int* const argc, char*** const argv) {
     }
   }
 
+  // Clients only learn about splits through partition checks
+  if (pdlfs::FLAGS_split_threshold != 0 && pdlfs::FLAGS_skip_fs_checks) {
+    if (pdlfs::FLAGS_rank == 0) {
+      fprintf(stderr, "%s:\n--split_threshold requires --skip_fs_checks=0\n",
+              (*argv)[0]);
+    }
+    MPI_Finalize();
+    exit(1);
+  }
+
   std::string default_db_prefix;
   // Choose a prefix for the test db if none given with --db=<path>
   if (!pdlfs::FLAGS_use_existing_fs && !pdlfs::FLAGS_db_prefix) {
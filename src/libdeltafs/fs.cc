@@ -45,8 +45,32 @@
 
 #include <sys/stat.h>
 
+#include <algorithm>
+
 namespace pdlfs {
 
+struct Filesystem::DirShard {
+  DirShard() : lru(NULL), dirs(NULL) {}
+  port::Mutex mu;
+  // An LRU cache of directory control blocks is kept in memory. A certain
+  // number of control blocks may be cached in memory. When the maximum is
+  // reached, cache eviction will start.
+  LRUCache<DirHandl>* lru;
+  // It is possible for a control block to be evicted from the LRU cache while
+  // the block itself is still being used by some threads. This would cause a
+  // caller seeking the control block to believe that there is no such block in
+  // memory and go create a new control block causing two control blocks of a
+  // single directory to appear in memory. To resolve this problem, we use a
+  // separate table to index all directory control blocks that exist in memory.
+  // A caller is expected to check the table whenever it gets a miss from the
+  // cache. If the caller finds the control block it seeks, it adds a new
+  // reference to the control block (and potentially re-inserts the control
+  // block to the cache). We only keep a certain number of control blocks in
+  // memory. If the maximum is reached, subsequent filesystem operations may be
+  // rejected until slots reappear.
+  HashTable<Dir>* dirs;
+};
+
 uint32_t Filesystem::PickupServer(const DirId& id) {
   char tmp[16];
   char* p = tmp;
@@ -61,12 +85,9 @@ Status Filesystem::Bukin(  ///
     const User& who, const LookupStat& parent, const std::string& table_dir) {
   DirId at(parent);
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
-    mutex_.Unlock();
     s = Bukin1(who, at, parent, dir, table_dir);
-    mutex_.Lock();
     Release(dir);
   }
   return s;
@@ -78,12 +99,9 @@ Status Filesystem::Lokup(  ///
   FilesystemDbStats stats;
   DirId at(parent);
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
-    mutex_.Unlock();
     s = Lokup1(who, at, name, parent, dir, stat, &stats);
-    mutex_.Lock();
     Release(dir);
   }
   return s;
@@ -95,12 +113,36 @@ Status Filesystem::Lstat(  ///
   FilesystemDbStats stats;
   DirId at(parent);
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
-    mutex_.Unlock();
     s = Lstat1(who, at, name, parent, dir, stat, &stats);
-    mutex_.Lock();
+    Release(dir);
+  }
+  return s;
+}
+
+Status Filesystem::Lstats(  ///
+    const User& who, const LookupStat& parent, const Slice& namearr, uint32_t n,
+    Stat* const stats, Status* const rets) {
+  FilesystemDbStats dbstats;
+  DirId at(parent);
+  Dir* dir;
+  Status s = AcquireDir(at, &dir);
+  if (s.ok()) {
+    s = Lstats1(who, at, namearr, n, parent, dir, stats, rets, &dbstats);
+    Release(dir);
+  }
+  return s;
+}
+
+Status Filesystem::Readdir(  ///
+    const User& who, const LookupStat& parent, const Slice& cursor,
+    uint32_t max_bytes, std::string* const entarr, std::string* const next) {
+  DirId at(parent);
+  Dir* dir;
+  Status s = AcquireDir(at, &dir);
+  if (s.ok()) {
+    s = Readdir1(who, at, cursor, max_bytes, parent, dir, entarr, next);
     Release(dir);
   }
   return s;
@@ -113,7 +155,6 @@ Status Filesystem::Mkfls(  ///
   FilesystemDbStats stats;
   DirId at(parent);
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
     Stat stat;
@@ -125,16 +166,16 @@ Status Filesystem::Mkfls(  ///
     stat.SetFileSize(0);
     stat.SetFileMode(S_IFREG | (mode & ACCESSPERMS));
     stat.SetZerothServer(-1);
-    inoq_ += *n;
-    uint64_t myino = inoq_;  // The last ino for the batch
-    uint64_t startino = myino - *n + 1;
-    mutex_.Unlock();
-    s = Mknos1(who, at, namearr, startino, parent, dir, &stat, n, &stats);
-    mutex_.Lock();
-    // Reuse inodes left by the batch
-    if (!s.ok()) {
-      uint64_t x = myino - startino + 1;
-      TryReuseIno(myino, x - *n);
+    uint64_t myino;  // The last ino for the batch
+    s = NewIno(&myino, *n);
+    if (s.ok()) {
+      const uint64_t startino = myino - *n + 1;
+      s = Mknos1(who, at, namearr, startino, parent, dir, &stat, n, &stats);
+      // Reuse inodes left by the batch
+      if (!s.ok()) {
+        uint64_t x = myino - startino + 1;
+        TryReuseIno(myino, x - *n);
+      }
     }
     Release(dir);
   }
@@ -147,7 +188,6 @@ Status Filesystem::Mkfle(  ///
   FilesystemDbStats stats;
   DirId at(parent);
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
     stat->SetDnodeNo(options_.mydno);
@@ -158,14 +198,15 @@ Status Filesystem::Mkfle(  ///
     stat->SetFileSize(0);
     stat->SetFileMode(S_IFREG | (mode & ACCESSPERMS));
     stat->SetZerothServer(-1);
-    const uint64_t myino = ++inoq_;
-    stat->SetInodeNo(myino);
-    stat->AssertAllSet();
-    mutex_.Unlock();
-    s = Mknod1(who, at, name, parent, dir, *stat, &stats);
-    mutex_.Lock();
-    if (!s.ok()) {
-      TryReuseIno(myino);
+    uint64_t myino;
+    s = NewIno(&myino);
+    if (s.ok()) {
+      stat->SetInodeNo(myino);
+      stat->AssertAllSet();
+      s = Mknod1(who, at, name, parent, dir, *stat, &stats);
+      if (!s.ok()) {
+        TryReuseIno(myino);
+      }
     }
     Release(dir);
   }
@@ -178,7 +219,6 @@ Status Filesystem::Mkdir(  ///
   FilesystemDbStats stats;
   DirId at(parent);
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
     stat->SetDnodeNo(options_.mydno);
@@ -188,24 +228,103 @@ Status Filesystem::Mkdir(  ///
     stat->SetGroupId(who.gid);
     stat->SetFileSize(0);
     stat->SetFileMode(S_IFDIR | (mode & ACCESSPERMS));
-    const uint64_t myino = ++inoq_;
-    stat->SetZerothServer(PickupServer(DirId(options_.mydno, myino)));
-    stat->SetInodeNo(myino);
-    stat->AssertAllSet();
-    mutex_.Unlock();
-    s = Mknod1(who, at, name, parent, dir, *stat, &stats);
-    mutex_.Lock();
-    if (!s.ok()) {
-      TryReuseIno(myino);
+    uint64_t myino;
+    s = NewIno(&myino);
+    if (s.ok()) {
+      stat->SetZerothServer(PickupServer(DirId(options_.mydno, myino)));
+      stat->SetInodeNo(myino);
+      stat->AssertAllSet();
+      s = Mknod1(who, at, name, parent, dir, *stat, &stats);
+      if (!s.ok()) {
+        TryReuseIno(myino);
+      }
     }
     Release(dir);
   }
   return s;
 }
 
+Status Filesystem::Split(  ///
+    const Slice& secret, int from, const LookupStat& parent, int index,
+    SplitPhase phase, const Slice& giga, const Slice& entarr) {
+  if (options_.split_secret.empty() || secret != options_.split_secret)
+    return Status::AccessDenied("Bad split secret");
+  DirId at(parent);
+  Dir* dir;
+  Status s = AcquireDir(at, &dir);
+  if (s.ok()) {
+    s = Split1(at, from, index, phase, giga, entarr, dir);
+    Release(dir);
+  }
+  return s;
+}
+
+Status Filesystem::Rdidx(  ///
+    const User& who, const LookupStat& parent, std::string* const giga) {
+  DirId at(parent);
+  Dir* dir;
+  Status s = AcquireDir(at, &dir);
+  if (s.ok()) {
+    {
+      MutexLock lock(dir->mu);
+      s = MaybeFetchDir(dir);
+      if (s.ok()) {
+        *giga = dir->giga->Encode().ToString();
+      }
+    }
+    Release(dir);
+  }
+  return s;
+}
+
+// Reserve n inode numbers for a client to assign on its own, such as to files
+// created through bulk insertion.
+Status Filesystem::Rsino(  ///
+    const User& who, uint32_t n, uint64_t* const dno,
+    uint64_t* const startino) {
+  if (n == 0) {
+    return Status::InvalidArgument("Empty ino range");
+  }
+  uint64_t myino;  // The last ino of the range
+  Status s = NewIno(&myino, n);
+  if (s.ok()) {
+    *dno = options_.mydno;
+    *startino = myino - n + 1;
+  }
+  return s;
+}
+
+// Names that we do not own are rejected by Lokup() as wrong partitions. Such
+// rejections beyond the first name end the walk and are left to the client,
+// which will contact the owner of the name on its own.
+Status Filesystem::Resolve(  ///
+    const User& who, const LookupStat& parent, const Slice& namearr,
+    uint32_t n, LookupStat* const stats, uint32_t* const m) {
+  *m = 0;
+  Slice input = namearr;
+  Slice name;
+  Status s;
+  for (uint32_t i = 0; i < n; i++) {
+    if (!GetLengthPrefixedSlice(&input, &name)) {
+      s = Status::InvalidArgument("Bad name array");
+      break;
+    } else if (i != 0 && options_.skip_partition_checks) {
+      break;
+    }
+    s = Lokup(who, i != 0 ? stats[i - 1] : parent, name, &stats[i]);
+    if (!s.ok()) {
+      if (i != 0 && IsWrongDirPartition(s)) {
+        s = Status::OK();
+      }
+      break;
+    }
+    ++*m;
+  }
+  return s;
+}
+
 FilesystemDir* Filesystem::TEST_ProbeDir(const DirId& at) {
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
     return reinterpret_cast<FilesystemDir*>(dir);
@@ -220,7 +339,6 @@ const FilesystemDbStats& Filesystem::TEST_FetchDbStats(FilesystemDir* dir) {
 }
 
 void Filesystem::TEST_Release(FilesystemDir* dir) {
-  MutexLock lock(&mutex_);
   Release(reinterpret_cast<Dir*>(dir));
 }
 
@@ -229,12 +347,9 @@ Status Filesystem::TEST_Lstat(  ///
     Stat* const stat, FilesystemDbStats* const stats) {
   DirId at(parent);
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
-    mutex_.Unlock();
     s = Lstat1(who, at, name, parent, dir, stat, stats);
-    mutex_.Lock();
     Release(dir);
   }
   return s;
@@ -245,25 +360,88 @@ Status Filesystem::TEST_Mkfle(  ///
     const Stat& stat, FilesystemDbStats* const stats) {
   DirId at(parent);
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
-    mutex_.Unlock();
     s = Mknod1(who, at, name, parent, dir, stat, stats);
-    mutex_.Lock();
     Release(dir);
   }
   return s;
 }
 
+void Filesystem::TEST_WaitForSplits() {
+  MutexLock lock(&split_mu_);
+  while (pending_splits_ != 0) {
+    split_cv_.Wait();
+  }
+}
+
 uint32_t Filesystem::TEST_TotalDirsInMemory() {
-  MutexLock lock(&mutex_);
-  return dirs_->Size();
+  uint32_t result = 0;
+  for (int i = 0; i < kNumDirShards; i++) {
+    MutexLock lock(&shards_[i].mu);
+    result += shards_[i].dirs->Size();
+  }
+  return result;
 }
 
 uint64_t Filesystem::TEST_LastIno() {
-  MutexLock lock(&mutex_);
+#if __cplusplus >= 201103L
+  return inoq_.load();
+#else
+  MutexLock lock(&inoq_mu_);
   return inoq_;
+#endif
+}
+
+Status Filesystem::NewIno(uint64_t* const ino, size_t n) {
+#if __cplusplus >= 201103L
+  *ino = inoq_.fetch_add(n) + n;
+  if (*ino <= maxino_.load(std::memory_order_acquire)) {
+    return Status::OK();
+  }
+  Status s;
+  {
+    MutexLock lock(&inoq_mu_);
+    s = ReserveInos(*ino);
+  }
+  if (!s.ok()) {
+    TryReuseIno(*ino, n);
+  }
+  return s;
+#else
+  MutexLock lock(&inoq_mu_);
+  Status s = ReserveInos(inoq_ + n);
+  if (s.ok()) {
+    inoq_ += n;
+    *ino = inoq_;
+  }
+  return s;
+#endif
+}
+
+Status Filesystem::ReserveInos(uint64_t ino) {
+  inoq_mu_.AssertHeld();
+  const uint64_t maxino = maxino_;
+  if (ino <= maxino) {
+    return Status::OK();
+  }
+  const uint64_t newmax = std::max(ino, maxino + options_.ino_range_size);
+  Status s = db_->PutMaxIno(newmax);
+  if (s.ok()) {
+    maxino_ = newmax;
+  }
+  return s;
+}
+
+void Filesystem::TryReuseIno(uint64_t ino, size_t n) {
+#if __cplusplus >= 201103L
+  inoq_.compare_exchange_strong(ino, ino - n);
+#else
+  MutexLock lock(&inoq_mu_);
+  if (ino == inoq_) {
+    inoq_ -= n;
+  }
+#endif
 }
 
 namespace {
@@ -304,6 +482,24 @@ bool IsDirWriteOk(const FilesystemOptions& options, const LookupStat& parent,
   }
 }
 
+// Check if a given user has the "r" permission on a directory based on a lease
+// certificate provided by the user.
+bool IsDirReadOk(const FilesystemOptions& options, const LookupStat& dir,
+                 const User& who) {
+  const uint32_t mode = dir.DirMode();
+  if (options.skip_perm_checks) {
+    return true;
+  } else if (who.uid == 0) {
+    return true;
+  } else if (who.uid == uid(dir) && (mode & S_IRUSR) == S_IRUSR) {
+    return true;
+  } else if (who.gid == gid(dir) && (mode & S_IRGRP) == S_IRGRP) {
+    return true;
+  } else {
+    return ((mode & S_IROTH) == S_IROTH);
+  }
+}
+
 // Check if a given user has the "x" permission beneath a parent
 // directory based on a lease certificate provided by the user.
 bool IsLookupOk(const FilesystemOptions& options, const LookupStat& parent,
@@ -362,9 +558,11 @@ Status Filesystem::Lstat1(  ///
   if (!s.ok()) {
     return s;
   }
-  // XXX: obtain split lock here to secure directory split status
+  // Wait for any ongoing directory split to install its new index
+  while (dir->splitting == 2) dir->cv->Wait();
   if (!IsDirPartitionOk(options_, dir->giga, name))
-    return Status::AccessDenied("Wrong dir partition");
+    return WrongDirPartition();
+  dir->readers++;
   dir->mu->Unlock();
   // The following Get() operation goes unlocked with an assumption
   // that the directory partition it just checked won't be later
@@ -406,9 +604,109 @@ Status Filesystem::Lstat1(  ///
   // write operations are blocked. The split operation bulk deletes
   // the half of partition that has been moved and install a new
   // directory index.
+  //
+  // We currently implement the latter. See MaybeSplitDir().
   s = DbGet(at, name, stat, stats);
   dir->mu->Lock();
   dir->stats->Merge(*stats);
+  dir->readers--;
+  if (dir->readers == 0 && dir->splitting == 2) {
+    dir->cv->SignalAll();
+  }
+  return s;
+}
+
+Status Filesystem::Lstats1(  ///
+    const User& who, const DirId& at, const Slice& namearr, uint32_t n,
+    const LookupStat& p, Dir* const dir, Stat* const stats, Status* const rets,
+    FilesystemDbStats* const dbstats) {
+  if (!IsLeaseOk(options_, p, CurrentMicros()))
+    return Status::AssertionFailed("Lease has expired");
+  if (!IsLookupOk(options_, p, who))
+    return Status::AccessDenied("No dir x perm");
+  std::vector<Slice> names;
+  names.reserve(n);
+  Slice input = namearr;
+  Slice name;
+  while (names.size() < n && GetLengthPrefixedSlice(&input, &name)) {
+    names.push_back(name);
+  }
+  if (names.size() != n) {
+    return Status::InvalidArgument("Bad name array");
+  }
+  MutexLock lock(dir->mu);
+  Status s = MaybeFetchDir(dir);
+  if (!s.ok()) {
+    return s;
+  }
+  // Wait for any ongoing directory split to install its new index
+  while (dir->splitting == 2) dir->cv->Wait();
+  // Names in other partitions are rejected individually. The rest are
+  // compacted to the front of the array and read from the db together.
+  std::vector<size_t> idx;
+  idx.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    if (!IsDirPartitionOk(options_, dir->giga, names[i])) {
+      rets[i] = WrongDirPartition();
+    } else {
+      names[idx.size()] = names[i];
+      idx.push_back(i);
+    }
+  }
+  if (idx.empty()) {
+    return s;
+  }
+  dir->readers++;
+  dir->mu->Unlock();
+  // Reads go unlocked as in Lstat1()
+  const size_t m = idx.size();
+  std::vector<Stat> tmpstats(m);
+  std::vector<Status> tmprets(m);
+  s = DbMultiGet(at, &names[0], m, &tmpstats[0], &tmprets[0], dbstats);
+  if (s.ok()) {
+    for (size_t j = 0; j < m; j++) {
+      rets[idx[j]] = tmprets[j];
+      if (tmprets[j].ok()) {
+        stats[idx[j]] = tmpstats[j];
+      }
+    }
+  }
+  dir->mu->Lock();
+  dir->stats->Merge(*dbstats);
+  dir->readers--;
+  if (dir->readers == 0 && dir->splitting == 2) {
+    dir->cv->SignalAll();
+  }
+  return s;
+}
+
+// Entries are read from the main db and all readonly dbs and are merged in
+// name order. Entries being moved by a concurrent directory split may appear
+// at both the source and the destination server and are expected to be
+// de-duplicated by the client.
+Status Filesystem::Readdir1(  ///
+    const User& who, const DirId& at, const Slice& cursor, uint32_t max_bytes,
+    const LookupStat& p, Dir* const dir, std::string* const entarr,
+    std::string* const next) {
+  if (!IsLeaseOk(options_, p, CurrentMicros()))
+    return Status::AssertionFailed("Lease has expired");
+  if (!IsDirReadOk(options_, p, who))
+    return Status::AccessDenied("No dir r perm");
+  if (db_ == NULL && n_ == 0) {
+    next->clear();
+    return Status::OK();
+  }
+  MutexLock lock(dir->mu);
+  // Wait for any ongoing directory split to install its new index
+  while (dir->splitting == 2) dir->cv->Wait();
+  dir->readers++;
+  dir->mu->Unlock();
+  Status s = DbReaddir(at, cursor, max_bytes, entarr, next);
+  dir->mu->Lock();
+  dir->readers--;
+  if (dir->readers == 0 && dir->splitting == 2) {
+    dir->cv->SignalAll();
+  }
   return s;
 }
 
@@ -433,26 +731,57 @@ Status Filesystem::Mknos1(  ///
     }
     dir->busy[i] = true;
   }
-  dir->mu->Unlock();
-  size_t m = 0;
+  std::vector<Slice> names;
+  std::vector<Stat> stats0;
   Slice input = namearr;
   Slice name;
-  while (m < (*n) && GetLengthPrefixedSlice(&input, &name)) {
-    stat->SetInodeNo(startino + m);
-    stat->AssertAllSet();
-    s = CheckAndPut(at, name, *stat, stats);
-    if (!s.ok()) {
+  while (names.size() < (*n) && GetLengthPrefixedSlice(&input, &name)) {
+    // No split may install its new index while all name subsets are locked,
+    // so names checked here stay in the partition until they are inserted
+    if (!IsDirPartitionOk(options_, dir->giga, name)) {
+      s = WrongDirPartition();
       break;
     }
-    m++;
+    stat->SetInodeNo(startino + names.size());
+    stat->AssertAllSet();
+    stats0.push_back(*stat);
+    names.push_back(name);
+  }
+  if (!s.ok()) {  // The entire batch is rejected
+    for (uint32_t i = 0; i < kWays; i++) {
+      dir->busy[i] = false;
+    }
+    dir->cv->SignalAll();
+    *n = 0;
+    return s;
+  }
+  dir->mu->Unlock();
+  size_t m = 0;
+  if (!names.empty()) {
+    s = CheckAndPutBatch(at, &names[0], names.size(), &stats0[0], &m, stats);
   }
   *n = m;
   dir->mu->Lock();
   dir->stats->Merge(*stats);
+  if (dir->sizes != NULL) {
+    for (size_t j = 0; j < m; j++) {
+      (*dir->sizes)[dir->giga->GetIndex(names[j])]++;
+      if (dir->split_log != NULL) {
+        LogSplitEntry(dir, names[j], stats0[j]);
+      }
+    }
+  }
   for (uint32_t i = 0; i < kWays; i++) {
     dir->busy[i] = false;
   }
   dir->cv->SignalAll();
+  if (dir->sizes != NULL) {
+    for (size_t j = 0; j < dir->sizes->size(); j++) {
+      if ((*dir->sizes)[j] >= options_.split_threshold) {
+        MaybeSplitDir(p, dir, int(j));
+      }
+    }
+  }
   return s;
 }
 
@@ -469,6 +798,8 @@ Status Filesystem::Bukin1(  ///
     return s;
   }
   dir->mu->AssertHeld();  // XXX: lock down directory split status
+  // Entries bulk inserted while a split is copying would not be moved
+  while (dir->splitting) dir->cv->Wait();
   // Lock all name subsets. Do I really need to lock? It's a bulk insertion so
   // we already assume that there are no conflicts!
   for (uint32_t i = 0; i < kWays; i++) {
@@ -499,18 +830,17 @@ Status Filesystem::Mknod1(  ///
   if (!s.ok()) {
     return s;
   }
-  // XXX: obtain directory split lock here to fix directory split status.
-  // Checking if the name is in the partition may be deferred to a later time
-  // though.
-  if (!IsDirPartitionOk(options_, dir->giga, name))
-    return Status::AccessDenied("Wrong dir partition");
   // Lock the corresponding name subset in the partition for serialization...
   // The best performance is achieved when a different hash function is used
   // as the one used for directory splits
   uint32_t hash = Hash(name.data(), name.size(), 0);
   uint32_t i = hash & uint32_t(kWays - 1);
-  // Wait for conflicting writes
+  // Wait for conflicting writes. An ongoing directory split locks all name
+  // subsets while installing its new index so this also waits for that.
   while (dir->busy[i]) dir->cv->Wait();
+  if (!IsDirPartitionOk(options_, dir->giga, name))
+    return WrongDirPartition();
+  const int index = dir->sizes != NULL ? dir->giga->GetIndex(name) : 0;
   dir->busy[i] = true;
   // Temporarily unlock for db operations
   dir->mu->Unlock();
@@ -519,6 +849,367 @@ Status Filesystem::Mknod1(  ///
   dir->stats->Merge(*stats);
   dir->busy[i] = false;
   dir->cv->SignalAll();
+  if (s.ok() && dir->sizes != NULL) {
+    (*dir->sizes)[index]++;
+    if (dir->split_log != NULL) {
+      LogSplitEntry(dir, name, stat);
+    }
+    MaybeSplitDir(p, dir, index);
+  }
+  return s;
+}
+
+// A directory split scheduled to run in the background.
+struct Filesystem::SplitTask {
+  Filesystem* fs;
+  LookupStat parent;
+  Dir* dir;
+  int index;
+};
+
+// Schedule a background split of a directory partition if it has grown too
+// large and the directory is not already being split. Should the split fail,
+// it will be retried by a subsequent insertion into the same partition.
+// REQUIRES: dir->mu has been locked.
+void Filesystem::MaybeSplitDir(const LookupStat& p, Dir* const dir,
+                               int index) {
+  dir->mu->AssertHeld();
+  if (dir->splitting || (*dir->sizes)[index] < options_.split_threshold)
+    return;
+  if (split_pool_ == NULL) return;  // No peers
+  if (dir->giga->GetServerForIndex(index) != options_.srvid ||
+      !dir->giga->IsSplittable(index))
+    return;
+  const int child = dir->giga->NewIndexForSplitting(index);
+  const int dst = dir->giga->GetServerForIndex(child);
+  if (dst != options_.srvid &&
+      (size_t(dst) >= npeers_ || peers_[dst] == NULL)) {
+    return;  // Cannot reach the target server
+  }
+  dir->splitting = 1;
+  dir->split_child = child;
+  dir->split_log = new std::string;
+  Ref(dir);  // Released by RunSplit()
+  SplitTask* const t = new SplitTask;
+  t->fs = this;
+  t->parent = p;
+  t->dir = dir;
+  t->index = index;
+  {
+    MutexLock lock(&split_mu_);
+    pending_splits_++;
+  }
+  split_pool_->Schedule(RunSplit, t);
+}
+
+void Filesystem::RunSplit(void* arg) {
+  SplitTask* const t = reinterpret_cast<SplitTask*>(arg);
+  Filesystem* const fs = t->fs;
+  fs->SplitDir(t->parent, t->dir, t->index);
+  fs->Release(t->dir);
+  delete t;
+  MutexLock lock(&fs->split_mu_);
+  fs->pending_splits_--;
+  fs->split_cv_.SignalAll();
+}
+
+// Log an entry just inserted into the child partition of an ongoing split so
+// that the split will also move it. REQUIRES: dir->mu has been locked.
+void Filesystem::LogSplitEntry(Dir* const dir, const Slice& name,
+                               const Stat& stat) {
+  char tmp[Stat::kMaxEncodedLength];
+  if (DirIndex::ToBeMigrated(dir->split_child,
+                             DirIndex::Hash(name, tmp).data())) {
+    PutLengthPrefixedSlice(dir->split_log, name);
+    Slice encoding = stat.EncodeTo(tmp);
+    dir->split_log->append(encoding.data(), encoding.size());
+  }
+}
+
+// Split a directory partition in half and move the half belonging to the new
+// child partition to the server owning it. No directory locks are held while
+// the bulk of the entries are copied. In phase 1, entries are streamed from the
+// db and copied to the target server while entries inserted into the child
+// partition meanwhile are logged by the inserting threads. In phase 2, writes
+// are blocked while the remaining logged entries are sent along with the
+// request to install the child partition at the target server. The target
+// server serves it at its peer port without waiting for its own directory
+// locks (see Split1()), so this cannot deadlock with a split going the other
+// way. Reads are then blocked as well while the new index is installed and
+// persisted and the moved entries are deleted. Entries residing in readonly
+// dbs are not moved. Should the split fail before the target server installs
+// the child partition, the entries copied there are removed. Entries left
+// behind when even that fails stay invisible at the target server and are
+// overwritten when the split is retried.
+Status Filesystem::SplitDir(const LookupStat& p, Dir* const dir, int index) {
+  const DirId& at = *dir->id;
+  MutexLock lock(dir->mu);
+  assert(dir->splitting == 1);
+  const int child = dir->split_child;
+  const int dst = dir->giga->GetServerForIndex(child);
+  DirIndex giga(dir->giga_opts);
+  giga.Update(*dir->giga);
+  giga.Set(child);
+  const std::string encoding = giga.Encode().ToString();
+  std::vector<std::string> moved;
+  dir->mu->Unlock();
+  Status s = CopyDirPart(p, at, child, dst, encoding, &moved);
+  dir->mu->Lock();
+  std::string entarr;
+  // Catch up with the entries inserted while copying, still without blocking
+  // writes, so that few remain to be sent in phase 2
+  if (s.ok() && !dir->split_log->empty()) {
+    entarr.swap(*dir->split_log);
+    dir->mu->Unlock();
+    s = SendSplit(p, dst, child, kSplitCopy, encoding, entarr, &moved);
+    dir->mu->Lock();
+  }
+  bool committed = false;
+  if (s.ok()) {
+    for (uint32_t i = 0; i < kWays; i++) {
+      while (dir->busy[i]) {
+        dir->cv->Wait();
+      }
+      dir->busy[i] = true;
+    }
+    entarr.clear();
+    entarr.swap(*dir->split_log);
+    dir->mu->Unlock();
+    s = SendSplit(p, dst, child, kSplitCommit, encoding, entarr, &moved);
+    if (!s.ok()) {
+      // The commit may have been installed even if its reply was lost, in
+      // which case the abort is rejected
+      if (AbortSplit(p, dst, child, encoding, moved).IsAlreadyExists()) {
+        s = Status::OK();
+      } else {
+        moved.clear();  // No need to abort again
+      }
+    }
+    dir->mu->Lock();
+    if (s.ok()) {
+      committed = true;
+      dir->splitting = 2;
+      while (dir->readers != 0) {
+        dir->cv->Wait();
+      }
+      dir->giga->Set(child);
+      // Entries inserted while copying may have been sent twice
+      std::sort(moved.begin(), moved.end());
+      moved.erase(std::unique(moved.begin(), moved.end()), moved.end());
+      const uint32_t m = static_cast<uint32_t>(moved.size());
+      (*dir->sizes)[index] -= std::min((*dir->sizes)[index], m);
+      if (dst == options_.srvid) {
+        (*dir->sizes)[child] += m;
+      }
+      const std::string new_encoding = dir->giga->Encode().ToString();
+      dir->mu->Unlock();
+      s = db_->PutDirIdx(at, new_encoding);
+      if (s.ok() && dst != options_.srvid) {
+        s = db_->BatchDelete(at, moved);
+      }
+      dir->mu->Lock();
+    }
+    for (uint32_t i = 0; i < kWays; i++) {
+      dir->busy[i] = false;
+    }
+    dir->cv->SignalAll();
+  }
+  if (!committed && !moved.empty()) {
+    dir->mu->Unlock();
+    AbortSplit(p, dst, child, encoding, moved);
+    dir->mu->Lock();
+  }
+  delete dir->split_log;
+  dir->split_log = NULL;
+  dir->splitting = 0;
+  dir->cv->SignalAll();
+  return s;
+}
+
+// Max size of each page of entries read from the db when copying a partition.
+static const size_t kSplitScanBytes = 64 << 10;
+
+// Stream the entries of a directory from the db and copy those belonging to a
+// child partition to the server owning it. Stop at the first error.
+Status Filesystem::CopyDirPart(  ///
+    const LookupStat& p, const DirId& at, int child, int dst,
+    const Slice& giga, std::vector<std::string>* const moved) {
+  char tmp[8];
+  std::string cursor;
+  std::string next;
+  std::string page;
+  std::string batch;
+  size_t n = 0;
+  Status s;
+  do {
+    page.clear();
+    s = db_->Readdir(at, cursor, kSplitScanBytes, &page, &next);
+    Slice input = page;
+    Slice name;
+    Stat stat;
+    while (s.ok() && !input.empty()) {
+      const char* const begin = input.data();
+      if (!GetLengthPrefixedSlice(&input, &name) || !stat.DecodeFrom(&input)) {
+        s = Status::Corruption("Bad dir entry");
+      } else if (DirIndex::ToBeMigrated(child,
+                                        DirIndex::Hash(name, tmp).data())) {
+        batch.append(begin, input.data() - begin);
+        if (++n == options_.split_batch_size) {
+          s = SendSplit(p, dst, child, kSplitCopy, giga, batch, moved);
+          batch.clear();
+          n = 0;
+        }
+      }
+    }
+    cursor.swap(next);
+  } while (s.ok() && !cursor.empty());
+  if (s.ok() && n != 0) {
+    s = SendSplit(p, dst, child, kSplitCopy, giga, batch, moved);
+  }
+  return s;
+}
+
+// Send entries of a child partition to the server owning it in batches of
+// split_batch_size entries. The last batch is sent as the specified phase and
+// the rest as kSplitCopy. Names of the entries are appended to *moved. Entries
+// moved to ourselves stay where they are and are not sent.
+Status Filesystem::SendSplit(  ///
+    const LookupStat& p, int dst, int child, SplitPhase phase,
+    const Slice& giga, const Slice& entarr,
+    std::vector<std::string>* const moved) {
+  const bool remote = dst != options_.srvid;
+  Slice input = entarr;
+  const char* begin = input.data();
+  size_t n = 0;
+  Slice name;
+  Stat stat;
+  Status s;
+  while (s.ok() && !input.empty()) {
+    if (!GetLengthPrefixedSlice(&input, &name) || !stat.DecodeFrom(&input)) {
+      return Status::Corruption("Bad dir entry");
+    }
+    moved->push_back(name.ToString());
+    if (++n == options_.split_batch_size && !input.empty()) {
+      if (remote) {
+        s = peers_[dst]->Split(options_.split_secret, options_.srvid, p, child,
+                               kSplitCopy, giga,
+                               Slice(begin, input.data() - begin));
+      }
+      begin = input.data();
+      n = 0;
+    }
+  }
+  if (s.ok() && remote && (n != 0 || phase != kSplitCopy)) {
+    s = peers_[dst]->Split(options_.split_secret, options_.srvid, p, child,
+                           phase, giga, Slice(begin, input.data() - begin));
+  }
+  return s;
+}
+
+// Remove the entries copied to the target server by a failed split. Return
+// AlreadyExists if the target server has already installed the child
+// partition, in which case nothing is removed.
+Status Filesystem::AbortSplit(  ///
+    const LookupStat& p, int dst, int child, const Slice& giga,
+    const std::vector<std::string>& moved) {
+  Status s;
+  if (dst == options_.srvid) {
+    return s;
+  }
+  std::string namearr;
+  size_t n = 0;
+  for (size_t i = 0; i < moved.size() && s.ok(); i++) {
+    PutLengthPrefixedSlice(&namearr, moved[i]);
+    if (++n == options_.split_batch_size || i + 1 == moved.size()) {
+      s = peers_[dst]->Split(options_.split_secret, options_.srvid, p, child,
+                             kSplitAbort, giga, namearr);
+      namearr.clear();
+      n = 0;
+    }
+  }
+  return s;
+}
+
+// Return the partition a given partition is split off from.
+static int ToParentIndex(int index) {
+  int r = 0;
+  while ((2 << r) <= index) r++;
+  return index - (1 << r);
+}
+
+// Install entries of a child partition split off by a peer server. Entries
+// are written to the db as they arrive but stay invisible until the child
+// partition is installed by the commit, as we don't own the partition before
+// that. No name subsets are locked so that split calls never wait for the
+// writes at this server, which may in turn be waiting for a split of our own.
+// Entries are put without checking for existing names as no names can be
+// inserted into a partition we don't own. The partition must be a child of a
+// partition owned by the calling server and must belong to us.
+Status Filesystem::Split1(  ///
+    const DirId& at, int from, int index, SplitPhase phase, const Slice& giga,
+    const Slice& entarr, Dir* const dir) {
+  MutexLock lock(dir->mu);
+  Status s = MaybeFetchDir(dir);
+  if (!s.ok()) {
+    return s;
+  }
+  if (dir->sizes == NULL) return Status::NotSupported("Dir split disabled");
+  if (index <= 0 || index >= options_.vsrvs)
+    return Status::InvalidArgument("Bad dir partition");
+  DirIndex newidx(dir->giga_opts);
+  if (!newidx.Update(giga) ||
+      newidx.ZerothServer() != dir->giga->ZerothServer() ||
+      !newidx.IsSet(index))
+    return Status::InvalidArgument("Bad dir index");
+  const int parent = ToParentIndex(index);
+  if (!newidx.IsSet(parent) || newidx.GetServerForIndex(parent) != from ||
+      newidx.GetServerForIndex(index) != options_.srvid)
+    return Status::AccessDenied("Not a split to us");
+  if (dir->giga->IsSet(index)) {
+    if (phase == kSplitCommit) {
+      return s;  // A retried commit
+    }
+    return Status::AlreadyExists("Dir partition already installed");
+  }
+  std::vector<std::string> names;
+  std::vector<Stat> stats;
+  Slice input = entarr;
+  Slice name;
+  Stat stat;
+  while (!input.empty()) {
+    if (!GetLengthPrefixedSlice(&input, &name) ||
+        (phase != kSplitAbort && !stat.DecodeFrom(&input))) {
+      return Status::InvalidArgument("Bad entry array");
+    }
+    if (newidx.GetIndex(name) != index) {
+      return Status::InvalidArgument("Entry not in dir partition");
+    }
+    names.push_back(name.ToString());
+    if (phase != kSplitAbort) {
+      stats.push_back(stat);
+    }
+  }
+  dir->mu->Unlock();
+  if (!names.empty()) {
+    if (phase == kSplitAbort) {
+      s = db_->BatchDelete(at, names);
+    } else {
+      s = db_->BatchPut(at, names, stats, NULL);
+    }
+  }
+  dir->mu->Lock();
+  if (s.ok()) {
+    const uint32_t n = static_cast<uint32_t>(names.size());
+    uint32_t* const size = &(*dir->sizes)[index];
+    *size = phase == kSplitAbort ? *size - std::min(*size, n) : *size + n;
+  }
+  if (s.ok() && phase == kSplitCommit) {
+    dir->giga->Update(newidx);
+    const std::string encoding = dir->giga->Encode().ToString();
+    dir->mu->Unlock();
+    s = db_->PutDirIdx(at, encoding);
+    dir->mu->Lock();
+  }
   return s;
 }
 
@@ -534,7 +1225,7 @@ Status Filesystem::DbGet(const DirId& at, const Slice& name, Stat* const stat,
     }
   }
   for (size_t i = 0; i < n_; i++) {
-    s = readonly_dbs_[i]->Get(at, name, stat, stats);
+    s = RoDbGet(i, at, name, stat, stats);
     if (s.ok()) {
       return s;  // Found it
     } else if (!s.IsNotFound()) {
@@ -544,6 +1235,171 @@ Status Filesystem::DbGet(const DirId& at, const Slice& name, Stat* const stat,
   return s;
 }
 
+// Names not found in the main db are individually looked up in readonly dbs.
+Status Filesystem::DbMultiGet(  ///
+    const DirId& at, const Slice* const names, size_t n, Stat* const stats,
+    Status* const rets, FilesystemDbStats* const dbstats) {
+  Status s;
+  if (db_ != NULL) {
+    s = db_->MultiGet(at, names, n, stats, rets, dbstats);
+    if (!s.ok()) {
+      return s;
+    }
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      rets[i] = Status::NotFound(Slice());
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = 0; j < n_ && rets[i].IsNotFound(); j++) {
+      rets[i] = RoDbGet(j, at, names[i], &stats[i], dbstats);
+    }
+  }
+  return s;
+}
+
+// Look up a name in the i-th readonly db of the db chain. Dbs whose in-memory
+// filters rule out the name are skipped without touching their tables.
+Status Filesystem::RoDbGet(  ///
+    size_t i, const DirId& at, const Slice& name, Stat* const stat,
+    FilesystemDbStats* const stats) {
+  FilesystemReadonlyDb* const db = readonly_dbs_[i];
+  if (!db->KeyMayMatch(at, name)) {
+    if (stats != NULL) {
+      stats->roskips++;
+    }
+    return Status::NotFound(Slice());
+  }
+  if (stats != NULL) {
+    const size_t d =
+        std::min(i, static_cast<size_t>(FilesystemDbStats::kMaxRoDepth - 1));
+    stats->roprobes[d]++;
+  }
+  return db->Get(at, name, stat, stats);
+}
+
+namespace {
+// A page of directory entries read from one db of the db chain.
+struct ReaddirPage {
+  std::string buf;
+  std::string next;
+  Slice input;  // Entries not yet consumed
+  Slice name;   // The current entry
+  Slice ent;    // Encoding of the current entry
+  bool Advance() {
+    const char* const p = input.data();
+    Stat ignored;
+    if (!GetLengthPrefixedSlice(&input, &name) || !ignored.DecodeFrom(&input))
+      return false;
+    ent = Slice(p, input.data() - p);
+    return true;
+  }
+};
+}  // namespace
+
+// Directory entries in the readonly db chain are merged with those in the main
+// db in name order. Every db is asked for a page after the cursor. Entries of a
+// page can only be returned up to the last name of the shortest page that does
+// not reach the end of its db so that no name is skipped by the next call. A
+// name existing in multiple dbs is returned once with its stat taken from the
+// first db of the chain holding it.
+Status Filesystem::DbReaddir(  ///
+    const DirId& at, const Slice& cursor, uint32_t max_bytes,
+    std::string* const entarr, std::string* const next) {
+  if (n_ == 0) {
+    return db_->Readdir(at, cursor, max_bytes, entarr, next);
+  }
+  std::vector<ReaddirPage> pages(n_ + 1);
+  std::vector<bool> valid(pages.size(), false);
+  Slice bound;  // Entries beyond it are not returned
+  bool bounded = false;
+  Status s;
+  for (size_t i = 0; i < pages.size() && s.ok(); i++) {
+    ReaddirPage* const pg = &pages[i];
+    if (i == 0) {
+      if (db_ == NULL) continue;
+      s = db_->Readdir(at, cursor, max_bytes, &pg->buf, &pg->next);
+    } else {
+      s = readonly_dbs_[i - 1]->Readdir(at, cursor, max_bytes, &pg->buf,
+                                        &pg->next);
+    }
+    if (s.ok()) {
+      pg->input = pg->buf;
+      valid[i] = pg->Advance();
+      if (!pg->next.empty() &&
+          (!bounded || Slice(pg->next).compare(bound) < 0)) {
+        bound = pg->next;
+        bounded = true;
+      }
+    }
+  }
+  if (!s.ok()) {
+    return s;
+  }
+  next->clear();
+  std::string last;
+  while (true) {
+    int k = -1;
+    for (size_t i = 0; i < pages.size(); i++) {
+      if (valid[i] && (k < 0 || pages[i].name.compare(pages[k].name) < 0)) {
+        k = static_cast<int>(i);
+      }
+    }
+    if (k < 0) {  // All pages consumed
+      if (bounded) next->swap(last);
+      break;
+    } else if (bounded && pages[k].name.compare(bound) > 0) {
+      next->swap(last);
+      break;
+    } else if (entarr->size() >= max_bytes) {
+      next->swap(last);
+      break;
+    }
+    entarr->append(pages[k].ent.data(), pages[k].ent.size());
+    last = pages[k].name.ToString();
+    for (size_t i = 0; i < pages.size(); i++) {
+      while (valid[i] && pages[i].name == last) {
+        valid[i] = pages[i].Advance();
+      }
+    }
+  }
+  return s;
+}
+
+// Names found in the readonly db chain cut the batch short before the rest of
+// the batch is checked against, and inserted into, the main db as one write.
+Status Filesystem::CheckAndPutBatch(  ///
+    const DirId& at, const Slice* const names, size_t n,
+    const Stat* const stats, size_t* const m,
+    FilesystemDbStats* const dbstats) {
+  const bool skip_checks = options_.skip_name_collision_checks;
+  size_t k = n;  // Entries at and after k are not inserted
+  Status s;
+  if (!skip_checks && n_ != 0) {
+    for (size_t i = 0; i < k; i++) {
+      Stat tmp;
+      for (size_t j = 0; j < n_; j++) {
+        Status ss = RoDbGet(j, at, names[i], &tmp, dbstats);
+        if (ss.ok()) {
+          s = Status::AlreadyExists(names[i]);
+          k = i;
+          break;
+        } else if (!ss.IsNotFound()) {
+          s = ss;
+          k = i;
+          break;
+        }
+      }
+    }
+  }
+  Status ss =
+      db_->CheckAndPutBatch(at, names, k, stats, skip_checks, m, dbstats);
+  if (!ss.ok()) {
+    return ss;
+  }
+  return s;
+}
+
 Status Filesystem::CheckAndPut(  ///
     const DirId& at, const Slice& name, const Stat& stat,
     FilesystemDbStats* const stats) {
@@ -582,13 +1438,15 @@ uint32_t LRUHash(const Slice& k) { return Hash(k.data(), k.size(), 0); }
 // then deletes the control block.
 void Filesystem::DeleteDir(const Slice& key, Dir* dir) {
   assert(dir->key() == key);
-  Filesystem* const fs = dir->fs;
-  fs->mutex_.AssertHeld();
-  fs->dirs_->Remove(dir);
+  DirShard* const shard = &dir->fs->shards_[ShardOf(dir->hash)];
+  shard->mu.AssertHeld();
+  shard->dirs->Remove(dir);
   delete dir->id;
   delete dir->stats;
   delete dir->giga_opts;
   delete dir->giga;
+  delete dir->sizes;
+  delete dir->split_log;
   delete dir->cv;
   delete dir->mu;
   free(dir);
@@ -598,8 +1456,15 @@ void Filesystem::DeleteDir(const Slice& key, Dir* dir) {
 // block may still be kept in memory by the LRU cache. If the control block has
 // been evicted from the cache before, it will be deleted.
 void Filesystem::Release(Dir* const dir) {
-  mutex_.AssertHeld();
-  dlru_->Release(dir->lru_handle);
+  DirShard* const shard = &shards_[ShardOf(dir->hash)];
+  MutexLock lock(&shard->mu);
+  shard->lru->Release(dir->lru_handle);
+}
+
+void Filesystem::Ref(Dir* const dir) {
+  DirShard* const shard = &shards_[ShardOf(dir->hash)];
+  MutexLock lock(&shard->mu);
+  shard->lru->Ref(dir->lru_handle);
 }
 
 // Fetch information from db if we haven't done so yet.
@@ -615,8 +1480,38 @@ Status Filesystem::MaybeFetchDir(Dir* dir) {
   dir->giga_opts->num_servers = options_.nsrvs;
 
   const uint32_t zsrv = PickupServer(*dir->id);
-  dir->giga = new DirIndex(zsrv, dir->giga_opts);
-  dir->giga->SetAll();
+  if (options_.split_threshold == 0 || db_ == NULL) {
+    dir->giga = new DirIndex(zsrv, dir->giga_opts);
+    dir->giga->SetAll();
+  } else {
+    // With directory splitting, a directory starts with a single partition
+    // at its zeroth server and only spreads to other servers as it grows.
+    std::string encoding;
+    s = db_->GetDirIdx(*dir->id, &encoding);
+    if (s.ok()) {
+      dir->giga = new DirIndex(dir->giga_opts);
+      if (!dir->giga->Update(encoding)) {
+        s = Status::Corruption("Cannot parse dir index");
+      }
+    } else if (s.IsNotFound()) {
+      dir->giga = new DirIndex(zsrv, dir->giga_opts);
+      s = Status::OK();
+    }
+    if (s.ok()) {
+      dir->sizes = new std::vector<uint32_t>(options_.vsrvs, 0);
+      s = db_->CountDirParts(*dir->id, *dir->giga, dir->sizes);
+    }
+  }
+
+  if (!s.ok()) {
+    delete dir->giga_opts;
+    dir->giga_opts = NULL;
+    delete dir->giga;
+    dir->giga = NULL;
+    delete dir->sizes;
+    dir->sizes = NULL;
+    return s;
+  }
 
   dir->fetched = true;
   return s;
@@ -631,17 +1526,19 @@ Status Filesystem::MaybeFetchDir(Dir* dir) {
 // cache but are still in use by some threads. When obtaining a control block,
 // we first look it up at the cache. If we cannot find it, we continue the
 // search at the table. If we still cannot find it, we create a new and insert
-// it into the LRU cache and the hash table.
+// it into the LRU cache and the hash table. All these steps are done within the
+// shard the directory hashes to, so only the lock of that shard is needed.
 Status Filesystem::AcquireDir(const DirId& id, Dir** result) {
-  mutex_.AssertHeld();
   char tmp[30];
   Slice key = LRUKey(id, tmp);
   const uint32_t hash = LRUHash(key);
+  DirShard* const shard = &shards_[ShardOf(hash)];
+  MutexLock lock(&shard->mu);
   Status s;
 
   Dir* dir;
   // We start our search at the LRU cache. If we find it we are done.
-  DirHandl* h = dlru_->Lookup(key, hash);
+  DirHandl* h = shard->lru->Lookup(key, hash);
   if (h != NULL) {
     dir = h->value;
     *result = dir;
@@ -652,7 +1549,7 @@ Status Filesystem::AcquireDir(const DirId& id, Dir** result) {
   // If we cannot find an entry in the cache, we continue our search at the
   // bigger hash table. We cache the cursor position returned by the table so
   // that we can reuse it in the subsequent table insertion.
-  Dir** const pos = dirs_->FindPointer(key, hash);
+  Dir** const pos = shard->dirs->FindPointer(key, hash);
   dir = *pos;
   if (dir != NULL) {
     *result = dir;
@@ -662,7 +1559,7 @@ Status Filesystem::AcquireDir(const DirId& id, Dir** result) {
     // evicted from the cache, this will further defer its deletion from the
     // memory, which is our intention here. Should we reinsert it into the cache
     // though?
-    dlru_->Ref(dir->lru_handle);
+    shard->lru->Ref(dir->lru_handle);
     return s;
   }
 
@@ -680,10 +1577,15 @@ Status Filesystem::AcquireDir(const DirId& id, Dir** result) {
   memset(&dir->busy[0], 0, sizeof(dir->busy));
   dir->giga = NULL;  // To be fetched from db later
   dir->giga_opts = NULL;
+  dir->sizes = NULL;
   dir->fetched = 0;
-  dirs_->Inject(dir, pos);
+  dir->splitting = 0;
+  dir->split_child = 0;
+  dir->split_log = NULL;
+  dir->readers = 0;
+  shard->dirs->Inject(dir, pos);
 
-  h = dlru_->Insert(key, hash, dir, 1, DeleteDir);
+  h = shard->lru->Insert(key, hash, dir, 1, DeleteDir);
   dir->lru_handle = h;
   *result = dir;
   return s;
@@ -698,12 +1600,30 @@ FilesystemOptions::FilesystemOptions()
       vsrvs(1),
       nsrvs(1),
       srvid(0),
-      mydno(0) {}
+      mydno(0),
+      split_threshold(0),
+      split_batch_size(1024),
+      ino_range_size(1 << 20) {}
 
 Filesystem::Filesystem(const FilesystemOptions& options)
-    : inoq_(0), options_(options), db_(NULL), readonly_dbs_(NULL), n_(0) {
-  dlru_ = new LRUCache<DirHandl>(options_.dir_lru_size);
-  dirs_ = new HashTable<Dir>();
+    : inoq_(0),
+      maxino_(0),
+      options_(options),
+      db_(NULL),
+      readonly_dbs_(NULL),
+      n_(0),
+      peers_(NULL),
+      npeers_(0),
+      split_pool_(NULL),
+      split_cv_(&split_mu_),
+      pending_splits_(0) {
+  const size_t per_shard =
+      (options_.dir_lru_size + kNumDirShards - 1) / kNumDirShards;
+  shards_ = new DirShard[kNumDirShards];
+  for (int i = 0; i < kNumDirShards; i++) {
+    shards_[i].lru = new LRUCache<DirHandl>(per_shard);
+    shards_[i].dirs = new HashTable<Dir>();
+  }
 }
 
 void Filesystem::SetReadonlyDbs(FilesystemReadonlyDb** readonly_dbs, size_t n) {
@@ -711,14 +1631,43 @@ void Filesystem::SetReadonlyDbs(FilesystemReadonlyDb** readonly_dbs, size_t n) {
   n_ = n;
 }
 
-void Filesystem::SetDb(FilesystemDb* db) { db_ = db; }
+void Filesystem::SetPeers(FilesystemIf** peers, size_t n) {
+  peers_ = peers;
+  npeers_ = n;
+  if (split_pool_ == NULL && options_.split_threshold != 0) {
+    split_pool_ = ThreadPool::NewFixed(1);
+  }
+}
+
+// Inode numbers reserved before a restart may have been handed out, so
+// allocation resumes from the last reserved inode no.
+Status Filesystem::SetDb(FilesystemDb* db) {
+  db_ = db;
+  uint64_t maxino;
+  Status s = db_->GetMaxIno(&maxino);
+  if (s.ok()) {
+    MutexLock lock(&inoq_mu_);
+    inoq_ = maxino;
+    maxino_ = maxino;
+  }
+  return s;
+}
 
 Filesystem::~Filesystem() {
-  mutex_.Lock();
-  delete dlru_;
-  assert(dirs_->Empty());
-  delete dirs_;
-  mutex_.Unlock();
+  {
+    MutexLock lock(&split_mu_);
+    while (pending_splits_ != 0) {
+      split_cv_.Wait();
+    }
+  }
+  delete split_pool_;
+  for (int i = 0; i < kNumDirShards; i++) {
+    MutexLock lock(&shards_[i].mu);
+    delete shards_[i].lru;
+    assert(shards_[i].dirs->Empty());
+    delete shards_[i].dirs;
+  }
+  delete[] shards_;
 }
 
 }  // namespace pdlfs
@@ -39,7 +39,9 @@
 #include "pdlfs-common/lru.h"
 #include "pdlfs-common/port.h"
 
+#include <vector>
 #if __cplusplus >= 201103L
+#include <atomic>
 #define OVERRIDE override
 #else
 #define OVERRIDE
@@ -47,6 +49,7 @@
 namespace pdlfs {
 
 class DirIndex;
+class ThreadPool;
 class FilesystemDb;
 class FilesystemReadonlyDb;
 
@@ -74,6 +77,27 @@ struct FilesystemOptions {
   // My dnode no for allocating new fids.
   // Default: 0
   uint64_t mydno;
+  // Number of entries a directory partition may hold before it is split in
+  // half and one of the halves is moved to another server. Set to 0 to disable
+  // splitting, in which case each directory is statically hash partitioned
+  // across all virtual servers from the very beginning. Splitting only takes
+  // effect when peers are set (see SetPeers()) and vsrvs is greater than 1.
+  // Default: 0
+  size_t split_threshold;
+  // Max number of entries sent to a peer in a single split call.
+  // Default: 1024
+  size_t split_batch_size;
+  // Secret shared by all servers of a filesystem. Split calls from peers are
+  // only accepted when they carry the same secret. Splits are sent to peers
+  // with it too. Leave empty to reject all split calls.
+  // Default: ""
+  std::string split_secret;
+  // Number of inode numbers reserved in the db at a time. Inode numbers are
+  // only handed out after being reserved so that they are never reused after
+  // a restart. A larger range means fewer db writes but more inode numbers
+  // skipped on each restart.
+  // Default: 1M
+  uint64_t ino_range_size;
 };
 
 class Filesystem : public FilesystemIf {
@@ -94,9 +118,32 @@ class Filesystem : public FilesystemIf {
                        const Slice& name, LookupStat* stat) OVERRIDE;
   virtual Status Lstat(const User& who, const LookupStat& parent,
                        const Slice& name, Stat* stat) OVERRIDE;
+  virtual Status Lstats(const User& who, const LookupStat& parent,
+                        const Slice& namearr, uint32_t n, Stat* stats,
+                        Status* rets) OVERRIDE;
+  virtual Status Readdir(const User& who, const LookupStat& parent,
+                         const Slice& cursor, uint32_t max_bytes,
+                         std::string* entarr, std::string* next) OVERRIDE;
+  virtual Status Split(const Slice& secret, int from, const LookupStat& parent,
+                       int index, SplitPhase phase, const Slice& giga,
+                       const Slice& entarr) OVERRIDE;
+  virtual Status Rdidx(const User& who, const LookupStat& parent,
+                       std::string* giga) OVERRIDE;
+  virtual Status Rsino(const User& who, uint32_t n, uint64_t* dno,
+                       uint64_t* startino) OVERRIDE;
+  // When partition checks are skipped, we cannot tell whether a name is stored
+  // at this server. Only the first name is resolved in that case.
+  virtual Status Resolve(const User& who, const LookupStat& parent,
+                         const Slice& namearr, uint32_t n, LookupStat* stats,
+                         uint32_t* m) OVERRIDE;
 
+  // Set the servers to which directory partitions are migrated when split.
+  // peers[i] is the server whose srvid is i. Peers are not owned by us.
+  void SetPeers(FilesystemIf** peers, size_t n);
   void SetReadonlyDbs(FilesystemReadonlyDb** readonly_dbs, size_t n);
-  void SetDb(FilesystemDb* db);
+  // Set the db and recover the inode allocator from it. Must be called before
+  // any filesystem operations.
+  Status SetDb(FilesystemDb* db);
   // Deterministically calculate a zeroth server based on a specified directory
   // id.
   static uint32_t PickupServer(const DirId& id);
@@ -106,6 +153,8 @@ class Filesystem : public FilesystemIf {
   Status TEST_Mkfle(const User& who, const LookupStat& parent,
                     const Slice& name, const Stat& stat,
                     FilesystemDbStats* stats);
+  // Wait until all directory splits scheduled so far have finished.
+  void TEST_WaitForSplits();
   FilesystemDir* TEST_ProbeDir(const DirId& dir_id);
   const FilesystemDbStats& TEST_FetchDbStats(FilesystemDir* dir);
   void TEST_Release(FilesystemDir* dir);
@@ -129,24 +178,64 @@ class Filesystem : public FilesystemIf {
   Status Lstat1(const User& who, const DirId& at, const Slice& name,
                 const LookupStat& parent, Dir* dir, Stat* stat,
                 FilesystemDbStats* stats);
+  Status Lstats1(const User& who, const DirId& at, const Slice& namearr,
+                 uint32_t n, const LookupStat& parent, Dir* dir, Stat* stats,
+                 Status* rets, FilesystemDbStats* dbstats);
+  Status Readdir1(const User& who, const DirId& at, const Slice& cursor,
+                  uint32_t max_bytes, const LookupStat& parent, Dir* dir,
+                  std::string* entarr, std::string* next);
+  Status Split1(const DirId& at, int from, int index, SplitPhase phase,
+                const Slice& giga, const Slice& entarr, Dir* dir);
+  void MaybeSplitDir(const LookupStat& p, Dir* dir, int index);
+  void LogSplitEntry(Dir* dir, const Slice& name, const Stat& stat);
+  Status SplitDir(const LookupStat& p, Dir* dir, int index);
+  Status CopyDirPart(const LookupStat& p, const DirId& at, int child, int dst,
+                     const Slice& giga, std::vector<std::string>* moved);
+  Status SendSplit(const LookupStat& p, int dst, int child, SplitPhase phase,
+                   const Slice& giga, const Slice& entarr,
+                   std::vector<std::string>* moved);
+  Status AbortSplit(const LookupStat& p, int dst, int child, const Slice& giga,
+                    const std::vector<std::string>& moved);
+  struct SplitTask;
+  static void RunSplit(void* arg);
   Status CheckAndPut(const DirId& at, const Slice& name, const Stat& stat,
                      FilesystemDbStats* stats);
+  Status CheckAndPutBatch(const DirId& at, const Slice* names, size_t n,
+                          const Stat* stats, size_t* m,
+                          FilesystemDbStats* dbstats);
   Status DbGet(const DirId& at, const Slice& name, Stat* stat,
                FilesystemDbStats* stats);
+  Status DbMultiGet(const DirId& at, const Slice* names, size_t n, Stat* stats,
+                    Status* rets, FilesystemDbStats* dbstats);
+  Status RoDbGet(size_t i, const DirId& at, const Slice& name, Stat* stat,
+                 FilesystemDbStats* stats);
+  Status DbReaddir(const DirId& at, const Slice& cursor, uint32_t max_bytes,
+                   std::string* entarr, std::string* next);
 
   // No copying allowed
   void operator=(const Filesystem& fs);
   Filesystem(const Filesystem&);
 
-  port::Mutex mutex_;
-  uint64_t inoq_;  // The last inode no.
+  // The last inode no. Allocated without holding any directory locks.
+  // Inode numbers up to maxino_ have been reserved in the db and are handed
+  // out from memory. Only allocations crossing maxino_ go to the db.
+#if __cplusplus >= 201103L
+  std::atomic<uint64_t> inoq_;
+  std::atomic<uint64_t> maxino_;
+#else
+  uint64_t inoq_;
+  uint64_t maxino_;
+#endif
+  // Serializes inode range reservations. Before C++11, also protects inoq_ and
+  // maxino_.
+  port::Mutex inoq_mu_;
+  // Allocate n new inode numbers and return the last one of them
+  Status NewIno(uint64_t* ino, size_t n = 1);
+  // Reserve inode numbers up to at least ino in the db.
+  // REQUIRES: inoq_mu_ has been locked.
+  Status ReserveInos(uint64_t ino);
   // If the last ino ever assigned is still ino, reduce it by n
-  void TryReuseIno(uint64_t ino, size_t n = 1) {
-    mutex_.AssertHeld();
-    if (ino == inoq_) {
-      inoq_ -= n;
-    }
-  }
+  void TryReuseIno(uint64_t ino, size_t n = 1);
 
   typedef LRUEntry<Dir> DirHandl;
   enum { kWays = 8 };  // Must be a power of 2
@@ -157,6 +246,9 @@ class Filesystem : public FilesystemIf {
     DirHandl* lru_handle;
     DirIndexOptions* giga_opts;
     DirIndex* giga;
+    // Number of entries in each partition of the directory. Only maintained
+    // when directory splitting is enabled.
+    std::vector<uint32_t>* sizes;
     Dir* next_hash;
     FilesystemDbStats* stats;
     Filesystem* fs;
@@ -165,6 +257,14 @@ class Filesystem : public FilesystemIf {
     size_t key_length;
     uint32_t hash;  // Hash of key(); used for fast partitioning and comparisons
     unsigned char fetched;
+    // 0: not splitting, 1: copying the half to be moved, 2: deleting the half
+    // moved and installing the new index. Reads are blocked in phase 2.
+    unsigned char splitting;
+    // The child partition being split off while splitting is not 0, and the
+    // entries inserted into it since the split started.
+    int split_child;
+    std::string* split_log;
+    int readers;  // Number of reads currently going unlocked
     unsigned char busy[kWays];  // True if a name subset is busy
     char key_data[1];           // Beginning of key
 
@@ -174,10 +274,16 @@ class Filesystem : public FilesystemIf {
 
     ///
   };
-  // An LRU cache of directory control blocks is kept in memory. A certain
-  // number of control blocks may be cached in memory. When the maximum is
-  // reached, cache eviction will start.
-  LRUCache<DirHandl>* dlru_;
+  // Directory control blocks are hash-partitioned into a fixed number of
+  // shards. Each shard is protected by its own mutex and has its own LRU cache
+  // and directory table (see below). Operations on different shards therefore
+  // don't contend with each other.
+  enum { kNumDirShardBits = 4, kNumDirShards = 1 << kNumDirShardBits };
+  struct DirShard;
+  DirShard* shards_;
+  static uint32_t ShardOf(uint32_t hash) {
+    return hash >> (32 - kNumDirShardBits);
+  }
   static void DeleteDir(const Slice& key, Dir* dir);
   // Obtain the control block for a specific directory.
   Status AcquireDir(const DirId&, Dir**);
@@ -185,25 +291,22 @@ class Filesystem : public FilesystemIf {
   Status MaybeFetchDir(Dir* dir);
   // Release a reference to a specified directory control block.
   void Release(Dir*);
-  // It is possible for a control block to be evicted from the LRU cache while
-  // the block itself is still being used by some threads. This would cause a
-  // caller seeking the control block to believe that there is no such block in
-  // memory and go create a new control block causing two control blocks of a
-  // single directory to appear in memory. To resolve this problem, we use a
-  // separate table to index all directory control blocks that exist in memory.
-  // A caller is expected to check the table whenever it gets a miss from the
-  // cache. If the caller finds the control block it seeks, it adds a new
-  // reference to the control block (and potentially re-inserts the control
-  // block to the cache). We only keep a certain number of control blocks in
-  // memory. If the maximum is reached, subsequent filesystem operations may be
-  // rejected until slots reappear.
-  HashTable<Dir>* dirs_;
+  // Add a reference to a directory control block already referenced by us.
+  void Ref(Dir*);
 
   // Constant after server opening
   FilesystemOptions options_;
   FilesystemDb* db_;
   FilesystemReadonlyDb** readonly_dbs_;
   size_t n_;
+  FilesystemIf** peers_;
+  size_t npeers_;
+  // Directory splits run in the background so that no client call waits for
+  // a peer. Created when peers are set.
+  ThreadPool* split_pool_;
+  port::Mutex split_mu_;
+  port::CondVar split_cv_;
+  int pending_splits_;  // Splits scheduled but not yet finished
 };
 
 }  // namespace pdlfs
@@ -34,14 +34,20 @@
 #include "fs.h"
 
 #include "fsdb.h"
+#include "fsro.h"
 
 #include "pdlfs-common/leveldb/db.h"
 #include "pdlfs-common/leveldb/options.h"
 
 #include "pdlfs-common/coding.h"
 #include "pdlfs-common/fsdbbase.h"
+#include "pdlfs-common/gigaplus.h"
+#include "pdlfs-common/mutexlock.h"
 #include "pdlfs-common/testharness.h"
 
+#include <stdio.h>
+#include <sys/stat.h>
+
 namespace pdlfs {
 
 class FilesystemTest {
@@ -68,7 +74,7 @@ class FilesystemTest {
     Status s = fsdb_->Open(fsloc);
     if (s.ok()) {
       fs_ = new Filesystem(fsopts_);
-      fs_->SetDb(fsdb_);
+      s = fs_->SetDb(fsdb_);
     }
     return s;
   }
@@ -92,6 +98,48 @@ class FilesystemTest {
     return fs_->Lstat(me_, p, name, &tmp);
   }
 
+  Status ExistAt(FilesystemIf* fs, uint64_t dir_id, const std::string& name) {
+    LookupStat p;
+    p.SetDnodeNo(0);
+    p.SetInodeNo(dir_id);
+    p.SetZerothServer(0);
+    p.SetDirMode(dirmode_);
+    p.SetUserId(0);
+    p.SetGroupId(0);
+    p.SetLeaseDue(due_);
+    p.AssertAllSet();
+    Stat tmp;
+    return fs->Lstat(me_, p, name, &tmp);
+  }
+
+  Status Lstats(uint64_t dir_id, const std::string& namearr, uint32_t n,
+                Stat* stats, Status* rets) {
+    LookupStat p;
+    p.SetDnodeNo(0);
+    p.SetInodeNo(dir_id);
+    p.SetZerothServer(0);
+    p.SetDirMode(dirmode_);
+    p.SetUserId(0);
+    p.SetGroupId(0);
+    p.SetLeaseDue(due_);
+    p.AssertAllSet();
+    return fs_->Lstats(me_, p, namearr, n, stats, rets);
+  }
+
+  Status Readdir(uint64_t dir_id, const std::string& cursor, uint32_t max_bytes,
+                 std::string* entarr, std::string* next) {
+    LookupStat p;
+    p.SetDnodeNo(0);
+    p.SetInodeNo(dir_id);
+    p.SetZerothServer(0);
+    p.SetDirMode(dirmode_);
+    p.SetUserId(0);
+    p.SetGroupId(0);
+    p.SetLeaseDue(due_);
+    p.AssertAllSet();
+    return fs_->Readdir(me_, p, cursor, max_bytes, entarr, next);
+  }
+
   Status BulkIn(uint64_t dir_id, const std::string& table_dir) {
     LookupStat p;
     p.SetDnodeNo(0);
@@ -134,6 +182,31 @@ class FilesystemTest {
     return fs_->Mkfle(me_, p, name, 0660, &tmp);
   }
 
+  // Create a directory beneath a parent directory and return a lease on it.
+  Status MakeDir(const LookupStat& p, const std::string& name,
+                 LookupStat* result) {
+    Stat tmp;
+    Status s = fs_->Mkdir(me_, p, name, dirmode_, &tmp);
+    if (s.ok()) {
+      result->CopyFrom(tmp);
+      result->SetLeaseDue(due_);
+    }
+    return s;
+  }
+
+  LookupStat RootDir() {
+    LookupStat p;
+    p.SetDnodeNo(0);
+    p.SetInodeNo(0);
+    p.SetZerothServer(0);
+    p.SetDirMode(dirmode_);
+    p.SetUserId(0);
+    p.SetGroupId(0);
+    p.SetLeaseDue(due_);
+    p.AssertAllSet();
+    return p;
+  }
+
   uint32_t dirmode_;
   uint64_t due_;
   FilesystemDbOptions fsdbopts_;
@@ -223,6 +296,198 @@ TEST(FilesystemTest, BatchedCreats) {
   ASSERT_EQ(fs_->TEST_LastIno(), 5);
 }
 
+TEST(FilesystemTest, BatchedCreatsWrongPartition) {
+  fsopts_.vsrvs = fsopts_.nsrvs = 2;
+  ASSERT_OK(OpenFilesystem());
+  std::string namearr;
+  std::string mine;
+  char name[20];
+  uint32_t m = 0;
+  for (int i = 0; i < 20; i++) {
+    snprintf(name, sizeof(name), "f%d", i);
+    PutLengthPrefixedSlice(&namearr, name);
+    if (!Exist(0, name).IsAccessDenied()) {
+      PutLengthPrefixedSlice(&mine, name);
+      m++;
+    }
+  }
+  ASSERT_TRUE(m > 0 && m < 20);
+  uint32_t n = 20;
+  ASSERT_TRUE(BatchedCreat(0, namearr, &n).IsAccessDenied());
+  ASSERT_EQ(n, 0);
+  for (int i = 0; i < 20; i++) {
+    snprintf(name, sizeof(name), "f%d", i);
+    Status s = Exist(0, name);
+    ASSERT_TRUE(s.IsNotFound() || s.IsAccessDenied());
+  }
+  n = m;
+  ASSERT_OK(BatchedCreat(0, mine, &n));
+  ASSERT_EQ(n, m);
+}
+
+TEST(FilesystemTest, BatchedLstats) {
+  ASSERT_OK(OpenFilesystem());
+  ASSERT_OK(Creat(0, "a"));
+  ASSERT_OK(Creat(0, "c"));
+  ASSERT_OK(Creat(0, "e"));
+  ASSERT_OK(fsdb_->Flush(true));
+  ASSERT_OK(Creat(0, "d"));
+  ASSERT_OK(Creat(1, "b"));
+  std::string namearr;
+  PutLengthPrefixedSlice(&namearr, "e");
+  PutLengthPrefixedSlice(&namearr, "b");
+  PutLengthPrefixedSlice(&namearr, "a");
+  PutLengthPrefixedSlice(&namearr, "d");
+  PutLengthPrefixedSlice(&namearr, "e");
+  PutLengthPrefixedSlice(&namearr, "c");
+  Stat stats[6];
+  Status rets[6];
+  ASSERT_OK(Lstats(0, namearr, 6, stats, rets));
+  ASSERT_OK(rets[0]);
+  ASSERT_EQ(stats[0].InodeNo(), 3);
+  ASSERT_TRUE(rets[1].IsNotFound());
+  ASSERT_OK(rets[2]);
+  ASSERT_EQ(stats[2].InodeNo(), 1);
+  ASSERT_OK(rets[3]);
+  ASSERT_EQ(stats[3].InodeNo(), 4);
+  ASSERT_OK(rets[4]);
+  ASSERT_EQ(stats[4].InodeNo(), 3);
+  ASSERT_OK(rets[5]);
+  ASSERT_EQ(stats[5].InodeNo(), 2);
+  ASSERT_TRUE(Lstats(0, namearr, 7, stats, rets).IsInvalidArgument());
+  dirmode_ = 0770;
+  ASSERT_TRUE(Lstats(0, namearr, 6, stats, rets).IsAccessDenied());
+}
+
+TEST(FilesystemTest, BatchedLstatsWrongPartition) {
+  fsopts_.vsrvs = fsopts_.nsrvs = 2;
+  ASSERT_OK(OpenFilesystem());
+  std::string namearr;
+  char name[20];
+  int mine = 0;
+  for (int i = 0; i < 20; i++) {
+    snprintf(name, sizeof(name), "f%d", i);
+    Status s = Creat(0, name);
+    if (s.ok()) {
+      mine++;
+    } else {
+      ASSERT_TRUE(s.IsAccessDenied());
+    }
+    PutLengthPrefixedSlice(&namearr, name);
+  }
+  ASSERT_TRUE(mine > 0 && mine < 20);
+  Stat stats[20];
+  Status rets[20];
+  ASSERT_OK(Lstats(0, namearr, 20, stats, rets));
+  for (int i = 0; i < 20; i++) {
+    snprintf(name, sizeof(name), "f%d", i);
+    Status s = Exist(0, name);
+    ASSERT_EQ(s.ok(), rets[i].ok());
+    ASSERT_EQ(s.IsAccessDenied(), rets[i].IsAccessDenied());
+  }
+}
+
+TEST(FilesystemTest, Resolve) {
+  ASSERT_OK(OpenFilesystem());
+  LookupStat a, b;
+  ASSERT_OK(MakeDir(RootDir(), "a", &a));
+  ASSERT_OK(MakeDir(a, "b", &b));
+  ASSERT_OK(Creat(b.InodeNo(), "c"));
+  std::string namearr;
+  PutLengthPrefixedSlice(&namearr, "a");
+  PutLengthPrefixedSlice(&namearr, "b");
+  LookupStat stats[3];
+  uint32_t m;
+  ASSERT_OK(fs_->Resolve(me_, RootDir(), namearr, 2, stats, &m));
+  ASSERT_EQ(m, 2);
+  ASSERT_EQ(stats[0].InodeNo(), a.InodeNo());
+  ASSERT_EQ(stats[1].InodeNo(), b.InodeNo());
+  PutLengthPrefixedSlice(&namearr, "c");
+  ASSERT_TRUE(fs_->Resolve(me_, RootDir(), namearr, 3, stats, &m)
+                  .IsDirExpected());
+  ASSERT_EQ(m, 2);
+  ASSERT_TRUE(fs_->Resolve(me_, RootDir(), namearr, 4, stats, &m)
+                  .IsDirExpected());
+  namearr.clear();
+  PutLengthPrefixedSlice(&namearr, "x");
+  ASSERT_TRUE(fs_->Resolve(me_, RootDir(), namearr, 1, stats, &m).IsNotFound());
+  ASSERT_EQ(m, 0);
+}
+
+TEST(FilesystemTest, ResolveWrongPartition) {
+  fsopts_.vsrvs = fsopts_.nsrvs = 2;
+  ASSERT_OK(OpenFilesystem());
+  // Find a dir that we own and a name beneath it that we do not own
+  LookupStat dir;
+  char name[20];
+  int i = 0;
+  for (;; i++) {
+    snprintf(name, sizeof(name), "d%d", i);
+    if (MakeDir(RootDir(), name, &dir).ok()) break;
+  }
+  std::string namearr;
+  PutLengthPrefixedSlice(&namearr, name);
+  for (i = 0;; i++) {
+    snprintf(name, sizeof(name), "x%d", i);
+    LookupStat tmp;
+    if (MakeDir(dir, name, &tmp).IsAccessDenied()) break;
+  }
+  PutLengthPrefixedSlice(&namearr, name);
+  LookupStat stats[2];
+  uint32_t m;
+  // Resolution stops at the name that we do not own
+  ASSERT_OK(fs_->Resolve(me_, RootDir(), namearr, 2, stats, &m));
+  ASSERT_EQ(m, 1);
+  ASSERT_EQ(stats[0].InodeNo(), dir.InodeNo());
+  // Unless it is the first name
+  namearr.clear();
+  PutLengthPrefixedSlice(&namearr, name);
+  ASSERT_TRUE(fs_->Resolve(me_, dir, namearr, 1, stats, &m).IsAccessDenied());
+  ASSERT_EQ(m, 0);
+}
+
+TEST(FilesystemTest, Readdir) {
+  ASSERT_OK(OpenFilesystem());
+  char name[20];
+  for (int i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "f%03d", i);
+    ASSERT_OK(Creat(0, name));
+    if (i == 50) {
+      ASSERT_OK(fsdb_->Flush(true));
+    }
+  }
+  ASSERT_OK(Creat(1, "x"));
+  std::string cursor;
+  std::string entarr;
+  int pages = 0;
+  int i = 0;
+  do {
+    entarr.clear();
+    ASSERT_OK(Readdir(0, cursor, 100, &entarr, &cursor));
+    ASSERT_TRUE(entarr.size() < 100 + 50);
+    Slice input = entarr;
+    Slice fname;
+    Stat stat;
+    while (!input.empty()) {
+      ASSERT_TRUE(GetLengthPrefixedSlice(&input, &fname));
+      ASSERT_TRUE(stat.DecodeFrom(&input));
+      snprintf(name, sizeof(name), "f%03d", i);
+      ASSERT_EQ(fname, Slice(name));
+      ASSERT_EQ(stat.InodeNo(), i + 1);
+      i++;
+    }
+    pages++;
+  } while (!cursor.empty());
+  ASSERT_EQ(i, 100);
+  ASSERT_TRUE(pages > 1);
+  entarr.clear();
+  ASSERT_OK(Readdir(2, "", 100, &entarr, &cursor));
+  ASSERT_TRUE(entarr.empty());
+  ASSERT_TRUE(cursor.empty());
+  dirmode_ = 0330;
+  ASSERT_TRUE(Readdir(0, "", 100, &entarr, &cursor).IsAccessDenied());
+}
+
 TEST(FilesystemTest, ErrorInBatch) {
   ASSERT_OK(OpenFilesystem());
   std::string namearr;
@@ -245,6 +510,323 @@ TEST(FilesystemTest, ErrorInBatch) {
   ASSERT_EQ(fs_->TEST_LastIno(), 4);
 }
 
+TEST(FilesystemTest, BatchConflictsWithDb) {
+  ASSERT_OK(OpenFilesystem());
+  ASSERT_OK(Creat(0, "c"));
+  std::string namearr;
+  PutLengthPrefixedSlice(&namearr, "d");
+  PutLengthPrefixedSlice(&namearr, "a");
+  PutLengthPrefixedSlice(&namearr, "c");
+  PutLengthPrefixedSlice(&namearr, "b");
+  uint32_t n = 4;
+  ASSERT_CONFLICT(BatchedCreat(0, namearr, &n));
+  ASSERT_EQ(n, 2);
+  ASSERT_OK(Exist(0, "a"));
+  ASSERT_NOTFOUND(Exist(0, "b"));
+  ASSERT_OK(Exist(0, "d"));
+}
+
+TEST(FilesystemTest, InoRecovery) {
+  fsopts_.ino_range_size = 4;
+  ASSERT_OK(OpenFilesystem());
+  ASSERT_OK(Creat(0, "a"));
+  ASSERT_OK(Creat(0, "b"));
+  ASSERT_OK(Creat(0, "c"));
+  ASSERT_EQ(fs_->TEST_LastIno(), 3);
+  // Inode numbers reserved before a restart are skipped
+  delete fs_;
+  fs_ = new Filesystem(fsopts_);
+  ASSERT_OK(fs_->SetDb(fsdb_));
+  ASSERT_EQ(fs_->TEST_LastIno(), 4);
+  ASSERT_OK(Creat(0, "d"));
+  ASSERT_EQ(fs_->TEST_LastIno(), 5);
+  uint64_t dno, startino;
+  ASSERT_OK(fs_->Rsino(me_, 10, &dno, &startino));
+  ASSERT_EQ(startino, 6);
+  ASSERT_EQ(fs_->TEST_LastIno(), 15);
+  delete fs_;
+  fs_ = new Filesystem(fsopts_);
+  ASSERT_OK(fs_->SetDb(fsdb_));
+  ASSERT_EQ(fs_->TEST_LastIno(), 15);
+  ASSERT_OK(Creat(0, "e"));
+  ASSERT_EQ(fs_->TEST_LastIno(), 16);
+}
+
+TEST(FilesystemTest, ReadonlyDbChain) {
+  ASSERT_OK(OpenFilesystem());
+  // Build a chain of two readonly dbs each holding one name
+  std::vector<FilesystemReadonlyDb*> dbs;
+  FilesystemReadonlyDbOptions rodbopts;
+  rodbopts.mem_filter_bits_per_key = 10;
+  for (int i = 0; i < 2; i++) {
+    char tmp[20];
+    snprintf(tmp, sizeof(tmp), "/ro%d", i);
+    const std::string dbloc = fsloc_ + tmp;
+    DestroyDB(dbloc, DBOptions());
+    FilesystemDb db(fsdbopts_, Env::GetUnBufferedIoEnv());
+    ASSERT_OK(db.Open(dbloc));
+    Stat stat;
+    stat.SetDnodeNo(0);
+    stat.SetInodeNo(i + 100);
+    stat.SetChangeTime(0);
+    stat.SetModifyTime(0);
+    stat.SetUserId(0);
+    stat.SetGroupId(0);
+    stat.SetFileSize(0);
+    stat.SetFileMode(S_IFREG);
+    stat.SetZerothServer(-1);
+    snprintf(tmp, sizeof(tmp), "r%d", i);
+    ASSERT_OK(db.Put(DirId(0, 0), tmp, stat, NULL));
+    ASSERT_OK(db.Flush(true));
+  }
+  for (int i = 0; i < 2; i++) {
+    char tmp[20];
+    snprintf(tmp, sizeof(tmp), "/ro%d", i);
+    dbs.push_back(new FilesystemReadonlyDb(rodbopts, Env::Default()));
+    ASSERT_OK(dbs.back()->Open(fsloc_ + tmp));
+  }
+  fs_->SetReadonlyDbs(&dbs[0], dbs.size());
+  ASSERT_OK(Exist(0, "r0"));
+  ASSERT_OK(Exist(0, "r1"));
+  ASSERT_NOTFOUND(Exist(0, "x"));
+  ASSERT_CONFLICT(Creat(0, "r1"));
+  FilesystemDir* const dir = fs_->TEST_ProbeDir(DirId(0, 0));
+  ASSERT_TRUE(dir != NULL);
+  const FilesystemDbStats& stats = fs_->TEST_FetchDbStats(dir);
+  // Lookups only touch the dbs that may hold the names. 7 readonly db lookups
+  // are needed without filters.
+  ASSERT_TRUE(stats.roprobes[0] >= 1);
+  ASSERT_TRUE(stats.roprobes[1] >= 2);
+  ASSERT_TRUE(stats.roskips > 0);
+  ASSERT_EQ(stats.roprobes[0] + stats.roprobes[1] + stats.roskips, 7);
+  fs_->TEST_Release(dir);
+  // Listings merge names from all dbs in name order
+  ASSERT_OK(Creat(0, "a"));
+  ASSERT_OK(Creat(0, "r"));
+  ASSERT_OK(Creat(0, "z"));
+  const char* const expected[] = {"a", "r", "r0", "r1", "z"};
+  const uint32_t max_bytes[] = {1, 100};
+  for (int j = 0; j < 2; j++) {
+    std::string cursor;
+    std::string entarr;
+    int i = 0;
+    do {
+      entarr.clear();
+      ASSERT_OK(Readdir(0, cursor, max_bytes[j], &entarr, &cursor));
+      Slice input = entarr;
+      Slice fname;
+      Stat stat;
+      while (!input.empty()) {
+        ASSERT_TRUE(GetLengthPrefixedSlice(&input, &fname));
+        ASSERT_TRUE(stat.DecodeFrom(&input));
+        ASSERT_TRUE(i < 5);
+        ASSERT_EQ(fname, Slice(expected[i]));
+        i++;
+      }
+    } while (!cursor.empty());
+    ASSERT_EQ(i, 5);
+  }
+  fs_->SetReadonlyDbs(NULL, 0);
+  for (size_t i = 0; i < dbs.size(); i++) {
+    delete dbs[i];
+  }
+}
+
+namespace {
+struct CreatorState {
+  FilesystemTest* t;
+  uint64_t dir_id;
+  int id;
+  int n;
+  port::Mutex* mu;
+  port::CondVar* cv;
+  int* nrunning;
+  Status status;
+};
+
+void CreatorThread(void* arg) {
+  CreatorState* const state = reinterpret_cast<CreatorState*>(arg);
+  char name[50];
+  for (int i = 0; i < state->n && state->status.ok(); i++) {
+    snprintf(name, sizeof(name), "t%d-%d", state->id, i);
+    state->status = state->t->Creat(state->dir_id, name);
+  }
+  MutexLock ml(state->mu);
+  --*state->nrunning;
+  state->cv->SignalAll();
+}
+}  // namespace
+
+// Concurrent file creates in both private and shared directories. Directory
+// control blocks are spread across shards and inode numbers are allocated
+// without a global lock.
+TEST(FilesystemTest, ConcurrentCreats) {
+  fsopts_.dir_lru_size = 2;  // Force control blocks to be evicted
+  ASSERT_OK(OpenFilesystem());
+  port::Mutex mu;
+  port::CondVar cv(&mu);
+  const int k = 8;
+  const int n = 200;
+  int nrunning = k;
+  CreatorState states[k];
+  for (int i = 0; i < k; i++) {
+    states[i].t = this;
+    states[i].dir_id = i % 2 == 0 ? 0 : i;
+    states[i].id = i;
+    states[i].n = n;
+    states[i].mu = &mu;
+    states[i].cv = &cv;
+    states[i].nrunning = &nrunning;
+    Env::Default()->StartThread(CreatorThread, &states[i]);
+  }
+  mu.Lock();
+  while (nrunning != 0) {
+    cv.Wait();
+  }
+  mu.Unlock();
+  char name[50];
+  for (int i = 0; i < k; i++) {
+    ASSERT_OK(states[i].status);
+    for (int j = 0; j < n; j++) {
+      snprintf(name, sizeof(name), "t%d-%d", i, j);
+      ASSERT_OK(Exist(states[i].dir_id, name));
+    }
+  }
+  ASSERT_EQ(fs_->TEST_LastIno(), k * n);
+}
+
+// A directory starts at its zeroth server and is split to the other server once
+// it grows past the split threshold.
+TEST(FilesystemTest, DirSplit) {
+  const int zsrv = DirIndex::MapIndexToServer(
+      0, uint16_t(Filesystem::PickupServer(DirId(0))), 2);
+  fsopts_.split_threshold = 100;
+  fsopts_.split_secret = "secret";
+  fsopts_.vsrvs = fsopts_.nsrvs = 2;
+  fsopts_.srvid = zsrv;
+  ASSERT_OK(OpenFilesystem());
+  const std::string peerloc = fsloc_ + "/peer";
+  DestroyDB(peerloc, DBOptions());
+  FilesystemDb peerdb(fsdbopts_, Env::GetUnBufferedIoEnv());
+  ASSERT_OK(peerdb.Open(peerloc));
+  FilesystemOptions peeropts = fsopts_;
+  peeropts.srvid = 1 - zsrv;
+  Filesystem peer(peeropts);
+  peer.SetDb(&peerdb);
+  FilesystemIf* peers[2];
+  peers[zsrv] = fs_;
+  peers[1 - zsrv] = &peer;
+  fs_->SetPeers(peers, 2);
+  char name[20];
+  for (int i = 0; i < 99; i++) {
+    snprintf(name, sizeof(name), "f%d", i);
+    ASSERT_OK(Creat(0, name));
+  }
+  ASSERT_TRUE(ExistAt(&peer, 0, "f0").IsAccessDenied());
+  ASSERT_OK(Creat(0, "f99"));  // Triggers the split
+  fs_->TEST_WaitForSplits();
+  LookupStat p;
+  p.SetDnodeNo(0);
+  p.SetInodeNo(0);
+  std::string giga;
+  ASSERT_OK(fs_->Rdidx(me_, p, &giga));
+  std::string peer_giga;
+  ASSERT_OK(peer.Rdidx(me_, p, &peer_giga));
+  ASSERT_EQ(giga, peer_giga);
+  int moved = 0;
+  for (int i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "f%d", i);
+    Status s = Exist(0, name);
+    if (s.IsAccessDenied()) {
+      ASSERT_OK(ExistAt(&peer, 0, name));
+      moved++;
+    } else {
+      ASSERT_OK(s);
+      ASSERT_TRUE(ExistAt(&peer, 0, name).IsAccessDenied());
+    }
+  }
+  ASSERT_TRUE(moved > 0 && moved < 100);
+  // The new index is persisted
+  delete fs_;
+  fs_ = new Filesystem(fsopts_);
+  fs_->SetDb(fsdb_);
+  for (int i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "f%d", i);
+    Status s = Exist(0, name);
+    ASSERT_TRUE(s.ok() != ExistAt(&peer, 0, name).ok());
+  }
+}
+
+// A server only accepts a split of a partition owned by the calling server into
+// a child partition owned by us, and only from peers knowing the secret.
+TEST(FilesystemTest, SplitChecks) {
+  const int zsrv = DirIndex::MapIndexToServer(
+      0, uint16_t(Filesystem::PickupServer(DirId(0))), 2);
+  fsopts_.split_threshold = 100;
+  fsopts_.split_secret = "secret";
+  fsopts_.vsrvs = fsopts_.nsrvs = 2;
+  fsopts_.srvid = 1 - zsrv;
+  ASSERT_OK(OpenFilesystem());
+  DirIndexOptions giga_opts;
+  giga_opts.num_virtual_servers = giga_opts.num_servers = 2;
+  DirIndex giga(Filesystem::PickupServer(DirId(0)), &giga_opts);
+  giga.Set(1);
+  std::string encoding = giga.Encode().ToString();
+  std::string moved;  // An entry in the child partition
+  std::string stays;  // An entry in the parent partition
+  char name[20];
+  for (int i = 0; moved.empty() || stays.empty(); i++) {
+    snprintf(name, sizeof(name), "f%d", i);
+    Stat stat;
+    stat.SetDnodeNo(0);
+    stat.SetInodeNo(i + 1);
+    stat.SetZerothServer(0);
+    stat.SetFileMode(0660 | S_IFREG);
+    stat.SetFileSize(0);
+    stat.SetUserId(0);
+    stat.SetGroupId(0);
+    stat.SetChangeTime(0);
+    stat.SetModifyTime(0);
+    char tmp[Stat::kMaxEncodedLength];
+    std::string* const entarr = giga.GetIndex(name) == 1 ? &moved : &stays;
+    if (entarr->empty()) {
+      PutLengthPrefixedSlice(entarr, name);
+      Slice encoded_stat = stat.EncodeTo(tmp);
+      entarr->append(encoded_stat.data(), encoded_stat.size());
+    }
+  }
+  LookupStat p;
+  p.SetDnodeNo(0);
+  p.SetInodeNo(0);
+  p.SetZerothServer(0);
+  p.SetDirMode(dirmode_);
+  p.SetUserId(0);
+  p.SetGroupId(0);
+  p.SetLeaseDue(due_);
+  ASSERT_TRUE(fs_->Split("x", zsrv, p, 1, kSplitCopy, encoding, moved)
+                  .IsAccessDenied());
+  ASSERT_TRUE(fs_->Split("secret", 1 - zsrv, p, 1, kSplitCopy, encoding, moved)
+                  .IsAccessDenied());
+  ASSERT_TRUE(fs_->Split("secret", zsrv, p, 1, kSplitCopy, encoding, stays)
+                  .IsInvalidArgument());
+  // Copied entries stay invisible until the partition is installed
+  ASSERT_OK(fs_->Split("secret", zsrv, p, 1, kSplitCopy, encoding, moved));
+  Slice input = moved;
+  Slice moved_name;
+  ASSERT_TRUE(GetLengthPrefixedSlice(&input, &moved_name));
+  ASSERT_TRUE(Exist(0, moved_name.ToString()).IsAccessDenied());
+  std::string namearr;
+  PutLengthPrefixedSlice(&namearr, moved_name);
+  ASSERT_OK(fs_->Split("secret", zsrv, p, 1, kSplitAbort, encoding, namearr));
+  ASSERT_OK(fs_->Split("secret", zsrv, p, 1, kSplitCommit, encoding, Slice()));
+  ASSERT_TRUE(Exist(0, moved_name.ToString()).IsNotFound());
+  // Neither copies nor aborts are accepted once the partition is installed
+  ASSERT_TRUE(fs_->Split("secret", zsrv, p, 1, kSplitCopy, encoding, moved)
+                  .IsAlreadyExists());
+  ASSERT_OK(fs_->Split("secret", zsrv, p, 1, kSplitCommit, encoding, moved));
+  ASSERT_TRUE(Exist(0, moved_name.ToString()).IsNotFound());
+}
+
 TEST(FilesystemTest, EmptyBulkIn) {
   ASSERT_OK(OpenFilesystem());
   ASSERT_OK(ReopenFilesystem(fsloc_ + "/fs2"));
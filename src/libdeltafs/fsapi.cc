@@ -35,6 +35,14 @@
 
 namespace pdlfs {
 
+Status WrongDirPartition() {
+  return Status::AccessDenied("Wrong dir partition");  ///
+}
+
+bool IsWrongDirPartition(const Status& s) {
+  return s.IsAccessDenied() && s.ToString() == WrongDirPartition().ToString();
+}
+
 FilesystemWrapper::~FilesystemWrapper() {}
 
 FilesystemIf::~FilesystemIf() {}
@@ -73,4 +81,38 @@ Status FilesystemWrapper::Lstat(  ///
   return Status::NotSupported(Slice());
 }
 
+Status FilesystemWrapper::Lstats(  ///
+    const User& who, const LookupStat& parent, const Slice& namearr, uint32_t n,
+    Stat* stats, Status* rets) {
+  return Status::NotSupported(Slice());
+}
+
+Status FilesystemWrapper::Readdir(  ///
+    const User& who, const LookupStat& parent, const Slice& cursor,
+    uint32_t max_bytes, std::string* entarr, std::string* next) {
+  return Status::NotSupported(Slice());
+}
+
+Status FilesystemWrapper::Split(  ///
+    const Slice& secret, int from, const LookupStat& parent, int index,
+    SplitPhase phase, const Slice& giga, const Slice& entarr) {
+  return Status::NotSupported(Slice());
+}
+
+Status FilesystemWrapper::Rdidx(  ///
+    const User& who, const LookupStat& parent, std::string* giga) {
+  return Status::NotSupported(Slice());
+}
+
+Status FilesystemWrapper::Rsino(  ///
+    const User& who, uint32_t n, uint64_t* dno, uint64_t* startino) {
+  return Status::NotSupported(Slice());
+}
+
+Status FilesystemWrapper::Resolve(  ///
+    const User& who, const LookupStat& parent, const Slice& namearr, uint32_t n,
+    LookupStat* stats, uint32_t* m) {
+  return Status::NotSupported(Slice());
+}
+
 }  // namespace pdlfs
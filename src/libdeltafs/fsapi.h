@@ -40,12 +40,22 @@
 
 namespace pdlfs {
 enum LokupMode { kRegular, kBatchedCreats, kBulkIn };
+// Steps of moving a directory partition to a peer server. See Split().
+enum SplitPhase { kSplitCopy, kSplitCommit, kSplitAbort };
 // User id information.
 struct User {
   uint32_t uid;
   uint32_t gid;
 };
 
+// Return the status with which a server rejects a name stored in a directory
+// partition at another server. Clients see it as an AccessDenied status
+// followed by the directory index so that they can retry at the right server.
+Status WrongDirPartition();
+// Return true iff s has been returned by WrongDirPartition(). Only works at
+// the server, as status messages are not sent to clients.
+bool IsWrongDirPartition(const Status& s);
+
 // Filesystem interface at the server side.
 class FilesystemIf {
  public:
@@ -63,6 +73,51 @@ class FilesystemIf {
                        const Slice& name, LookupStat* stat) = 0;
   virtual Status Lstat(const User& who, const LookupStat& parent,
                        const Slice& name, Stat* stat) = 0;
+  // Look up a batch of n names beneath a parent directory. Names are encoded as
+  // a sequence of length-prefixed strings. On OK, rets[i] is set to the result
+  // of looking up the i-th name and stats[i] is set when rets[i] is OK. A
+  // non-OK status is returned when the batch as a whole fails.
+  virtual Status Lstats(const User& who, const LookupStat& parent,
+                        const Slice& namearr, uint32_t n, Stat* stats,
+                        Status* rets) = 0;
+  // List the entries of a parent directory stored at this server in name
+  // order, starting after a given cursor (empty to start from the beginning).
+  // Entries are encoded as in Split() and appended to *entarr until *entarr
+  // reaches max_bytes. On OK, *next is set to the cursor for the next page,
+  // or cleared when no entries remain.
+  virtual Status Readdir(const User& who, const LookupStat& parent,
+                         const Slice& cursor, uint32_t max_bytes,
+                         std::string* entarr, std::string* next) = 0;
+  // Install a directory partition migrated from a peer server as a result of
+  // a directory split. Only peer servers knowing the shared split secret may
+  // call it. from is the server owning the partition being split and index is
+  // the new child partition, which must belong to us under giga, the new
+  // directory index. Entries are copied in one or more kSplitCopy calls and
+  // the child partition is installed by a final kSplitCommit call, which may
+  // carry the last entries. For both, entries are encoded as a sequence of
+  // length-prefixed names each followed by a stat encoding. A kSplitAbort call
+  // removes the copied entries of a failed split and carries length-prefixed
+  // names only. Calls are idempotent so a failed split may simply be retried.
+  virtual Status Split(const Slice& secret, int from, const LookupStat& parent,
+                       int index, SplitPhase phase, const Slice& giga,
+                       const Slice& entarr) = 0;
+  // Return the current encoding of a directory's GIGA+ index.
+  virtual Status Rdidx(const User& who, const LookupStat& parent,
+                       std::string* giga) = 0;
+  // Reserve n inode numbers for a client to assign locally to new files. On
+  // OK, the reserved range starts at *startino and belongs to *dno.
+  virtual Status Rsino(const User& who, uint32_t n, uint64_t* dno,
+                       uint64_t* startino) = 0;
+  // Resolve a path of n names, each beneath the directory found by looking up
+  // the name before it, starting with a parent directory. Names are encoded as
+  // a sequence of length-prefixed strings. Resolution stops early at the first
+  // name not stored at this server. *m is set to the number of names resolved,
+  // and stats[i] is set for each i < *m. Return the status of the first failed
+  // lookup, except that stopping early at a name other than the first one is
+  // not an error.
+  virtual Status Resolve(const User& who, const LookupStat& parent,
+                         const Slice& namearr, uint32_t n, LookupStat* stats,
+                         uint32_t* m) = 0;
 };
 
 #if __cplusplus >= 201103L
@@ -87,6 +142,22 @@ class FilesystemWrapper : public FilesystemIf {
                        const Slice& name, LookupStat* stat) OVERRIDE;
   virtual Status Lstat(const User& who, const LookupStat& parent,
                        const Slice& name, Stat* stat) OVERRIDE;
+  virtual Status Lstats(const User& who, const LookupStat& parent,
+                        const Slice& namearr, uint32_t n, Stat* stats,
+                        Status* rets) OVERRIDE;
+  virtual Status Readdir(const User& who, const LookupStat& parent,
+                         const Slice& cursor, uint32_t max_bytes,
+                         std::string* entarr, std::string* next) OVERRIDE;
+  virtual Status Split(const Slice& secret, int from, const LookupStat& parent,
+                       int index, SplitPhase phase, const Slice& giga,
+                       const Slice& entarr) OVERRIDE;
+  virtual Status Rdidx(const User& who, const LookupStat& parent,
+                       std::string* giga) OVERRIDE;
+  virtual Status Rsino(const User& who, uint32_t n, uint64_t* dno,
+                       uint64_t* startino) OVERRIDE;
+  virtual Status Resolve(const User& who, const LookupStat& parent,
+                         const Slice& namearr, uint32_t n, LookupStat* stats,
+                         uint32_t* m) OVERRIDE;
 };
 #undef OVERRIDE
 
@@ -38,10 +38,14 @@
 #include "pdlfs-common/coding.h"
 #include "pdlfs-common/fsdbbase.h"
 #include "pdlfs-common/gigaplus.h"
+#include "pdlfs-common/hash.h"
 #include "pdlfs-common/mutexlock.h"
 
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <vector>
+
 namespace pdlfs {
 namespace {
 Status Nofs() {  ///
@@ -51,6 +55,28 @@ Status Nofs() {  ///
 
 FilesystemCli::UriMapper::~UriMapper() {}
 
+struct FilesystemCli::DirShard {
+  DirShard()
+      : dirs(NULL), plru(NULL), pars(NULL), stat_cache_hits(0),
+        stat_cache_misses(0) {}
+  port::Mutex mu;
+  // All directories of the shard currently kept in memory.
+  HashTable<Dir>* dirs;
+  Dir dirlist;  // Dummy head of the linked list
+  // We keep an LRU cache of directory partitions in memory so that we can
+  // reuse them when a recent directory partition is accessed. Partitions are
+  // kept in the shard of their directory.
+  LRUCache<PartHandl>* plru;
+  // All directory partition control blocks currently kept in memory. These
+  // include both the control blocks currently referenced by the LRU cache and
+  // the control blocks that have been evicted from the cache but still have
+  // remaining references.
+  HashTable<Partition>* pars;
+  // Stat cache hits and misses at partitions of the shard
+  uint64_t stat_cache_hits;
+  uint64_t stat_cache_misses;
+};
+
 Status FilesystemCli::TEST_Mkfle(  ///
     FilesystemCliCtx* const ctx, const LookupStat& parent, const Slice& fname,
     const Stat& stat, FilesystemDbStats* const stats) {
@@ -58,7 +84,6 @@ Status FilesystemCli::TEST_Mkfle(  ///
   if (fname.empty()) {
     status = Status::AssertionFailed("tgt is empty");
   } else {
-    MutexLock lock(&mutex_);
     Partition* part;
     Dir* dir;
     int i;
@@ -66,9 +91,7 @@ Status FilesystemCli::TEST_Mkfle(  ///
     if (status.ok()) {
       status = AcquirePartition(dir, i, &part);
       if (status.ok()) {
-        mutex_.Unlock();
         status = fs_->TEST_Mkfle(ctx->who, parent, fname, stat, stats);
-        mutex_.Lock();
         Release(part);
       }
       Release(dir);
@@ -102,7 +125,6 @@ Status FilesystemCli::TEST_Lstat(  ///
   if (fname.empty()) {
     status = Status::AssertionFailed("tgt is empty");
   } else {
-    MutexLock lock(&mutex_);
     Partition* part;
     Dir* dir;
     int i;
@@ -110,9 +132,7 @@ Status FilesystemCli::TEST_Lstat(  ///
     if (status.ok()) {
       status = AcquirePartition(dir, i, &part);
       if (status.ok()) {
-        mutex_.Unlock();
         status = fs_->TEST_Lstat(ctx->who, parent, fname, stat, stats);
-        mutex_.Lock();
         Release(part);
       }
       Release(dir);
@@ -139,6 +159,92 @@ Status FilesystemCli::TEST_Lstat(  ///
   return status;
 }
 
+namespace {
+// Jump to the next intermediate component of a path. *p points to a path
+// splitter. Return true and set *name if such a component is found, in which
+// case *p is moved to the splitter preceding the component after it.
+// Otherwise, return false and set *q to the end of the last component of the
+// path, which starts at *p + 1.
+bool NextDirName(const char** p, const char** q, Slice* name) {
+  while (true) {
+    // Jump forward to the next path splitter.
+    // E.g., "/", "/a/b", "/aa/bb/cc/dd".
+    //        ||     | |         |  |
+    //        pq     p q         p  q
+    for (*q = *p + 1; (*q)[0]; (*q)++) {
+      if ((*q)[0] == '/') {
+        break;
+      }
+    }
+    if (!(*q)[0]) {  // End of path
+      return false;
+    }
+    // This skips empty names in the beginning of a path.
+    // E.g., "///", "//a", "/////a/b/c".
+    //         ||    ||        ||
+    //         pq    pq        pq
+    if (*q - *p - 1 == 0) {
+      *p = *q;  // I.e., p++
+      continue;
+    }
+    // Look ahead and skip repeated slashes. E.g., "//a//b", "/a/bb////cc".
+    //                                               | | |      |  |   |
+    //                                               p q c      p  q   c
+    // This also gets rid of potential tailing slashes.
+    // E.g., "/a/b/", "/a/b/c/////".
+    //          | ||       | |    |
+    //          p qc       p q    c
+    const char* c = *q + 1;
+    for (; c[0]; c++) {
+      if (c[0] != '/') {
+        break;
+      }
+    }
+    if (!c[0]) {  // End of path
+      return false;
+    }
+    *name = Slice(*p + 1, *q - *p - 1);
+    *p = c - 1;
+    return true;
+  }
+}
+}  // namespace
+
+// State of a path resolution assisted by servers. Path components are gathered
+// before resolution starts. On the first lease cache miss, the missing
+// component and all components after it are sent to the server owning the
+// missing component in a single rpc. The server resolves them until it reaches
+// a component that it does not own. This is either a resolve rpc, or a
+// compound rpc when a final operation on the last component is piggybacked.
+// Leases for the components resolved by the server are then instantiated and
+// inserted into the lease cache of their partitions as resolution proceeds,
+// without contacting servers. Components left are looked up as usual.
+struct FilesystemCli::Cmpnd {
+  Cmpnd(uint32_t op, uint32_t mode)
+      : op(op), mode(mode), cur(0), sent(false), first(0), nlstats(0),
+        done(false) {}
+
+  // Return true if the current component is to be looked up through the rpc.
+  bool Usable() const { return !sent || cur - first < nlstats; }
+
+  std::vector<Slice> names;  // Intermediate components of the path
+  Slice last;                // The last component of the path
+  // Final operation on the last component. Set to rpc::kNumOps for none.
+  uint32_t op;
+  uint32_t mode;
+  size_t cur;  // Index of the component currently being looked up
+  bool sent;
+  size_t first;  // Index of the first component looked up by the rpc
+  std::vector<LookupStat> lstats;
+  size_t nlstats;  // Number of successful lookups
+  // Set when the final operation has been executed by the server along with
+  // the lookups of all remaining components. The final operation is performed
+  // under the parent directory returned by the resolution in that case.
+  bool done;
+  Status status;
+  Stat stat;
+};
+
 // Relative root of a pathname
 struct FilesystemCli::AT {
   // Look up stat of the parent directory of the relative root
@@ -153,8 +259,9 @@ Status FilesystemCli::Atdir(  ///
   bool has_tailing_slashes(false);
   Lease* parent_dir(NULL);
   Slice tgt;
-  Status status =
-      Resolu(ctx, at, pathname, &parent_dir, &tgt, &has_tailing_slashes);
+  Cmpnd cp(rpc::kNumOps, 0);
+  Status status = Resolu(ctx, at, pathname, &parent_dir, &tgt,
+                         &has_tailing_slashes, PrepareCmpnd(&cp));
   if (status.ok()) {
     if (!tgt.empty()) {
       AT* rv = new AT;
@@ -188,8 +295,9 @@ Status FilesystemCli::BatchInit(  ///
   bool has_tailing_slashes(false);
   Lease* parent_dir(NULL);
   Slice tgt;
-  Status status =
-      Resolu(ctx, at, pathname, &parent_dir, &tgt, &has_tailing_slashes);
+  Cmpnd cp(rpc::kNumOps, 0);
+  Status status = Resolu(ctx, at, pathname, &parent_dir, &tgt,
+                         &has_tailing_slashes, PrepareCmpnd(&cp));
   if (status.ok()) {
     if (!tgt.empty()) {
       Lease* dir_lease;
@@ -225,10 +333,24 @@ Status FilesystemCli::BatchInsert(BAT* bat, const char* name) {
   } else if (!bc->bg_status.ok()) {
     return bc->bg_status;
   }
-  const int i = bc->dir->giga->SelectServer(name);
   bc->mu.Unlock();
-  Status s =
-      Mkfls1(bc->ctx, *lease->rep, name, bc->mode, false, i, &bc->wribufs[i]);
+  Status s;
+  std::string giga;
+  std::vector<int> dsts;
+  bool retry = false;
+  do {
+    int i;
+    {
+      MutexLock dirlock(bc->dir->mu);
+      i = bc->dir->giga->SelectServer(name);
+    }
+    giga.clear();
+    s = Mkfls1(bc->ctx, *lease->rep, name, bc->mode, false, bc->stubs[i],
+               &bc->wribufs[i], &giga);
+    // Names are left in the buffer when it is rejected for being sent to a
+    // wrong partition. They are sent again by later flushes.
+    retry = s.IsAccessDenied() && RerouteBatch(bc, i, giga, &dsts);
+  } while (retry);
   bc->mu.Lock();
   if (!s.ok() && bc->bg_status.ok()) {
     bc->bg_status = s;
@@ -249,14 +371,7 @@ Status FilesystemCli::BatchCommit(BAT* bat) {
   }
   bc->commit_status = 1;
   bc->mu.Unlock();
-  Status s;
-  for (int i = 0; i < srvs_; i++) {
-    s = Mkfls1(bc->ctx, *lease->rep, Slice(), bc->mode, true, i,
-               &bc->wribufs[i]);
-    if (!s.ok()) {
-      break;
-    }
-  }
+  Status s = CommitAll(*lease->rep, bc, NULL);
   bc->mu.Lock();
   bc->commit_status = 2;
   if (!s.ok() && bc->bg_status.ok()) {
@@ -295,13 +410,15 @@ Status FilesystemCli::Destroy(BAT* bat) {
   }
   part->cached_leases->Release(lease->lru_handle);
   part->mu->Unlock();
-  {
+  if (!r) {
+    Release(bc->dir);
     MutexLock lock(&mutex_);
-    if (!r) Release(bc->dir);
-    Release(part);
+    ncontexts_--;
   }
+  Release(part);
   if (!r) {
     delete[] bc->wribufs;
+    delete[] bc->stubs;
     delete bc;
   }
   delete bat;
@@ -320,8 +437,9 @@ Status FilesystemCli::BulkInit(  ///
   bool has_tailing_slashes(false);
   Lease* parent_dir(NULL);
   Slice tgt;
-  Status status =
-      Resolu(ctx, at, pathname, &parent_dir, &tgt, &has_tailing_slashes);
+  Cmpnd cp(rpc::kNumOps, 0);
+  Status status = Resolu(ctx, at, pathname, &parent_dir, &tgt,
+                         &has_tailing_slashes, PrepareCmpnd(&cp));
   if (status.ok()) {
     if (!tgt.empty()) {
       Lease* dir_lease;
@@ -356,7 +474,8 @@ Status FilesystemCli::BulkInsert(BULK* hdl, const char* name) {
   }
   const int i = bk->dir->giga->SelectServer(name);
   bk->mu.Unlock();
-  Status s = Bukin1(bk->ctx, *lease->rep, name, false, i, &bk->bulks[i]);
+  Status s = Bukin1(bk->ctx, *lease->rep, name, false, i, bk->stubs[i],
+                    &bk->bulks[i]);
   bk->mu.Lock();
   if (!s.ok() && bk->bg_status.ok()) {
     bk->bg_status = s;
@@ -377,13 +496,7 @@ Status FilesystemCli::BulkCommit(BULK* hdl) {
   }
   bk->commit_status = 1;
   bk->mu.Unlock();
-  Status s;
-  for (int i = 0; i < srvs_; i++) {
-    s = Bukin1(bk->ctx, *lease->rep, Slice(), true, i, &bk->bulks[i]);
-    if (!s.ok()) {
-      break;
-    }
-  }
+  Status s = CommitAll(*lease->rep, NULL, bk);
   bk->mu.Lock();
   bk->commit_status = 2;
   if (!s.ok() && bk->bg_status.ok()) {
@@ -412,33 +525,115 @@ Status FilesystemCli::Destroy(BULK* hdl) {
   }
   part->cached_leases->Release(lease->lru_handle);
   part->mu->Unlock();
-  {
+  if (!r) {
+    Release(bk->dir);
     MutexLock lock(&mutex_);
-    if (!r) Release(bk->dir);
-    Release(part);
+    ncontexts_--;
   }
+  Release(part);
   if (!r) {
     for (int i = 0; i < srvs_; i++) {
       delete bk->bulks[i].db;
     }
     delete[] bk->bulks;
+    delete[] bk->stubs;
     delete bk;
   }
   delete hdl;
   return Status::OK();
 }
 
+// State shared by per-server commits that are fanned out to background
+// threads. Exactly one of bc and bk is non-NULL.
+struct FilesystemCli::Committer {
+  Committer(FilesystemCli* c, const LookupStat& p, BatchedCreates* b,
+            BulkInserts* k)
+      : cli(c), parent(p), bc(b), bk(k), cv(&mu), remaining(0) {}
+
+  struct Call {
+    Committer* committer;
+    int srv_idx;
+  };
+
+  Status Commit(int i) {
+    if (bc != NULL) {
+      return cli->Mkfls3(parent, bc, i);
+    } else {
+      return cli->Bukin1(bk->ctx, parent, Slice(), true, i, bk->stubs[i],
+                         &bk->bulks[i]);
+    }
+  }
+
+  static void CommitCall(void* arg) {
+    Call* const call = reinterpret_cast<Call*>(arg);
+    Committer* const c = call->committer;
+    Status s = c->Commit(call->srv_idx);
+    MutexLock lock(&c->mu);
+    if (!s.ok() && c->status.ok()) {
+      c->status = s;
+    }
+    assert(c->remaining > 0);
+    c->remaining--;
+    if (!c->remaining) {
+      c->cv.SignalAll();
+    }
+  }
+
+  FilesystemCli* const cli;
+  const LookupStat& parent;
+  BatchedCreates* const bc;
+  BulkInserts* const bk;
+  port::Mutex mu;
+  port::CondVar cv;
+  // State below protected by mu
+  int remaining;
+  Status status;
+};
+
+Status FilesystemCli::CommitAll(  ///
+    const LookupStat& parent, BatchedCreates* const bc, BulkInserts* const bk) {
+  Committer committer(this, parent, bc, bk);
+  if (options_.pool == NULL) {
+    Status s;
+    for (int i = 0; i < srvs_; i++) {
+      s = committer.Commit(i);
+      if (!s.ok()) {
+        break;
+      }
+    }
+    return s;
+  }
+  std::vector<Committer::Call> calls(srvs_);
+  MutexLock lock(&committer.mu);
+  committer.remaining = srvs_;
+  for (int i = 0; i < srvs_; i++) {
+    calls[i].committer = &committer;
+    calls[i].srv_idx = i;
+    options_.pool->Schedule(Committer::CommitCall, &calls[i]);
+  }
+  while (committer.remaining != 0) {
+    committer.cv.Wait();
+  }
+  return committer.status;
+}
+
 Status FilesystemCli::Mkfle(  ///
     FilesystemCliCtx* const ctx, const AT* const at, const char* pathname,
     const uint32_t mode, Stat* const stat) {
   bool has_tailing_slashes(false);
   Lease* parent_dir(NULL);
   Slice tgt;
-  Status status =
-      Resolu(ctx, at, pathname, &parent_dir, &tgt, &has_tailing_slashes);
+  Cmpnd cp(rpc::kMkfle, mode);
+  Status status = Resolu(ctx, at, pathname, &parent_dir, &tgt,
+                         &has_tailing_slashes, PrepareCmpnd(&cp));
   if (status.ok()) {
     if (!tgt.empty() && !has_tailing_slashes) {
-      status = Mkfle1(ctx, *parent_dir->rep, tgt, mode, stat);
+      if (cp.done && !cp.status.IsAccessDenied()) {
+        status = cp.status;
+        if (status.ok()) *stat = cp.stat;
+      } else {
+        status = Mkfle1(ctx, *parent_dir->rep, tgt, mode, stat);
+      }
     } else {
       status = Status::FileExpected("Path is dir");
     }
@@ -455,11 +650,17 @@ Status FilesystemCli::Mkdir(  ///
   bool has_tailing_slashes(false);
   Lease* parent_dir(NULL);
   Slice tgt;
-  Status status =
-      Resolu(ctx, at, pathname, &parent_dir, &tgt, &has_tailing_slashes);
+  Cmpnd cp(rpc::kMkdir, mode);
+  Status status = Resolu(ctx, at, pathname, &parent_dir, &tgt,
+                         &has_tailing_slashes, PrepareCmpnd(&cp));
   if (status.ok()) {
     if (!tgt.empty()) {
-      status = Mkdir1(ctx, *parent_dir->rep, tgt, mode, stat);
+      if (cp.done && !cp.status.IsAccessDenied()) {
+        status = cp.status;
+        if (status.ok()) *stat = cp.stat;
+      } else {
+        status = Mkdir1(ctx, *parent_dir->rep, tgt, mode, stat);
+      }
     } else {  // Special case: pathname is root
       status = Status::AlreadyExists(Slice());
     }
@@ -476,11 +677,17 @@ Status FilesystemCli::Lstat(  ///
   bool has_tailing_slashes(false);
   Lease* parent_dir(NULL);
   Slice tgt;
-  Status status =
-      Resolu(ctx, at, pathname, &parent_dir, &tgt, &has_tailing_slashes);
+  Cmpnd cp(rpc::kLstat, 0);
+  Status status = Resolu(ctx, at, pathname, &parent_dir, &tgt,
+                         &has_tailing_slashes, PrepareCmpnd(&cp));
   if (status.ok()) {
     if (!tgt.empty()) {
-      status = Lstat1(ctx, *parent_dir->rep, tgt, stat);
+      if (cp.done && !cp.status.IsAccessDenied()) {
+        status = cp.status;
+        if (status.ok()) *stat = cp.stat;
+      } else {
+        status = Lstat1(ctx, *parent_dir->rep, tgt, stat);
+      }
       if (has_tailing_slashes) {
         if (!S_ISDIR(stat->FileMode())) {
           status = Status::DirExpected("Not a dir");
@@ -496,12 +703,40 @@ Status FilesystemCli::Lstat(  ///
   return status;
 }
 
+Status FilesystemCli::Lstats(  ///
+    FilesystemCliCtx* const ctx, const AT* const at, const char* pathname,
+    const char* const* names, size_t n, Stat* const stats,
+    Status* const rets) {
+  bool has_tailing_slashes(false);
+  Lease* parent_dir(NULL);
+  Slice tgt;
+  Cmpnd cp(rpc::kNumOps, 0);
+  Status status = Resolu(ctx, at, pathname, &parent_dir, &tgt,
+                         &has_tailing_slashes, PrepareCmpnd(&cp));
+  if (status.ok()) {
+    if (!tgt.empty()) {
+      Lease* dir_lease;
+      status = Lokup(ctx, *parent_dir->rep, tgt, kRegular, &dir_lease);
+      if (status.ok()) {
+        status = Lstats1(ctx, *dir_lease->rep, names, n, stats, rets);
+        Release(dir_lease);
+      }
+    } else {  // Special case: pathname is root
+      status = Lstats1(ctx, *parent_dir->rep, names, n, stats, rets);
+    }
+  }
+  if (parent_dir) {
+    Release(parent_dir);
+  }
+  return status;
+}
+
 // After a call, the caller must release *parent_dir when it is set. *parent_dir
 // may be set even when an non-OK status is returned.
 Status FilesystemCli::Resolu(  ///
     FilesystemCliCtx* const ctx, const AT* const at, const char* pathname,
     Lease** parent_dir, Slice* last_component,  ///
-    bool* has_tailing_slashes) {
+    bool* has_tailing_slashes, Cmpnd* const cp) {
 #define PATH_PREFIX(pathname, remaining_path) \
   Slice(pathname, remaining_path - pathname)
   const char* rp(NULL);  // Remaining path on errors
@@ -516,7 +751,7 @@ Status FilesystemCli::Resolu(  ///
   } else {
     rr = &rtlease_;
   }
-  status = Resolv(ctx, rr, pathname, parent_dir, last_component, &rp);
+  status = Resolv(ctx, rr, pathname, parent_dir, last_component, &rp, cp);
   if (status.IsDirExpected() && rp) {
     return Status::DirExpected(PATH_PREFIX(pathname, rp));
   } else if (status.IsNotFound() && rp) {
@@ -537,7 +772,7 @@ Status FilesystemCli::Resolu(  ///
 Status FilesystemCli::Resolv(  ///
     FilesystemCliCtx* const ctx, Lease* const relative_root,
     const char* pathname, Lease** parent_dir, Slice* last_component,
-    const char** remaining_path) {
+    const char** remaining_path, Cmpnd* const cp) {
   assert(pathname);
   const char* p = pathname;
   const char* q;
@@ -546,49 +781,27 @@ Status FilesystemCli::Resolv(  ///
   Status status;
   Lease* current_parent = relative_root;
   Slice current_name;
-  while (true) {
-    // Jump forward to the next path splitter.
-    // E.g., "/", "/a/b", "/aa/bb/cc/dd".
-    //        ||     | |         |  |
-    //        pq     p q         p  q
-    for (q = p + 1; q[0]; q++) {
-      if (q[0] == '/') {
-        break;
-      }
-    }
-    if (!q[0]) {  // End of path
-      break;
-    }
-    // This skips empty names in the beginning of a path.
-    // E.g., "///", "//a", "/////a/b/c".
-    //         ||    ||        ||
-    //         pq    pq        pq
-    if (q - p - 1 == 0) {
-      p = q;  // I.e., p++
-      continue;
-    }
-    // Look ahead and skip repeated slashes. E.g., "//a//b", "/a/bb////cc".
-    //                                               | | |      |  |   |
-    //                                               p q c      p  q   c
-    // This also gets rid of potential tailing slashes.
-    // E.g., "/a/b/", "/a/b/c/////".
-    //          | ||       | |    |
-    //          p qc       p q    c
-    const char* c = q + 1;
-    for (; c[0]; c++) {
-      if (c[0] != '/') {
-        break;
-      }
+  if (cp != NULL) {
+    const char* pp = p;
+    const char* qq;
+    while (NextDirName(&pp, &qq, &current_name)) {
+      cp->names.push_back(current_name);
     }
-    if (!c[0]) {  // End of path
-      break;
+    cp->last = Slice(pp + 1, qq - pp - 1);
+    // Files cannot be created with tailing slashes
+    if (cp->last.empty() || (cp->op == rpc::kMkfle && qq[0] == '/')) {
+      cp->op = rpc::kNumOps;
     }
-    current_name = Slice(p + 1, q - p - 1);
-    p = c - 1;
-    status = Lokup(ctx, *current_parent->rep, current_name, kRegular, &tmp);
+  }
+  while (NextDirName(&p, &q, &current_name)) {
+    status =
+        Lokup(ctx, *current_parent->rep, current_name, kRegular, &tmp, cp);
     if (status.ok()) {
       Release(current_parent);
       current_parent = tmp;
+      if (cp != NULL) {
+        cp->cur++;
+      }
     } else {
       break;
     }
@@ -610,26 +823,30 @@ Status FilesystemCli::Resolv(  ///
 // errors, no lease will be returned.
 Status FilesystemCli::Lokup(  ///
     FilesystemCliCtx* const ctx, const LookupStat& parent, const Slice& name,
-    LokupMode mode, Lease** stat) {
-  MutexLock lock(&mutex_);
+    LokupMode mode, Lease** stat, Cmpnd* const cp) {
   Dir* dir;
   int i;  // Index of the partition holding the name being looked up
   Status s = AcquireAndFetch(ctx, parent, name, &dir, &i);
   if (s.ok()) {
-    Partition* part;
-    s = AcquirePartition(dir, i, &part);
-    if (s.ok()) {
-      // Lokup1() uses per-partition locking. Unlock here...
-      mutex_.Unlock();
-      s = Lokup1(ctx, parent, name, mode, part, stat);
-      mutex_.Lock();
+    std::string giga;
+    bool retry = false;
+    do {
+      Partition* part;
+      s = AcquirePartition(dir, i, &part);
+      if (!s.ok()) {
+        break;
+      }
+      // Lokup1() uses per-partition locking
+      s = Lokup1(ctx, parent, name, mode, part, stat, &giga, cp);
+      // Retry if the request has been sent to a wrong partition
+      retry = s.IsAccessDenied() && RefreshDir(dir, giga, name, &i);
       // Increase partition reference before returning the lease to the caller
       if (s.ok()) {
         assert(*stat != &rtlease_);
         Ref(part);
       }
       Release(part);
-    }
+    } while (retry);
     Release(dir);
   }
   return s;
@@ -639,14 +856,24 @@ Status FilesystemCli::Lokup(  ///
 Status FilesystemCli::CreateBulkContext(  ///
     FilesystemCliCtx* const ctx, const LookupStat& parent,
     BulkInserts** result) {
-  MutexLock lock(&mutex_);
   Dir* dir;
   Status s = AcquireAndFetch(ctx, parent, Slice(), &dir, NULL);
+  if (s.ok() && !options_.static_partitioning) {
+    s = Rdidx1(ctx, parent, dir);  // Rdidx1() uses per-dir locking
+    if (!s.ok()) {
+      Release(dir);
+    }
+  }
   if (s.ok()) {
     BulkInserts* in = new BulkInserts;
     *result = in;
     in->commit_status = 0;
     in->refs = 0;  // To be incremented by the caller
+    in->stubs = PrepareStubs(ctx);
+    if (!ctx->inoleases_) {
+      ctx->inoleases_ = new FilesystemCliCtx::InoLease[srvs_];
+      memset(ctx->inoleases_, 0, sizeof(FilesystemCliCtx::InoLease) * srvs_);
+    }
     in->bulks = new BulkIn[srvs_];
     for (int i = 0; i < srvs_; i++) {
       in->bulks[i].db = NULL;
@@ -668,6 +895,8 @@ Status FilesystemCli::CreateBulkContext(  ///
     }
     in->dir = dir;
     in->ctx = ctx;
+    MutexLock lock(&mutex_);
+    ncontexts_++;
   }
   return s;
 }
@@ -676,9 +905,14 @@ Status FilesystemCli::CreateBulkContext(  ///
 Status FilesystemCli::CreateBatch(  ///
     FilesystemCliCtx* const ctx, const LookupStat& parent,
     BatchedCreates** result) {
-  MutexLock lock(&mutex_);
   Dir* dir;
   Status s = AcquireAndFetch(ctx, parent, Slice(), &dir, NULL);
+  if (s.ok() && !options_.static_partitioning) {
+    s = Rdidx1(ctx, parent, dir);  // Rdidx1() uses per-dir locking
+    if (!s.ok()) {
+      Release(dir);
+    }
+  }
   if (s.ok()) {
     BatchedCreates* bc = new BatchedCreates;
     *result = bc;
@@ -687,26 +921,25 @@ Status FilesystemCli::CreateBatch(  ///
     bc->mode = 0660;
     bc->commit_status = 0;
     bc->refs = 0;  // To be incremented by the caller
+    bc->stubs = PrepareStubs(ctx);
     bc->wribufs = new WriBuf[srvs_];
     bc->dir = dir;
     bc->ctx = ctx;
+    MutexLock lock(&mutex_);
+    ncontexts_++;
   }
   return s;
 }
 
 // After a successful call, the caller must release *result after use. On
 // errors, no directory handle is returned.
-// REQUIRES: mutex_ has been locked.
 Status FilesystemCli::AcquireAndFetch(  ///
     FilesystemCliCtx* const ctx, const LookupStat& parent, const Slice& name,
     Dir** result, int* i) {
-  mutex_.AssertHeld();
   DirId at(parent);
   Status s = AcquireDir(at, result);
   if (s.ok()) {
-    mutex_.Unlock();  // Fetch1() uses per-dir locking
-    s = Fetch1(ctx, parent, name, *result, i);
-    mutex_.Lock();
+    s = Fetch1(ctx, parent, name, *result, i);  // Fetch1() uses per-dir locking
     if (!s.ok()) {
       Release(*result);
     }
@@ -743,6 +976,24 @@ bool IsDirWriteOk(const FilesystemCliOptions& options, const LookupStat& parent,
   }
 }
 
+// Check if a given user has the "r" permission on a directory based on a lease
+// certificate provided by the user.
+bool IsDirReadOk(const FilesystemCliOptions& options, const LookupStat& dir,
+                 const User& who) {
+  const uint32_t mode = dir.DirMode();
+  if (options.skip_perm_checks) {
+    return true;
+  } else if (who.uid == 0) {
+    return true;
+  } else if (who.uid == uid(dir) && (mode & S_IRUSR) == S_IRUSR) {
+    return true;
+  } else if (who.gid == gid(dir) && (mode & S_IRGRP) == S_IRGRP) {
+    return true;
+  } else {
+    return ((mode & S_IROTH) == S_IROTH);
+  }
+}
+
 // Check if a given user has the "x" permission beneath a parent
 // directory based on a lease certificate provided by the user.
 bool IsLookupOk(const FilesystemCliOptions& options, const LookupStat& parent,
@@ -762,6 +1013,442 @@ bool IsLookupOk(const FilesystemCliOptions& options, const LookupStat& parent,
 }
 }  // namespace
 
+// An asynchronous create or lookup. While the operation is outstanding, it
+// holds a lease on its parent dir and references to the dir and the partition
+// to which its request has been sent.
+struct FilesystemCli::AsyncOp {
+  AsyncOp(ASYNC* a, int t, uint32_t m, Stat* st, Status* s)
+      : as(a),
+        type(t),
+        mode(m),
+        has_tailing_slashes(false),
+        parent_dir(NULL),
+        dir(NULL),
+        part(NULL),
+        srv_idx(0),
+        stat(st),
+        status(s) {}
+
+  ASYNC* const as;
+  const int type;  // Either rpc::kMkfle or rpc::kLstat
+  const uint32_t mode;
+  bool has_tailing_slashes;
+  std::string name;
+  Lease* parent_dir;
+  Dir* dir;
+  Partition* part;
+  int srv_idx;
+  Stat* const stat;
+  Status* const status;
+  rpc::If::Message in;
+  rpc::If::Message out;
+  Status rpc_status;
+};
+
+struct FilesystemCli::ASYNC {
+  ASYNC(FilesystemCliCtx* c, int n)
+      : ctx(c), max_outstanding(n), cv(&mu), outstanding(0) {}
+  FilesystemCliCtx* const ctx;
+  const int max_outstanding;
+  port::Mutex mu;
+  port::CondVar cv;
+  // State below protected by mu
+  std::vector<AsyncOp*> done;  // Completed but not yet finished
+  int outstanding;
+};
+
+Status FilesystemCli::AsyncInit(  ///
+    FilesystemCliCtx* const ctx, const int max_outstanding, ASYNC** result) {
+  if (max_outstanding < 1) {
+    return Status::InvalidArgument("Bad max outstanding operations");
+  }
+  *result = new ASYNC(ctx, max_outstanding);
+  return Status::OK();
+}
+
+void FilesystemCli::AsyncMkfle(  ///
+    ASYNC* const as, const AT* const at, const char* pathname,
+    const uint32_t mode, Stat* const stat, Status* const status) {
+  if (rpc_ == NULL) {
+    *status = Mkfle(as->ctx, at, pathname, mode, stat);
+    return;
+  }
+  AsyncReap(as, as->max_outstanding - 1);
+  AsyncStart(new AsyncOp(as, rpc::kMkfle, mode, stat, status), at, pathname);
+}
+
+void FilesystemCli::AsyncLstat(  ///
+    ASYNC* const as, const AT* const at, const char* pathname,
+    Stat* const stat, Status* const status) {
+  if (rpc_ == NULL) {
+    *status = Lstat(as->ctx, at, pathname, stat);
+    return;
+  }
+  AsyncReap(as, as->max_outstanding - 1);
+  AsyncStart(new AsyncOp(as, rpc::kLstat, 0, stat, status), at, pathname);
+}
+
+void FilesystemCli::AsyncWait(ASYNC* const as) { AsyncReap(as, 0); }
+
+Status FilesystemCli::Destroy(ASYNC* const as) {
+  AsyncWait(as);
+  delete as;
+  return Status::OK();
+}
+
+void FilesystemCli::AsyncStart(  ///
+    AsyncOp* const op, const AT* const at, const char* pathname) {
+  FilesystemCliCtx* const ctx = op->as->ctx;
+  Slice tgt;
+  Status s = Resolu(ctx, at, pathname, &op->parent_dir, &tgt,
+                    &op->has_tailing_slashes);
+  if (s.ok()) {
+    if (op->type == rpc::kMkfle && (tgt.empty() || op->has_tailing_slashes)) {
+      s = Status::FileExpected("Path is dir");
+    } else if (tgt.empty()) {  // Special case: pathname is root
+      *op->stat = rtstat_;
+    } else {
+      op->name = tgt.ToString();
+      const LookupStat& p = *op->parent_dir->rep;
+      if (op->type == rpc::kMkfle) {
+        if (!IsDirWriteOk(options_, p, ctx->who))  // Parental perm checks
+          s = Status::AccessDenied("No write perm");
+      } else {
+        if (!IsLookupOk(options_, p, ctx->who))  // Avoid unnecessary rpc
+          s = Status::AccessDenied("No x perm");
+      }
+      bool cached = false;
+      if (s.ok()) {
+        s = AcquireAndFetch(ctx, p, op->name, &op->dir, &op->srv_idx);
+        if (s.ok()) {
+          s = AcquirePartition(op->dir, op->srv_idx, &op->part);
+          if (!s.ok()) {
+            Release(op->dir);
+            op->dir = NULL;
+          } else if (op->type == rpc::kLstat) {
+            cached = LookupStatCache(op->part, op->name, op->stat, &s);
+            if (cached) {  // Answered locally; no rpc is needed
+              Release(op->part);
+              op->part = NULL;
+              Release(op->dir);
+              op->dir = NULL;
+            }
+          }
+        }
+      }
+      if (cached) {
+        if (s.ok() && op->has_tailing_slashes) {
+          if (!S_ISDIR(op->stat->FileMode())) {
+            s = Status::DirExpected("Not a dir");
+          }
+        }
+      } else if (s.ok()) {
+        if (op->type == rpc::kMkfle) {
+          MkfleOptions opts;
+          opts.parent = &p;
+          opts.name = op->name;
+          opts.mode = op->mode;
+          opts.me = ctx->who;
+          opts.compact_reply = options_.compact_replies;
+          rpc::MkfleCli::EncodeRequest(opts, &op->in);
+        } else {
+          LstatOptions opts;
+          opts.parent = &p;
+          opts.name = op->name;
+          opts.me = ctx->who;
+          opts.compact_reply = options_.compact_replies;
+          rpc::LstatCli::EncodeRequest(opts, &op->in);
+        }
+        ASYNC* const as = op->as;
+        as->mu.Lock();
+        as->outstanding++;
+        as->mu.Unlock();
+        rpc::If* const stub = PrepareStub(ctx, op->srv_idx);
+        stub->AsyncCall(op->in, op->out, AsyncDone, op);
+        return;
+      }
+    }
+  }
+  if (op->parent_dir) {
+    Release(op->parent_dir);
+  }
+  *op->status = s;
+  delete op;
+}
+
+void FilesystemCli::AsyncDone(const Status& status, void* arg) {
+  AsyncOp* const op = reinterpret_cast<AsyncOp*>(arg);
+  op->rpc_status = status;
+  ASYNC* const as = op->as;
+  MutexLock lock(&as->mu);
+  as->done.push_back(op);
+  as->cv.Signal();
+}
+
+void FilesystemCli::AsyncReap(ASYNC* const as, const int n) {
+  std::vector<AsyncOp*> done;
+  MutexLock lock(&as->mu);
+  while (as->outstanding > n) {
+    while (as->done.empty()) {
+      as->cv.Wait();
+    }
+    done.swap(as->done);
+    as->outstanding -= static_cast<int>(done.size());
+    as->mu.Unlock();  // Operations may be resent; unlock here...
+    for (size_t i = 0; i < done.size(); i++) {
+      AsyncFinish(done[i]);
+    }
+    done.clear();
+    as->mu.Lock();
+  }
+}
+
+// Decode the reply of a completed operation and resend it if it has been sent
+// to a wrong partition. Resends are synchronous.
+void FilesystemCli::AsyncFinish(AsyncOp* const op) {
+  FilesystemCliCtx* const ctx = op->as->ctx;
+  const LookupStat& p = *op->parent_dir->rep;
+  std::string giga;
+  Status s = op->rpc_status;
+  if (s.ok()) {
+    if (op->type == rpc::kMkfle) {
+      MkfleOptions opts;
+      opts.parent = &p;
+      opts.compact_reply = options_.compact_replies;
+      MkfleRet ret;
+      ret.stat = op->stat;
+      ret.giga = &giga;
+      s = rpc::MkfleCli::DecodeReply(opts, op->out, &ret);
+    } else {
+      LstatOptions opts;
+      opts.parent = &p;
+      opts.compact_reply = options_.compact_replies;
+      LstatRet ret;
+      ret.stat = op->stat;
+      ret.giga = &giga;
+      s = rpc::LstatCli::DecodeReply(opts, op->out, &ret);
+    }
+  }
+  // Retry if the request has been sent to a wrong partition
+  bool retry = s.IsAccessDenied() && RefreshDir(op->dir, giga, op->name,  ///
+                                                &op->srv_idx);
+  while (retry) {
+    Release(op->part);
+    op->part = NULL;
+    s = AcquirePartition(op->dir, op->srv_idx, &op->part);
+    if (!s.ok()) {
+      break;
+    }
+    if (op->type == rpc::kMkfle) {
+      s = Mkfle2(ctx, p, op->name, op->mode, op->srv_idx, op->stat, &giga);
+    } else {
+      s = Lstat2(ctx, p, op->name, op->srv_idx, op->stat, &giga);
+    }
+    retry = s.IsAccessDenied() && RefreshDir(op->dir, giga, op->name,  ///
+                                             &op->srv_idx);
+  }
+  if (op->part) {
+    UpdateStatCache(op->part, p, op->name, *op->stat, s);
+    Release(op->part);
+  }
+  Release(op->dir);
+  if (s.ok() && op->has_tailing_slashes) {
+    if (!S_ISDIR(op->stat->FileMode())) {
+      s = Status::DirExpected("Not a dir");
+    }
+  }
+  Release(op->parent_dir);
+  *op->status = s;
+  delete op;
+}
+
+// A directory listing consists of a stream of directory entries from each
+// server. Streams are merged into name order by always returning the smallest
+// name among the heads of all streams. Each stream prefetches its next page as
+// soon as it starts consuming a page so that pages from different servers are
+// fetched in parallel with the merge.
+struct FilesystemCli::RDIR {
+  struct Stream {
+    RDIR* rd;
+    rpc::If* stub;
+    Slice input;       // Unconsumed part of the current page
+    std::string page;  // Page being consumed
+    bool last_page;    // True if the current page is the last one
+    // Head of the stream
+    Slice name;
+    Stat stat;
+    bool has_head;
+    bool done;
+    // State below protected by rd->mu
+    std::string next_page;  // Page being prefetched
+    std::string cursor;     // Resume point after the prefetched page
+    Status status;
+    bool fetching;
+  };
+
+  explicit RDIR(int n) : nstreams(n), cv(&mu) { streams = new Stream[n]; }
+  ~RDIR() { delete[] streams; }
+
+  static void FetchCall(void* arg) {
+    Stream* const st = reinterpret_cast<Stream*>(arg);
+    RDIR* const rd = st->rd;
+    std::string entarr;
+    std::string next;
+    // No one else touches the cursor while a fetch is in progress
+    Status s = rd->cli->Readdir2(rd->ctx, rd->dir, st->cursor, st->stub,
+                                 &entarr, &next);
+    MutexLock lock(&rd->mu);
+    st->next_page.swap(entarr);
+    st->cursor.swap(next);
+    st->status = s;
+    st->fetching = false;
+    rd->cv.SignalAll();
+  }
+
+  // REQUIRES: mu has been locked.
+  void StartFetch(Stream* st) {
+    mu.AssertHeld();
+    st->fetching = true;
+    ThreadPool* const pool = cli->options_.pool;
+    if (pool != NULL) {
+      pool->Schedule(FetchCall, st);
+    } else {
+      mu.Unlock();
+      FetchCall(st);
+      mu.Lock();
+    }
+  }
+
+  // Make sure that the stream has a head unless it has been drained.
+  // REQUIRES: mu has been locked.
+  Status Advance(Stream* st) {
+    mu.AssertHeld();
+    while (!st->has_head && !st->done) {
+      if (!st->input.empty()) {
+        if (!GetLengthPrefixedSlice(&st->input, &st->name) ||
+            !st->stat.DecodeFrom(&st->input)) {
+          return Status::Corruption("Bad directory page");
+        }
+        st->has_head = true;
+      } else if (st->last_page) {
+        st->done = true;
+      } else {
+        while (st->fetching) cv.Wait();
+        if (!st->status.ok()) {
+          return st->status;
+        }
+        st->page.swap(st->next_page);
+        st->input = st->page;
+        st->last_page = st->cursor.empty();
+        if (!st->last_page) {
+          StartFetch(st);
+        }
+      }
+    }
+    return Status::OK();
+  }
+
+  FilesystemCli* cli;
+  FilesystemCliCtx* ctx;
+  LookupStat dir;
+  Stream* streams;
+  int nstreams;
+  // Last name returned. Entries being moved by a directory split may be
+  // returned by two servers and are skipped the second time.
+  std::string last;
+  port::Mutex mu;
+  port::CondVar cv;
+};
+
+Status FilesystemCli::Opendir(  ///
+    FilesystemCliCtx* const ctx, const AT* const at, const char* pathname,
+    RDIR** result) {
+  bool has_tailing_slashes(false);
+  Lease* parent_dir(NULL);
+  Slice tgt;
+  LookupStat dir;
+  Cmpnd cp(rpc::kNumOps, 0);
+  Status status = Resolu(ctx, at, pathname, &parent_dir, &tgt,
+                         &has_tailing_slashes, PrepareCmpnd(&cp));
+  if (status.ok()) {
+    if (!tgt.empty()) {
+      Lease* dir_lease;
+      status = Lokup(ctx, *parent_dir->rep, tgt, kRegular, &dir_lease);
+      if (status.ok()) {
+        dir = *dir_lease->rep;
+        Release(dir_lease);
+      }
+    } else {  // Special case: pathname is root
+      dir = *parent_dir->rep;
+    }
+  }
+  if (parent_dir) {
+    Release(parent_dir);
+  }
+  if (status.ok() && !IsDirReadOk(options_, dir, ctx->who)) {
+    status = Status::AccessDenied("No r perm");
+  }
+  if (status.ok()) {
+    RDIR* const rd = new RDIR(srvs_);
+    rd->cli = this;
+    rd->ctx = ctx;
+    rd->dir = dir;
+    for (int i = 0; i < srvs_; i++) {
+      RDIR::Stream* const st = &rd->streams[i];
+      st->rd = rd;
+      st->stub = rpc_ != NULL ? PrepareStub(ctx, i) : NULL;
+      st->last_page = false;
+      st->has_head = false;
+      st->done = false;
+      st->fetching = false;
+    }
+    MutexLock lock(&rd->mu);
+    for (int i = 0; i < srvs_; i++) {
+      rd->StartFetch(&rd->streams[i]);
+    }
+    *result = rd;
+  }
+  return status;
+}
+
+Status FilesystemCli::Readdir(RDIR* const rd, std::string* const name,
+                              Stat* const stat) {
+  MutexLock lock(&rd->mu);
+  for (;;) {
+    RDIR::Stream* min = NULL;
+    for (int i = 0; i < rd->nstreams; i++) {
+      RDIR::Stream* const st = &rd->streams[i];
+      Status s = rd->Advance(st);
+      if (!s.ok()) {
+        return s;
+      } else if (st->has_head && (min == NULL || st->name < min->name)) {
+        min = st;
+      }
+    }
+    if (min == NULL) {
+      return Status::NotFound(Slice());
+    }
+    min->has_head = false;
+    if (min->name != Slice(rd->last) || rd->last.empty()) {
+      rd->last.assign(min->name.data(), min->name.size());
+      name->assign(min->name.data(), min->name.size());
+      *stat = min->stat;
+      return Status::OK();
+    }
+  }
+}
+
+// Wait for all ongoing page fetches before freeing the listing.
+Status FilesystemCli::Destroy(RDIR* const rd) {
+  rd->mu.Lock();
+  for (int i = 0; i < rd->nstreams; i++) {
+    while (rd->streams[i].fetching) rd->cv.Wait();
+  }
+  rd->mu.Unlock();
+  delete rd;
+  return Status::OK();
+}
+
 Status FilesystemCli::Fetch1(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
     Dir* const dir, int* const rv) {
@@ -775,6 +1462,44 @@ Status FilesystemCli::Fetch1(  ///
   return s;
 }
 
+// Obtain the directory index from the zeroth server of a directory and merge
+// it into our view of the directory. Servers do not check partitions for bulk
+// insertions and reject entire batches of creates sent to wrong partitions, so
+// this is done before such operations start routing names to servers. Servers
+// that do not support the call are ignored.
+Status FilesystemCli::Rdidx1(  ///
+    FilesystemCliCtx* const ctx, const LookupStat& p, Dir* const dir) {
+  int i;
+  {
+    MutexLock lock(dir->mu);
+    i = dir->giga->GetServerForIndex(0);
+  }
+  std::string giga;
+  Status s;
+  if (fs_ != NULL) {
+    s = fs_->Rdidx(ctx->who, p, &giga);
+  } else if (rpc_ != NULL) {
+    RdidxOptions opts;
+    opts.parent = &p;
+    opts.me = ctx->who;
+    RdidxRet ret;
+    ret.giga = &giga;
+    rpc::If* const stub = PrepareStub(ctx, i);
+    s = rpc::RdidxCli(stub)(opts, &ret);
+  } else {
+    s = Nofs();
+  }
+  if (s.ok()) {
+    MutexLock lock(dir->mu);
+    if (!dir->giga->Update(giga)) {
+      s = Status::Corruption("Dir index mismatch");
+    }
+  } else if (s.IsNotSupported()) {
+    s = Status::OK();
+  }
+  return s;
+}
+
 // Look up a named directory beneath a specified parent directory. On success, a
 // lease for the stat of the directory being looked up is returned. The returned
 // lease must be released after use. Only valid leases will be returned. Expired
@@ -789,7 +1514,8 @@ Status FilesystemCli::Fetch1(  ///
 // reference must also be released after use.
 Status FilesystemCli::Lokup1(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
-    LokupMode mode, Partition* const part, Lease** stat) {
+    LokupMode mode, Partition* const part, Lease** stat,
+    std::string* const giga, Cmpnd* const cp) {
   if (!IsLookupOk(options_, p, ctx->who))  // Parental perm checks
     return Status::AccessDenied("No x perm");
   Lease* lease;
@@ -798,7 +1524,7 @@ Status FilesystemCli::Lokup1(  ///
   // in the per-partition lease LRU cache, and for lookups in the per-partition
   // lease table.
   const uint32_t hash = Hash(name.data(), name.size(), 0);
-  Status s = Lokup2(ctx, p, name, hash, mode, part, &lease);
+  Status s = Lokup2(ctx, p, name, hash, mode, part, &lease, giga, cp);
   if (s.ok()) {
     if (lease->mode != mode) {
       part->cached_leases->Release(lease->lru_handle);
@@ -829,7 +1555,8 @@ Status FilesystemCli::Lokup1(  ///
 
 Status FilesystemCli::Bukin1(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
-    const bool force_flush, const int i, BulkIn* const buk) {
+    const bool force_flush, const int i, rpc::If* const stub,
+    BulkIn* const buk) {
   Status s;
   MutexLock lock(&buk->mu);
   if (!buk->db) {
@@ -838,30 +1565,56 @@ Status FilesystemCli::Bukin1(  ///
     s = buk->db->Open(buk->dbloc);
   }
   if (s.ok() && !name.empty()) {
-    s = buk->db->Put(DirId(p), name, buk->stat, &buk->stats);
+    s = NextIno(ctx, i, stub, &buk->stat);
+    if (s.ok()) {
+      s = buk->db->Put(DirId(p), name, buk->stat, &buk->stats);
+    }
   }
   if (s.ok() && force_flush) {
     s = buk->db->Flush();
     if (s.ok()) {
       delete buk->db;
       buk->db = NULL;
-      s = Bukin2(ctx, p, buk->dbloc, i);
+      s = Bukin2(ctx, p, buk->dbloc, stub);
     }
   }
   return s;
 }
 
+// Names are double buffered: a full buffer is swapped out and sent to the
+// server without holding buf->mu so that other threads may keep inserting
+// names while the flush is in progress. At most one flush is outstanding per
+// buffer so that names reach the server in the order they are inserted. Names
+// of a failed flush are kept in the buffer.
 Status FilesystemCli::Mkfls1(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
-    const uint32_t mode, const bool force_flush, const int i,
-    WriBuf* const buf) {
+    const uint32_t mode, const bool force_flush, rpc::If* const stub,
+    WriBuf* const buf, std::string* const giga) {
   Status s;
-  MutexLock lock(&buf->mu);  // Shall we use double buffering?
+  MutexLock lock(&buf->mu);
   if (force_flush || buf->n >= options_.batch_size) {
-    s = Mkfls2(ctx, p, buf->namearr, buf->n, mode, i);
-    if (s.ok()) {
-      buf->namearr.resize(0);
+    while (buf->flushing) {
+      buf->cv.Wait();
+    }
+    // Check again as the buffer may have just been flushed by others
+    if (force_flush || buf->n >= options_.batch_size) {
+      buf->namearr.swap(buf->flushbuf);
+      const uint32_t n = buf->n;
       buf->n = 0;
+      buf->flushing = true;
+      buf->mu.Unlock();
+      s = Mkfls2(ctx, p, buf->flushbuf, n, mode, stub, giga);
+      buf->mu.Lock();
+      if (!s.ok()) {
+        // Put names back in front of those inserted during the flush so that
+        // they are sent again by the next flush
+        buf->flushbuf.append(buf->namearr);
+        buf->namearr.swap(buf->flushbuf);
+        buf->n += n;
+      }
+      buf->flushbuf.resize(0);
+      buf->flushing = false;
+      buf->cv.SignalAll();
     }
   }
   if (s.ok() && !name.empty()) {
@@ -871,22 +1624,48 @@ Status FilesystemCli::Mkfls1(  ///
   return s;
 }
 
+// Flush the names buffered for a server. Names rejected for being sent to a
+// wrong partition are rerouted and the servers now owning them are flushed as
+// well.
+Status FilesystemCli::Mkfls3(  ///
+    const LookupStat& p, BatchedCreates* const bc, const int i) {
+  std::vector<int> todo(1, i);
+  std::string giga;
+  Status s;
+  while (s.ok() && !todo.empty()) {
+    const int j = todo.back();
+    todo.pop_back();
+    giga.clear();
+    s = Mkfls1(bc->ctx, p, Slice(), bc->mode, true, bc->stubs[j],
+               &bc->wribufs[j], &giga);
+    if (s.IsAccessDenied() && RerouteBatch(bc, j, giga, &todo)) {
+      s = Status::OK();
+    }
+  }
+  return s;
+}
+
 Status FilesystemCli::Mkfle1(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
     const uint32_t mode, Stat* const stat) {
-  MutexLock lock(&mutex_);
   Dir* dir;
   int i;
   Status s = AcquireAndFetch(ctx, p, name, &dir, &i);
   if (s.ok()) {
-    Partition* part;
-    s = AcquirePartition(dir, i, &part);
-    if (s.ok()) {
-      mutex_.Unlock();  // Mkfle2() is serialized by server; unlock here...
-      s = Mkfle2(ctx, p, name, mode, i, stat);
-      mutex_.Lock();
+    std::string giga;
+    bool retry = false;
+    do {
+      Partition* part;
+      s = AcquirePartition(dir, i, &part);
+      if (!s.ok()) {
+        break;
+      }
+      s = Mkfle2(ctx, p, name, mode, i, stat, &giga);
+      // Retry if the request has been sent to a wrong partition
+      retry = s.IsAccessDenied() && RefreshDir(dir, giga, name, &i);
+      UpdateStatCache(part, p, name, *stat, s);
       Release(part);
-    }
+    } while (retry);
     Release(dir);
   }
   return s;
@@ -895,19 +1674,24 @@ Status FilesystemCli::Mkfle1(  ///
 Status FilesystemCli::Mkdir1(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
     const uint32_t mode, Stat* const stat) {
-  MutexLock lock(&mutex_);
   Dir* dir;
   int i;
   Status s = AcquireAndFetch(ctx, p, name, &dir, &i);
   if (s.ok()) {
-    Partition* part;
-    s = AcquirePartition(dir, i, &part);
-    if (s.ok()) {
-      mutex_.Unlock();  // Mkdir2() is serialized by server; unlock here...
-      s = Mkdir2(ctx, p, name, mode, i, stat);
-      mutex_.Lock();
+    std::string giga;
+    bool retry = false;
+    do {
+      Partition* part;
+      s = AcquirePartition(dir, i, &part);
+      if (!s.ok()) {
+        break;
+      }
+      s = Mkdir2(ctx, p, name, mode, i, stat, &giga);
+      // Retry if the request has been sent to a wrong partition
+      retry = s.IsAccessDenied() && RefreshDir(dir, giga, name, &i);
+      UpdateStatCache(part, p, name, *stat, s);
       Release(part);
-    }
+    } while (retry);
     Release(dir);
   }
   return s;
@@ -916,24 +1700,122 @@ Status FilesystemCli::Mkdir1(  ///
 Status FilesystemCli::Lstat1(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
     Stat* const stat) {
-  MutexLock lock(&mutex_);
   Dir* dir;
   int i;
   Status s = AcquireAndFetch(ctx, p, name, &dir, &i);
   if (s.ok()) {
-    Partition* part;
-    s = AcquirePartition(dir, i, &part);
-    if (s.ok()) {
-      mutex_.Unlock();  // Lstat2() is serialized by server; unlock here...
-      s = Lstat2(ctx, p, name, i, stat);
-      mutex_.Lock();
+    std::string giga;
+    bool retry = false;
+    do {
+      Partition* part;
+      s = AcquirePartition(dir, i, &part);
+      if (!s.ok()) {
+        break;
+      } else if (LookupStatCache(part, name, stat, &s)) {
+        Release(part);
+        break;
+      }
+      s = Lstat2(ctx, p, name, i, stat, &giga);
+      // Retry if the request has been sent to a wrong partition
+      retry = s.IsAccessDenied() && RefreshDir(dir, giga, name, &i);
+      UpdateStatCache(part, p, name, *stat, s);
       Release(part);
-    }
+    } while (retry);
     Release(dir);
   }
   return s;
 }
 
+// Names are grouped by the servers we believe hold them. Names rejected for
+// being sent to a wrong partition are re-sent once our view of the directory is
+// refreshed by the indices piggybacked on the rejections.
+Status FilesystemCli::Lstats1(  ///
+    FilesystemCliCtx* const ctx, const LookupStat& p,
+    const char* const* const names, size_t n, Stat* const stats,
+    Status* const rets) {
+  Dir* dir;
+  int i;
+  Status s = AcquireAndFetch(ctx, p, Slice(), &dir, &i);
+  if (!s.ok()) {
+    return s;
+  }
+  const size_t batch_size = std::max<size_t>(options_.batch_size, 1);
+  std::vector<std::vector<size_t> > todo(srvs_);
+  std::vector<int> srv(n);  // Server each name was last sent to
+  dir->mu->Lock();
+  for (size_t j = 0; j < n; j++) {
+    srv[j] = dir->giga->SelectServer(names[j]);
+    todo[srv[j]].push_back(j);
+  }
+  dir->mu->Unlock();
+  std::vector<std::string> gigas;
+  std::vector<Stat> tmpstats(std::min(batch_size, n));
+  std::vector<Status> tmprets(tmpstats.size());
+  std::string namearr;
+  bool retry = false;
+  do {
+    for (i = 0; s.ok() && i < srvs_; i++) {
+      for (size_t k = 0; k < todo[i].size(); k += batch_size) {
+        const size_t m = std::min(batch_size, todo[i].size() - k);
+        Partition* part;
+        s = AcquirePartition(dir, i, &part);
+        if (!s.ok()) {
+          break;
+        }
+        namearr.clear();
+        for (size_t x = 0; x < m; x++) {
+          PutLengthPrefixedSlice(&namearr, names[todo[i][k + x]]);
+        }
+        std::string giga;
+        s = Lstats2(ctx, p, namearr, m, i, &tmpstats[0], &tmprets[0], &giga);
+        if (s.ok()) {
+          for (size_t x = 0; x < m; x++) {
+            const size_t j = todo[i][k + x];
+            rets[j] = tmprets[x];
+            if (rets[j].ok()) {
+              stats[j] = tmpstats[x];
+            }
+          }
+        }
+        if (!giga.empty()) {
+          gigas.push_back(giga);
+        }
+        Release(part);
+        if (!s.ok()) {
+          break;
+        }
+      }
+    }
+    retry = false;
+    if (s.ok() && !gigas.empty()) {
+      dir->mu->Lock();
+      bool updated = false;
+      for (size_t x = 0; x < gigas.size(); x++) {
+        if (dir->giga->Update(gigas[x])) updated = true;
+      }
+      gigas.clear();
+      for (int x = 0; x < srvs_; x++) {
+        todo[x].clear();
+      }
+      // Only retry names whose server has changed. This bounds the number of
+      // retries as directory indices only grow.
+      for (size_t j = 0; updated && j < n; j++) {
+        if (rets[j].IsAccessDenied()) {
+          const int x = dir->giga->SelectServer(names[j]);
+          if (x != srv[j]) {
+            srv[j] = x;
+            todo[x].push_back(j);
+            retry = true;
+          }
+        }
+      }
+      dir->mu->Unlock();
+    }
+  } while (retry);
+  Release(dir);
+  return s;
+}
+
 // Look for a lease. Dynamically instantiate a new lease when none can be found
 // locally or the one we find has already expired. When dynamically
 // instantiating a lease, the specified lookup mode will be checked and the
@@ -946,7 +1828,7 @@ Status FilesystemCli::Lstat1(  ///
 Status FilesystemCli::Lokup2(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
     const uint32_t hash, LokupMode mode, Partition* const part,
-    Lease** const stat) {
+    Lease** const stat, std::string* const giga, Cmpnd* const cp) {
   part->mu->AssertHeld();
   Lease* lease;
   Status s;
@@ -958,9 +1840,9 @@ Status FilesystemCli::Lokup2(  ///
     lease = h->value;
     if (lease->rep->LeaseDue() < CurrentMicros()) {
       ht->Remove(lease);  // Lease expired; remove it from the partition
-      lru->Erase(h);
       lease->out = true;
       lru->Release(h);
+      lru->Erase(name, hash);  // h must not be used after its release
     } else {
       // Directly return the cached lease
       assert(lease->lru_handle == h);
@@ -994,9 +1876,9 @@ Status FilesystemCli::Lokup2(  ///
     lease = h->value;
     if (lease->rep->LeaseDue() < CurrentMicros()) {
       ht->Remove(lease);  // Lease expired; remove it from the partition
-      lru->Erase(h);
       lease->out = true;
       lru->Release(h);
+      lru->Erase(name, hash);  // h must not be used after its release
     } else {
       assert(lease->lru_handle == h);
       *stat = lease;
@@ -1021,6 +1903,26 @@ Status FilesystemCli::Lokup2(  ///
     LookupStat* tmp = new LookupStat;
     if (fs_ != NULL) {
       s = fs_->Lokup(ctx->who, p, name, tmp);
+      if (s.IsAccessDenied()) {
+        fs_->Rdidx(ctx->who, p, giga);
+      }
+    } else if (rpc_ != NULL && cp != NULL && cp->Usable()) {
+      assert(cp->cur < cp->names.size());
+      if (!cp->sent) {
+        cp->sent = true;
+        cp->first = cp->cur;
+        rpc::If* const stub = PrepareStub(ctx, part->index);
+        if (cp->op != rpc::kNumOps) {
+          s = Cmpnd2(ctx, p, stub, cp, giga);
+        } else {
+          s = Resolve2(ctx, p, stub, cp, giga);
+        }
+      }
+      // Names resolved by the server are returned regardless of the status
+      if (cp->cur - cp->first < cp->nlstats) {
+        *tmp = cp->lstats[cp->cur - cp->first];
+        s = Status::OK();
+      }
     } else if (rpc_ != NULL) {
       LokupOptions opts;
       opts.parent = &p;
@@ -1028,6 +1930,7 @@ Status FilesystemCli::Lokup2(  ///
       opts.me = ctx->who;
       LokupRet ret;
       ret.stat = tmp;
+      ret.giga = giga;
       rpc::If* const stub = PrepareStub(ctx, part->index);
       s = rpc::LokupCli(stub)(opts, &ret);
     } else {
@@ -1094,7 +1997,7 @@ Status FilesystemCli::Lokup2(  ///
 
 Status FilesystemCli::Bukin2(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const std::string& bkdir,
-    const int i) {
+    rpc::If* const stub) {
   if (!IsDirWriteOk(options_, p, ctx->who))  // Parental perm checks
     return Status::AccessDenied("No write perm");
   Status s;
@@ -1106,7 +2009,6 @@ Status FilesystemCli::Bukin2(  ///
     opts.dir = bkdir;
     opts.me = ctx->who;
     BukinRet ret;
-    rpc::If* const stub = PrepareStub(ctx, i);
     s = rpc::BukinCli(stub)(opts, &ret);
   } else {
     s = Nofs();
@@ -1117,12 +2019,16 @@ Status FilesystemCli::Bukin2(  ///
 
 Status FilesystemCli::Mkfls2(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& namearr,
-    uint32_t n, const uint32_t mode, const int i) {
+    uint32_t n, const uint32_t mode, rpc::If* const stub,
+    std::string* const giga) {
   if (!IsDirWriteOk(options_, p, ctx->who))  // Parental perm checks
     return Status::AccessDenied("No write perm");
   Status s;
   if (fs_ != NULL) {
     s = fs_->Mkfls(ctx->who, p, namearr, mode, &n);
+    if (s.IsAccessDenied()) {
+      fs_->Rdidx(ctx->who, p, giga);
+    }
   } else if (rpc_ != NULL) {
     MkflsOptions opts;
     opts.parent = &p;
@@ -1131,7 +2037,7 @@ Status FilesystemCli::Mkfls2(  ///
     opts.n = n;
     opts.me = ctx->who;
     MkflsRet ret;
-    rpc::If* const stub = PrepareStub(ctx, i);
+    ret.giga = giga;
     s = rpc::MkflsCli(stub)(opts, &ret);
   } else {
     s = Nofs();
@@ -1142,20 +2048,26 @@ Status FilesystemCli::Mkfls2(  ///
 
 Status FilesystemCli::Mkfle2(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
-    const uint32_t mode, const int i, Stat* const stat) {
+    const uint32_t mode, const int i, Stat* const stat,
+    std::string* const giga) {
   if (!IsDirWriteOk(options_, p, ctx->who))  // Parental perm checks
     return Status::AccessDenied("No write perm");
   Status s;
   if (fs_ != NULL) {
     s = fs_->Mkfle(ctx->who, p, name, mode, stat);
+    if (s.IsAccessDenied()) {
+      fs_->Rdidx(ctx->who, p, giga);
+    }
   } else if (rpc_ != NULL) {
     MkfleOptions opts;
     opts.parent = &p;
     opts.name = name;
     opts.mode = mode;
     opts.me = ctx->who;
+    opts.compact_reply = options_.compact_replies;
     MkfleRet ret;
     ret.stat = stat;
+    ret.giga = giga;
     rpc::If* const stub = PrepareStub(ctx, i);
     s = rpc::MkfleCli(stub)(opts, &ret);
   } else {
@@ -1167,20 +2079,26 @@ Status FilesystemCli::Mkfle2(  ///
 
 Status FilesystemCli::Mkdir2(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
-    const uint32_t mode, const int i, Stat* const stat) {
+    const uint32_t mode, const int i, Stat* const stat,
+    std::string* const giga) {
   if (!IsDirWriteOk(options_, p, ctx->who))  // Parental perm checks
     return Status::AccessDenied("No write perm");
   Status s;
   if (fs_ != NULL) {
     s = fs_->Mkdir(ctx->who, p, name, mode, stat);
+    if (s.IsAccessDenied()) {
+      fs_->Rdidx(ctx->who, p, giga);
+    }
   } else if (rpc_ != NULL) {
     MkdirOptions opts;
     opts.parent = &p;
     opts.name = name;
     opts.mode = mode;
     opts.me = ctx->who;
+    opts.compact_reply = options_.compact_replies;
     MkdirRet ret;
     ret.stat = stat;
+    ret.giga = giga;
     rpc::If* const stub = PrepareStub(ctx, i);
     s = rpc::MkdirCli(stub)(opts, &ret);
   } else {
@@ -1192,19 +2110,24 @@ Status FilesystemCli::Mkdir2(  ///
 
 Status FilesystemCli::Lstat2(  ///
     FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& name,
-    const int i, Stat* const stat) {
+    const int i, Stat* const stat, std::string* const giga) {
   if (!IsLookupOk(options_, p, ctx->who))  // Avoid unnecessary server rpc
     return Status::AccessDenied("No x perm");
   Status s;
   if (fs_ != NULL) {
     s = fs_->Lstat(ctx->who, p, name, stat);
+    if (s.IsAccessDenied()) {
+      fs_->Rdidx(ctx->who, p, giga);
+    }
   } else if (rpc_ != NULL) {
     LstatOptions opts;
     opts.parent = &p;
     opts.name = name;
     opts.me = ctx->who;
+    opts.compact_reply = options_.compact_replies;
     LstatRet ret;
     ret.stat = stat;
+    ret.giga = giga;
     rpc::If* const stub = PrepareStub(ctx, i);
     s = rpc::LstatCli(stub)(opts, &ret);
   } else {
@@ -1214,6 +2137,189 @@ Status FilesystemCli::Lstat2(  ///
   return s;
 }
 
+Status FilesystemCli::Readdir2(  ///
+    FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& cursor,
+    rpc::If* const stub, std::string* const entarr, std::string* const next) {
+  Status s;
+  if (fs_ != NULL) {
+    entarr->clear();
+    s = fs_->Readdir(ctx->who, p, cursor,
+                     static_cast<uint32_t>(options_.readdir_page_size), entarr,
+                     next);
+  } else if (rpc_ != NULL) {
+    ReaddirOptions opts;
+    opts.parent = &p;
+    opts.cursor = cursor;
+    opts.max_bytes = static_cast<uint32_t>(options_.readdir_page_size);
+    opts.me = ctx->who;
+    ReaddirRet ret;
+    ret.entarr = entarr;
+    ret.next = next;
+    s = rpc::ReaddirCli(stub)(opts, &ret);
+  } else {
+    s = Nofs();
+  }
+
+  return s;
+}
+
+Status FilesystemCli::Lstats2(  ///
+    FilesystemCliCtx* const ctx, const LookupStat& p, const Slice& namearr,
+    const uint32_t n, const int i, Stat* const stats, Status* const rets,
+    std::string* const giga) {
+  if (!IsLookupOk(options_, p, ctx->who))  // Avoid unnecessary server rpc
+    return Status::AccessDenied("No x perm");
+  Status s;
+  if (fs_ != NULL) {
+    s = fs_->Lstats(ctx->who, p, namearr, n, stats, rets);
+    for (uint32_t j = 0; s.ok() && j < n; j++) {
+      if (rets[j].IsAccessDenied()) {
+        fs_->Rdidx(ctx->who, p, giga);
+        break;
+      }
+    }
+  } else if (rpc_ != NULL) {
+    LstatsOptions opts;
+    opts.parent = &p;
+    opts.namearr = namearr;
+    opts.n = n;
+    opts.me = ctx->who;
+    opts.compact_reply = options_.compact_replies;
+    LstatsRet ret;
+    ret.stats = stats;
+    ret.rets = rets;
+    ret.giga = giga;
+    rpc::If* const stub = PrepareStub(ctx, i);
+    s = rpc::LstatsCli(stub)(opts, &ret);
+  } else {
+    s = Nofs();
+  }
+
+  return s;
+}
+
+Status FilesystemCli::Rsino2(  ///
+    FilesystemCliCtx* const ctx, uint32_t n, rpc::If* const stub,
+    uint64_t* const dno, uint64_t* const startino) {
+  Status s;
+  if (fs_ != NULL) {
+    s = fs_->Rsino(ctx->who, n, dno, startino);
+  } else if (rpc_ != NULL) {
+    RsinoOptions opts;
+    opts.n = n;
+    opts.me = ctx->who;
+    RsinoRet ret;
+    s = rpc::RsinoCli(stub)(opts, &ret);
+    if (s.ok()) {
+      *dno = ret.dno;
+      *startino = ret.startino;
+    }
+  } else {
+    s = Nofs();
+  }
+
+  return s;
+}
+
+Status FilesystemCli::Cmpnd2(  ///
+    FilesystemCliCtx* const ctx, const LookupStat& p, rpc::If* const stub,
+    Cmpnd* const cp, std::string* const giga) {
+  std::vector<CmpndSubOp> ops;
+  for (size_t j = cp->cur; j < cp->names.size(); j++) {
+    CmpndSubOp sub;
+    sub.op = rpc::kLokup;
+    sub.name = cp->names[j];
+    sub.mode = 0;
+    ops.push_back(sub);
+  }
+  const size_t nlookups = ops.size();
+  assert(cp->op != rpc::kNumOps);
+  CmpndSubOp sub;
+  sub.op = cp->op;
+  sub.name = cp->last;
+  sub.mode = cp->mode;
+  ops.push_back(sub);
+  cp->lstats.resize(ops.size());
+  std::vector<Stat> stats(ops.size());
+  CmpndOptions opts;
+  opts.parent = &p;
+  opts.ops = &ops[0];
+  opts.n = static_cast<uint32_t>(ops.size());
+  opts.me = ctx->who;
+  CmpndRet ret;
+  ret.lstats = &cp->lstats[0];
+  ret.stats = &stats[0];
+  ret.giga = giga;
+  Status s = rpc::CmpndCli(stub)(opts, &ret);
+  cp->nlstats = std::min<size_t>(ret.n, nlookups);
+  if (ret.n > nlookups) {
+    cp->done = true;
+    cp->stat = stats[nlookups];
+  } else if (ret.n == nlookups) {
+    cp->done = true;
+    cp->status = s;  // Status of the final operation
+  }
+  return s;
+}
+
+Status FilesystemCli::Resolve2(  ///
+    FilesystemCliCtx* const ctx, const LookupStat& p, rpc::If* const stub,
+    Cmpnd* const cp, std::string* const giga) {
+  // Components beyond the server's limit are looked up individually later
+  const size_t n = std::min<size_t>(cp->names.size() - cp->cur,
+                                    rpc::kMaxResolveDepth);
+  std::string namearr;
+  for (size_t j = cp->cur; j < cp->cur + n; j++) {
+    PutLengthPrefixedSlice(&namearr, cp->names[j]);
+  }
+  cp->lstats.resize(n);
+  ResolveOptions opts;
+  opts.parent = &p;
+  opts.namearr = namearr;
+  opts.n = static_cast<uint32_t>(cp->lstats.size());
+  opts.me = ctx->who;
+  ResolveRet ret;
+  ret.stats = &cp->lstats[0];
+  ret.giga = giga;
+  Status s = rpc::ResolveCli(stub)(opts, &ret);
+  cp->nlstats = ret.m;
+  return s;
+}
+
+FilesystemCli::Cmpnd* FilesystemCli::PrepareCmpnd(Cmpnd* const cp) {
+  if (rpc_ == NULL ||
+      (!options_.compound_lookups && !options_.server_resolution)) {
+    return NULL;
+  } else if (!options_.compound_lookups) {
+    cp->op = rpc::kNumOps;
+  } else if (cp->op == rpc::kMkfle || cp->op == rpc::kMkdir) {
+    MutexLock lock(&mutex_);
+    if (ncontexts_ != 0) {
+      cp->op = rpc::kNumOps;
+    }
+  }
+  return cp;
+}
+
+Status FilesystemCli::NextIno(  ///
+    FilesystemCliCtx* const ctx, const int i, rpc::If* const stub,
+    Stat* const stat) {
+  assert(ctx->inoleases_ != NULL);
+  FilesystemCliCtx::InoLease* const lease = &ctx->inoleases_[i];
+  if (lease->next == lease->end) {
+    const uint32_t n = std::max<uint32_t>(options_.ino_lease_size, 1);
+    Status s = Rsino2(ctx, n, stub, &lease->dno, &lease->next);
+    if (!s.ok()) {
+      lease->next = lease->end = 0;
+      return s;
+    }
+    lease->end = lease->next + n;
+  }
+  stat->SetDnodeNo(lease->dno);
+  stat->SetInodeNo(lease->next++);
+  return Status::OK();
+}
+
 rpc::If* FilesystemCli::PrepareStub(  ///
     FilesystemCliCtx* const ctx, const int srv_idx) {
   assert(srv_idx < srvs_);
@@ -1222,9 +2328,13 @@ rpc::If* FilesystemCli::PrepareStub(  ///
     memset(ctx->stubs_, 0, sizeof(rpc::If*) * srvs_ * ports_per_srv_);
     ctx->n_ = srvs_ * ports_per_srv_;
   }
+  // Contexts are spread across the ports of a server by hash, each always
+  // using the same port so that its requests are handled by the same channel
   int port_idx = 0;
   if (ports_per_srv_ > 1) {
-    port_idx = int(ctx->rnd_.Next()) % ports_per_srv_;
+    char tmp[4];
+    EncodeFixed32(tmp, ctx->seed_);
+    port_idx = int(Hash(tmp, sizeof(tmp), srv_idx) % ports_per_srv_);
   }
   int i = srv_idx * ports_per_srv_ + port_idx;
   if (!ctx->stubs_[i]) {
@@ -1233,6 +2343,17 @@ rpc::If* FilesystemCli::PrepareStub(  ///
   return ctx->stubs_[i];
 }
 
+// Return an array of stubs, one per server. Each stub is owned by the context
+// but the array is owned by the caller. Return an array of NULLs when not
+// using rpc.
+rpc::If** FilesystemCli::PrepareStubs(FilesystemCliCtx* const ctx) {
+  rpc::If** const stubs = new rpc::If*[srvs_];
+  for (int i = 0; i < srvs_; i++) {
+    stubs[i] = rpc_ != NULL ? PrepareStub(ctx, i) : NULL;
+  }
+  return stubs;
+}
+
 // This function is called when the last reference to a lease of a parent
 // directory is released. It deletes the lease by freeing its memory and
 // removing its record from its parent lease table. Future lookups to the
@@ -1258,7 +2379,6 @@ void FilesystemCli::Release(Lease* lease) {
   part->mu->Lock();
   part->cached_leases->Release(lease->lru_handle);
   part->mu->Unlock();
-  MutexLock lock(&mutex_);
   Release(part);
 }
 
@@ -1266,7 +2386,6 @@ uint32_t FilesystemCli::TEST_TotalLeasesAtPartition(const DirId& at, int ix) {
   uint32_t rv(0);
   Partition* part;
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
     s = AcquirePartition(dir, ix, &part);
@@ -1284,7 +2403,6 @@ uint32_t FilesystemCli::TEST_TotalLeasesAtPartition(const DirId& at, int ix) {
 Status FilesystemCli::TEST_ProbePartition(const DirId& at, int ix) {
   Partition* part;
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
     s = AcquirePartition(dir, ix, &part);
@@ -1298,7 +2416,6 @@ Status FilesystemCli::TEST_ProbePartition(const DirId& at, int ix) {
 
 Status FilesystemCli::TEST_ProbeDir(const DirId& at) {
   Dir* dir;
-  MutexLock lock(&mutex_);
   Status s = AcquireDir(at, &dir);
   if (s.ok()) {
     Release(dir);
@@ -1307,13 +2424,21 @@ Status FilesystemCli::TEST_ProbeDir(const DirId& at) {
 }
 
 uint32_t FilesystemCli::TEST_TotalPartitionsInMemory() {
-  MutexLock lock(&mutex_);
-  return pars_->Size();
+  uint32_t result = 0;
+  for (int i = 0; i < kNumDirShards; i++) {
+    MutexLock lock(&shards_[i].mu);
+    result += shards_[i].pars->Size();
+  }
+  return result;
 }
 
 uint32_t FilesystemCli::TEST_TotalDirsInMemory() {
-  MutexLock lock(&mutex_);
-  return dirs_->Size();
+  uint32_t result = 0;
+  for (int i = 0; i < kNumDirShards; i++) {
+    MutexLock lock(&shards_[i].mu);
+    result += shards_[i].dirs->Size();
+  }
+  return result;
 }
 
 namespace {
@@ -1355,12 +2480,21 @@ void LIST_Append(E* e, E* list) {
 
 }  // namespace
 
-void FilesystemCli::Release(Dir* dir) {
-  mutex_.AssertHeld();
+// Release a reference to a directory control block.
+void FilesystemCli::Release(Dir* const dir) {
+  MutexLock lock(&shards_[ShardOf(dir->hash)].mu);
+  Unref(dir);
+}
+
+// Delete the control block when the last reference is removed.
+// REQUIRES: the shard of the dir has been locked.
+void FilesystemCli::Unref(Dir* const dir) {
+  DirShard* const shard = &shards_[ShardOf(dir->hash)];
+  shard->mu.AssertHeld();
   assert(dir->refs != 0);
   dir->refs--;
   if (!dir->refs) {
-    dirs_->Remove(dir->key(), dir->hash);
+    shard->dirs->Remove(dir->key(), dir->hash);
     LIST_Remove(dir);
     delete dir->id;
     delete dir->giga_opts;
@@ -1382,24 +2516,89 @@ Status FilesystemCli::FetchDir(uint32_t zeroth_server, Dir* dir) {
   dir->giga_opts->num_virtual_servers = srvs_;
   dir->giga_opts->num_servers = srvs_;
 
+  // Unless partitioning is static, a directory is assumed to consist of a
+  // single partition at its zeroth server until servers tell us otherwise.
   const uint32_t zsrv = Filesystem::PickupServer(*dir->id);
   dir->giga = new DirIndex(zsrv, dir->giga_opts);
-  dir->giga->SetAll();
+  if (options_.static_partitioning) {
+    dir->giga->SetAll();
+  }
 
   dir->fetched = true;
   return s;
 }
 
-// REQUIRES: mutex_ has been locked.
+bool FilesystemCli::RefreshDir(  ///
+    Dir* const dir, const Slice& giga, const Slice& name, int* const srv_idx) {
+  MutexLock lock(dir->mu);
+  if (giga.empty() || !dir->giga->Update(giga)) {
+    return false;
+  }
+  const int i = dir->giga->SelectServer(name);
+  if (i != *srv_idx) {
+    *srv_idx = i;
+    return true;
+  } else {
+    return false;
+  }
+}
+
+bool FilesystemCli::RerouteBatch(  ///
+    BatchedCreates* const bc, const int i, const Slice& giga,
+    std::vector<int>* const dsts) {
+  Dir* const dir = bc->dir;
+  {
+    MutexLock lock(dir->mu);
+    if (giga.empty() || !dir->giga->Update(giga)) {
+      return false;
+    }
+  }
+  WriBuf* const buf = &bc->wribufs[i];
+  std::string namearr;
+  {
+    MutexLock lock(&buf->mu);
+    namearr.swap(buf->namearr);
+    buf->n = 0;
+  }
+  std::vector<std::string> arrs(srvs_);
+  std::vector<uint32_t> counts(srvs_, 0);
+  Slice input = namearr;
+  Slice name;
+  {
+    MutexLock lock(dir->mu);
+    while (GetLengthPrefixedSlice(&input, &name)) {
+      const int j = dir->giga->SelectServer(name);
+      PutLengthPrefixedSlice(&arrs[j], name);
+      counts[j]++;
+    }
+  }
+  bool moved = false;
+  for (int j = 0; j < srvs_; j++) {
+    if (counts[j] == 0) {
+      continue;
+    } else if (j != i) {
+      dsts->push_back(j);
+      moved = true;
+    }
+    WriBuf* const dst = &bc->wribufs[j];
+    MutexLock lock(&dst->mu);
+    dst->namearr.append(arrs[j]);
+    dst->n += counts[j];
+  }
+  return moved;
+}
+
+// Only the lock of the shard the directory hashes to is needed.
 Status FilesystemCli::AcquireDir(const DirId& id, Dir** result) {
-  mutex_.AssertHeld();
   char tmp[30];
   Slice key = DirKey(id, tmp);
   const uint32_t hash = HashKey(key);
+  DirShard* const shard = &shards_[ShardOf(hash)];
+  MutexLock lock(&shard->mu);
   Status s;
 
   // Check if we have already cached it
-  Dir** const pos = dirs_->FindPointer(key, hash);
+  Dir** const pos = shard->dirs->FindPointer(key, hash);
   Dir* dir = *pos;
   if (dir != NULL) {
     *result = dir;
@@ -1421,8 +2620,8 @@ Status FilesystemCli::AcquireDir(const DirId& id, Dir** result) {
   dir->fetched = 0;
 
   *result = dir;
-  LIST_Append(dir, &dirlist_);
-  dirs_->Inject(dir, pos);
+  LIST_Append(dir, &shard->dirlist);
+  shard->dirs->Inject(dir, pos);
   dir->refs = 1;
   return s;
 }
@@ -1431,45 +2630,127 @@ Status FilesystemCli::AcquireDir(const DirId& id, Dir** result) {
 void FilesystemCli::DeletePartition(const Slice& key, Partition* part) {
   assert(part->key() == key);
   FilesystemCli* const cli = part->dir->fscli;
-  cli->mutex_.AssertHeld();
-  cli->pars_->Remove(key, part->hash);
-  cli->mutex_.Unlock();
+  DirShard* const shard = &cli->shards_[ShardOf(part->dir->hash)];
+  shard->mu.AssertHeld();
+  shard->pars->Remove(key, part->hash);
+  shard->mu.Unlock();
   part->mu->Lock();
+  delete part->cached_stats;
   delete part->cached_leases;
   assert(part->leases->Empty());
   delete part->leases;
   part->mu->Unlock();
   delete part->cv;
   delete part->mu;
-  cli->mutex_.Lock();
-  cli->Release(part->dir);
+  shard->mu.Lock();
+  cli->Unref(part->dir);
   free(part);
 }
 
+void FilesystemCli::DeleteCachedStat(const Slice& key, CachedStat* cs) {
+  delete cs;
+}
+
+// A cache hit requires a cached result that has not expired. Expired results
+// are dropped as they are found.
+bool FilesystemCli::LookupStatCache(  ///
+    Partition* const part, const Slice& name, Stat* const stat,
+    Status* const s) {
+  LRUCache<StatHandl>* const lru = part->cached_stats;
+  if (lru == NULL) {
+    return false;
+  }
+  DirShard* const shard = &shards_[ShardOf(part->dir->hash)];
+  MutexLock lock(&shard->mu);
+  bool hit = false;
+  const uint32_t hash = HashKey(name);
+  StatHandl* const h = lru->Lookup(name, hash);
+  if (h != NULL) {
+    const CachedStat* const cs = h->value;
+    const bool expired = cs->due < CurrentMicros();
+    if (!expired) {
+      *s = cs->found ? Status::OK() : Status::NotFound(Slice());
+      if (cs->found) {
+        *stat = cs->stat;
+      }
+      hit = true;
+    }
+    lru->Release(h);
+    // Erase by key after the release so that h is never used after the entry
+    // has been freed
+    if (expired) {
+      lru->Erase(name, hash);
+    }
+  }
+  if (hit) {
+    shard->stat_cache_hits++;
+  } else {
+    shard->stat_cache_misses++;
+  }
+  return hit;
+}
+
+// Cached results never outlive the parent dir's lease. Leases that never
+// expire, such as the root's, are capped by options_.max_stat_age.
+void FilesystemCli::UpdateStatCache(  ///
+    Partition* const part, const LookupStat& p, const Slice& name,
+    const Stat& stat, const Status& s) {
+  LRUCache<StatHandl>* const lru = part->cached_stats;
+  if (lru == NULL) {
+    return;
+  }
+  MutexLock lock(&shards_[ShardOf(part->dir->hash)].mu);
+  const uint32_t hash = HashKey(name);
+  if ((!s.ok() && !s.IsNotFound()) || p.LeaseDue() == 0) {
+    lru->Erase(name, hash);
+    return;
+  }
+  CachedStat* const cs = new CachedStat;
+  cs->due = std::min(p.LeaseDue(), CurrentMicros() + options_.max_stat_age);
+  cs->found = s.ok();
+  if (cs->found) {
+    cs->stat = stat;
+  }
+  lru->Release(lru->Insert(name, hash, cs, 1, DeleteCachedStat));
+}
+
+void FilesystemCli::GetStatCacheStats(uint64_t* hits, uint64_t* misses) {
+  *hits = *misses = 0;
+  for (int i = 0; i < kNumDirShards; i++) {
+    MutexLock lock(&shards_[i].mu);
+    *hits += shards_[i].stat_cache_hits;
+    *misses += shards_[i].stat_cache_misses;
+  }
+}
+
 // Remove a reference to a specified directory partition control block. Delete
 // it when the last reference is removed.
 void FilesystemCli::Release(Partition* const part) {
-  mutex_.AssertHeld();
-  plru_->Release(part->lru_handle);
+  DirShard* const shard = &shards_[ShardOf(part->dir->hash)];
+  MutexLock lock(&shard->mu);
+  shard->plru->Release(part->lru_handle);
 }
 
 // Add a reference to a directory partition.
 void FilesystemCli::Ref(Partition* part) {
-  mutex_.AssertHeld();
-  plru_->Ref(part->lru_handle);
+  DirShard* const shard = &shards_[ShardOf(part->dir->hash)];
+  MutexLock lock(&shard->mu);
+  shard->plru->Ref(part->lru_handle);
 }
 
-// Obtain the control block for a specific directory partition.
+// Obtain the control block for a specific directory partition. Partitions are
+// kept in the shard of their directory.
 Status FilesystemCli::AcquirePartition(Dir* dir, int ix, Partition** result) {
-  mutex_.AssertHeld();
   char tmp[30];
   Slice key = LRUKey(*dir->id, ix, tmp);
   const uint32_t hash = HashKey(key);
+  DirShard* const shard = &shards_[ShardOf(dir->hash)];
+  MutexLock lock(&shard->mu);
   Status s;
 
   Partition* part;
   // Try the LRU cache first...
-  PartHandl* h = plru_->Lookup(key, hash);
+  PartHandl* h = shard->plru->Lookup(key, hash);
   if (h != NULL) {
     part = h->value;
     assert(part->lru_handle == h);
@@ -1480,13 +2761,13 @@ Status FilesystemCli::AcquirePartition(Dir* dir, int ix, Partition** result) {
   // If we cannot find an entry from the cache, we continue our search at the
   // bigger hash table. We cache the cursor position returned by the table so
   // that we can reuse it in a later table insertion.
-  Partition** const pos = pars_->FindPointer(key, hash);
+  Partition** const pos = shard->pars->FindPointer(key, hash);
   part = *pos;
   if (part != NULL) {
     *result = part;
     assert(part->lru_handle->value == part);
     // Should we reinsert it into the cache?
-    plru_->Ref(part->lru_handle);
+    shard->plru->Ref(part->lru_handle);
     return s;
   }
 
@@ -1498,15 +2779,20 @@ Status FilesystemCli::AcquirePartition(Dir* dir, int ix, Partition** result) {
   part->index = ix;
   part->cached_leases =
       new LRUCache<LeaseHandl>(options_.per_partition_lease_lru_size);
+  part->cached_stats = NULL;
+  if (options_.per_partition_stat_lru_size != 0) {
+    part->cached_stats =
+        new LRUCache<StatHandl>(options_.per_partition_stat_lru_size);
+  }
   part->leases = new HashTable<Lease>;
   part->mu = new port::Mutex;
   part->cv = new port::CondVar(part->mu);
   memset(&part->busy[0], 0, kWays);
-  pars_->Inject(part, pos);
+  shard->pars->Inject(part, pos);
   part->dir = dir;
   dir->refs++;
 
-  h = plru_->Insert(key, hash, part, 1, DeletePartition);
+  h = shard->plru->Insert(key, hash, part, 1, DeletePartition);
   part->lru_handle = h;
   *result = part;
   return s;
@@ -1526,20 +2812,25 @@ void FilesystemCli::FormatRoot() {
 }
 
 FilesystemCli::FilesystemCli(const FilesystemCliOptions& options)
-    : dirs_(NULL),
-      plru_(NULL),
-      pars_(NULL),
+    : ncontexts_(0),
+      shards_(NULL),
       options_(options),
       fs_(NULL),
       uri_mapper_(NULL),
       ports_per_srv_(1),
       srvs_(1),
       rpc_(NULL) {
-  dirs_ = new HashTable<Dir>;
-  dirlist_.next = &dirlist_;
-  dirlist_.prev = &dirlist_;
-  plru_ = new LRUCache<PartHandl>(options_.partition_lru_size);
-  pars_ = new HashTable<Partition>;
+  const size_t per_shard =
+      (options_.partition_lru_size + kNumDirShards - 1) / kNumDirShards;
+  shards_ = new DirShard[kNumDirShards];
+  for (int i = 0; i < kNumDirShards; i++) {
+    DirShard* const shard = &shards_[i];
+    shard->dirs = new HashTable<Dir>;
+    shard->dirlist.next = &shard->dirlist;
+    shard->dirlist.prev = &shard->dirlist;
+    shard->plru = new LRUCache<PartHandl>(per_shard);
+    shard->pars = new HashTable<Partition>;
+  }
 
   FormatRoot();
 
@@ -1553,7 +2844,16 @@ FilesystemCliOptions::FilesystemCliOptions()
     : per_partition_lease_lru_size(4096),
       partition_lru_size(4096),
       batch_size(16),
-      skip_perm_checks(false) {}
+      skip_perm_checks(false),
+      static_partitioning(false),
+      readdir_page_size(32 << 10),
+      pool(NULL),
+      ino_lease_size(4096),
+      compound_lookups(false),
+      server_resolution(false),
+      compact_replies(true),
+      per_partition_stat_lru_size(0),
+      max_stat_age(1000 * 1000) {}
 
 void FilesystemCli::RegisterFsSrvUris(  ///
     RPC* rpc, const UriMapper* uri_mapper, int srvs, int ports_per_srv) {
@@ -1568,15 +2868,18 @@ void FilesystemCli::SetLocalFs(Filesystem* fs) {
 }
 
 FilesystemCli::~FilesystemCli() {
-  mutex_.Lock();
-  delete plru_;
-  assert(pars_->Empty());
-  delete pars_;
-  assert(dirlist_.next == &dirlist_);
-  assert(dirlist_.prev == &dirlist_);
-  assert(dirs_->Empty());
-  delete dirs_;
-  mutex_.Unlock();
+  for (int i = 0; i < kNumDirShards; i++) {
+    DirShard* const shard = &shards_[i];
+    MutexLock lock(&shard->mu);
+    delete shard->plru;
+    assert(shard->pars->Empty());
+    delete shard->pars;
+    assert(shard->dirlist.next == &shard->dirlist);
+    assert(shard->dirlist.prev == &shard->dirlist);
+    assert(shard->dirs->Empty());
+    delete shard->dirs;
+  }
+  delete[] shards_;
 }
 
 }  // namespace pdlfs
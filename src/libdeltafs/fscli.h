@@ -57,7 +57,8 @@ class FilesystemCli;
 // Client context to make filesystem calls.
 class FilesystemCliCtx {
  public:
-  explicit FilesystemCliCtx(int seed) : rnd_(seed), stubs_(NULL), n_(0) {
+  explicit FilesystemCliCtx(int seed)
+      : seed_(seed), stubs_(NULL), n_(0), inoleases_(NULL) {
     bkenv = Env::Default();
     bkdno = bkid = 0;
   }
@@ -69,6 +70,7 @@ class FilesystemCliCtx {
       }
     }
     delete[] stubs_;
+    delete[] inoleases_;
   }
 
   int bkid;
@@ -79,10 +81,20 @@ class FilesystemCliCtx {
   User who;
 
  private:
-  Random rnd_;
+  // Selects the channel through which the context talks to each server when
+  // servers have multiple channels.
+  const uint32_t seed_;
   friend class FilesystemCli;
   rpc::If** stubs_;
   int n_;
+  // Inode numbers leased from each server for assigning inodes locally. Inode
+  // numbers in [next, end) remain available.
+  struct InoLease {
+    uint64_t dno;
+    uint64_t next;
+    uint64_t end;
+  };
+  InoLease* inoleases_;
 };
 
 struct FilesystemCliOptions {
@@ -91,6 +103,56 @@ struct FilesystemCliOptions {
   size_t partition_lru_size;
   size_t batch_size;
   bool skip_perm_checks;
+  // Assume that all directories are statically hash partitioned across all
+  // servers instead of learning directory indices from servers as they reject
+  // requests sent to wrong partitions. Only use this when servers never split
+  // directories or when servers skip partition checks.
+  // Default: false
+  bool static_partitioning;
+  // Max size of a page of directory entries fetched from a server by a single
+  // readdir rpc. Pages larger than a udp datagram are sent as fragments.
+  // Default: 32KB
+  size_t readdir_page_size;
+  // Thread pool for fetching pages of directory entries from different servers
+  // and for committing batched or bulk creates to different servers in
+  // parallel. Not owned by us. When NULL, servers are contacted one at a time
+  // by the calling thread.
+  // Default: NULL
+  ThreadPool* pool;
+  // Number of inode numbers leased from a server at a time for files created
+  // through bulk insertion. Leased inode numbers are assigned by the client
+  // without contacting the server.
+  // Default: 4096
+  uint32_t ino_lease_size;
+  // On the first lease cache miss when resolving a path, send the lookups of
+  // all remaining path components, together with the final create or stat
+  // operation of the call, to the server in a single compound rpc. The server
+  // executes them until it reaches a name it does not own. Saves round trips
+  // on cold caches when a server owns consecutive components of a path.
+  // Requires servers to perform partition checks. Only used when talking to
+  // servers through rpc.
+  // Default: false
+  bool compound_lookups;
+  // On the first lease cache miss when resolving a path, have the server walk
+  // as many remaining path components as it owns and return their leases in a
+  // single rpc. Only used when talking to servers through rpc.
+  // Default: false
+  bool server_resolution;
+  // Ask servers to encode the stats in create and lookup replies as deltas
+  // against the parent dir of the request. Replies shrink from 32 to about 8
+  // bytes per stat. Only used when talking to servers through rpc.
+  // Default: true
+  bool compact_replies;
+  // Max number of file lstat results cached per directory partition. Both
+  // found and not-found results are cached. A cached result expires with the
+  // parent dir's lease or after max_stat_age micros, whichever comes first.
+  // Creates and lookups done through batch or bulk contexts, or by other
+  // clients, are not reflected by cached results until they expire. Set to 0
+  // to disable the cache.
+  // Default: 0
+  size_t per_partition_stat_lru_size;
+  // Default: 1000000 (1s)
+  uint64_t max_stat_age;
 };
 
 // A filesystem client may either talk to a local metadata manager via the
@@ -109,6 +171,9 @@ class FilesystemCli {
     void operator=(const UriMapper& other);
     UriMapper(const UriMapper&);
   };
+  // Each server may listen on ports_per_srv ports, such as the channels of a
+  // multi-channel FilesystemServer. Each client context sticks to one port per
+  // server, picked by hashing the context's seed.
   void RegisterFsSrvUris(RPC* rpc, const UriMapper* uri_mapper, int srvs,
                          int ports_per_srv = 1);
   void SetLocalFs(Filesystem* fs);
@@ -126,6 +191,22 @@ class FilesystemCli {
                uint32_t mode, Stat* stat);
   Status Lstat(FilesystemCliCtx* ctx, const AT* at, const char* pathname,
                Stat* stat);
+  // Look up n names beneath the directory specified by pathname. Names are
+  // sent to servers in batches of options.batch_size names. On OK, rets[i] is
+  // set to the result of looking up names[i] and stats[i] is set when rets[i]
+  // is OK. A non-OK status is returned when the directory cannot be resolved or
+  // when a batch fails as a whole.
+  Status Lstats(FilesystemCliCtx* ctx, const AT* at, const char* pathname,
+                const char* const* names, size_t n, Stat* stats, Status* rets);
+
+  // Reference to an open directory listing. Entries are fetched from all
+  // servers in pages and merged into name order. Readdir() returns NotFound
+  // once all entries have been returned.
+  struct RDIR;
+  Status Opendir(FilesystemCliCtx* ctx, const AT* at, const char* pathname,
+                 RDIR** result);
+  Status Readdir(RDIR* dir, std::string* name, Stat* stat);
+  Status Destroy(RDIR* dir);
 
   // Reference to a batch of create operations buffered at the client guarded by
   // a server-issued parent dir lease
@@ -145,6 +226,28 @@ class FilesystemCli {
   Status BulkCommit(BULK* bk);
   Status Destroy(BULK* bk);
 
+  // Reference to a window of asynchronous file creates and lookups. At most
+  // max_outstanding operations are in flight at any time; further operations
+  // block until earlier ones complete. Results of an operation, both its
+  // status and its stat, are set by the time AsyncWait() returns. Path
+  // resolution and resends to partitions of a split directory are done
+  // synchronously by the calling thread. Operations run synchronously when
+  // not using rpc. An ASYNC reference must not be used by concurrent threads.
+  struct ASYNC;
+  Status AsyncInit(FilesystemCliCtx* ctx, int max_outstanding, ASYNC** result);
+  void AsyncMkfle(ASYNC* as, const AT* at, const char* pathname, uint32_t mode,
+                  Stat* stat, Status* status);
+  void AsyncLstat(ASYNC* as, const AT* at, const char* pathname, Stat* stat,
+                  Status* status);
+  // Wait for all outstanding operations to complete.
+  void AsyncWait(ASYNC* as);
+  Status Destroy(ASYNC* as);
+
+  // Return the number of lstat calls answered by the stat cache (hits) and the
+  // number of lstat calls that went to the filesystem (misses). Both are 0 when
+  // the cache is disabled.
+  void GetStatCacheStats(uint64_t* hits, uint64_t* misses);
+
   Status TEST_Mkfle(FilesystemCliCtx* ctx, const LookupStat& parent,
                     const Slice& fname, const Stat& stat,
                     FilesystemDbStats* stats);
@@ -168,6 +271,8 @@ class FilesystemCli {
   struct Lease;
   struct Partition;
   struct Dir;
+  struct Cmpnd;
+  struct AsyncOp;
 
   // Resolve a filesystem path down to the last component of the path. Return
   // the name of the last component and a lease on its parent directory on
@@ -176,19 +281,22 @@ class FilesystemCli {
   // called instead of it. When the input filesystem path points to the root
   // directory, the root directory itself is returned as the parent directory
   // and the name of the last component of the path is set to empty.
+  // When cp is not NULL, uncached path components are resolved by servers as
+  // described by cp.
   Status Resolu(FilesystemCliCtx* ctx, const AT* at, const char* pathname,
                 Lease** parent_dir, Slice* last_component,
-                bool* has_tailing_slashes);
+                bool* has_tailing_slashes, Cmpnd* cp = NULL);
   // Resolve a filesystem path down to the last component of the path. On
   // success, return the name of the last component and a lease on its parent
   // directory. Return a non-OK status on error. Path following (not including)
   // the erroneous directory is returned as well to assist debugging.
   Status Resolv(FilesystemCliCtx* ctx, Lease* relative_root,
                 const char* pathname, Lease** parent_dir, Slice* last_component,
-                const char** remaining_path);
+                const char** remaining_path, Cmpnd* cp);
 
   Status Lokup(FilesystemCliCtx* ctx, const LookupStat& parent,
-               const Slice& name, LokupMode mode, Lease** stat);
+               const Slice& name, LokupMode mode, Lease** stat,
+               Cmpnd* cp = NULL);
   Status CreateBulkContext(FilesystemCliCtx* ctx, const LookupStat& parent,
                            BulkInserts**);
   Status CreateBatch(FilesystemCliCtx* ctx, const LookupStat& parent,
@@ -198,48 +306,109 @@ class FilesystemCli {
 
   Status Fetch1(FilesystemCliCtx* ctx, const LookupStat& parent,
                 const Slice& name, Dir* dir, int*);
+  Status Rdidx1(FilesystemCliCtx* ctx, const LookupStat& parent, Dir* dir);
   Status Lokup1(FilesystemCliCtx* ctx, const LookupStat& parent,
                 const Slice& name, LokupMode mode, Partition* part,
-                Lease** stat);
+                Lease** stat, std::string* giga, Cmpnd* cp);
   Status Bukin1(FilesystemCliCtx* ctx, const LookupStat& parent,
-                const Slice& name, bool force_flush, int srv_idx, BulkIn* buk);
+                const Slice& name, bool force_flush, int srv_idx,
+                rpc::If* stub, BulkIn* buk);
   Status Mkfls1(FilesystemCliCtx* ctx, const LookupStat& parent,
-                const Slice& name, uint32_t mode, bool force_flush, int srv_idx,
-                WriBuf* buf);
+                const Slice& name, uint32_t mode, bool force_flush,
+                rpc::If* stub, WriBuf* buf, std::string* giga);
+  Status Mkfls3(const LookupStat& parent, BatchedCreates* bc, int srv_idx);
   Status Mkfle1(FilesystemCliCtx* ctx, const LookupStat& parent,
                 const Slice& name, uint32_t mode, Stat* stat);
   Status Mkdir1(FilesystemCliCtx* ctx, const LookupStat& parent,
                 const Slice& name, uint32_t mode, Stat* stat);
   Status Lstat1(FilesystemCliCtx* ctx, const LookupStat& parent,
                 const Slice& name, Stat* stat);
+  Status Lstats1(FilesystemCliCtx* ctx, const LookupStat& parent,
+                 const char* const* names, size_t n, Stat* stats,
+                 Status* rets);
 
   Status Lokup2(FilesystemCliCtx* ctx, const LookupStat& parent,
                 const Slice& name, uint32_t hash, LokupMode mode,
-                Partition* part, Lease** stat);
+                Partition* part, Lease** stat, std::string* giga, Cmpnd* cp);
+  // Stubs for batched and bulk creates are prepared when a batch or bulk
+  // context is created as per-server commits may run in background threads.
   Status Bukin2(FilesystemCliCtx* ctx, const LookupStat& parent,
-                const std::string& bkdir, int srv_idx);
+                const std::string& bkdir, rpc::If* stub);
   Status Mkfls2(FilesystemCliCtx* ctx, const LookupStat& parent,
-                const Slice& namearr, uint32_t n, uint32_t mode, int srv_idx);
+                const Slice& namearr, uint32_t n, uint32_t mode, rpc::If* stub,
+                std::string* giga);
   Status Mkfle2(FilesystemCliCtx* ctx, const LookupStat& parent,
-                const Slice& name, uint32_t mode, int srv_idx, Stat* stat);
+                const Slice& name, uint32_t mode, int srv_idx, Stat* stat,
+                std::string* giga);
   Status Mkdir2(FilesystemCliCtx* ctx, const LookupStat& parent,
-                const Slice& name, uint32_t mode, int srv_idx, Stat* stat);
+                const Slice& name, uint32_t mode, int srv_idx, Stat* stat,
+                std::string* giga);
   Status Lstat2(FilesystemCliCtx* ctx, const LookupStat& parent,
-                const Slice& name, int srv_idx, Stat* stat);
+                const Slice& name, int srv_idx, Stat* stat, std::string* giga);
+  // The stub is prepared by the caller as pages may be fetched by background
+  // threads. PrepareStub() is not thread-safe.
+  Status Readdir2(FilesystemCliCtx* ctx, const LookupStat& parent,
+                  const Slice& cursor, rpc::If* stub, std::string* entarr,
+                  std::string* next);
+  Status Lstats2(FilesystemCliCtx* ctx, const LookupStat& parent,
+                 const Slice& namearr, uint32_t n, int srv_idx, Stat* stats,
+                 Status* rets, std::string* giga);
+  Status Rsino2(FilesystemCliCtx* ctx, uint32_t n, rpc::If* stub,
+                uint64_t* dno, uint64_t* startino);
+  // Resolve the remaining components of a path through a single rpc. Results
+  // are stored in cp.
+  Status Cmpnd2(FilesystemCliCtx* ctx, const LookupStat& parent,
+                rpc::If* stub, Cmpnd* cp, std::string* giga);
+  Status Resolve2(FilesystemCliCtx* ctx, const LookupStat& parent,
+                  rpc::If* stub, Cmpnd* cp, std::string* giga);
+  // Return cp if path resolution is to be assisted by servers, or NULL
+  // otherwise. Drop the final operation of cp if it is not to be piggybacked.
+  // Creates are only piggybacked when there are no batch or bulk contexts, and
+  // therefore no non-regular leases, that could fail the resolution after the
+  // create has been executed by the server.
+  Cmpnd* PrepareCmpnd(Cmpnd* cp);
+
+  // Assign the next inode leased from a server to *stat. Lease more inode
+  // numbers from the server when the current lease runs out.
+  Status NextIno(FilesystemCliCtx* ctx, int srv_idx, rpc::If* stub,
+                 Stat* stat);
+
+  // Start an asynchronous operation. Operations that fail early or that are not
+  // sent through rpc are completed before return.
+  void AsyncStart(AsyncOp* op, const AT* at, const char* pathname);
+  // Finish completed operations until at most n operations remain outstanding.
+  void AsyncReap(ASYNC* as, int n);
+  void AsyncFinish(AsyncOp* op);
+  static void AsyncDone(const Status& status, void* arg);
 
   rpc::If* PrepareStub(FilesystemCliCtx* ctx, int srv_idx);
+  rpc::If** PrepareStubs(FilesystemCliCtx* ctx);
+
+  // Flush all per-server buffers of a batch or a bulk context. Servers are
+  // flushed in parallel using options_.pool when there is one.
+  struct Committer;
+  Status CommitAll(const LookupStat& parent, BatchedCreates* bc,
+                   BulkInserts* bk);
 
   // No copying allowed
   void operator=(const FilesystemCli& cli);
   FilesystemCli(const FilesystemCli&);
 
+  // Names are inserted into namearr while a previous batch of names is being
+  // sent from flushbuf, so that inserts do not block on an ongoing flush.
   struct WriBuf {
-    std::string namearr;
+    WriBuf() : cv(&mu), n(0), flushing(false) {}
     port::Mutex mu;
+    port::CondVar cv;
+    // State below protected by mu
+    std::string namearr;
+    std::string flushbuf;
     uint32_t n;
+    bool flushing;
   };
   struct BatchedCreates {
     FilesystemCliCtx* ctx;
+    rpc::If** stubs;  // One per server, NULL if not using rpc
     WriBuf* wribufs;
     uint32_t mode;
     // Currently, each reference to a batch context must be accompanied by
@@ -270,6 +439,7 @@ class FilesystemCli {
   };
   struct BulkInserts {
     FilesystemCliCtx* ctx;
+    rpc::If** stubs;  // One per server, NULL if not using rpc
     BulkIn* bulks;
     uint32_t refs;  // Serialized via the parent lease's parent dir partition
     // State below protected by mu
@@ -308,8 +478,6 @@ class FilesystemCli {
   static void DeleteLease(const Slice& key, Lease* lease);
   void Release(Lease* lease);
 
-  // State below is protected by mutex_
-  port::Mutex mutex_;
   // Per-directory control block. Each directory consists of one or more
   // partitions. Per-directory giga status is serialized here.
   // Struct doubles as an hash table entry.
@@ -323,7 +491,7 @@ class FilesystemCli {
     FilesystemCli* fscli;
     port::Mutex* mu;
     size_t key_length;
-    uint32_t refs;  // Total number of refs (system + active)
+    uint32_t refs;  // Total number of refs (system + active); shard protected
     uint32_t hash;  // Hash of key(); used for fast partitioning and comparisons
     unsigned char fetched;
     char key_data[1];  // Beginning of key
@@ -338,11 +506,34 @@ class FilesystemCli {
   Status AcquireDir(const DirId& id, Dir**);
   // Fetch dir info from server.
   Status FetchDir(uint32_t zeroth_server, Dir* dir);
+  // Merge a directory index returned by a server into our view of the
+  // directory. Return true if the name is now mapped to a different server, in
+  // which case *srv_idx is updated and the request should be retried.
+  bool RefreshDir(Dir* dir, const Slice& giga, const Slice& name,
+                  int* srv_idx);
+  // Merge a directory index returned by a server rejecting a batch of names
+  // into our view of the directory and move the names buffered for that
+  // server that are now mapped to other servers into their buffers. Return
+  // true if any name is moved, in which case the servers receiving names are
+  // added to *dsts.
+  bool RerouteBatch(BatchedCreates* bc, int srv_idx, const Slice& giga,
+                    std::vector<int>* dsts);
   // Release a reference to the dir.
   void Release(Dir* dir);
-  // All directories currently kept in memory.
-  HashTable<Dir>* dirs_;
-  Dir dirlist_;  // Dummy head of the linked list
+  // REQUIRES: the shard of the dir has been locked.
+  void Unref(Dir* dir);
+  port::Mutex mutex_;
+  // Number of batch and bulk contexts currently alive. Protected by mutex_.
+  uint32_t ncontexts_;
+
+  // A cached lstat result. Not-found results are cached as negative entries.
+  struct CachedStat {
+    Stat stat;
+    uint64_t due;  // Expires after this time (micros)
+    bool found;
+  };
+  typedef LRUEntry<CachedStat> StatHandl;
+  static void DeleteCachedStat(const Slice& key, CachedStat* cs);
 
   typedef LRUEntry<Partition> PartHandl;
   enum { kWays = 8 };  // Must be a power of 2
@@ -353,6 +544,7 @@ class FilesystemCli {
     PartHandl* lru_handle;
     Dir* dir;
     LRUCache<LeaseHandl>* cached_leases;
+    LRUCache<StatHandl>* cached_stats;  // Shard protected; NULL if disabled
     HashTable<Lease>* leases;
     port::Mutex* mu;
     port::CondVar* cv;
@@ -369,9 +561,17 @@ class FilesystemCli {
 
     ///
   };
-  // We keep an LRU cache of directory partitions in memory so that we can reuse
-  // them when a recent directory partition is accessed.
-  LRUCache<PartHandl>* plru_;
+  // Directory control blocks are hash-partitioned into a fixed number of
+  // shards. Each shard is protected by its own mutex and has its own directory
+  // table and partition tables. The partitions of a directory are kept in the
+  // shard of the directory. Operations on directories of different shards
+  // therefore don't contend with each other.
+  enum { kNumDirShardBits = 4, kNumDirShards = 1 << kNumDirShardBits };
+  struct DirShard;
+  DirShard* shards_;
+  static uint32_t ShardOf(uint32_t hash) {
+    return hash >> (32 - kNumDirShardBits);
+  }
   static void DeletePartition(const Slice& key, Partition* partition);
   // Obtain the control block for a specific directory partition.
   Status AcquirePartition(Dir* dir, int index, Partition**);
@@ -380,11 +580,14 @@ class FilesystemCli {
   void Ref(Partition* partition);
   // Release a reference to a specified directory partition.
   void Release(Partition* partition);
-  // All directory partition control blocks currently kept in memory. These
-  // include both the control blocks currently referenced by the LRU cache and
-  // the control blocks that have been evicted from the cache but still have
-  // remaining references.
-  HashTable<Partition>* pars_;
+  // Look up the cached lstat result of a name. Return true on a hit, in which
+  // case *s and *stat are set as if the name had been looked up.
+  bool LookupStatCache(Partition* part, const Slice& name, Stat* stat,
+                       Status* s);
+  // Cache the result of looking up or creating a name under parent p, or
+  // drop any cached result when s is neither OK nor NotFound.
+  void UpdateStatCache(Partition* part, const LookupStat& p, const Slice& name,
+                       const Stat& stat, const Status& s);
 
   void FormatRoot();
   // Constant after client open
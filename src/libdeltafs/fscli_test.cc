@@ -66,6 +66,7 @@ class FilesystemCliTest {
   typedef FilesystemCli::BULK BUK;
   typedef FilesystemCli::BAT BATCH;
   typedef FilesystemCli::AT AT;
+  typedef FilesystemCli::RDIR RDIR;
   FilesystemCliTest()
       : fsdb_(NULL),
         fs_(NULL),
@@ -96,7 +97,7 @@ class FilesystemCliTest {
       fscli_ = new FilesystemCli(fscliopts_);
       fs_ = new Filesystem(fsopts_);
       fscli_->SetLocalFs(fs_);
-      fs_->SetDb(fsdb_);
+      s = fs_->SetDb(fsdb_);
     }
     return s;
   }
@@ -123,6 +124,22 @@ class FilesystemCliTest {
     return fscli_->Lstat(&myctx_, at, path, &tmp_);
   }
 
+  // Return the number of entries listed or -1 on errors.
+  int List(const char* path, std::vector<std::string>* names) {
+    RDIR* dir;
+    Status s = fscli_->Opendir(&myctx_, NULL, path, &dir);
+    if (!s.ok()) return -1;
+    std::string name;
+    for (;;) {
+      s = fscli_->Readdir(dir, &name, &tmp_);
+      if (!s.ok()) break;
+      names->push_back(name);
+    }
+    fscli_->Destroy(dir);
+    if (!s.IsNotFound()) return -1;
+    return static_cast<int>(names->size());
+  }
+
   Status BatchStart(const char* path, BATCH** result, const AT* at = NULL) {
     return fscli_->BatchInit(&myctx_, at, path, result);
   }
@@ -215,6 +232,109 @@ TEST(FilesystemCliTest, Subdirs) {
   ASSERT_OK(Mkdir("/1/b"));
 }
 
+TEST(FilesystemCliTest, Lstats) {
+  fscliopts_.batch_size = 2;
+  ASSERT_OK(OpenFilesystemCli());
+  ASSERT_OK(Mkdir("/1"));
+  ASSERT_OK(Creat("/1/a"));
+  ASSERT_OK(Mkdir("/1/b"));
+  ASSERT_OK(Creat("/1/c"));
+  ASSERT_OK(Creat("/d"));
+  const char* names[] = {"c", "x", "a", "b", "d"};
+  Stat stats[5];
+  Status rets[5];
+  ASSERT_OK(fscli_->Lstats(&myctx_, NULL, "/1", names, 5, stats, rets));
+  ASSERT_OK(rets[0]);
+  ASSERT_TRUE(S_ISREG(stats[0].FileMode()));
+  ASSERT_NOTFOUND(rets[1]);
+  ASSERT_OK(rets[2]);
+  ASSERT_OK(rets[3]);
+  ASSERT_TRUE(S_ISDIR(stats[3].FileMode()));
+  ASSERT_NOTFOUND(rets[4]);
+  ASSERT_OK(fscli_->Lstats(&myctx_, NULL, "/", names, 5, stats, rets));
+  ASSERT_NOTFOUND(rets[0]);
+  ASSERT_OK(rets[4]);
+  ASSERT_ERR(fscli_->Lstats(&myctx_, NULL, "/2", names, 5, stats, rets));
+}
+
+TEST(FilesystemCliTest, AsyncOps) {
+  ASSERT_OK(OpenFilesystemCli());
+  ASSERT_OK(Mkdir("/1"));
+  FilesystemCli::ASYNC* as;
+  ASSERT_ERR(fscli_->AsyncInit(&myctx_, 0, &as));
+  ASSERT_OK(fscli_->AsyncInit(&myctx_, 2, &as));
+  Stat stats[6];
+  Status rets[6];
+  fscli_->AsyncMkfle(as, NULL, "/1/a", 0660, &stats[0], &rets[0]);
+  fscli_->AsyncMkfle(as, NULL, "/1/a", 0660, &stats[1], &rets[1]);
+  fscli_->AsyncMkfle(as, NULL, "/1/", 0660, &stats[2], &rets[2]);
+  fscli_->AsyncLstat(as, NULL, "/1/a", &stats[3], &rets[3]);
+  fscli_->AsyncLstat(as, NULL, "/1/b", &stats[4], &rets[4]);
+  fscli_->AsyncLstat(as, NULL, "/1/", &stats[5], &rets[5]);
+  fscli_->AsyncWait(as);
+  ASSERT_OK(rets[0]);
+  ASSERT_CONFLICT(rets[1]);
+  ASSERT_ERR(rets[2]);
+  ASSERT_OK(rets[3]);
+  ASSERT_TRUE(S_ISREG(stats[3].FileMode()));
+  ASSERT_NOTFOUND(rets[4]);
+  ASSERT_OK(rets[5]);
+  ASSERT_TRUE(S_ISDIR(stats[5].FileMode()));
+  ASSERT_OK(fscli_->Destroy(as));
+}
+
+TEST(FilesystemCliTest, StatCache) {
+  fscliopts_.per_partition_stat_lru_size = 16;
+  ASSERT_OK(OpenFilesystemCli());
+  ASSERT_OK(Mkdir("/1"));
+  ASSERT_NOTFOUND(Exist("/1/a"));
+  ASSERT_NOTFOUND(Exist("/1/a"));  // Negative hit
+  ASSERT_OK(Creat("/1/a"));
+  ASSERT_OK(Exist("/1/a"));
+  ASSERT_ERR(Exist("/1/a/"));
+  FilesystemCli::ASYNC* as;
+  ASSERT_OK(fscli_->AsyncInit(&myctx_, 2, &as));
+  Status ret;
+  fscli_->AsyncLstat(as, NULL, "/1/a", &tmp_, &ret);
+  fscli_->AsyncWait(as);
+  ASSERT_OK(ret);
+  ASSERT_TRUE(S_ISREG(tmp_.FileMode()));
+  ASSERT_OK(fscli_->Destroy(as));
+  uint64_t hits, misses;
+  fscli_->GetStatCacheStats(&hits, &misses);
+  ASSERT_EQ(hits, 4);
+  ASSERT_EQ(misses, 1);
+}
+
+TEST(FilesystemCliTest, Readdir) {
+  fscliopts_.readdir_page_size = 64;
+  ThreadPool* const pool = ThreadPool::NewFixed(2);
+  fscliopts_.pool = pool;
+  ASSERT_OK(OpenFilesystemCli());
+  ASSERT_OK(Mkdir("/1"));
+  char path[20];
+  for (int i = 0; i < 100; i++) {
+    snprintf(path, sizeof(path), "/1/%03d", i);
+    ASSERT_OK(Creat(path));
+  }
+  ASSERT_OK(Creat("/2"));
+  std::vector<std::string> names;
+  ASSERT_EQ(List("/1", &names), 100);
+  for (int i = 0; i < 100; i++) {
+    snprintf(path, sizeof(path), "%03d", i);
+    ASSERT_EQ(names[i], path);
+  }
+  names.clear();
+  ASSERT_EQ(List("/", &names), 2);
+  ASSERT_EQ(names[0], "1");
+  ASSERT_EQ(names[1], "2");
+  names.clear();
+  ASSERT_EQ(List("/3", &names), -1);
+  delete fscli_;
+  fscli_ = NULL;
+  delete pool;
+}
+
 TEST(FilesystemCliTest, Resolv) {
   ASSERT_OK(OpenFilesystemCli());
   ASSERT_OK(Mkdir("/1"));
@@ -348,8 +468,50 @@ TEST(FilesystemCliTest, Buk) {
   ASSERT_OK(BulkCommit(buk));
   ASSERT_OK(BulkEnd(buk));
   ASSERT_OK(Exist("/a/1"));
+  const uint64_t ino = tmp_.InodeNo();
   ASSERT_OK(Exist("/a/2"));
+  ASSERT_EQ(tmp_.InodeNo(), ino + 1);
   ASSERT_OK(Exist("/a/3"));
+  ASSERT_EQ(tmp_.InodeNo(), ino + 2);
+  // Inodes are leased from the server and never reused
+  ASSERT_OK(Creat("/a/4"));
+  ASSERT_TRUE(tmp_.InodeNo() > ino + 2);
+}
+
+TEST(FilesystemCliTest, ParallelCommits) {
+  fscliopts_.batch_size = 4;
+  ThreadPool* const pool = ThreadPool::NewFixed(2);
+  fscliopts_.pool = pool;
+  ASSERT_OK(OpenFilesystemCli());
+  BATCH* bat;
+  ASSERT_OK(Mkdir("/a"));
+  ASSERT_OK(BatchStart("/a", &bat));
+  char name[20];
+  for (int i = 0; i < 50; i++) {
+    snprintf(name, sizeof(name), "%d", i);
+    ASSERT_OK(BatchInsert(name, bat));
+  }
+  ASSERT_OK(BatchCommit(bat));
+  ASSERT_OK(BatchEnd(bat));
+  BUK* buk;
+  ASSERT_OK(Mkdir("/b"));
+  ASSERT_OK(BulkStart("/b", &buk));
+  for (int i = 0; i < 50; i++) {
+    snprintf(name, sizeof(name), "%d", i);
+    ASSERT_OK(BulkInsert(name, buk));
+  }
+  ASSERT_OK(BulkCommit(buk));
+  ASSERT_OK(BulkEnd(buk));
+  char path[20];
+  for (int i = 0; i < 50; i++) {
+    snprintf(path, sizeof(path), "/a/%d", i);
+    ASSERT_OK(Exist(path));
+    snprintf(path, sizeof(path), "/b/%d", i);
+    ASSERT_OK(Exist(path));
+  }
+  delete fscli_;
+  fscli_ = NULL;
+  delete pool;
 }
 
 namespace {  // Filesystem rpc performance bench (the client part of it)...
@@ -374,6 +536,15 @@ int FLAGS_gid = 1;
 // Comma-separated server locations.
 const char* FLAGS_svr_uris = NULL;
 
+// Instead of sending rpcs to servers, have all threads share a single
+// FilesystemCli backed by a local filesystem. Each thread creates and then
+// looks up its files through the client.
+bool FLAGS_fscli = false;
+
+// With --fscli, have all threads create files in a single shared dir instead
+// of one dir per thread.
+bool FLAGS_share_dir = false;
+
 // Performance stats.
 class Stats {
  private:
@@ -570,6 +741,10 @@ class Benchmark {
  private:
   std::vector<std::string> svr_uris_;
   RPC* rpc_;
+  // Set when running with --fscli
+  FilesystemDb* fsdb_;
+  Filesystem* fs_;
+  FilesystemCli* fscli_;
 
   static void PrintHeader() {
     PrintEnvironment();
@@ -577,6 +752,10 @@ class Benchmark {
     fprintf(stdout, "Threads:            %d\n", FLAGS_threads);
     fprintf(stdout, "Num sends:          %d per thread\n", FLAGS_num);
     fprintf(stdout, "Random key order:   %d\n", FLAGS_random_order);
+    fprintf(stdout, "Shared fscli:       %d\n", FLAGS_fscli);
+    if (FLAGS_fscli) {
+      fprintf(stdout, "Share dir:          %d\n", FLAGS_share_dir);
+    }
     fprintf(stdout, "------------------------------------------------\n");
   }
 
@@ -648,8 +827,10 @@ class Benchmark {
 #endif
   }
 
+  typedef void (Benchmark::*Method)(ThreadState*);
   struct ThreadArg {
     Benchmark* bm;
+    Method method;
     SharedState* shared;
     ThreadState* thread;
   };
@@ -670,7 +851,7 @@ class Benchmark {
     }
 
     thread->stats.Start();
-    arg->bm->SendAndReceive(thread);
+    (arg->bm->*(arg->method))(thread);
     thread->stats.Stop();
 
     {
@@ -682,12 +863,13 @@ class Benchmark {
     }
   }
 
-  void RunBenchmark(int n) {
+  void RunBenchmark(int n, const char* name, Method method) {
     SharedState shared(n);
 
     ThreadArg* const arg = new ThreadArg[n];
     for (int i = 0; i < n; i++) {
       arg[i].bm = this;
+      arg[i].method = method;
       arg[i].shared = &shared;
       arg[i].thread = new ThreadState(i);
       arg[i].thread->shared = &shared;
@@ -710,7 +892,7 @@ class Benchmark {
     for (int i = 1; i < n; i++) {
       arg[0].thread->stats.Merge(arg[i].thread->stats);
     }
-    arg[0].thread->stats.Report("send/recv");
+    arg[0].thread->stats.Report(name);
     for (int i = 0; i < n; i++) {
       delete arg[i].thread;
     }
@@ -726,6 +908,7 @@ class Benchmark {
     options.parent = &shared->parent_lstat;
     options.mode = 0660;
     options.me = shared->me;
+    options.compact_reply = true;
     Stat stat;
     MkfleRet ret;
     ret.stat = &stat;
@@ -754,10 +937,96 @@ class Benchmark {
     delete[] clis;
   }
 
+  // Path of the i-th file created by a thread.
+  static void FilePath(char* dst, size_t dstlen,
+                              const ThreadState* const thread, int i) {
+    const uint64_t tid = uint64_t(thread->tid) << 32;
+    char tmp[30];
+    const Slice name = Base64Enc(tmp, tid | thread->fids[i]);
+    if (FLAGS_share_dir) {
+      snprintf(dst, dstlen, "/%s", name.ToString().c_str());
+    } else {
+      snprintf(dst, dstlen, "/t%d/%s", thread->tid, name.ToString().c_str());
+    }
+  }
+
+  void Mkfles(ThreadState* const thread) {
+    FilesystemCliCtx ctx(1000 + thread->tid);
+    ctx.who = thread->shared->me;
+    Stats* stats = &thread->stats;
+    Stat stat;
+    char path[50];
+    for (int i = 0; i < FLAGS_num; i++) {
+      FilePath(path, sizeof(path), thread, i);
+      Status s = fscli_->Mkfle(&ctx, NULL, path, 0660, &stat);
+      if (!s.ok()) {
+        fprintf(stderr, "Cannot mkfle: %s\n", s.ToString().c_str());
+        exit(1);
+      }
+      stats->FinishedSingleOp(FLAGS_num, thread->tid);
+    }
+  }
+
+  void Lstats(ThreadState* const thread) {
+    FilesystemCliCtx ctx(1000 + thread->tid);
+    ctx.who = thread->shared->me;
+    Stats* stats = &thread->stats;
+    Stat stat;
+    char path[50];
+    for (int i = 0; i < FLAGS_num; i++) {
+      FilePath(path, sizeof(path), thread, i);
+      Status s = fscli_->Lstat(&ctx, NULL, path, &stat);
+      if (!s.ok()) {
+        fprintf(stderr, "Cannot lstat: %s\n", s.ToString().c_str());
+        exit(1);
+      }
+      stats->FinishedSingleOp(FLAGS_num, thread->tid);
+    }
+  }
+
+  void RunFilesystemCli() {
+    const std::string fsloc = test::TmpDir() + "/fscli_bench";
+    DestroyDB(fsloc, DBOptions());
+    FilesystemDbOptions dbopts;
+    dbopts.ReadFromEnv();
+    fsdb_ = new FilesystemDb(dbopts, Env::GetUnBufferedIoEnv());
+    Status s = fsdb_->Open(fsloc);
+    if (!s.ok()) {
+      fprintf(stderr, "Cannot open fs db: %s\n", s.ToString().c_str());
+      exit(1);
+    }
+    FilesystemOptions fsopts;
+    fs_ = new Filesystem(fsopts);
+    fs_->SetDb(fsdb_);
+    FilesystemCliOptions cliopts;
+    fscli_ = new FilesystemCli(cliopts);
+    fscli_->SetLocalFs(fs_);
+    if (!FLAGS_share_dir) {
+      FilesystemCliCtx ctx(1);
+      ctx.who.uid = FLAGS_uid;
+      ctx.who.gid = FLAGS_gid;
+      Stat stat;
+      char path[20];
+      for (int i = 0; i < FLAGS_threads; i++) {
+        snprintf(path, sizeof(path), "/t%d", i);
+        s = fscli_->Mkdir(&ctx, NULL, path, 0770, &stat);
+        if (!s.ok()) {
+          fprintf(stderr, "Cannot mkdir: %s\n", s.ToString().c_str());
+          exit(1);
+        }
+      }
+    }
+    RunBenchmark(FLAGS_threads, "mkfle", &Benchmark::Mkfles);
+    RunBenchmark(FLAGS_threads, "lstat", &Benchmark::Lstats);
+  }
+
  public:
-  Benchmark() : rpc_(NULL) {}
+  Benchmark() : rpc_(NULL), fsdb_(NULL), fs_(NULL), fscli_(NULL) {}
 
   ~Benchmark() {
+    delete fscli_;
+    delete fs_;
+    delete fsdb_;
     if (rpc_) {
       rpc_->Stop();
     }
@@ -766,6 +1035,10 @@ class Benchmark {
 
   void Run() {
     PrintHeader();
+    if (FLAGS_fscli) {
+      RunFilesystemCli();
+      return;
+    }
     RPCOptions opts;
     opts.uri = "udp://-1:-1";
     opts.mode = rpc::kClientOnly;
@@ -791,7 +1064,7 @@ class Benchmark {
     }
     fflush(stdout);
 
-    RunBenchmark(FLAGS_threads);
+    RunBenchmark(FLAGS_threads, "send/recv", &Benchmark::SendAndReceive);
   }
 };
 }  // namespace
@@ -817,6 +1090,12 @@ void BM_Main(const int* const argc, char*** const argv) {
       pdlfs::FLAGS_threads = n;
     } else if (sscanf((*argv)[i], "--num=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_num = n;
+    } else if (sscanf((*argv)[i], "--fscli=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_fscli = n;
+    } else if (sscanf((*argv)[i], "--share_dir=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      pdlfs::FLAGS_share_dir = n;
     } else {
       fprintf(stderr, "Invalid flag: '%s'\n", (*argv)[i]);
       exit(1);
@@ -35,6 +35,8 @@
 
 #include "pdlfs-common/coding.h"
 
+#include <vector>
+
 namespace pdlfs {
 
 namespace {
@@ -75,6 +77,14 @@ void PutLookupStat(std::string* dst, const LookupStat& stat) {
   PutFixed32(dst, stat.GroupId());
 }
 
+void PutStat(std::string* dst, const Stat& stat) {
+  PutFixed64(dst, stat.DnodeNo());
+  PutFixed64(dst, stat.InodeNo());
+  PutFixed32(dst, stat.FileMode());
+  PutFixed32(dst, stat.UserId());
+  PutFixed32(dst, stat.GroupId());
+}
+
 void PutUser(std::string* dst, const User& u) {
   PutFixed32(dst, u.uid);
   PutFixed32(dst, u.gid);
@@ -121,9 +131,107 @@ bool GetFixed32(Slice* input, uint32_t* op) {
   input->remove_prefix(4);
   return true;
 }
-}  // namespace
+
+bool GetFixed64(Slice* input, uint64_t* v) {
+  if (input->size() < 8) return false;
+  *v = DecodeFixed64(input->data());
+  input->remove_prefix(8);
+  return true;
+}
 
 // clang-format on
+// Append the current index of a directory to an error reply so that a client
+// hitting a wrong directory partition can refresh its view of the directory.
+void PutDirIdx(FilesystemIf* fs, const User& who, const LookupStat& parent,
+               rpc::If::Message& out) {
+  std::string giga;
+  if (fs->Rdidx(who, parent, &giga).ok()) {
+    out.extra_buf.assign(out.contents.data(), out.contents.size());
+    PutLengthPrefixedSlice(&out.extra_buf, giga);
+    out.contents = out.extra_buf;
+  }
+}
+
+// Obtain the directory index piggybacked on an error reply, if any.
+void GetDirIdx(Slice* input, std::string* giga) {
+  Slice tmp;
+  if (giga != NULL && GetLengthPrefixedSlice(input, &tmp)) {
+    giga->assign(tmp.data(), tmp.size());
+  }
+}
+
+// Presence flags of a compactly encoded stat. A field is only encoded when it
+// differs from the corresponding field of the parent dir.
+enum { kDnodeNoPresent = 1, kUserIdPresent = 2, kGroupIdPresent = 4 };
+
+// Maximum length of a compactly encoded stat.
+const size_t kMaxCompactStatLength = 1 + 10 + 5 + 10 + 5 + 5;
+
+char* EncodeCompactStat(char* dst, const Stat& stat, const LookupStat& parent) {
+  unsigned char flags = 0;
+  if (stat.DnodeNo() != parent.DnodeNo()) flags |= kDnodeNoPresent;
+  if (stat.UserId() != parent.UserId()) flags |= kUserIdPresent;
+  if (stat.GroupId() != parent.GroupId()) flags |= kGroupIdPresent;
+  *dst++ = static_cast<char>(flags);
+  dst = EncodeVarint64(dst, stat.InodeNo());
+  dst = EncodeVarint32(dst, stat.FileMode());
+  if (flags & kDnodeNoPresent) dst = EncodeVarint64(dst, stat.DnodeNo());
+  if (flags & kUserIdPresent) dst = EncodeVarint32(dst, stat.UserId());
+  if (flags & kGroupIdPresent) dst = EncodeVarint32(dst, stat.GroupId());
+  return dst;
+}
+
+bool GetCompactStat(Slice* input, const LookupStat& parent, Stat* stat) {
+  if (input->empty()) return false;
+  const unsigned char flags = static_cast<unsigned char>((*input)[0]);
+  input->remove_prefix(1);
+  uint64_t ino, dno = parent.DnodeNo();
+  uint32_t mode, uid = parent.UserId(), gid = parent.GroupId();
+  if (!GetVarint64(input, &ino) || !GetVarint32(input, &mode)) return false;
+  if ((flags & kDnodeNoPresent) && !GetVarint64(input, &dno)) return false;
+  if ((flags & kUserIdPresent) && !GetVarint32(input, &uid)) return false;
+  if ((flags & kGroupIdPresent) && !GetVarint32(input, &gid)) return false;
+  stat->SetDnodeNo(dno);
+  stat->SetInodeNo(ino);
+  stat->SetFileMode(mode);
+  stat->SetUserId(uid);
+  stat->SetGroupId(gid);
+  return true;
+}
+
+// Encode the status code and, on OK, the resulting stat of a mkfle, mkdir, or
+// lstat reply.
+char* EncodeStatReply(char* dst, const Status& status, const Stat& stat,
+                      const LookupStat& parent, bool compact) {
+  if (compact) {
+    dst = EncodeVarint32(dst, status.err_code());
+    if (status.ok()) dst = EncodeCompactStat(dst, stat, parent);
+  } else {
+    EncodeFixed32(dst, status.err_code());
+    dst += 4;
+    if (status.ok()) dst = EncodeStat(dst, stat);
+  }
+  return dst;
+}
+
+// Decode a reply encoded by EncodeStatReply().
+Status GetStatReply(Slice* input, const LookupStat& parent, bool compact,
+                    Stat* stat, std::string* giga) {
+  uint32_t rv;
+  if (!(compact ? GetVarint32(input, &rv) : GetFixed32(input, &rv))) {
+    return Status::Corruption("Bad rpc reply header");
+  } else if (rv != 0) {
+    GetDirIdx(input, giga);
+    return Status::FromCode(rv);
+  } else if (!(compact ? GetCompactStat(input, parent, stat)
+                       : GetStat(input, stat))) {
+    return Status::Corruption("Bad rpc reply");
+  } else {
+    return Status::OK();
+  }
+}
+}  // namespace
+
 namespace rpc {
 Status LokupOperation::operator()(If::Message& in, If::Message& out) {
   Status s;
@@ -145,6 +253,9 @@ Status LokupOperation::operator()(If::Message& in, If::Message& out) {
       p = EncodeLookupStat(p, stat);
     }
     out.contents = Slice(dst, p - dst);
+    if (IsWrongDirPartition(ss)) {
+      PutDirIdx(fs_, options.me, pa, out);
+    }
   }
   return s;
 }
@@ -171,6 +282,7 @@ Status LokupCli::operator()(  ///
   if (!GetFixed32(&input, &rv)) {
     return Status::Corruption("Bad rpc reply header");
   } else if (rv != 0) {
+    GetDirIdx(&input, ret->giga);
     return Status::FromCode(rv);
   } else if (!GetLookupStat(&input, ret->stat)) {
     return Status::Corruption("Bad rpc reply");
@@ -198,12 +310,11 @@ Status MkdirOperation::operator()(If::Message& in, If::Message& out) {
   } else {
     Status ss = fs_->Mkdir(options.me, pa, options.name, options.mode, &stat);
     char* dst = &out.buf[0];
-    EncodeFixed32(dst, ss.err_code());
-    char* p = dst + 4;
-    if (ss.ok()) {
-      p = EncodeStat(p, stat);
-    }
+    char* p = EncodeStatReply(dst, ss, stat, pa, (op & kCompactReply) != 0);
     out.contents = Slice(dst, p - dst);
+    if (IsWrongDirPartition(ss)) {
+      PutDirIdx(fs_, options.me, pa, out);
+    }
   }
   return s;
 }
@@ -213,7 +324,7 @@ Status MkdirCli::operator()(  ///
   Status s;
   If::Message in;
   char* const dst = &in.buf[0];
-  EncodeFixed32(dst, kMkdir);
+  EncodeFixed32(dst, kMkdir | (options.compact_reply ? kCompactReply : 0));
   char* p = dst + 4;
   p = EncodeLookupStat(p, *options.parent);
   p = EncodeLengthPrefixedSlice(p, options.name);
@@ -223,21 +334,13 @@ Status MkdirCli::operator()(  ///
   assert(p - dst <= sizeof(in.buf));
   in.contents = Slice(dst, p - dst);
   If::Message out;
-  uint32_t rv;
   s = rpc_->Call(in, out);
   if (!s.ok()) {
     return s;
   }
   Slice input = out.contents;
-  if (!GetFixed32(&input, &rv)) {
-    return Status::Corruption("Bad rpc reply header");
-  } else if (rv != 0) {
-    return Status::FromCode(rv);
-  } else if (!GetStat(&input, ret->stat)) {
-    return Status::Corruption("Bad rpc reply");
-  } else {
-    return s;
-  }
+  return GetStatReply(&input, *options.parent, options.compact_reply,
+                      ret->stat, ret->giga);
 }
 }  // namespace rpc
 Status Mkdir(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
@@ -259,46 +362,45 @@ Status MkfleOperation::operator()(If::Message& in, If::Message& out) {
   } else {
     Status ss = fs_->Mkfle(options.me, pa, options.name, options.mode, &stat);
     char* dst = &out.buf[0];
-    EncodeFixed32(dst, ss.err_code());
-    char* p = dst + 4;
-    if (ss.ok()) {
-      p = EncodeStat(p, stat);
-    }
+    char* p = EncodeStatReply(dst, ss, stat, pa, (op & kCompactReply) != 0);
     out.contents = Slice(dst, p - dst);
+    if (IsWrongDirPartition(ss)) {
+      PutDirIdx(fs_, options.me, pa, out);
+    }
   }
   return s;
 }
 
-Status MkfleCli::operator()(  ///
-    const MkfleOptions& options, MkfleRet* ret) {
-  Status s;
-  If::Message in;
-  char* const dst = &in.buf[0];
-  EncodeFixed32(dst, kMkfle);
+void MkfleCli::EncodeRequest(const MkfleOptions& options, If::Message* in) {
+  char* const dst = &in->buf[0];
+  EncodeFixed32(dst, kMkfle | (options.compact_reply ? kCompactReply : 0));
   char* p = dst + 4;
   p = EncodeLookupStat(p, *options.parent);
   p = EncodeLengthPrefixedSlice(p, options.name);
   p = EncodeUser(p, options.me);
   EncodeFixed32(p, options.mode);
   p += 4;
-  assert(p - dst <= sizeof(in.buf));
-  in.contents = Slice(dst, p - dst);
+  assert(p - dst <= sizeof(in->buf));
+  in->contents = Slice(dst, p - dst);
+}
+
+Status MkfleCli::DecodeReply(  ///
+    const MkfleOptions& options, const If::Message& out, MkfleRet* ret) {
+  Slice input = out.contents;
+  return GetStatReply(&input, *options.parent, options.compact_reply,
+                      ret->stat, ret->giga);
+}
+
+Status MkfleCli::operator()(  ///
+    const MkfleOptions& options, MkfleRet* ret) {
+  If::Message in;
+  EncodeRequest(options, &in);
   If::Message out;
-  uint32_t rv;
-  s = rpc_->Call(in, out);
+  Status s = rpc_->Call(in, out);
   if (!s.ok()) {
     return s;
   }
-  Slice input = out.contents;
-  if (!GetFixed32(&input, &rv)) {
-    return Status::Corruption("Bad rpc reply header");
-  } else if (rv != 0) {
-    return Status::FromCode(rv);
-  } else if (!GetStat(&input, ret->stat)) {
-    return Status::Corruption("Bad rpc reply");
-  } else {
-    return s;
-  }
+  return DecodeReply(options, out, ret);
 }
 }  // namespace rpc
 Status Mkfle(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
@@ -328,6 +430,9 @@ Status MkflsOperation::operator()(If::Message& in, If::Message& out) {
       p += 4;
     }
     out.contents = Slice(dst, p - dst);
+    if (IsWrongDirPartition(ss)) {
+      PutDirIdx(fs_, options.me, pa, out);
+    }
   }
   return s;
 }
@@ -336,29 +441,23 @@ Status MkflsCli::operator()(  ///
     const MkflsOptions& options, MkflsRet* ret) {
   Status s;
   If::Message in;
-#if 0
+  // The name array is sent as a separate chunk directly from caller memory.
+  // Only the header and the trailer of the message are encoded here.
   char* const dst = &in.buf[0];
   EncodeFixed32(dst, kMkfls);
   char* p = dst + 4;
   p = EncodeLookupStat(p, *options.parent);
-  p = EncodeLengthPrefixedSlice(p, options.namearr);
+  p = EncodeVarint32(p, static_cast<uint32_t>(options.namearr.size()));
+  in.contents = Slice(dst, p - dst);
+  in.AddChunk(options.namearr);
+  char* const trailer = p;
   p = EncodeUser(p, options.me);
   EncodeFixed32(p, options.n);
   p += 4;
   EncodeFixed32(p, options.mode);
   p += 4;
   assert(p - dst <= sizeof(in.buf));
-  in.contents = Slice(dst, p - dst);
-#else
-  in.extra_buf.reserve(options.namearr.size() + 100);
-  PutFixed32(&in.extra_buf, kMkfls);
-  PutLookupStat(&in.extra_buf, *options.parent);
-  PutLengthPrefixedSlice(&in.extra_buf, options.namearr);
-  PutUser(&in.extra_buf, options.me);
-  PutFixed32(&in.extra_buf, options.n);
-  PutFixed32(&in.extra_buf, options.mode);
-  in.contents = in.extra_buf;
-#endif
+  in.AddChunk(Slice(trailer, p - trailer));
   If::Message out;
   uint32_t rv;
   s = rpc_->Call(in, out);
@@ -369,6 +468,7 @@ Status MkflsCli::operator()(  ///
   if (!GetFixed32(&input, &rv)) {
     return Status::Corruption("Bad rpc reply header");
   } else if (rv != 0) {
+    GetDirIdx(&input, ret->giga);
     return Status::FromCode(rv);
   } else if (!GetFixed32(&input, &ret->n)) {
     return Status::Corruption("Bad rpc reply");
@@ -451,25 +551,438 @@ Status LstatOperation::operator()(If::Message& in, If::Message& out) {
   } else {
     Status ss = fs_->Lstat(options.me, pa, options.name, &stat);
     char* dst = &out.buf[0];
+    char* p = EncodeStatReply(dst, ss, stat, pa, (op & kCompactReply) != 0);
+    out.contents = Slice(dst, p - dst);
+    if (IsWrongDirPartition(ss)) {
+      PutDirIdx(fs_, options.me, pa, out);
+    }
+  }
+  return s;
+}
+
+void LstatCli::EncodeRequest(const LstatOptions& options, If::Message* in) {
+  char* const dst = &in->buf[0];
+  EncodeFixed32(dst, kLstat | (options.compact_reply ? kCompactReply : 0));
+  char* p = dst + 4;
+  p = EncodeLookupStat(p, *options.parent);
+  p = EncodeLengthPrefixedSlice(p, options.name);
+  p = EncodeUser(p, options.me);
+  assert(p - dst <= sizeof(in->buf));
+  in->contents = Slice(dst, p - dst);
+}
+
+Status LstatCli::DecodeReply(  ///
+    const LstatOptions& options, const If::Message& out, LstatRet* ret) {
+  Slice input = out.contents;
+  return GetStatReply(&input, *options.parent, options.compact_reply,
+                      ret->stat, ret->giga);
+}
+
+Status LstatCli::operator()(  ///
+    const LstatOptions& options, LstatRet* ret) {
+  If::Message in;
+  EncodeRequest(options, &in);
+  If::Message out;
+  Status s = rpc_->Call(in, out);
+  if (!s.ok()) {
+    return s;
+  }
+  return DecodeReply(options, out, ret);
+}
+}  // namespace rpc
+Status Lstat(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
+  return rpc::LstatOperation(fs)(in, out);
+}
+
+namespace rpc {
+// Replies carry a status code for each name followed by a packed array of the
+// stats of all names found. Compact replies instead carry a varint status code
+// for each name, each immediately followed by the stat of the name when it is
+// found.
+Status LstatsOperation::operator()(If::Message& in, If::Message& out) {
+  Status s;
+  uint32_t op;
+  LstatsOptions options;
+  LookupStat pa;
+  Slice input = in.contents;
+  if (!GetFixed32(&input, &op) || !GetLookupStat(&input, &pa) ||
+      !GetLengthPrefixedSlice(&input, &options.namearr) ||
+      !GetUser(&input, &options.me) || !GetFixed32(&input, &options.n) ||
+      options.n > options.namearr.size()) {
+    s = Status::InvalidArgument("Bad rpc input data");
+  } else {
+    const uint32_t n = options.n;
+    std::vector<Stat> stats(n);
+    std::vector<Status> rets(n);
+    Status ss = fs_->Lstats(options.me, pa, options.namearr, n,
+                            n != 0 ? &stats[0] : NULL,
+                            n != 0 ? &rets[0] : NULL);
+    const bool compact = (op & kCompactReply) != 0;
+    if (compact) {
+      out.extra_buf.reserve(10 + 16 * n);
+      PutVarint32(&out.extra_buf, ss.err_code());
+    } else {
+      out.extra_buf.reserve(8 + 32 * n);
+      PutFixed32(&out.extra_buf, ss.err_code());
+    }
+    bool wrong_partition = false;
+    if (ss.ok() && compact) {
+      PutVarint32(&out.extra_buf, n);
+      char tmp[kMaxCompactStatLength];
+      for (uint32_t i = 0; i < n; i++) {
+        PutVarint32(&out.extra_buf, rets[i].err_code());
+        if (rets[i].ok()) {
+          char* p = EncodeCompactStat(tmp, stats[i], pa);
+          out.extra_buf.append(tmp, p - tmp);
+        } else if (IsWrongDirPartition(rets[i])) {
+          wrong_partition = true;
+        }
+      }
+    } else if (ss.ok()) {
+      PutFixed32(&out.extra_buf, n);
+      for (uint32_t i = 0; i < n; i++) {
+        PutFixed32(&out.extra_buf, rets[i].err_code());
+        if (IsWrongDirPartition(rets[i])) {
+          wrong_partition = true;
+        }
+      }
+      char tmp[28];
+      for (uint32_t i = 0; i < n; i++) {
+        if (rets[i].ok()) {
+          char* p = EncodeStat(tmp, stats[i]);
+          out.extra_buf.append(tmp, p - tmp);
+        }
+      }
+    }
+    if (IsWrongDirPartition(ss) || wrong_partition) {
+      std::string giga;
+      if (fs_->Rdidx(options.me, pa, &giga).ok()) {
+        PutLengthPrefixedSlice(&out.extra_buf, giga);
+      }
+    }
+    out.contents = out.extra_buf;
+  }
+  return s;
+}
+
+namespace {
+Status GetCompactLstatsReply(  ///
+    const LstatsOptions& options, Slice input, LstatsRet* ret) {
+  uint32_t rv;
+  uint32_t n;
+  if (!GetVarint32(&input, &rv)) {
+    return Status::Corruption("Bad rpc reply header");
+  } else if (rv != 0) {
+    GetDirIdx(&input, ret->giga);
+    return Status::FromCode(rv);
+  } else if (!GetVarint32(&input, &n) || n != options.n) {
+    return Status::Corruption("Bad rpc reply");
+  }
+  bool wrong_partition = false;
+  for (uint32_t i = 0; i < n; i++) {
+    if (!GetVarint32(&input, &rv)) {
+      return Status::Corruption("Bad rpc reply");
+    } else if (rv == 0) {
+      ret->rets[i] = Status::OK();
+      if (!GetCompactStat(&input, *options.parent, &ret->stats[i])) {
+        return Status::Corruption("Bad rpc reply");
+      }
+    } else {
+      ret->rets[i] = Status::FromCode(rv);
+      if (ret->rets[i].IsAccessDenied()) {
+        wrong_partition = true;
+      }
+    }
+  }
+  if (wrong_partition) {
+    GetDirIdx(&input, ret->giga);
+  }
+  return Status::OK();
+}
+}  // namespace
+
+Status LstatsCli::operator()(  ///
+    const LstatsOptions& options, LstatsRet* ret) {
+  Status s;
+  If::Message in;
+  in.extra_buf.reserve(options.namearr.size() + 100);
+  PutFixed32(&in.extra_buf,
+             kLstats | (options.compact_reply ? kCompactReply : 0));
+  PutLookupStat(&in.extra_buf, *options.parent);
+  PutLengthPrefixedSlice(&in.extra_buf, options.namearr);
+  PutUser(&in.extra_buf, options.me);
+  PutFixed32(&in.extra_buf, options.n);
+  in.contents = in.extra_buf;
+  If::Message out;
+  uint32_t rv;
+  s = rpc_->Call(in, out);
+  if (!s.ok()) {
+    return s;
+  }
+  Slice input = out.contents;
+  if (options.compact_reply) {
+    return GetCompactLstatsReply(options, input, ret);
+  }
+  uint32_t n;
+  if (!GetFixed32(&input, &rv)) {
+    return Status::Corruption("Bad rpc reply header");
+  } else if (rv != 0) {
+    GetDirIdx(&input, ret->giga);
+    return Status::FromCode(rv);
+  } else if (!GetFixed32(&input, &n) || n != options.n ||
+             input.size() < 4 * size_t(n)) {
+    return Status::Corruption("Bad rpc reply");
+  }
+  Slice codes(input.data(), 4 * size_t(n));
+  input.remove_prefix(codes.size());
+  bool wrong_partition = false;
+  for (uint32_t i = 0; i < n; i++) {
+    GetFixed32(&codes, &rv);
+    if (rv == 0) {
+      ret->rets[i] = Status::OK();
+      if (!GetStat(&input, &ret->stats[i])) {
+        return Status::Corruption("Bad rpc reply");
+      }
+    } else {
+      ret->rets[i] = Status::FromCode(rv);
+      if (ret->rets[i].IsAccessDenied()) {
+        wrong_partition = true;
+      }
+    }
+  }
+  if (wrong_partition) {
+    GetDirIdx(&input, ret->giga);
+  }
+  return s;
+}
+}  // namespace rpc
+Status Lstats(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
+  return rpc::LstatsOperation(fs)(in, out);
+}
+
+namespace rpc {
+Status ReaddirOperation::operator()(If::Message& in, If::Message& out) {
+  Status s;
+  uint32_t op;
+  ReaddirOptions options;
+  LookupStat pa;
+  Slice input = in.contents;
+  if (!GetFixed32(&input, &op) || !GetLookupStat(&input, &pa) ||
+      !GetLengthPrefixedSlice(&input, &options.cursor) ||
+      !GetFixed32(&input, &options.max_bytes) ||
+      !GetUser(&input, &options.me)) {
+    s = Status::InvalidArgument("Bad rpc input data");
+  } else {
+    std::string entarr;
+    std::string next;
+    Status ss = fs_->Readdir(options.me, pa, options.cursor, options.max_bytes,
+                             &entarr, &next);
+    out.extra_buf.reserve(entarr.size() + next.size() + 20);
+    PutFixed32(&out.extra_buf, ss.err_code());
+    if (ss.ok()) {
+      PutLengthPrefixedSlice(&out.extra_buf, next);
+      PutLengthPrefixedSlice(&out.extra_buf, entarr);
+    }
+    out.contents = out.extra_buf;
+  }
+  return s;
+}
+
+Status ReaddirCli::operator()(  ///
+    const ReaddirOptions& options, ReaddirRet* ret) {
+  Status s;
+  If::Message in;
+  in.extra_buf.reserve(options.cursor.size() + 100);
+  PutFixed32(&in.extra_buf, kReaddir);
+  PutLookupStat(&in.extra_buf, *options.parent);
+  PutLengthPrefixedSlice(&in.extra_buf, options.cursor);
+  PutFixed32(&in.extra_buf, options.max_bytes);
+  PutUser(&in.extra_buf, options.me);
+  in.contents = in.extra_buf;
+  If::Message out;
+  uint32_t rv;
+  s = rpc_->Call(in, out);
+  if (!s.ok()) {
+    return s;
+  }
+  Slice input = out.contents;
+  Slice next;
+  Slice entarr;
+  if (!GetFixed32(&input, &rv)) {
+    return Status::Corruption("Bad rpc reply header");
+  } else if (rv != 0) {
+    return Status::FromCode(rv);
+  } else if (!GetLengthPrefixedSlice(&input, &next) ||
+             !GetLengthPrefixedSlice(&input, &entarr)) {
+    return Status::Corruption("Bad rpc reply");
+  } else {
+    ret->next->assign(next.data(), next.size());
+    ret->entarr->assign(entarr.data(), entarr.size());
+    return s;
+  }
+}
+}  // namespace rpc
+Status Readdir(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
+  return rpc::ReaddirOperation(fs)(in, out);
+}
+
+namespace rpc {
+Status SplitOperation::operator()(If::Message& in, If::Message& out) {
+  Status s;
+  uint32_t op;
+  uint32_t index;
+  uint32_t phase;
+  uint32_t from;
+  SplitOptions options;
+  LookupStat pa;
+  Slice input = in.contents;
+  if (!GetFixed32(&input, &op) || !GetLookupStat(&input, &pa) ||
+      !GetFixed32(&input, &index) || !GetFixed32(&input, &phase) ||
+      phase > kSplitAbort || !GetFixed32(&input, &from) ||
+      !GetLengthPrefixedSlice(&input, &options.secret) ||
+      !GetLengthPrefixedSlice(&input, &options.giga) ||
+      !GetLengthPrefixedSlice(&input, &options.entarr)) {
+    s = Status::InvalidArgument("Bad rpc input data");
+  } else {
+    Status ss = fs_->Split(options.secret, static_cast<int>(from), pa,
+                           static_cast<int>(index),
+                           static_cast<SplitPhase>(phase), options.giga,
+                           options.entarr);
+    char* dst = &out.buf[0];
+    EncodeFixed32(dst, ss.err_code());
+    out.contents = Slice(dst, 4);
+  }
+  return s;
+}
+
+Status SplitCli::operator()(  ///
+    const SplitOptions& options, SplitRet* ret) {
+  Status s;
+  If::Message in;
+  in.extra_buf.reserve(options.secret.size() + options.giga.size() +
+                       options.entarr.size() + 100);
+  PutFixed32(&in.extra_buf, kSplit);
+  PutLookupStat(&in.extra_buf, *options.parent);
+  PutFixed32(&in.extra_buf, static_cast<uint32_t>(options.index));
+  PutFixed32(&in.extra_buf, static_cast<uint32_t>(options.phase));
+  PutFixed32(&in.extra_buf, static_cast<uint32_t>(options.from));
+  PutLengthPrefixedSlice(&in.extra_buf, options.secret);
+  PutLengthPrefixedSlice(&in.extra_buf, options.giga);
+  PutLengthPrefixedSlice(&in.extra_buf, options.entarr);
+  in.contents = in.extra_buf;
+  If::Message out;
+  uint32_t rv;
+  s = rpc_->Call(in, out);
+  if (!s.ok()) {
+    return s;
+  }
+  Slice input = out.contents;
+  if (!GetFixed32(&input, &rv)) {
+    return Status::Corruption("Bad rpc reply header");
+  } else if (rv != 0) {
+    return Status::FromCode(rv);
+  } else {
+    return s;
+  }
+}
+}  // namespace rpc
+Status Split(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
+  return rpc::SplitOperation(fs)(in, out);
+}
+
+namespace rpc {
+Status RdidxOperation::operator()(If::Message& in, If::Message& out) {
+  Status s;
+  uint32_t op;
+  RdidxOptions options;
+  LookupStat pa;
+  Slice input = in.contents;
+  if (!GetFixed32(&input, &op) || !GetLookupStat(&input, &pa) ||
+      !GetUser(&input, &options.me)) {
+    s = Status::InvalidArgument("Bad rpc input data");
+  } else {
+    std::string giga;
+    Status ss = fs_->Rdidx(options.me, pa, &giga);
+    out.extra_buf.reserve(giga.size() + 10);
+    PutFixed32(&out.extra_buf, ss.err_code());
+    if (ss.ok()) {
+      PutLengthPrefixedSlice(&out.extra_buf, giga);
+    }
+    out.contents = out.extra_buf;
+  }
+  return s;
+}
+
+Status RdidxCli::operator()(  ///
+    const RdidxOptions& options, RdidxRet* ret) {
+  Status s;
+  If::Message in;
+  char* const dst = &in.buf[0];
+  EncodeFixed32(dst, kRdidx);
+  char* p = dst + 4;
+  p = EncodeLookupStat(p, *options.parent);
+  p = EncodeUser(p, options.me);
+  assert(p - dst <= sizeof(in.buf));
+  in.contents = Slice(dst, p - dst);
+  If::Message out;
+  uint32_t rv;
+  s = rpc_->Call(in, out);
+  if (!s.ok()) {
+    return s;
+  }
+  Slice input = out.contents;
+  Slice giga;
+  if (!GetFixed32(&input, &rv)) {
+    return Status::Corruption("Bad rpc reply header");
+  } else if (rv != 0) {
+    return Status::FromCode(rv);
+  } else if (!GetLengthPrefixedSlice(&input, &giga)) {
+    return Status::Corruption("Bad rpc reply");
+  } else {
+    ret->giga->assign(giga.data(), giga.size());
+    return s;
+  }
+}
+}  // namespace rpc
+Status Rdidx(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
+  return rpc::RdidxOperation(fs)(in, out);
+}
+
+namespace rpc {
+Status RsinoOperation::operator()(If::Message& in, If::Message& out) {
+  Status s;
+  uint32_t op;
+  RsinoOptions options;
+  Slice input = in.contents;
+  if (!GetFixed32(&input, &op) || !GetFixed32(&input, &options.n) ||
+      !GetUser(&input, &options.me)) {
+    s = Status::InvalidArgument("Bad rpc input data");
+  } else {
+    RsinoRet ret;
+    Status ss = fs_->Rsino(options.me, options.n, &ret.dno, &ret.startino);
+    char* const dst = &out.buf[0];
     EncodeFixed32(dst, ss.err_code());
     char* p = dst + 4;
     if (ss.ok()) {
-      p = EncodeStat(p, stat);
+      EncodeFixed64(p, ret.dno);
+      p += 8;
+      EncodeFixed64(p, ret.startino);
+      p += 8;
     }
     out.contents = Slice(dst, p - dst);
   }
   return s;
 }
 
-Status LstatCli::operator()(  ///
-    const LstatOptions& options, LstatRet* ret) {
+Status RsinoCli::operator()(  ///
+    const RsinoOptions& options, RsinoRet* ret) {
   Status s;
   If::Message in;
   char* const dst = &in.buf[0];
-  EncodeFixed32(dst, kLstat);
+  EncodeFixed32(dst, kRsino);
   char* p = dst + 4;
-  p = EncodeLookupStat(p, *options.parent);
-  p = EncodeLengthPrefixedSlice(p, options.name);
+  EncodeFixed32(p, options.n);
+  p += 4;
   p = EncodeUser(p, options.me);
   assert(p - dst <= sizeof(in.buf));
   in.contents = Slice(dst, p - dst);
@@ -484,15 +997,250 @@ Status LstatCli::operator()(  ///
     return Status::Corruption("Bad rpc reply header");
   } else if (rv != 0) {
     return Status::FromCode(rv);
-  } else if (!GetStat(&input, ret->stat)) {
+  } else if (!GetFixed64(&input, &ret->dno) ||
+             !GetFixed64(&input, &ret->startino)) {
     return Status::Corruption("Bad rpc reply");
   } else {
     return s;
   }
 }
 }  // namespace rpc
-Status Lstat(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
-  return rpc::LstatOperation(fs)(in, out);
+Status Rsino(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
+  return rpc::RsinoOperation(fs)(in, out);
+}
+
+namespace {
+// A sub-op takes at least a fixed32 op code and a one-byte name length.
+const size_t kMinCmpndSubOpLength = 4 + 1;
+
+bool GetCmpndSubOp(Slice* input, CmpndSubOp* sub) {
+  sub->mode = 0;
+  if (!GetFixed32(input, &sub->op) ||
+      !GetLengthPrefixedSlice(input, &sub->name)) {
+    return false;
+  } else if (sub->op == rpc::kMkfle || sub->op == rpc::kMkdir) {
+    return GetFixed32(input, &sub->mode);
+  } else {
+    return true;
+  }
+}
+}  // namespace
+
+namespace rpc {
+Status CmpndOperation::operator()(If::Message& in, If::Message& out) {
+  Status s;
+  uint32_t op;
+  CmpndOptions options;
+  LookupStat pa;
+  std::vector<CmpndSubOp> subs;
+  Slice input = in.contents;
+  if (!GetFixed32(&input, &op) || !GetLookupStat(&input, &pa) ||
+      !GetUser(&input, &options.me) || !GetFixed32(&input, &options.n) ||
+      options.n > input.size() / kMinCmpndSubOpLength) {
+    s = Status::InvalidArgument("Bad rpc input data");
+  } else {
+    CmpndSubOp sub;
+    subs.reserve(options.n);
+    for (uint32_t i = 0; i < options.n; i++) {
+      if (!GetCmpndSubOp(&input, &sub)) {
+        s = Status::InvalidArgument("Bad rpc input data");
+        break;
+      }
+      subs.push_back(sub);
+    }
+  }
+  if (s.ok()) {
+    std::string* const dst = &out.extra_buf;
+    dst->clear();
+    PutFixed32(dst, 0);  // To be replaced with the final error code
+    PutFixed32(dst, 0);  // To be replaced with the number of ops done
+    Status ss;
+    uint32_t i = 0;
+    for (; i < options.n; i++) {
+      const CmpndSubOp& sub = subs[i];
+      Stat stat;
+      LookupStat lstat;
+      switch (sub.op) {
+        case kLokup:
+          ss = fs_->Lokup(options.me, pa, sub.name, &lstat);
+          break;
+        case kLstat:
+          ss = fs_->Lstat(options.me, pa, sub.name, &stat);
+          break;
+        case kMkfle:
+          ss = fs_->Mkfle(options.me, pa, sub.name, sub.mode, &stat);
+          break;
+        case kMkdir:
+          ss = fs_->Mkdir(options.me, pa, sub.name, sub.mode, &stat);
+          break;
+        default:
+          ss = Status::NotSupported("Bad compound sub-op");
+          break;
+      }
+      if (!ss.ok()) {
+        break;
+      } else if (sub.op == kLokup) {
+        PutLookupStat(dst, lstat);
+        pa = lstat;
+      } else {
+        PutStat(dst, stat);
+      }
+    }
+    EncodeFixed32(&(*dst)[0], ss.err_code());
+    EncodeFixed32(&(*dst)[4], i);
+    if (IsWrongDirPartition(ss)) {
+      std::string giga;
+      if (fs_->Rdidx(options.me, pa, &giga).ok()) {
+        PutLengthPrefixedSlice(dst, giga);
+      }
+    }
+    out.contents = *dst;
+  }
+  return s;
+}
+
+Status CmpndCli::operator()(  ///
+    const CmpndOptions& options, CmpndRet* ret) {
+  Status s;
+  If::Message in;
+  std::string* const dst = &in.extra_buf;
+  PutFixed32(dst, kCmpnd);
+  PutLookupStat(dst, *options.parent);
+  PutUser(dst, options.me);
+  PutFixed32(dst, options.n);
+  for (uint32_t i = 0; i < options.n; i++) {
+    const CmpndSubOp& sub = options.ops[i];
+    PutFixed32(dst, sub.op);
+    PutLengthPrefixedSlice(dst, sub.name);
+    if (sub.op == kMkfle || sub.op == kMkdir) {
+      PutFixed32(dst, sub.mode);
+    }
+  }
+  in.contents = *dst;
+  If::Message out;
+  uint32_t rv;
+  uint32_t n;
+  ret->n = 0;
+  s = rpc_->Call(in, out);
+  if (!s.ok()) {
+    return s;
+  }
+  Slice input = out.contents;
+  if (!GetFixed32(&input, &rv) || !GetFixed32(&input, &n) || n > options.n) {
+    return Status::Corruption("Bad rpc reply header");
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    const bool ok = options.ops[i].op == kLokup
+                        ? GetLookupStat(&input, &ret->lstats[i])
+                        : GetStat(&input, &ret->stats[i]);
+    if (!ok) {
+      return Status::Corruption("Bad rpc reply");
+    }
+    ret->n++;
+  }
+  if (rv != 0) {
+    GetDirIdx(&input, ret->giga);
+    return Status::FromCode(rv);
+  } else {
+    return s;
+  }
+}
+}  // namespace rpc
+Status Cmpnd(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
+  return rpc::CmpndOperation(fs)(in, out);
+}
+
+namespace rpc {
+Status ResolveOperation::operator()(If::Message& in, If::Message& out) {
+  Status s;
+  uint32_t op;
+  ResolveOptions options;
+  LookupStat pa;
+  Slice input = in.contents;
+  if (!GetFixed32(&input, &op) || !GetLookupStat(&input, &pa) ||
+      !GetLengthPrefixedSlice(&input, &options.namearr) ||
+      !GetFixed32(&input, &options.n) || !GetUser(&input, &options.me) ||
+      options.n > options.namearr.size() || options.n > kMaxResolveDepth) {
+    s = Status::InvalidArgument("Bad rpc input data");
+  } else {
+    std::vector<LookupStat> stats(options.n);
+    uint32_t m = 0;
+    Status ss = fs_->Resolve(options.me, pa, options.namearr, options.n,
+                             options.n != 0 ? &stats[0] : NULL, &m);
+    std::string* const dst = &out.extra_buf;
+    dst->clear();
+    PutFixed32(dst, ss.err_code());
+    PutFixed32(dst, m);
+    for (uint32_t i = 0; i < m; i++) {
+      PutLookupStat(dst, stats[i]);
+    }
+    if (IsWrongDirPartition(ss) && m == 0) {
+      std::string giga;
+      if (fs_->Rdidx(options.me, pa, &giga).ok()) {
+        PutLengthPrefixedSlice(dst, giga);
+      }
+    }
+    out.contents = *dst;
+  }
+  return s;
+}
+
+Status ResolveCli::operator()(  ///
+    const ResolveOptions& options, ResolveRet* ret) {
+  Status s;
+  If::Message in;
+  std::string* const dst = &in.extra_buf;
+  PutFixed32(dst, kRsolv);
+  PutLookupStat(dst, *options.parent);
+  PutLengthPrefixedSlice(dst, options.namearr);
+  PutFixed32(dst, options.n);
+  PutUser(dst, options.me);
+  in.contents = *dst;
+  If::Message out;
+  uint32_t rv;
+  uint32_t m;
+  ret->m = 0;
+  s = rpc_->Call(in, out);
+  if (!s.ok()) {
+    return s;
+  }
+  Slice input = out.contents;
+  if (!GetFixed32(&input, &rv) || !GetFixed32(&input, &m) || m > options.n) {
+    return Status::Corruption("Bad rpc reply header");
+  }
+  for (uint32_t i = 0; i < m; i++) {
+    if (!GetLookupStat(&input, &ret->stats[i])) {
+      return Status::Corruption("Bad rpc reply");
+    }
+    ret->m++;
+  }
+  if (rv != 0) {
+    GetDirIdx(&input, ret->giga);
+    return Status::FromCode(rv);
+  } else {
+    return s;
+  }
+}
+}  // namespace rpc
+Status Resolve(FilesystemIf* fs, rpc::If::Message& in, rpc::If::Message& out) {
+  return rpc::ResolveOperation(fs)(in, out);
+}
+
+FilesystemPeer::~FilesystemPeer() {}
+
+Status FilesystemPeer::Split(  ///
+    const Slice& secret, int from, const LookupStat& parent, int index,
+    SplitPhase phase, const Slice& giga, const Slice& entarr) {
+  SplitOptions options;
+  options.parent = &parent;
+  options.index = index;
+  options.phase = phase;
+  options.from = from;
+  options.secret = secret;
+  options.giga = giga;
+  options.entarr = entarr;
+  SplitRet ret;
+  return rpc::SplitCli(rpc_)(options, &ret);
 }
 
 }  // namespace pdlfs
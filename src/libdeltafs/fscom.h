@@ -39,7 +39,33 @@
 
 namespace pdlfs {
 namespace rpc {
-enum { kLokup = 0, kMkdir, kMkfle, kMkfls, kBukin, kLstat, kNumOps };
+enum {
+  kLokup = 0,
+  kMkdir,
+  kMkfle,
+  kMkfls,
+  kBukin,
+  kLstat,
+  kSplit,
+  kRdidx,
+  kLstats,
+  kReaddir,
+  kRsino,
+  kCmpnd,
+  kRsolv,
+  kNumOps
+};
+
+// Set in the op code of a mkfle, mkdir, lstat, or lstats request to ask for a
+// compact reply. In a compact reply, status codes are varints and each stat is
+// encoded as a delta against the parent dir of the request: a byte of presence
+// flags followed by varints of the fields that differ from the parent's.
+// Servers accept requests with and without the flag.
+enum { kCompactReply = 1 << 30 };
+
+// Maximum number of path components a server resolves in one kRsolv request.
+// Clients look up any components beyond that on their own.
+enum { kMaxResolveDepth = 256 };
 }
 
 struct LokupOptions {
@@ -48,7 +74,11 @@ struct LokupOptions {
   User me;
 };
 struct LokupRet {
+  LokupRet() : stat(NULL), giga(NULL) {}
   LookupStat* stat;
+  // Set to the server's directory index on wrong partition errors. May be
+  // NULL if not needed.
+  std::string* giga;
 };
 namespace rpc {
 struct LokupOperation {
@@ -71,9 +101,14 @@ struct MkdirOptions {
   Slice name;
   uint32_t mode;
   User me;
+  bool compact_reply;
 };
 struct MkdirRet {
+  MkdirRet() : stat(NULL), giga(NULL) {}
   Stat* stat;
+  // Set to the server's directory index on wrong partition errors. May be
+  // NULL if not needed.
+  std::string* giga;
 };
 namespace rpc {
 struct MkdirOperation {
@@ -96,9 +131,14 @@ struct MkfleOptions {
   Slice name;
   uint32_t mode;
   User me;
+  bool compact_reply;
 };
 struct MkfleRet {
+  MkfleRet() : stat(NULL), giga(NULL) {}
   Stat* stat;
+  // Set to the server's directory index on wrong partition errors. May be
+  // NULL if not needed.
+  std::string* giga;
 };
 namespace rpc {
 struct MkfleOperation {
@@ -112,6 +152,10 @@ namespace rpc {
 struct MkfleCli {
   MkfleCli(If* rpc) : rpc_(rpc) {}
   Status operator()(const MkfleOptions&, MkfleRet*);
+  // Halves of operator() for callers making asynchronous calls.
+  static void EncodeRequest(const MkfleOptions&, If::Message* in);
+  static Status DecodeReply(const MkfleOptions&, const If::Message& out,
+                            MkfleRet*);
   If* rpc_;
 };
 }  // namespace rpc
@@ -124,7 +168,12 @@ struct MkflsOptions {
   User me;
 };
 struct MkflsRet {
+  MkflsRet() : n(0), giga(NULL) {}
   uint32_t n;
+  // Set to the server's directory index when the names are sent to a wrong
+  // partition, in which case none of them is inserted. May be NULL if not
+  // needed.
+  std::string* giga;
 };
 namespace rpc {
 struct MkflsOperation {
@@ -170,9 +219,14 @@ struct LstatOptions {
   const LookupStat* parent;
   Slice name;
   User me;
+  bool compact_reply;
 };
 struct LstatRet {
+  LstatRet() : stat(NULL), giga(NULL) {}
   Stat* stat;
+  // Set to the server's directory index on wrong partition errors. May be
+  // NULL if not needed.
+  std::string* giga;
 };
 namespace rpc {
 struct LstatOperation {
@@ -186,8 +240,239 @@ namespace rpc {
 struct LstatCli {
   LstatCli(If* rpc) : rpc_(rpc) {}
   Status operator()(const LstatOptions&, LstatRet*);
+  // Halves of operator() for callers making asynchronous calls.
+  static void EncodeRequest(const LstatOptions&, If::Message* in);
+  static Status DecodeReply(const LstatOptions&, const If::Message& out,
+                            LstatRet*);
+  If* rpc_;
+};
+}  // namespace rpc
+
+struct LstatsOptions {
+  const LookupStat* parent;
+  Slice namearr;
+  uint32_t n;
+  User me;
+  bool compact_reply;
+};
+struct LstatsRet {
+  LstatsRet() : stats(NULL), rets(NULL), giga(NULL) {}
+  // Both arrays must have room for n entries.
+  Stat* stats;
+  Status* rets;
+  // Set to the server's directory index when any of the names is rejected for
+  // being sent to a wrong partition. May be NULL if not needed.
+  std::string* giga;
+};
+namespace rpc {
+struct LstatsOperation {
+  LstatsOperation(FilesystemIf* fs) : fs_(fs) {}
+  Status operator()(If::Message& in, If::Message& out);
+  FilesystemIf* fs_;
+};
+}  // namespace rpc
+Status Lstats(FilesystemIf*, rpc::If::Message& in, rpc::If::Message& out);
+namespace rpc {
+struct LstatsCli {
+  LstatsCli(If* rpc) : rpc_(rpc) {}
+  Status operator()(const LstatsOptions&, LstatsRet*);
+  If* rpc_;
+};
+}  // namespace rpc
+
+struct ReaddirOptions {
+  const LookupStat* parent;
+  Slice cursor;
+  uint32_t max_bytes;
+  User me;
+};
+struct ReaddirRet {
+  ReaddirRet() : entarr(NULL), next(NULL) {}
+  std::string* entarr;
+  std::string* next;
+};
+namespace rpc {
+struct ReaddirOperation {
+  ReaddirOperation(FilesystemIf* fs) : fs_(fs) {}
+  Status operator()(If::Message& in, If::Message& out);
+  FilesystemIf* fs_;
+};
+}  // namespace rpc
+Status Readdir(FilesystemIf*, rpc::If::Message& in, rpc::If::Message& out);
+namespace rpc {
+struct ReaddirCli {
+  ReaddirCli(If* rpc) : rpc_(rpc) {}
+  Status operator()(const ReaddirOptions&, ReaddirRet*);
+  If* rpc_;
+};
+}  // namespace rpc
+
+struct SplitOptions {
+  const LookupStat* parent;
+  int index;
+  SplitPhase phase;
+  int from;
+  Slice secret;
+  Slice giga;
+  Slice entarr;
+};
+struct SplitRet {
+  // Empty
+};
+namespace rpc {
+struct SplitOperation {
+  SplitOperation(FilesystemIf* fs) : fs_(fs) {}
+  Status operator()(If::Message& in, If::Message& out);
+  FilesystemIf* fs_;
+};
+}  // namespace rpc
+Status Split(FilesystemIf*, rpc::If::Message& in, rpc::If::Message& out);
+namespace rpc {
+struct SplitCli {
+  SplitCli(If* rpc) : rpc_(rpc) {}
+  Status operator()(const SplitOptions&, SplitRet*);
+  If* rpc_;
+};
+}  // namespace rpc
+
+struct RdidxOptions {
+  const LookupStat* parent;
+  User me;
+};
+struct RdidxRet {
+  std::string* giga;
+};
+namespace rpc {
+struct RdidxOperation {
+  RdidxOperation(FilesystemIf* fs) : fs_(fs) {}
+  Status operator()(If::Message& in, If::Message& out);
+  FilesystemIf* fs_;
+};
+}  // namespace rpc
+Status Rdidx(FilesystemIf*, rpc::If::Message& in, rpc::If::Message& out);
+namespace rpc {
+struct RdidxCli {
+  RdidxCli(If* rpc) : rpc_(rpc) {}
+  Status operator()(const RdidxOptions&, RdidxRet*);
+  If* rpc_;
+};
+}  // namespace rpc
+
+struct RsinoOptions {
+  uint32_t n;
+  User me;
+};
+struct RsinoRet {
+  uint64_t dno;
+  uint64_t startino;
+};
+namespace rpc {
+struct RsinoOperation {
+  RsinoOperation(FilesystemIf* fs) : fs_(fs) {}
+  Status operator()(If::Message& in, If::Message& out);
+  FilesystemIf* fs_;
+};
+}  // namespace rpc
+Status Rsino(FilesystemIf*, rpc::If::Message& in, rpc::If::Message& out);
+namespace rpc {
+struct RsinoCli {
+  RsinoCli(If* rpc) : rpc_(rpc) {}
+  Status operator()(const RsinoOptions&, RsinoRet*);
+  If* rpc_;
+};
+}  // namespace rpc
+
+// A compound operation carries a sequence of sub-operations that a server
+// executes in order on behalf of a client in a single round trip. Each
+// sub-operation is performed under the directory resolved by the latest kLokup
+// before it, or under the initial parent directory when there is no such
+// kLokup. Execution stops at the first failed sub-operation.
+struct CmpndSubOp {
+  uint32_t op;  // One of rpc::kLokup, rpc::kLstat, rpc::kMkfle, rpc::kMkdir
+  Slice name;
+  uint32_t mode;  // Only used by rpc::kMkfle and rpc::kMkdir
+};
+struct CmpndOptions {
+  const LookupStat* parent;
+  const CmpndSubOp* ops;
+  uint32_t n;
+  User me;
+};
+struct CmpndRet {
+  CmpndRet() : lstats(NULL), stats(NULL), n(0), giga(NULL) {}
+  // Results of successful sub-operations. Both arrays must have room for
+  // options.n entries. lstats[i] is set if the i-th sub-operation is a kLokup.
+  // Otherwise, stats[i] is set.
+  LookupStat* lstats;
+  Stat* stats;
+  // Number of sub-operations that succeeded before the first failure.
+  uint32_t n;
+  // Set to the server's index of the parent directory of the failed
+  // sub-operation on wrong partition errors. May be NULL if not needed.
+  std::string* giga;
+};
+namespace rpc {
+struct CmpndOperation {
+  CmpndOperation(FilesystemIf* fs) : fs_(fs) {}
+  Status operator()(If::Message& in, If::Message& out);
+  FilesystemIf* fs_;
+};
+}  // namespace rpc
+Status Cmpnd(FilesystemIf*, rpc::If::Message& in, rpc::If::Message& out);
+namespace rpc {
+// Return the status of the first failed sub-operation, or OK if all
+// sub-operations succeeded. ret->n is set in both cases.
+struct CmpndCli {
+  CmpndCli(If* rpc) : rpc_(rpc) {}
+  Status operator()(const CmpndOptions&, CmpndRet*);
+  If* rpc_;
+};
+}  // namespace rpc
+
+struct ResolveOptions {
+  const LookupStat* parent;
+  Slice namearr;
+  uint32_t n;
+  User me;
+};
+struct ResolveRet {
+  ResolveRet() : stats(NULL), m(0), giga(NULL) {}
+  LookupStat* stats;  // Must have room for options.n entries
+  uint32_t m;
+  // Set to the server's directory index when the first name is rejected for
+  // being sent to a wrong partition. May be NULL if not needed.
+  std::string* giga;
+};
+namespace rpc {
+struct ResolveOperation {
+  ResolveOperation(FilesystemIf* fs) : fs_(fs) {}
+  Status operator()(If::Message& in, If::Message& out);
+  FilesystemIf* fs_;
+};
+}  // namespace rpc
+Status Resolve(FilesystemIf*, rpc::If::Message& in, rpc::If::Message& out);
+namespace rpc {
+// ret->m is set regardless of the return status.
+struct ResolveCli {
+  ResolveCli(If* rpc) : rpc_(rpc) {}
+  Status operator()(const ResolveOptions&, ResolveRet*);
   If* rpc_;
 };
 }  // namespace rpc
 
+// A filesystem peer forwards directory split operations to a remote
+// filesystem server through rpc. Used by a server to move directory partitions
+// to other servers.
+class FilesystemPeer : public FilesystemWrapper {
+ public:
+  explicit FilesystemPeer(rpc::If* rpc) : rpc_(rpc) {}
+  virtual ~FilesystemPeer();
+  virtual Status Split(const Slice& secret, int from, const LookupStat& parent,
+                       int index, SplitPhase phase, const Slice& giga,
+                       const Slice& entarr);
+
+ private:
+  rpc::If* rpc_;  // Not owned by us
+};
+
 }  // namespace pdlfs
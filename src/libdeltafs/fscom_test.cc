@@ -33,7 +33,12 @@
  */
 #include "fscom.h"
 
+#include "pdlfs-common/coding.h"
 #include "pdlfs-common/testharness.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <vector>
 #if __cplusplus >= 201103L
 #define OVERRIDE override
 #else
@@ -60,6 +65,7 @@ class LokupTest : public rpc::If, public FilesystemWrapper {
     stat_.SetGroupId(15);
     stat_.SetLeaseDue(16);
     name_ = "x";
+    no_perm_ = false;
   }
 
   virtual Status Lokup(  ///
@@ -75,18 +81,33 @@ class LokupTest : public rpc::If, public FilesystemWrapper {
     ASSERT_EQ(parent.GroupId(), parent_.GroupId());
     ASSERT_EQ(parent.LeaseDue(), parent_.LeaseDue());
     ASSERT_EQ(name, name_);
+    if (no_perm_) {
+      return Status::AccessDenied("No dir x perm");
+    } else if (!giga_.empty()) {
+      return WrongDirPartition();
+    }
     *stat = stat_;
     return Status::OK();
   }
 
+  virtual Status Rdidx(const User& who, const LookupStat& parent,
+                       std::string* giga) OVERRIDE {
+    ASSERT_EQ(parent.DnodeNo(), parent_.DnodeNo());
+    ASSERT_EQ(parent.InodeNo(), parent_.InodeNo());
+    *giga = giga_.ToString();
+    return Status::OK();
+  }
+
   virtual Status Call(Message& in, Message& out) RPCNOEXCEPT OVERRIDE {
     return rpc::LokupOperation(this)(in, out);
   }
 
   LookupStat parent_;
   LookupStat stat_;
+  Slice giga_;
   Slice name_;
   User who_;
+  bool no_perm_;
 };
 
 TEST(LokupTest, LokupCall) {
@@ -107,6 +128,38 @@ TEST(LokupTest, LokupCall) {
   ASSERT_EQ(stat.LeaseDue(), stat_.LeaseDue());
 }
 
+TEST(LokupTest, WrongPartition) {
+  giga_ = "giga";
+  LokupOptions opts;
+  opts.parent = &parent_;
+  opts.name = name_;
+  opts.me = who_;
+  LokupRet ret;
+  LookupStat stat;
+  ret.stat = &stat;
+  std::string giga;
+  ret.giga = &giga;
+  ASSERT_TRUE(rpc::LokupCli(this)(opts, &ret).IsAccessDenied());
+  ASSERT_EQ(giga, giga_);
+}
+
+// The dir index is only sent back for names stored at other servers
+TEST(LokupTest, NoPerm) {
+  giga_ = "giga";
+  no_perm_ = true;
+  LokupOptions opts;
+  opts.parent = &parent_;
+  opts.name = name_;
+  opts.me = who_;
+  LokupRet ret;
+  LookupStat stat;
+  ret.stat = &stat;
+  std::string giga;
+  ret.giga = &giga;
+  ASSERT_TRUE(rpc::LokupCli(this)(opts, &ret).IsAccessDenied());
+  ASSERT_TRUE(giga.empty());
+}
+
 class MkflsTest : public rpc::If, public FilesystemWrapper {
  public:
   MkflsTest() {
@@ -145,6 +198,7 @@ class MkflsTest : public rpc::If, public FilesystemWrapper {
   }
 
   virtual Status Call(Message& in, Message& out) RPCNOEXCEPT OVERRIDE {
+    in.Flatten();
     return rpc::MkflsOperation(this)(in, out);
   }
 
@@ -168,6 +222,507 @@ TEST(MkflsTest, MkflsCall) {
   ASSERT_EQ(ret.n, n_);
 }
 
+class LstatsTest : public rpc::If, public FilesystemWrapper {
+ public:
+  LstatsTest() {
+    who_.uid = 1;
+    who_.gid = 2;
+    parent_.SetDnodeNo(3);
+    parent_.SetInodeNo(4);
+    parent_.SetZerothServer(5);
+    parent_.SetDirMode(6);
+    parent_.SetUserId(7);
+    parent_.SetGroupId(8);
+    parent_.SetLeaseDue(9);
+    PutLengthPrefixedSlice(&namearr_, "a");
+    PutLengthPrefixedSlice(&namearr_, "b");
+    PutLengthPrefixedSlice(&namearr_, "c");
+    stat_.SetDnodeNo(10);
+    stat_.SetInodeNo(11);
+    stat_.SetFileMode(12);
+    stat_.SetUserId(13);
+    stat_.SetGroupId(14);
+    giga_ = "x";
+  }
+
+  virtual Status Lstats(const User& who, const LookupStat& parent,
+                        const Slice& namearr, uint32_t n, Stat* stats,
+                        Status* rets) OVERRIDE {
+    ASSERT_EQ(who.uid, who_.uid);
+    ASSERT_EQ(who.gid, who_.gid);
+    ASSERT_EQ(parent.DnodeNo(), parent_.DnodeNo());
+    ASSERT_EQ(parent.InodeNo(), parent_.InodeNo());
+    ASSERT_EQ(namearr, namearr_);
+    ASSERT_EQ(n, 3);
+    stats[0] = stat_;
+    rets[0] = Status::OK();
+    rets[1] = Status::NotFound(Slice());
+    rets[2] = WrongDirPartition();
+    return Status::OK();
+  }
+
+  virtual Status Rdidx(const User& who, const LookupStat& parent,
+                       std::string* giga) OVERRIDE {
+    *giga = giga_;
+    return Status::OK();
+  }
+
+  virtual Status Call(Message& in, Message& out) RPCNOEXCEPT OVERRIDE {
+    return rpc::LstatsOperation(this)(in, out);
+  }
+
+  LookupStat parent_;
+  std::string namearr_;
+  std::string giga_;
+  Stat stat_;
+  User who_;
+};
+
+TEST(LstatsTest, LstatsCall) {
+  LstatsOptions opts;
+  opts.parent = &parent_;
+  opts.namearr = namearr_;
+  opts.n = 3;
+  opts.me = who_;
+  opts.compact_reply = false;
+  Stat stats[3];
+  Status rets[3];
+  std::string giga;
+  LstatsRet ret;
+  ret.stats = stats;
+  ret.rets = rets;
+  ret.giga = &giga;
+  ASSERT_OK(rpc::LstatsCli(this)(opts, &ret));
+  ASSERT_OK(rets[0]);
+  ASSERT_EQ(stats[0].DnodeNo(), stat_.DnodeNo());
+  ASSERT_EQ(stats[0].InodeNo(), stat_.InodeNo());
+  ASSERT_EQ(stats[0].FileMode(), stat_.FileMode());
+  ASSERT_EQ(stats[0].UserId(), stat_.UserId());
+  ASSERT_EQ(stats[0].GroupId(), stat_.GroupId());
+  ASSERT_TRUE(rets[1].IsNotFound());
+  ASSERT_TRUE(rets[2].IsAccessDenied());
+  ASSERT_EQ(giga, giga_);
+}
+
+// Stats are either encoded in full or as deltas against the parent dir
+// depending on whether their fields match those of the parent dir.
+TEST(LstatsTest, CompactLstatsCall) {
+  for (int k = 0; k < 2; k++) {
+    if (k != 0) {
+      stat_.SetDnodeNo(parent_.DnodeNo());
+      stat_.SetUserId(parent_.UserId());
+      stat_.SetGroupId(parent_.GroupId());
+    }
+    LstatsOptions opts;
+    opts.parent = &parent_;
+    opts.namearr = namearr_;
+    opts.n = 3;
+    opts.me = who_;
+    opts.compact_reply = true;
+    Stat stats[3];
+    Status rets[3];
+    std::string giga;
+    LstatsRet ret;
+    ret.stats = stats;
+    ret.rets = rets;
+    ret.giga = &giga;
+    ASSERT_OK(rpc::LstatsCli(this)(opts, &ret));
+    ASSERT_OK(rets[0]);
+    ASSERT_EQ(stats[0].DnodeNo(), stat_.DnodeNo());
+    ASSERT_EQ(stats[0].InodeNo(), stat_.InodeNo());
+    ASSERT_EQ(stats[0].FileMode(), stat_.FileMode());
+    ASSERT_EQ(stats[0].UserId(), stat_.UserId());
+    ASSERT_EQ(stats[0].GroupId(), stat_.GroupId());
+    ASSERT_TRUE(rets[1].IsNotFound());
+    ASSERT_TRUE(rets[2].IsAccessDenied());
+    ASSERT_EQ(giga, giga_);
+  }
+}
+
+class ReaddirTest : public rpc::If, public FilesystemWrapper {
+ public:
+  ReaddirTest() {
+    who_.uid = 1;
+    who_.gid = 2;
+    parent_.SetDnodeNo(3);
+    parent_.SetInodeNo(4);
+    parent_.SetZerothServer(5);
+    parent_.SetDirMode(6);
+    parent_.SetUserId(7);
+    parent_.SetGroupId(8);
+    parent_.SetLeaseDue(9);
+    cursor_ = "x";
+    max_bytes_ = 10;
+    entarr_ = "y";
+    next_ = "z";
+  }
+
+  virtual Status Readdir(const User& who, const LookupStat& parent,
+                         const Slice& cursor, uint32_t max_bytes,
+                         std::string* entarr, std::string* next) OVERRIDE {
+    ASSERT_EQ(who.uid, who_.uid);
+    ASSERT_EQ(who.gid, who_.gid);
+    ASSERT_EQ(parent.DnodeNo(), parent_.DnodeNo());
+    ASSERT_EQ(parent.InodeNo(), parent_.InodeNo());
+    ASSERT_EQ(cursor, cursor_);
+    ASSERT_EQ(max_bytes, max_bytes_);
+    *entarr = entarr_;
+    *next = next_;
+    return Status::OK();
+  }
+
+  virtual Status Call(Message& in, Message& out) RPCNOEXCEPT OVERRIDE {
+    return rpc::ReaddirOperation(this)(in, out);
+  }
+
+  LookupStat parent_;
+  std::string cursor_;
+  uint32_t max_bytes_;
+  std::string entarr_;
+  std::string next_;
+  User who_;
+};
+
+TEST(ReaddirTest, ReaddirCall) {
+  ReaddirOptions opts;
+  opts.parent = &parent_;
+  opts.cursor = cursor_;
+  opts.max_bytes = max_bytes_;
+  opts.me = who_;
+  std::string entarr;
+  std::string next;
+  ReaddirRet ret;
+  ret.entarr = &entarr;
+  ret.next = &next;
+  ASSERT_OK(rpc::ReaddirCli(this)(opts, &ret));
+  ASSERT_EQ(entarr, entarr_);
+  ASSERT_EQ(next, next_);
+}
+
+class RsinoTest : public rpc::If, public FilesystemWrapper {
+ public:
+  RsinoTest() {
+    who_.uid = 1;
+    who_.gid = 2;
+    n_ = 3;
+    dno_ = 4;
+    startino_ = 5;
+  }
+
+  virtual Status Rsino(const User& who, uint32_t n, uint64_t* dno,
+                       uint64_t* startino) OVERRIDE {
+    ASSERT_EQ(who.uid, who_.uid);
+    ASSERT_EQ(who.gid, who_.gid);
+    ASSERT_EQ(n, n_);
+    *dno = dno_;
+    *startino = startino_;
+    return Status::OK();
+  }
+
+  virtual Status Call(Message& in, Message& out) RPCNOEXCEPT OVERRIDE {
+    return rpc::RsinoOperation(this)(in, out);
+  }
+
+  uint32_t n_;
+  uint64_t dno_;
+  uint64_t startino_;
+  User who_;
+};
+
+TEST(RsinoTest, RsinoCall) {
+  RsinoOptions opts;
+  opts.n = n_;
+  opts.me = who_;
+  RsinoRet ret;
+  ASSERT_OK(rpc::RsinoCli(this)(opts, &ret));
+  ASSERT_EQ(ret.dno, dno_);
+  ASSERT_EQ(ret.startino, startino_);
+}
+
+// Each directory looked up gets an inode number one larger than its parent
+// directory. Names starting with "-" are rejected as if they were sent to a
+// wrong directory partition.
+class CmpndTest : public rpc::If, public FilesystemWrapper {
+ public:
+  CmpndTest() {
+    who_.uid = 1;
+    who_.gid = 2;
+    parent_.SetDnodeNo(3);
+    parent_.SetInodeNo(4);
+    forged_n_ = 0;
+    mode_ = 5;
+  }
+
+  virtual Status Lokup(  ///
+      const User& who, const LookupStat& parent, const Slice& name,
+      LookupStat* stat) OVERRIDE {
+    ASSERT_EQ(who.uid, who_.uid);
+    ASSERT_EQ(who.gid, who_.gid);
+    if (name.starts_with("-")) {
+      return WrongDirPartition();
+    }
+    stat->SetDnodeNo(parent.DnodeNo());
+    stat->SetInodeNo(parent.InodeNo() + 1);
+    stat->SetDirMode(S_IFDIR);
+    return Status::OK();
+  }
+
+  virtual Status Mkfle(  ///
+      const User& who, const LookupStat& parent, const Slice& name,
+      uint32_t mode, Stat* stat) OVERRIDE {
+    ASSERT_EQ(mode, mode_);
+    stat->SetDnodeNo(parent.DnodeNo());
+    stat->SetInodeNo(parent.InodeNo() + 1);
+    stat->SetFileMode(mode);
+    return Status::OK();
+  }
+
+  virtual Status Lstat(  ///
+      const User& who, const LookupStat& parent, const Slice& name,
+      Stat* stat) OVERRIDE {
+    return Status::NotFound(Slice());
+  }
+
+  virtual Status Rdidx(const User& who, const LookupStat& parent,
+                       std::string* giga) OVERRIDE {
+    char tmp[20];
+    snprintf(tmp, sizeof(tmp), "%d", int(parent.InodeNo()));
+    *giga = tmp;
+    return Status::OK();
+  }
+
+  virtual Status Call(Message& in, Message& out) RPCNOEXCEPT OVERRIDE {
+    std::string forged;
+    if (forged_n_ != 0) {  // Overwrite the op count at the end of the request
+      forged = in.contents.ToString();
+      EncodeFixed32(&forged[forged.size() - 4], forged_n_);
+      in.contents = forged;
+    }
+    return rpc::CmpndOperation(this)(in, out);
+  }
+
+  void AddOp(uint32_t op, const char* name) {
+    CmpndSubOp sub;
+    sub.op = op;
+    sub.name = name;
+    sub.mode = mode_;
+    ops_.push_back(sub);
+  }
+
+  Status Run(CmpndRet* ret) {
+    CmpndOptions opts;
+    opts.parent = &parent_;
+    opts.ops = !ops_.empty() ? &ops_[0] : NULL;
+    opts.n = ops_.size();
+    opts.me = who_;
+    lstats_.resize(ops_.size() + 1);
+    stats_.resize(ops_.size() + 1);
+    ret->lstats = &lstats_[0];
+    ret->stats = &stats_[0];
+    return rpc::CmpndCli(this)(opts, ret);
+  }
+
+  std::vector<CmpndSubOp> ops_;
+  std::vector<LookupStat> lstats_;
+  std::vector<Stat> stats_;
+  LookupStat parent_;
+  uint32_t forged_n_;
+  uint32_t mode_;
+  User who_;
+};
+
+TEST(CmpndTest, CmpndCall) {
+  AddOp(rpc::kLokup, "a");
+  AddOp(rpc::kLokup, "b");
+  AddOp(rpc::kMkfle, "c");
+  CmpndRet ret;
+  ASSERT_OK(Run(&ret));
+  ASSERT_EQ(ret.n, 3);
+  ASSERT_EQ(lstats_[0].InodeNo(), 5);
+  ASSERT_EQ(lstats_[1].InodeNo(), 6);
+  ASSERT_EQ(stats_[2].DnodeNo(), 3);
+  ASSERT_EQ(stats_[2].InodeNo(), 7);
+  ASSERT_EQ(stats_[2].FileMode(), mode_);
+}
+
+TEST(CmpndTest, StopsAtFirstError) {
+  AddOp(rpc::kLokup, "a");
+  AddOp(rpc::kLstat, "b");
+  AddOp(rpc::kMkfle, "c");
+  CmpndRet ret;
+  ASSERT_TRUE(Run(&ret).IsNotFound());
+  ASSERT_EQ(ret.n, 1);
+  ASSERT_EQ(lstats_[0].InodeNo(), 5);
+}
+
+TEST(CmpndTest, CmpndWrongPartition) {
+  AddOp(rpc::kLokup, "a");
+  AddOp(rpc::kLokup, "-b");
+  AddOp(rpc::kLokup, "c");
+  CmpndRet ret;
+  std::string giga;
+  ret.giga = &giga;
+  ASSERT_TRUE(Run(&ret).IsAccessDenied());
+  ASSERT_EQ(ret.n, 1);
+  // Index of the parent of the rejected name
+  ASSERT_EQ(giga, "5");
+}
+
+TEST(CmpndTest, BadOpCount) {
+  forged_n_ = 0xffffffff;
+  CmpndRet ret;
+  ASSERT_TRUE(Run(&ret).IsInvalidArgument());
+  ASSERT_EQ(ret.n, 0);
+}
+
+class ResolveTest : public rpc::If, public FilesystemWrapper {
+ public:
+  ResolveTest() {
+    who_.uid = 1;
+    who_.gid = 2;
+    parent_.SetDnodeNo(3);
+    parent_.SetInodeNo(4);
+    PutLengthPrefixedSlice(&namearr_, "a");
+    PutLengthPrefixedSlice(&namearr_, "b");
+    PutLengthPrefixedSlice(&namearr_, "c");
+    n_ = 3;
+    m_ = 2;
+  }
+
+  virtual Status Resolve(const User& who, const LookupStat& parent,
+                         const Slice& namearr, uint32_t n, LookupStat* stats,
+                         uint32_t* m) OVERRIDE {
+    ASSERT_EQ(who.uid, who_.uid);
+    ASSERT_EQ(who.gid, who_.gid);
+    ASSERT_EQ(parent.DnodeNo(), parent_.DnodeNo());
+    ASSERT_EQ(parent.InodeNo(), parent_.InodeNo());
+    ASSERT_EQ(namearr, namearr_);
+    ASSERT_EQ(n, n_);
+    for (uint32_t i = 0; i < m_; i++) {
+      stats[i].SetDnodeNo(parent.DnodeNo());
+      stats[i].SetInodeNo(parent.InodeNo() + i + 1);
+    }
+    *m = m_;
+    if (m_ == 0) {
+      return WrongDirPartition();
+    }
+    return Status::OK();
+  }
+
+  virtual Status Rdidx(const User& who, const LookupStat& parent,
+                       std::string* giga) OVERRIDE {
+    *giga = "giga";
+    return Status::OK();
+  }
+
+  virtual Status Call(Message& in, Message& out) RPCNOEXCEPT OVERRIDE {
+    return rpc::ResolveOperation(this)(in, out);
+  }
+
+  Status Run(ResolveRet* ret) {
+    ResolveOptions opts;
+    opts.parent = &parent_;
+    opts.namearr = namearr_;
+    opts.n = n_;
+    opts.me = who_;
+    ret->stats = stats_;
+    return rpc::ResolveCli(this)(opts, ret);
+  }
+
+  LookupStat parent_;
+  LookupStat stats_[3];
+  std::string namearr_;
+  uint32_t n_;
+  uint32_t m_;
+  User who_;
+};
+
+TEST(ResolveTest, ResolveCall) {
+  ResolveRet ret;
+  ASSERT_OK(Run(&ret));
+  ASSERT_EQ(ret.m, m_);
+  ASSERT_EQ(stats_[0].InodeNo(), 5);
+  ASSERT_EQ(stats_[1].InodeNo(), 6);
+}
+
+TEST(ResolveTest, ResolveWrongPartition) {
+  m_ = 0;
+  ResolveRet ret;
+  std::string giga;
+  ret.giga = &giga;
+  ASSERT_TRUE(Run(&ret).IsAccessDenied());
+  ASSERT_EQ(ret.m, 0);
+  ASSERT_EQ(giga, "giga");
+}
+
+TEST(ResolveTest, BadNameCount) {
+  n_ = 0xffffffff;
+  ResolveRet ret;
+  ASSERT_TRUE(Run(&ret).IsInvalidArgument());
+  ASSERT_EQ(ret.m, 0);
+}
+
+TEST(ResolveTest, TooManyNames) {
+  namearr_.clear();
+  for (n_ = 0; n_ <= rpc::kMaxResolveDepth; n_++) {
+    PutLengthPrefixedSlice(&namearr_, "a");
+  }
+  ResolveRet ret;
+  ASSERT_TRUE(Run(&ret).IsInvalidArgument());
+  ASSERT_EQ(ret.m, 0);
+}
+
+class SplitTest : public rpc::If, public FilesystemWrapper {
+ public:
+  SplitTest() {
+    secret_ = "s";
+    from_ = 1;
+    parent_.SetDnodeNo(3);
+    parent_.SetInodeNo(4);
+    parent_.SetZerothServer(5);
+    parent_.SetDirMode(6);
+    parent_.SetUserId(7);
+    parent_.SetGroupId(8);
+    parent_.SetLeaseDue(9);
+    index_ = 10;
+    phase_ = kSplitCommit;
+    giga_ = "x";
+    entarr_ = "y";
+  }
+
+  virtual Status Split(const Slice& secret, int from, const LookupStat& parent,
+                       int index, SplitPhase phase, const Slice& giga,
+                       const Slice& entarr) OVERRIDE {
+    ASSERT_EQ(secret, secret_);
+    ASSERT_EQ(from, from_);
+    ASSERT_EQ(parent.DnodeNo(), parent_.DnodeNo());
+    ASSERT_EQ(parent.InodeNo(), parent_.InodeNo());
+    ASSERT_EQ(index, index_);
+    ASSERT_EQ(phase, phase_);
+    ASSERT_EQ(giga, giga_);
+    ASSERT_EQ(entarr, entarr_);
+    return Status::OK();
+  }
+
+  virtual Status Call(Message& in, Message& out) RPCNOEXCEPT OVERRIDE {
+    return rpc::SplitOperation(this)(in, out);
+  }
+
+  Slice secret_;
+  int from_;
+  LookupStat parent_;
+  int index_;
+  SplitPhase phase_;
+  Slice giga_;
+  Slice entarr_;
+};
+
+TEST(SplitTest, SplitCall) {
+  FilesystemPeer peer(this);
+  ASSERT_OK(
+      peer.Split(secret_, from_, parent_, index_, phase_, giga_, entarr_));
+}
+
 }  // namespace pdlfs
 #undef OVERRIDE
 
@@ -43,9 +43,13 @@
 #include "pdlfs-common/leveldb/write_batch.h"
 
 #include "pdlfs-common/cache.h"
+#include "pdlfs-common/env.h"
+#include "pdlfs-common/gigaplus.h"
 #include "pdlfs-common/fsdb0.h"
+#include "pdlfs-common/pdlfs_config.h"
 #include "pdlfs-common/strutil.h"
 
+#include <algorithm>
 #include <stdlib.h>
 
 namespace pdlfs {
@@ -59,7 +63,12 @@ FilesystemDbStats::FilesystemDbStats()
       puts(0),
       getkeybytes(0),
       getbytes(0),
-      gets(0) {}
+      gets(0),
+      roskips(0) {
+  for (int i = 0; i < kMaxRoDepth; i++) {
+    roprobes[i] = 0;
+  }
+}
 
 void FilesystemDbStats::Merge(const FilesystemDbStats& other) {
   putkeybytes += other.putkeybytes;
@@ -68,6 +77,10 @@ void FilesystemDbStats::Merge(const FilesystemDbStats& other) {
   getkeybytes += other.getkeybytes;
   getbytes += other.getbytes;
   gets += other.gets;
+  for (int i = 0; i < kMaxRoDepth; i++) {
+    roprobes[i] += other.roprobes[i];
+  }
+  roskips += other.roskips;
 }
 
 FilesystemDbOptions::FilesystemDbOptions()
@@ -87,6 +100,8 @@ FilesystemDbOptions::FilesystemDbOptions()
       l0_compaction_trigger(4),
       l0_soft_limit(8),
       l0_hard_limit(12),
+      compaction_threads(0),
+      max_subcompactions(1),
       detach_dir_on_close(false),
       detach_dir_on_bulk_end(false),
       attach_dir_on_bulk(false),
@@ -95,6 +110,10 @@ FilesystemDbOptions::FilesystemDbOptions()
       enable_io_monitoring(false),
       use_default_logger(false),
       disable_write_ahead_logging(false),
+      pipelined_write(false),
+      concurrent_memtable(false),
+      memtable_hash_buckets(0),
+      use_ect_index(false),
       disable_compaction(false),
       compression(false) {}
 
@@ -141,9 +160,18 @@ void FilesystemDbOptions::ReadFromEnv() {
                            &l0_compaction_trigger);
   ReadIntegerOptionFromEnv("DELTAFS_Db_l0_soft_limit", &l0_soft_limit);
   ReadIntegerOptionFromEnv("DELTAFS_Db_l0_hard_limit", &l0_hard_limit);
+  ReadIntegerOptionFromEnv("DELTAFS_Db_compaction_threads",
+                           &compaction_threads);
+  ReadIntegerOptionFromEnv("DELTAFS_Db_max_subcompactions",
+                           &max_subcompactions);
+  ReadIntegerOptionFromEnv("DELTAFS_Db_memtable_hash_buckets",
+                           &memtable_hash_buckets);
   ReadBoolFromEnv("DELTAFS_Db_use_default_logger", &use_default_logger);
   ReadBoolFromEnv("DELTAFS_Db_disable_write_ahead_logging",
                   &disable_write_ahead_logging);
+  ReadBoolFromEnv("DELTAFS_Db_pipelined_write", &pipelined_write);
+  ReadBoolFromEnv("DELTAFS_Db_concurrent_memtable", &concurrent_memtable);
+  ReadBoolFromEnv("DELTAFS_Db_use_ect_index", &use_ect_index);
   ReadBoolFromEnv("DELTAFS_Db_disable_compaction", &disable_compaction);
   ReadBoolFromEnv("DELTAFS_Db_enable_io_monitoring", &enable_io_monitoring);
   ReadBoolFromEnv("DELTAFS_Db_compression", &compression);
@@ -170,12 +198,21 @@ Status FilesystemDb::Open(const std::string& dbloc, bool readonly) {
   if (readonly) {
     return ReadonlyOpen(dbloc);
   }
+#if !defined(PDLFS_SILT_ECT)
+  if (options_.use_ect_index) {
+    return Status::NotSupported("ect index requires PDLFS_SILT_ECT");
+  }
+#endif
   DBOptions dbopts;
   dbopts.create_if_missing = true;
   dbopts.table_builder_skip_verification = true;
   dbopts.sync_log_on_close = true;
   dbopts.detach_dir_on_close = options_.detach_dir_on_close;
   dbopts.disable_write_ahead_log = options_.disable_write_ahead_logging;
+  dbopts.pipelined_write = options_.pipelined_write;
+  dbopts.concurrent_memtable = options_.concurrent_memtable;
+  dbopts.memtable_hash_buckets = options_.memtable_hash_buckets;
+  dbopts.index_type = options_.use_ect_index ? kEctIndex : kBlockIndex;
   dbopts.prefetch_compaction_input = options_.prefetch_compaction_input;
   dbopts.disable_compaction = options_.disable_compaction;
   dbopts.disable_seek_compaction = true;
@@ -194,6 +231,8 @@ Status FilesystemDb::Open(const std::string& dbloc, bool readonly) {
   dbopts.l0_compaction_trigger = options_.l0_compaction_trigger;
   dbopts.l0_soft_limit = options_.l0_soft_limit;
   dbopts.l0_hard_limit = options_.l0_hard_limit;
+  dbopts.compaction_pool = compaction_pool_;
+  dbopts.max_subcompactions = options_.max_subcompactions;
   dbopts.max_mem_compact_level = 0;
   dbopts.info_log = options_.use_default_logger ? Logger::Default() : NULL;
   dbopts.compression =
@@ -239,11 +278,15 @@ FilesystemDb::FilesystemDb(const FilesystemDbOptions& options, Env* base)
                          : NULL),
       table_cache_(NewLRUCache(options_.table_cache_size)),
       block_cache_(NewLRUCache(options_.block_cache_size)),
+      compaction_pool_(options_.compaction_threads > 0
+                           ? ThreadPool::NewFixed(options_.compaction_threads)
+                           : NULL),
       db_(NULL) {}
 
 FilesystemDb::~FilesystemDb() {
   delete reinterpret_cast<MDB*>(mdb_);
   delete db_;
+  delete compaction_pool_;
   delete filter_policy_;
   delete block_cache_;
   delete table_cache_;
@@ -304,6 +347,267 @@ Status FilesystemDb::Delete(const DirId& id, const Slice& fname) {
   return reinterpret_cast<MDB*>(mdb_)->DELETE<Key>(id, fname, &options, tx);
 }
 
+namespace {
+// Order the indices of a name array by the names they point to.
+struct NameIndexLess {
+  explicit NameIndexLess(const Slice* names) : names_(names) {}
+  bool operator()(size_t a, size_t b) const {
+    return names_[a].compare(names_[b]) < 0;
+  }
+  const Slice* names_;
+};
+}  // namespace
+
+Status FilesystemDb::MultiGet(  ///
+    const DirId& id, const Slice* const fnames, size_t n, Stat* const stats,
+    Status* const rets, FilesystemDbStats* const stats0) {
+  // Max number of entries we step over before we give up and seek. Stepping is
+  // far cheaper than seeking when the names being looked up are dense.
+  static const int kMaxSteps = 8;
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; i++) order[i] = i;
+  // Names are directly used as key suffixes so sorting names sorts their keys
+  std::sort(order.begin(), order.end(), NameIndexLess(fnames));
+  ReadOptions options;
+  Iterator* const iter = db_->NewIterator(options);
+  Key key(id.dno, id.ino, kDirEntType);
+  for (size_t j = 0; j < n; j++) {
+    const size_t i = order[j];
+    key.SetSuffix(fnames[i]);
+    const Slice target = key.Encode();
+    for (int k = 0; k < kMaxSteps; k++) {
+      if (!iter->Valid() || iter->key().compare(target) >= 0) break;
+      iter->Next();
+    }
+    if (!iter->Valid() || iter->key().compare(target) < 0) {
+      iter->Seek(target);
+    }
+    if (iter->Valid() && iter->key() == target) {
+      Slice input = iter->value();
+      if (!stats[i].DecodeFrom(&input)) {
+        rets[i] = Status::Corruption(Slice());
+      } else {
+        rets[i] = Status::OK();
+      }
+      if (stats0 != NULL) {
+        stats0->getbytes += iter->value().size();
+      }
+    } else {
+      rets[i] = Status::NotFound(Slice());
+    }
+    if (stats0 != NULL) {
+      stats0->getkeybytes += target.size();
+      stats0->gets++;
+    }
+  }
+  Status s = iter->status();
+  delete iter;
+  return s;
+}
+
+Status FilesystemDb::CheckAndPutBatch(  ///
+    const DirId& id, const Slice* const fnames, size_t n,
+    const Stat* const stats, bool skip_checks, size_t* const m,
+    FilesystemDbStats* const stats0) {
+  *m = 0;
+  size_t k = n;  // Entries at and after k are not inserted
+  Status s;
+  if (!skip_checks && n != 0) {
+    std::vector<Stat> tmp(n);
+    std::vector<Status> rets(n);
+    s = MultiGet(id, fnames, n, &tmp[0], &rets[0], stats0);
+    if (!s.ok()) {
+      return s;
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (rets[i].ok()) {
+        s = Status::AlreadyExists(fnames[i]);
+        k = i;
+        break;
+      } else if (!rets[i].IsNotFound()) {
+        s = rets[i];
+        k = i;
+        break;
+      }
+    }
+    // Names repeated within the batch collide with their first occurrence
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), NameIndexLess(fnames));
+    for (size_t j = 1; j < n; j++) {
+      if (fnames[order[j]] == fnames[order[j - 1]] && order[j] < k) {
+        s = Status::AlreadyExists(fnames[order[j]]);
+        k = order[j];
+      }
+    }
+  }
+  if (k != 0) {
+    MDB* const mdb = reinterpret_cast<MDB*>(mdb_);
+    WriteOptions options;
+    Tx* const tx = mdb->STARTTX<Tx>(false);
+    Status ss;
+    for (size_t i = 0; ss.ok() && i < k; i++) {
+      ss = mdb->PUT<Key>(id, fnames[i], stats[i], fnames[i], &options, tx,
+                         stats0);
+    }
+    if (ss.ok()) {
+      ss = mdb->COMMIT(&options, tx);
+    }
+    mdb->RELEASE(tx);
+    if (!ss.ok()) {
+      return ss;
+    }
+    *m = k;
+  }
+  return s;
+}
+
+Status FilesystemDb::BatchPut(  ///
+    const DirId& id, const std::vector<std::string>& fnames,
+    const std::vector<Stat>& stats, FilesystemDbStats* const stats0) {
+  assert(fnames.size() == stats.size());
+  MDB* const mdb = reinterpret_cast<MDB*>(mdb_);
+  WriteOptions options;
+  Tx* const tx = mdb->STARTTX<Tx>(false);
+  Status s;
+  for (size_t i = 0; s.ok() && i < fnames.size(); i++) {
+    s = mdb->PUT<Key>(id, fnames[i], stats[i], fnames[i], &options, tx,
+                      stats0);
+  }
+  if (s.ok()) {
+    s = mdb->COMMIT(&options, tx);
+  }
+  mdb->RELEASE(tx);
+  return s;
+}
+
+Status FilesystemDb::BatchDelete(  ///
+    const DirId& id, const std::vector<std::string>& fnames) {
+  MDB* const mdb = reinterpret_cast<MDB*>(mdb_);
+  WriteOptions options;
+  Tx* const tx = mdb->STARTTX<Tx>(false);
+  Status s;
+  for (size_t i = 0; s.ok() && i < fnames.size(); i++) {
+    s = mdb->DELETE<Key>(id, fnames[i], &options, tx);
+  }
+  if (s.ok()) {
+    s = mdb->COMMIT(&options, tx);
+  }
+  mdb->RELEASE(tx);
+  return s;
+}
+
+size_t FilesystemDb::List(  ///
+    const DirId& id, std::vector<std::string>* const fnames,
+    std::vector<Stat>* const stats) {
+  ReadOptions options;
+  options.fill_cache = false;
+  Tx* const tx = NULL;
+  return reinterpret_cast<MDB*>(mdb_)->LIST<Iterator, Key>(
+      id, stats, fnames, &options, tx, ~static_cast<size_t>(0));
+}
+
+Status FilesystemDb::CountDirParts(  ///
+    const DirId& id, const DirIndex& giga, std::vector<uint32_t>* const sizes) {
+  ReadOptions options;
+  options.fill_cache = false;
+  Iterator* const iter = db_->NewIterator(options);
+  Key key(id.dno, id.ino, kDirEntType);
+  const Slice prefix = key.prefix();
+  for (iter->Seek(prefix); iter->Valid(); iter->Next()) {
+    Slice name = iter->key();
+    if (!name.starts_with(prefix))  // Hitting end of directory
+      break;
+    name.remove_prefix(prefix.size());
+    const int i = giga.GetIndex(name);
+    if (i >= 0 && static_cast<size_t>(i) < sizes->size()) {
+      (*sizes)[i]++;
+    }
+  }
+  Status s = iter->status();
+  delete iter;
+  return s;
+}
+
+Status FilesystemDb::Readdir(  ///
+    const DirId& id, const Slice& cursor, size_t max_bytes,
+    std::string* const entarr, std::string* const next) {
+  MDB* const mdb = reinterpret_cast<MDB*>(mdb_);
+  ReadOptions options;
+  options.fill_cache = false;
+  Tx* const tx = NULL;
+  MDB::Dir<Iterator>* const dir =
+      mdb->OPENDIR<Iterator, Key>(id, &options, tx);
+  if (dir == NULL) {
+    return Status::IOError("Cannot open dir");
+  }
+  if (!cursor.empty()) {  // Resume from where the previous scan stopped
+    Key key(id.dno, id.ino, kDirEntType);
+    key.SetSuffix(cursor);
+    dir->iter->Seek(key.Encode());
+    if (dir->iter->Valid() && dir->iter->key() == key.Encode()) {
+      dir->iter->Next();
+    }
+  }
+  char tmp[Stat::kMaxEncodedLength];
+  std::string name;
+  Stat stat;
+  Status s;
+  next->clear();
+  while (entarr->size() < max_bytes) {
+    s = mdb->READDIR(dir, &stat, &name);
+    if (!s.ok()) {
+      break;
+    }
+    PutLengthPrefixedSlice(entarr, name);
+    Slice encoded_stat = stat.EncodeTo(tmp);
+    entarr->append(encoded_stat.data(), encoded_stat.size());
+    next->swap(name);
+  }
+  mdb->CLOSEDIR(dir);
+  if (s.IsNotFound()) {  // Hitting the end of the directory
+    next->clear();
+    s = Status::OK();
+  }
+  return s;
+}
+
+Status FilesystemDb::GetDirIdx(const DirId& id, std::string* const giga) {
+  Key key(id.dno, id.ino, kDirIdxType);
+  return db_->Get(ReadOptions(), key.prefix(), giga);
+}
+
+Status FilesystemDb::PutDirIdx(const DirId& id, const Slice& giga) {
+  Key key(id.dno, id.ino, kDirIdxType);
+  return db_->Put(WriteOptions(), key.prefix(), giga);
+}
+
+Status FilesystemDb::GetMaxIno(uint64_t* const ino) {
+  Key key(0, 0, kSuperBlockType);
+  std::string tmp;
+  Status s = db_->Get(ReadOptions(), key.prefix(), &tmp);
+  if (s.IsNotFound()) {
+    *ino = 0;
+    return Status::OK();
+  } else if (!s.ok()) {
+    return s;
+  } else if (tmp.size() != 8) {
+    return Status::Corruption("Bad max ino");
+  } else {
+    *ino = DecodeFixed64(tmp.data());
+    return s;
+  }
+}
+
+Status FilesystemDb::PutMaxIno(uint64_t ino) {
+  Key key(0, 0, kSuperBlockType);
+  char tmp[8];
+  EncodeFixed64(tmp, ino);
+  WriteOptions options;
+  options.sync = true;
+  return db_->Put(options, key.prefix(), Slice(tmp, sizeof(tmp)));
+}
+
 Status FilesystemDb::BulkInsert(const std::string& dir) {
   if (options_.create_dir_on_bulk) {
     myenv_->CreateDir(dir.c_str());
@@ -36,15 +36,19 @@
 #include "pdlfs-common/status.h"
 
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 namespace pdlfs {
 
 class Cache;
 class DB;
+class DirIndex;
 class Env;
 class FilesystemDbEnvWrapper;
 class FilterPolicy;
 class Stat;
+class ThreadPool;
 
 struct DirId;
 
@@ -106,6 +110,14 @@ struct FilesystemDbOptions {
   // Number of files in Level-0 until writes are entirely stalled.
   // Default: 12
   int l0_hard_limit;
+  // Number of threads for running background compactions and their
+  // subcompactions. Use 0 to run compactions in the db env.
+  // Default: 0
+  int compaction_threads;
+  // Max number of key ranges a compaction is split into and compacted in
+  // parallel. Only useful with multiple compaction threads.
+  // Default: 1
+  int max_subcompactions;
   // Detach db directory on db closing.
   // Default: false
   bool detach_dir_on_close;
@@ -131,6 +143,24 @@ struct FilesystemDbOptions {
   // Disable write ahead logging.
   // Default: false
   bool disable_write_ahead_logging;
+  // Overlap write ahead logging with memtable insertion so that concurrent
+  // writers are not serialized behind a single one.
+  // Default: false
+  bool pipelined_write;
+  // Allow multiple writers to insert into the memtable at the same time.
+  // Default: false
+  bool concurrent_memtable;
+  // Number of hash buckets for indexing memtable entries by key so that
+  // point lookups do not need to search the memtable's skiplist.
+  // Use 0 to disable.
+  // Default: 0
+  size_t memtable_hash_buckets;
+  // Write table indexes as entropy-coded tries instead of regular blocks.
+  // ECT indexes take a few bytes per table block, which greatly reduces the
+  // memory pinned by open tables. Tables are readable in either format.
+  // Requires building with PDLFS_SILT_ECT.
+  // Default: false
+  bool use_ect_index;
   // Prefetch compaction input table files.
   // Default: false
   bool prefetch_compaction_input;
@@ -157,6 +187,13 @@ struct FilesystemDbStats {
   uint64_t getbytes;
   // Total number of get operations.
   uint64_t gets;
+  // Number of lookups sent to each readonly db of a db chain, indexed by the
+  // db's depth in the chain. Lookups sent to dbs deeper than the last slot are
+  // counted in the last slot.
+  enum { kMaxRoDepth = 8 };
+  uint64_t roprobes[kMaxRoDepth];
+  // Total number of readonly db lookups skipped by in-memory key filters.
+  uint64_t roskips;
 };
 
 class FilesystemDb {
@@ -176,6 +213,51 @@ class FilesystemDb {
   Status Put(const DirId& id, const Slice& fname, const Stat& stat,
              FilesystemDbStats* stats);
   Status Delete(const DirId& id, const Slice& fname);
+  // Look up a batch of n names in a directory. Names are sorted and then read
+  // through a single db iterator in key order so that names close to each
+  // other are served by the same data blocks without a full db lookup each.
+  // rets[i] is set to the result of looking up fnames[i]. stats[i] is set when
+  // rets[i] is OK. Return a non-OK status if the db iterator fails.
+  Status MultiGet(const DirId& id, const Slice* fnames, size_t n, Stat* stats,
+                  Status* rets, FilesystemDbStats* stats0);
+  // Insert a batch of n new entries into a directory with a single db write.
+  // Unless skip_checks is set, names are first checked against the db through
+  // one MultiGet pass. Only the longest prefix of the batch whose names neither
+  // exist in the db nor repeat an earlier name of the batch is inserted, and
+  // *m is set to its length. Return AlreadyExists if the batch is cut short by
+  // an existing name.
+  Status CheckAndPutBatch(const DirId& id, const Slice* fnames, size_t n,
+                          const Stat* stats, bool skip_checks, size_t* m,
+                          FilesystemDbStats* stats0);
+  // Atomically insert a batch of entries into a directory.
+  Status BatchPut(const DirId& id, const std::vector<std::string>& fnames,
+                  const std::vector<Stat>& stats, FilesystemDbStats* stats0);
+  // Atomically remove a batch of entries from a directory.
+  Status BatchDelete(const DirId& id, const std::vector<std::string>& fnames);
+  // Append all entries of a directory to *fnames and *stats. Return the number
+  // of entries listed.
+  size_t List(const DirId& id, std::vector<std::string>* fnames,
+              std::vector<Stat>* stats);
+  // Count the entries of a directory that fall into each partition of a given
+  // dir index. (*sizes)[i] is incremented once for each name mapped to
+  // partition i. Only keys are examined and names are not retained.
+  Status CountDirParts(const DirId& id, const DirIndex& giga,
+                       std::vector<uint32_t>* sizes);
+  // Scan entries of a directory in name order, starting after a given cursor
+  // (empty to start from the beginning). Entries are appended to *entarr as
+  // length-prefixed names each followed by a stat encoding until *entarr
+  // reaches max_bytes. On OK, *next is set to the cursor for resuming the scan,
+  // or cleared when the end of the directory has been reached.
+  Status Readdir(const DirId& id, const Slice& cursor, size_t max_bytes,
+                 std::string* entarr, std::string* next);
+  // Read or write the GIGA+ index of a directory.
+  Status GetDirIdx(const DirId& id, std::string* giga);
+  Status PutDirIdx(const DirId& id, const Slice& giga);
+  // Read or write the largest inode no. reserved by the filesystem. Inode
+  // numbers up to it may have been handed out and must not be reused after a
+  // restart. Writes are synced. *ino is set to 0 if nothing has been reserved.
+  Status GetMaxIno(uint64_t* ino);
+  Status PutMaxIno(uint64_t ino);
   Status Flush(bool force_flush_l0, bool async = false);
   Status BulkInsert(const std::string& dir);
 
@@ -190,6 +272,7 @@ class FilesystemDb {
   const FilterPolicy* filter_policy_;
   Cache* table_cache_;
   Cache* block_cache_;
+  ThreadPool* compaction_pool_;
   DB* db_;
 };
 
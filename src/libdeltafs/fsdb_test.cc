@@ -130,6 +130,10 @@ const char* FLAGS_benchmarks =
 // Number of concurrent threads to run.
 int FLAGS_threads = 1;
 
+// If positive, each benchmark is run repeatedly with 1, 2, 4, ... threads until
+// the specified number of threads is reached. Overrides FLAGS_threads.
+int FLAGS_max_threads = 0;
+
 // Number of KV pairs to insert per thread.
 int FLAGS_num = 8;
 
@@ -438,7 +442,11 @@ class Benchmark {
   static void PrintHeader() {
     PrintEnvironment();
     PrintWarnings();
-    fprintf(stdout, "Threads:            %d\n", FLAGS_threads);
+    if (FLAGS_max_threads > 0) {
+      fprintf(stdout, "Threads:            1 to %d\n", FLAGS_max_threads);
+    } else {
+      fprintf(stdout, "Threads:            %d\n", FLAGS_threads);
+    }
     fprintf(stdout, "Num (rd/wr):        %d/%d per thread\n", FLAGS_reads,
             FLAGS_num);
     char mon_info[100];
@@ -885,6 +893,21 @@ class Benchmark {
     }
   }
 
+  // Repeatedly obtain and then release the control block of the parent dir.
+  // This isolates the cost of locating in-memory directory control blocks from
+  // the cost of db operations.
+  void ProbeDir(ThreadState* const thread) {
+    for (int i = 0; i < FLAGS_num; i++) {
+      FilesystemDir* const dir = fs_->TEST_ProbeDir(thread->parent_dir);
+      if (dir == NULL) {
+        fprintf(stderr, "Cannot probe dir\n");
+        exit(1);
+      }
+      fs_->TEST_Release(dir);
+      thread->stats.FinishedSingleOp(FLAGS_num, thread->tid);
+    }
+  }
+
   Env* OpenEnv() {
     Env* env;
     switch (FLAGS_env) {
@@ -992,33 +1015,45 @@ class Benchmark {
         method = &Benchmark::Compact;
       } else if (name.starts_with("read")) {
         method = &Benchmark::Read;
+      } else if (name == Slice("probedir")) {
+        method = &Benchmark::ProbeDir;
       } else {
         if (!name.empty()) {  // No error message for empty name
           fprintf(stderr, "unknown benchmark '%s'\n", name.ToString().c_str());
         }
       }
 
-      if (fresh_db) {
-        if (FLAGS_use_existing_db) {
-          fprintf(stdout, "%-12s : skipped (--use_existing_db is true)\n",
-                  name.ToString().c_str());
-          method = NULL;
-        } else {
-          delete fscli_;
-          fscli_ = NULL;
-          delete fs_;
-          fs_ = NULL;
-          delete db_;
-          db_ = NULL;
+      int n = FLAGS_threads;
+      if (FLAGS_max_threads > 0) {
+        n = 1;
+      }
+      do {
+        if (fresh_db) {
+          if (FLAGS_use_existing_db) {
+            fprintf(stdout, "%-12s : skipped (--use_existing_db is true)\n",
+                    name.ToString().c_str());
+            method = NULL;
+          } else {
+            delete fscli_;
+            fscli_ = NULL;
+            delete fs_;
+            fs_ = NULL;
+            delete db_;
+            db_ = NULL;
+            Open(fresh_db);
+          }
+        } else if (db_ == NULL) {
           Open(fresh_db);
         }
-      } else if (db_ == NULL) {
-        Open(fresh_db);
-      }
 
-      if (method != NULL) {
-        RunBenchmark(FLAGS_threads, m++, name, method);
-      }
+        if (method != NULL) {
+          if (FLAGS_max_threads > 0) {
+            fprintf(stdout, "Threads: %d\n", n);
+          }
+          RunBenchmark(n, m++, name, method);
+        }
+        n *= 2;
+      } while (method != NULL && n <= FLAGS_max_threads);
     }
   }
 };
@@ -1104,6 +1139,8 @@ void BM_Main(int* const argc, char*** const argv) {
       pdlfs::FLAGS_reads = n;
     } else if (sscanf((*argv)[i], "--threads=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_threads = n;
+    } else if (sscanf((*argv)[i], "--max_threads=%d%c", &n, &junk) == 1) {
+      pdlfs::FLAGS_max_threads = n;
     } else if (sscanf((*argv)[i], "--max_open_files=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_dboptions.table_cache_size = n;
     } else if (sscanf((*argv)[i], "--table_file_size=%dM%c", &n, &junk) == 1) {
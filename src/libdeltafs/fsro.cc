@@ -38,6 +38,7 @@
 #include "pdlfs-common/leveldb/db.h"
 #include "pdlfs-common/leveldb/filenames.h"
 #include "pdlfs-common/leveldb/filter_policy.h"
+#include "pdlfs-common/leveldb/iterator.h"
 #include "pdlfs-common/leveldb/options.h"
 #include "pdlfs-common/leveldb/readonly.h"
 #include "pdlfs-common/leveldb/snapshot.h"
@@ -48,6 +49,8 @@
 #include "pdlfs-common/mutexlock.h"
 #include "pdlfs-common/strutil.h"
 
+#include <vector>
+
 namespace pdlfs {
 namespace {
 typedef MXDB<DB, Slice, Status, kNameInKey> MDB;
@@ -59,7 +62,8 @@ FilesystemReadonlyDbOptions::FilesystemReadonlyDbOptions()
       block_cache(NULL),
       enable_io_monitoring(false),
       detach_dir_on_close(false),
-      use_default_logger(false) {}
+      use_default_logger(false),
+      mem_filter_bits_per_key(0) {}
 
 FilesystemReadonlyDbEnvWrapper::FilesystemReadonlyDbEnvWrapper(
     const FilesystemReadonlyDbOptions& options, Env* base)
@@ -142,6 +146,8 @@ void ReadBoolFromEnv(const char* key, bool* dst) {
 // Read options from system env. All env keys start with "DELTAFS_Rr_".
 void FilesystemReadonlyDbOptions::ReadFromEnv() {
   ReadBoolFromEnv("DELTAFS_Rr_use_default_logger", &use_default_logger);
+  ReadIntegerOptionFromEnv("DELTAFS_Rr_mem_filter_bits_per_key",
+                           &mem_filter_bits_per_key);
 }
 
 Status FilesystemReadonlyDb::Open(const std::string& dbloc) {
@@ -157,10 +163,53 @@ Status FilesystemReadonlyDb::Open(const std::string& dbloc) {
   Status status = ReadonlyDB::Open(dbopts, dbloc, &db_);
   if (status.ok()) {
     mdb_ = reinterpret_cast<MetadataDb*>(new MDB(db_));
+    if (mem_filter_policy_ != NULL) {
+      status = BuildMemFilter();
+    }
   }
   return status;
 }
 
+// Scan all keys of the db and summarize them in a single in-memory filter. The
+// db is scanned twice: once to count keys so that the filter can be sized and
+// once more to add keys to the filter. Keys are never buffered.
+Status FilesystemReadonlyDb::BuildMemFilter() {
+  ReadOptions options;
+  options.fill_cache = false;
+  Iterator* iter = db_->NewIterator(options);
+  size_t n = 0;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    n++;
+  }
+  Status status = iter->status();
+  delete iter;
+  if (!status.ok()) {
+    return status;
+  }
+  std::string filter;
+  BloomFilterBuilder builder(options_.mem_filter_bits_per_key, n, &filter);
+  iter = db_->NewIterator(options);
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    builder.AddKey(iter->key());
+  }
+  status = iter->status();
+  delete iter;
+  if (status.ok()) {
+    mem_filter_.swap(filter);
+  }
+  return status;
+}
+
+bool FilesystemReadonlyDb::KeyMayMatch(const DirId& id, const Slice& fname) {
+  if (mem_filter_policy_ == NULL || mem_filter_.empty()) {
+    return true;
+  }
+  Key key(id.dno, id.ino, kDirEntType);
+  key.SetSuffix(fname);
+  return mem_filter_policy_->KeyMayMatch(Slice(key.data(), key.size()),
+                                         mem_filter_);
+}
+
 struct FilesystemReadonlyDb::Tx {
   const Snapshot* snap;
 };
@@ -174,6 +223,49 @@ Status FilesystemReadonlyDb::Get(const DirId& id, const Slice& fname,
                                                 tx, stats);
 }
 
+Status FilesystemReadonlyDb::Readdir(  ///
+    const DirId& id, const Slice& cursor, size_t max_bytes,
+    std::string* const entarr, std::string* const next) {
+  MDB* const mdb = reinterpret_cast<MDB*>(mdb_);
+  ReadOptions options;
+  options.fill_cache = false;
+  Tx* const tx = NULL;
+  MDB::Dir<Iterator>* const dir =
+      mdb->OPENDIR<Iterator, Key>(id, &options, tx);
+  if (dir == NULL) {
+    return Status::IOError("Cannot open dir");
+  }
+  if (!cursor.empty()) {  // Resume from where the previous scan stopped
+    Key key(id.dno, id.ino, kDirEntType);
+    key.SetSuffix(cursor);
+    dir->iter->Seek(key.Encode());
+    if (dir->iter->Valid() && dir->iter->key() == key.Encode()) {
+      dir->iter->Next();
+    }
+  }
+  char tmp[Stat::kMaxEncodedLength];
+  std::string name;
+  Stat stat;
+  Status s;
+  next->clear();
+  while (entarr->size() < max_bytes) {
+    s = mdb->READDIR(dir, &stat, &name);
+    if (!s.ok()) {
+      break;
+    }
+    PutLengthPrefixedSlice(entarr, name);
+    Slice encoded_stat = stat.EncodeTo(tmp);
+    entarr->append(encoded_stat.data(), encoded_stat.size());
+    next->swap(name);
+  }
+  mdb->CLOSEDIR(dir);
+  if (s.IsNotFound()) {  // Hitting the end of the directory
+    next->clear();
+    s = Status::OK();
+  }
+  return s;
+}
+
 FilesystemReadonlyDb::FilesystemReadonlyDb(
     const FilesystemReadonlyDbOptions& options, Env* base)
     : mdb_(NULL),
@@ -182,6 +274,10 @@ FilesystemReadonlyDb::FilesystemReadonlyDb(
       filter_policy_(options_.filter_bits_per_key != 0
                          ? NewBloomFilterPolicy(options_.filter_bits_per_key)
                          : NULL),
+      mem_filter_policy_(
+          options_.mem_filter_bits_per_key != 0
+              ? NewBloomFilterPolicy(options_.mem_filter_bits_per_key)
+              : NULL),
       table_cache_(options_.table_cache ? options_.table_cache
                                         : NewLRUCache(0)),
       block_cache_(options_.block_cache ? options_.block_cache
@@ -192,6 +288,7 @@ FilesystemReadonlyDb::~FilesystemReadonlyDb() {
   delete reinterpret_cast<MDB*>(mdb_);
   delete db_;
   delete filter_policy_;
+  delete mem_filter_policy_;
   delete env_wrapper_;
   if (block_cache_ != options_.block_cache) {
     delete block_cache_;
@@ -82,6 +82,13 @@ struct FilesystemReadonlyDbOptions {
   // Log to stderr.
   // Default: false
   bool use_default_logger;
+  // Bloom filter bits per key for an in-memory filter built over all keys of
+  // the db when the db is opened. Lookups ruled out by the filter skip the db
+  // altogether instead of searching its tables. Building the filter requires
+  // a full scan of the db.
+  // Use 0 to disable the in-memory filter.
+  // Default: 0
+  size_t mem_filter_bits_per_key;
 };
 
 class FilesystemReadonlyDbEnvWrapper : public EnvWrapper {
@@ -115,6 +122,13 @@ class FilesystemReadonlyDb {
   DB* TEST_GetDbRep() { return db_; }
   Status Get(const DirId& id, const Slice& fname, Stat* stat,
              FilesystemDbStats* stats);
+  // Return false if a name is known not to exist in the db. Always return true
+  // when the db has no in-memory filter.
+  bool KeyMayMatch(const DirId& id, const Slice& fname);
+  // Scan entries of a directory in name order. Same as
+  // FilesystemDb::Readdir().
+  Status Readdir(const DirId& id, const Slice& cursor, size_t max_bytes,
+                 std::string* entarr, std::string* next);
   Status Open(const std::string& dbloc);
   ~FilesystemReadonlyDb();
 
@@ -124,9 +138,12 @@ class FilesystemReadonlyDb {
   MetadataDb* mdb_;
   void operator=(const FilesystemReadonlyDb&);
   FilesystemReadonlyDb(const FilesystemReadonlyDb& other);
+  Status BuildMemFilter();
   FilesystemReadonlyDbOptions options_;
   FilesystemReadonlyDbEnvWrapper* env_wrapper_;
   const FilterPolicy* filter_policy_;
+  const FilterPolicy* mem_filter_policy_;
+  std::string mem_filter_;
   Cache* table_cache_;
   Cache* block_cache_;
   DB* db_;
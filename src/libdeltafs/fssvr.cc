@@ -35,6 +35,13 @@
 
 #include "pdlfs-common/coding.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(PDLFS_OS_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace pdlfs {
 
 FilesystemServerOptions::FilesystemServerOptions()
@@ -42,9 +49,16 @@ FilesystemServerOptions::FilesystemServerOptions()
       num_rpc_worker_threads(0),
       num_rpc_threads(1),
       uri("udp://0.0.0.0:10086"),
+      num_channels(1),
+      pin_threads(false),
       udp_max_incoming_msgsz(1432),
       udp_rcvbuf(-1),
       udp_sndbuf(-1),
+      udp_batch_size(1),
+      udp_reuseport(false),
+      udp_max_pending_calls(0),
+      tcp_persistent_conns(false),
+      peer_port(false),
       info_log(NULL) {}
 
 FilesystemServer::FilesystemServer(  ///
@@ -52,16 +66,25 @@ FilesystemServer::FilesystemServer(  ///
     : options_(options),
       fs_(NULL),
       hmap_(NULL),
-      rpc_workers_(NULL),
       rpc_(NULL) {
   hmap_ = new RequestHandler[rpc::kNumOps];
   memset(hmap_, 0, rpc::kNumOps * sizeof(void*));
-  hmap_[rpc::kLokup] = Lokup;
-  hmap_[rpc::kMkdir] = Mkdir;
-  hmap_[rpc::kMkfle] = Mkfle;
-  hmap_[rpc::kMkfls] = Mkfls;
-  hmap_[rpc::kBukin] = Bukin;
-  hmap_[rpc::kLstat] = Lstat;
+  if (options_.peer_port) {
+    hmap_[rpc::kSplit] = Split;
+  } else {
+    hmap_[rpc::kLokup] = Lokup;
+    hmap_[rpc::kMkdir] = Mkdir;
+    hmap_[rpc::kMkfle] = Mkfle;
+    hmap_[rpc::kMkfls] = Mkfls;
+    hmap_[rpc::kBukin] = Bukin;
+    hmap_[rpc::kLstat] = Lstat;
+    hmap_[rpc::kRdidx] = Rdidx;
+    hmap_[rpc::kLstats] = Lstats;
+    hmap_[rpc::kReaddir] = Readdir;
+    hmap_[rpc::kRsino] = Rsino;
+    hmap_[rpc::kCmpnd] = Cmpnd;
+    hmap_[rpc::kRsolv] = Resolve;
+  }
   if (!options_.info_log) {
     options_.info_log = Logger::Default();
   }
@@ -72,8 +95,13 @@ void FilesystemServer::SetFs(FilesystemIf* const fs) {
 }
 
 Status FilesystemServer::Call(Message& in, Message& out) RPCNOEXCEPT {
+  in.Flatten();  // No-op unless the message is passed to us in-process
   if (in.contents.size() >= 4) {
-    return hmap_[DecodeFixed32(&in.contents[0])](fs_, in, out);
+    const uint32_t op = DecodeFixed32(&in.contents[0]) & ~rpc::kCompactReply;
+    if (op >= rpc::kNumOps || hmap_[op] == NULL) {
+      return Status::InvalidArgument("Bad rpc op");
+    }
+    return hmap_[op](fs_, in, out);
   } else {
     return Status::InvalidArgument("Bad rpc req");
   }
@@ -101,46 +129,211 @@ void FilesystemServer::TEST_Remap(int i, RequestHandler h) {
 }
 
 FilesystemServer::~FilesystemServer() {
-  delete rpc_;
-  delete rpc_workers_;
+  for (size_t i = 0; i < chans_.size(); i++) {
+    delete chans_[i].rpc;
+    delete chans_[i].rpc_workers;
+    delete chans_[i].env;
+  }
   delete[] hmap_;
 }
 
 Status FilesystemServer::Close() {
-  if (rpc_) return rpc_->Stop();
-  return Status::OK();
+  Status status;
+  for (size_t i = 0; i < chans_.size(); i++) {
+    Status s = chans_[i].rpc->Stop();
+    if (status.ok()) {
+      status = s;
+    }
+  }
+  return status;
 }
 
-int FilesystemServer::GetPort() const { return rpc_ ? rpc_->GetPort() : -1; }
+int FilesystemServer::GetNumChannels() const {
+  return static_cast<int>(chans_.size());
+}
+
+int FilesystemServer::GetPort(int channel) const {
+  if (channel < 0 || size_t(channel) >= chans_.size()) return -1;
+  return chans_[channel].rpc->GetPort();
+}
 
 std::string FilesystemServer::GetUsageInfo() const {
-  if (rpc_) return rpc_->GetUsageInfo();
-  return std::string();
+  if (chans_.size() == 1) return rpc_->GetUsageInfo();
+  std::string result;
+  char tmp[30];
+  for (size_t i = 0; i < chans_.size(); i++) {
+    snprintf(tmp, sizeof(tmp), "Channel %d: ", int(i));
+    result += tmp;
+    result += chans_[i].rpc->GetUsageInfo();
+    result += "\n";
+  }
+  return result;
 }
 
-Status FilesystemServer::OpenServer() {
+namespace {
+// Return the uri of the i-th channel of a server whose first channel listens
+// at uri.
+std::string ChannelUri(const std::string& uri, int i) {
+  if (i == 0) return uri;
+  size_t host = uri.find("://");
+  host = (host == std::string::npos) ? 0 : host + 3;
+  const size_t colon = uri.rfind(':');
+  if (colon == std::string::npos || colon < host) {
+    return uri;  // Ephemeral ports
+  }
+  const int port = atoi(uri.c_str() + colon + 1);
+  if (port <= 0) {
+    return uri;
+  }
+  char tmp[20];
+  snprintf(tmp, sizeof(tmp), ":%d", port + i);
+  return uri.substr(0, colon) + tmp;
+}
+
+#if defined(PDLFS_OS_LINUX)
+// Obtain the i-th of n even shares of the CPUs that the calling thread may run
+// on. Return false on errors.
+bool GetChannelCpus(int i, int n, cpu_set_t* result) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return false;
+  }
+  std::vector<int> cpus;
+  for (int c = 0; c < CPU_SETSIZE; c++) {
+    if (CPU_ISSET(c, &allowed)) {
+      cpus.push_back(c);
+    }
+  }
+  if (cpus.empty()) {
+    return false;
+  }
+  const int ncpus = static_cast<int>(cpus.size());
+  CPU_ZERO(result);
+  if (n >= ncpus) {
+    CPU_SET(cpus[i % ncpus], result);
+  } else {
+    for (int k = i * ncpus / n; k < (i + 1) * ncpus / n; k++) {
+      CPU_SET(cpus[k], result);
+    }
+  }
+  return true;
+}
+
+// An Env that pins every thread it starts to a given set of CPUs. Used to pin
+// the rpc threads of a channel, which are started through RPCOptions::env.
+class PinnedEnv : public EnvWrapper {
+ public:
+  explicit PinnedEnv(const cpu_set_t& cpus)
+      : EnvWrapper(Env::Default()), cpus_(cpus) {}
+
+  virtual void StartThread(void (*function)(void*), void* arg) {
+    Thread* const t = new Thread;
+    t->env = this;
+    t->function = function;
+    t->arg = arg;
+    target()->StartThread(ThreadBody, t);
+  }
+
+ private:
+  struct Thread {
+    PinnedEnv* env;
+    void (*function)(void*);
+    void* arg;
+  };
+
+  static void ThreadBody(void* arg) {
+    Thread* const t = reinterpret_cast<Thread*>(arg);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &t->env->cpus_);
+    void (*const function)(void*) = t->function;
+    void* const a = t->arg;
+    delete t;
+    function(a);
+  }
+
+  cpu_set_t cpus_;
+};
+#endif
+}  // namespace
+
+Status FilesystemServer::OpenChannel(int i, Channel* const chan) {
   RPCOptions options;
   options.fs = this;
   options.impl = rpc::kSocketRPC;
   options.mode = rpc::kServerClient;
+  void* attr = NULL;
+#if defined(PDLFS_OS_LINUX)
+  cpu_set_t cpus;
+  pthread_attr_t pattr;
+  if (options_.pin_threads) {
+    if (!GetChannelCpus(i, options_.num_channels, &cpus)) {
+      return Status::IOError("Cannot obtain cpu affinity");
+    }
+    chan->env = new PinnedEnv(cpus);
+    pthread_attr_init(&pattr);
+    pthread_attr_setaffinity_np(&pattr, sizeof(cpus), &cpus);
+    attr = &pattr;
+  }
+#else
+  if (options_.pin_threads) {
+    return Status::NotSupported("Pinning threads");
+  }
+#endif
   if (options_.num_rpc_worker_threads) {
-    rpc_workers_ = ThreadPool::NewFixed(options_.num_rpc_worker_threads);
+    // Worker threads are started immediately so that they are created with
+    // attr
+    chan->rpc_workers = ThreadPool::NewFixed(options_.num_rpc_worker_threads,
+                                             attr != NULL, attr);
   }
-  options.extra_workers = rpc_workers_;
+#if defined(PDLFS_OS_LINUX)
+  if (attr != NULL) {
+    pthread_attr_destroy(&pattr);
+  }
+#endif
+  options.extra_workers = chan->rpc_workers;
+  options.env = chan->env;
   options.num_rpc_threads = options_.num_rpc_threads;
   options.info_log = options_.info_log;
-  options.uri = options_.uri;
+  options.uri = ChannelUri(options_.uri, i);
   options.udp_max_unexpected_msgsz = options_.udp_max_incoming_msgsz;
   options.udp_srv_rcvbuf = options_.udp_rcvbuf;
   options.udp_srv_sndbuf = options_.udp_sndbuf;
-  rpc_ = RPC::Open(options);
-  Status status = rpc_->Start();
-  if (status.ok()) {
+  options.udp_srv_batch_size = options_.udp_batch_size;
+  options.udp_srv_reuseport = options_.udp_reuseport;
+  options.udp_max_pending_calls = options_.udp_max_pending_calls;
+  options.tcp_persistent_conns = options_.tcp_persistent_conns;
+  chan->rpc = RPC::Open(options);
+  return chan->rpc->Start();
+}
+
+Status FilesystemServer::OpenServer() {
+  if (options_.num_channels < 1) {
+    options_.num_channels = 1;
+  }
+  Status status;
+  for (int i = 0; i < options_.num_channels; i++) {
+    Channel chan;
+    chan.env = NULL;
+    chan.rpc_workers = NULL;
+    chan.rpc = NULL;
+    status = OpenChannel(i, &chan);
+    if (chan.rpc != NULL) {
+      chans_.push_back(chan);
+    } else {
+      delete chan.rpc_workers;
+      delete chan.env;
+    }
+    if (!status.ok()) {
+      break;
+    }
 #if VERBOSE >= 2
     Log(options_.info_log, 2, "Filesystem server is up: %s",
-        rpc_->GetUri().c_str());
+        chan.rpc->GetUri().c_str());
 #endif
   }
+  if (!chans_.empty()) {
+    rpc_ = chans_[0].rpc;
+  }
   return status;
 }
 
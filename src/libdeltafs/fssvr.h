@@ -37,22 +37,60 @@
 
 #include "pdlfs-common/rpc.h"
 
+#include <vector>
+
 namespace pdlfs {
 
 struct FilesystemServerOptions {
   FilesystemServerOptions();
-  rpc::Engine impl;            // RPC impl selector. Default: rpc::kSocketRPC
+  rpc::Engine impl;  // RPC impl selector. Default: rpc::kSocketRPC
+  // Number of rpc worker threads and rpc threads of each channel.
   int num_rpc_worker_threads;  // Default: 0
   int num_rpc_threads;         // Default: 1
   // Implementation-specific initialization string for RPC.
   // Default: udp://0.0.0.0:10086
   std::string uri;
+  // Number of listening channels. Each channel is a separate rpc instance with
+  // its own port, rpc threads, and rpc worker threads. The first channel
+  // listens at uri. Subsequent channels listen at the ports following the port
+  // of uri, or at ephemeral ports when uri does not specify a port.
+  // Default: 1
+  int num_channels;
+  // Divide the CPUs that the process may run on evenly among channels and pin
+  // the rpc threads and the rpc worker threads of each channel to its share of
+  // CPUs. CPUs are assigned in id order so that a channel's CPUs tend to share
+  // a socket and a NUMA node. Linux only.
+  // Default: false
+  bool pin_threads;
   // Max incoming message size for UDP.
   // Default: 1432
   size_t udp_max_incoming_msgsz;
   // SO_RCVBUF and SO_SNDBUF for UDP. Set to -1 to use system defaults.
   int udp_rcvbuf;  // Default: -1
   int udp_sndbuf;  // Default: -1
+  // Number of UDP datagrams received (and replies sent) per system call by
+  // each rpc thread. Linux only.
+  // Default: 1
+  int udp_batch_size;
+  // Give each rpc thread its own UDP socket bound to the server port.
+  // Default: false
+  bool udp_reuseport;
+  // Max number of incoming UDP requests queued for rpc worker threads. Further
+  // requests are rejected with a busy reply, causing clients to back off. Set
+  // to 0 to queue requests without limits.
+  // Default: 0
+  int udp_max_pending_calls;
+  // Use long-lived, length-framed TCP connections. Clients must be configured
+  // the same way.
+  // Default: false
+  bool tcp_persistent_conns;
+  // Serve directory split calls from peer servers instead of client calls.
+  // Split calls are never served at a client port. Peer ports are kept apart
+  // so that a split call is never queued behind client calls that may wait for
+  // a split at this server, which in turn may be waiting for the peer calling
+  // us. A server therefore typically opens a client port and a peer port.
+  // Default: false
+  bool peer_port;
   // Logger object for progressing/error information.
   // Default: NULL, which causes Logger::Default() to be used.
   Logger* info_log;
@@ -76,7 +114,8 @@ class FilesystemServer : public rpc::If {
   Status Close();
 
   std::string GetUsageInfo() const;
-  int GetPort() const;
+  int GetNumChannels() const;
+  int GetPort(int channel = 0) const;
   If* TEST_CreateSelfCli();  // Create a client that connects the server itself
   If* TEST_CreateCli(const std::string& uri);
   typedef Status (*RequestHandler)(FilesystemIf*, Message& in, Message& out);
@@ -90,8 +129,14 @@ class FilesystemServer : public rpc::If {
   FilesystemServerOptions options_;
   FilesystemIf* fs_;  // Not owned by us
   RequestHandler* hmap_;
-  ThreadPool* rpc_workers_;
-  RPC* rpc_;
+  struct Channel {
+    Env* env;  // NULL unless threads are pinned
+    ThreadPool* rpc_workers;
+    RPC* rpc;
+  };
+  Status OpenChannel(int i, Channel* chan);
+  std::vector<Channel> chans_;
+  RPC* rpc_;  // The first channel
 };
 
 }  // namespace pdlfs
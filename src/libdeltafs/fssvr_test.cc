@@ -97,6 +97,34 @@ TEST(FilesystemServerTest, OpRoute) {
   ASSERT_OK(svr_->Close());
 }
 
+TEST(FilesystemServerTest, Channels) {
+  options_.uri = "udp://127.0.0.1";
+  options_.num_channels = 3;
+#if defined(PDLFS_OS_LINUX)
+  options_.pin_threads = true;
+#endif
+  delete svr_;
+  svr_ = new FilesystemServer(options_);
+  ASSERT_OK(svr_->OpenServer());
+  ASSERT_EQ(svr_->GetNumChannels(), 3);
+  svr_->TEST_Remap(0, TEST_Handler);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(svr_->GetPort(i) > 0);
+    char uri[50];
+    snprintf(uri, sizeof(uri), "udp://127.0.0.1:%d", svr_->GetPort(i));
+    rpc::If* cli = svr_->TEST_CreateCli(uri);
+    rpc::If::Message in, out;
+    PutFixed32(&in.extra_buf, 0);
+    PutFixed32(&in.extra_buf, i);
+    in.contents = in.extra_buf;
+    ASSERT_OK(cli->Call(in, out));
+    ASSERT_EQ(out.contents.size(), 4);
+    ASSERT_EQ(DecodeFixed32(&out.contents[0]), i);
+    delete cli;
+  }
+  ASSERT_OK(svr_->Close());
+}
+
 namespace {  // RPC performance bench (the srvr part of it)...
 // Number of rpc processing threads to launch.
 int FLAGS_threads = 1;
@@ -142,9 +142,6 @@ int FLAGS_rpc_batch_min = 1;
 // Max number of kv pairs that can be buffered.
 int FLAGS_rpc_batch_max = 2;
 
-// Number of async rpc senders.
-int FLAGS_rpc_async_sender_threads = 16;
-
 // Number of rpc worker threads to run.
 int FLAGS_rpc_worker_threads = 0;
 
@@ -294,8 +291,6 @@ void PrintHeader() {
   fprintf(stdout, "rpc batch:          %d (min), %d (max)\n",
           FLAGS_rpc_batch_min, FLAGS_rpc_batch_max);
   fprintf(stdout, "rpc timeout:        %d\n", FLAGS_rpc_timeout);
-  fprintf(stdout, "num sender threads: %d (max outstanding rpcs)\n",
-          FLAGS_rpc_async_sender_threads);
   fprintf(stdout, "num rpc threads:    %d + %d\n", FLAGS_rpc_threads,
           FLAGS_rpc_worker_threads);
   fprintf(stdout, "num ranks:          %d\n", FLAGS_comm_size);
@@ -444,17 +439,12 @@ class AsyncKVSender {
   std::string buf_;
   size_t n_;
 
-  static void SenderCall(void* arg) {
+  static void SendDone(const Status& status, void* arg) {
     AsyncKVSender* s = reinterpret_cast<AsyncKVSender*>(arg);
-    MutexLock ml(&s->mu_);
-    s->SendIt();
+    s->Finish(status);
   }
 
-  void SendIt() {
-    mu_.AssertHeld();
-    assert(scheduled_);
-    mu_.Unlock();
-    Status s = stub_->Call(in_, out_);
+  void Finish(Status s) {
     if (s.ok()) {
       Slice reply = out_.contents;
       uint32_t err_code = 0;
@@ -464,7 +454,7 @@ class AsyncKVSender {
         s = Status::FromCode(err_code);
       }
     }
-    mu_.Lock();
+    MutexLock ml(&mu_);
     scheduled_ = false;
     cv_.SignalAll();
     if (!s.ok() && status_.ok()) {
@@ -472,7 +462,7 @@ class AsyncKVSender {
     }
   }
 
-  void Schedule(ThreadPool* pool) {
+  void Schedule() {
     mu_.AssertHeld();
     assert(!scheduled_);
     scheduled_ = true;
@@ -482,11 +472,9 @@ class AsyncKVSender {
     buf_.clear();
     PutFixed32(&buf_, 0);
     n_ = 0;
-    if (pool != NULL) {
-      pool->Schedule(AsyncKVSender::SenderCall, this);
-    } else {
-      SendIt();
-    }
+    mu_.Unlock();  // The callback may be invoked before AsyncCall() returns
+    stub_->AsyncCall(in_, out_, SendDone, this);
+    mu_.Lock();
   }
 
  public:
@@ -496,7 +484,7 @@ class AsyncKVSender {
   }
   ~AsyncKVSender() { delete stub_; }
 
-  Status Flush(ThreadPool* pool) {
+  Status Flush() {
     Status s;
     MutexLock ml(&mu_);
     while (true) {
@@ -506,7 +494,7 @@ class AsyncKVSender {
       } else if (n_ == 0) {
         break;  // Done
       } else if (!scheduled_) {
-        Schedule(pool);
+        Schedule();
         break;
       } else {
         cv_.Wait();
@@ -515,7 +503,7 @@ class AsyncKVSender {
     return s;
   }
 
-  Status Send(ThreadPool* pool, const Slice& key, const Slice& val) {
+  Status Send(const Slice& key, const Slice& val) {
     Status s;
     MutexLock ml(&mu_);
     PutLengthPrefixedSlice(&buf_, key);
@@ -528,7 +516,7 @@ class AsyncKVSender {
       } else if (n_ < FLAGS_rpc_batch_min) {
         break;  // Done
       } else if (!scheduled_) {
-        Schedule(pool);
+        Schedule();
         break;
       } else if (n_ < FLAGS_rpc_batch_max) {
         break;  // Done
@@ -566,7 +554,6 @@ class Compactor : public rpc::If {
   HashTable<Dir> dirs_;
   RPC* rpc_;
   AsyncKVSender** async_kv_senders_;
-  ThreadPool* sender_workers_;
   ThreadPool* server_workers_;
   FilesystemReadonlyDb* srcdb_;
   FilesystemDb* dstdb_;
@@ -719,9 +706,6 @@ class Compactor : public rpc::If {
 
   void OpenSenders(const unsigned short* const port_info,
                    const unsigned* const ip_info) {
-    if (FLAGS_rpc_async_sender_threads != 0) {
-      sender_workers_ = ThreadPool::NewFixed(FLAGS_rpc_async_sender_threads);
-    }
     async_kv_senders_ = new AsyncKVSender*[FLAGS_comm_size];
     struct in_addr tmp_addr;
     char tmp_uri[100];
@@ -770,7 +754,7 @@ class Compactor : public rpc::If {
       Slice name(key.data() + 16, key.size() - 16);
       Dir* const dir = FetchDir(Slice(key.data(), 16));
       int i = dir->giga->SelectServer(name);
-      s = async_kv_senders_[i]->Send(sender_workers_, key, iter->value());
+      s = async_kv_senders_[i]->Send(key, iter->value());
       if (!s.ok()) {
         fprintf(stderr, "%d: Cannot send rpc: %s\n", FLAGS_rank,
                 s.ToString().c_str());
@@ -784,7 +768,7 @@ class Compactor : public rpc::If {
       printf("Sender flushing...%30s\r", "");
     }
     for (int i = 0; i < FLAGS_comm_size; i++) {
-      s = async_kv_senders_[i]->Flush(sender_workers_);
+      s = async_kv_senders_[i]->Flush();
       if (!s.ok()) {
         fprintf(stderr, "%d: Cannot flush rpc: %s\n", FLAGS_rank,
                 s.ToString().c_str());
@@ -867,7 +851,6 @@ class Compactor : public rpc::If {
   Compactor()
       : rpc_(NULL),
         async_kv_senders_(NULL),
-        sender_workers_(NULL),
         server_workers_(NULL),
         srcdb_(NULL),
         dstdb_(NULL) {
@@ -884,7 +867,6 @@ class Compactor : public rpc::If {
     delete[] async_kv_senders_;
     delete rpc_;
     delete server_workers_;
-    delete sender_workers_;
     delete srcdb_;
     delete dstdb_;
     for (int i = 0; i < dirrepo_.size(); i++) {
@@ -1007,9 +989,6 @@ void BM_Main(int* const argc, char*** const argv) {
       pdlfs::FLAGS_rpc_batch_min = n;
     } else if (sscanf((*argv)[i], "--rpc_batch_max=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_rpc_batch_max = n;
-    } else if (sscanf((*argv)[i], "--rpc_async_sender_threads=%d%c", &n,
-                      &junk) == 1) {
-      pdlfs::FLAGS_rpc_async_sender_threads = n;
     } else if (sscanf((*argv)[i], "--print_ips=%d%c", &n, &junk) == 1) {
       pdlfs::FLAGS_print_ips = n;
     } else if (sscanf((*argv)[i], "--env_use_rados=%d%c", &n, &junk) == 1 &&